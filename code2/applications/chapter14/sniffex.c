@@ -151,8 +151,10 @@
  * 
  ****************************************************************************
  * 
- * Example compiler command-line for GCC:
- *   gcc -Wall -o sniffex sniffex.c -lpcap
+ * Example compiler command-line for GCC, with the flow table [4] from
+ * pcap-example:
+ *   gcc -Wall -I../../pcap-example -o sniffex sniffex.c \
+ *       ../../pcap-example/flow.c -lpcap
  * 
  ****************************************************************************
  *
@@ -187,6 +189,13 @@
  * tcp port 80			Capture only TCP packets with a port equal to 80.
  * ip host 10.1.2.3		Capture all IP packets to or from host 10.1.2.3.
  *
+ * 4. Every packet also goes through a flow table (flow.h in pcap-example),
+ * which keeps per flow packet and byte counts, ends flows idle for a
+ * minute and reassembles TCP streams, holding only so much out-of-order
+ * data. Its totals are printed at the end. With -f the packets come from
+ * a capture file, all of them, and only the totals are printed; see
+ * sniff.c in pcap-example for doing that with many threads.
+ *
  ****************************************************************************
  *
  */
@@ -206,6 +215,8 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <unistd.h>
+#include "flow.h"
 
 /* default snap length (maximum bytes per packet to capture) */
 #define SNAP_LEN 1518
@@ -282,6 +293,12 @@ print_app_banner(void);
 void
 print_app_usage(void);
 
+void
+print_flows(void);
+
+static struct flow_table *flows;	/* [4] */
+static int quiet;			/* just the flows */
+
 /*
  * app name/banner
  */
@@ -305,9 +322,12 @@ print_app_usage(void)
 {
 
 	printf("Usage: %s [interface]\n", APP_NAME);
+	printf("       %s -f file\n", APP_NAME);
 	printf("\n");
 	printf("Options:\n");
 	printf("    interface    Listen on <interface> for packets.\n");
+	printf("    -f file      Read all the packets of a capture file, printing\n");
+	printf("                 only the flow totals [4].\n");
 	printf("\n");
 
 return;
@@ -411,6 +431,29 @@ print_payload(const u_char *payload, int len)
 return;
 }
 
+/*
+ * flow table totals [4]
+ */
+void
+print_flows(void)
+{
+	struct flow_stats st;
+
+	flow_flush(flows);
+	flow_stats(flows, &st);
+	printf("Flows: %lu (at most %lu at once), %lu timed out, %lu closed\n",
+	    (unsigned long)st.flows, (unsigned long)st.max_active,
+	    (unsigned long)st.idle, (unsigned long)st.closed);
+	printf("Flow packets: %lu (%lu bytes)\n",
+	    (unsigned long)st.packets, (unsigned long)st.bytes);
+	printf("TCP streams: %lu bytes in order, %lu out-of-order segments, "
+	    "%lu bytes retransmitted, %lu missing\n",
+	    (unsigned long)st.tcp_bytes, (unsigned long)st.ooo_segments,
+	    (unsigned long)st.overlap_bytes, (unsigned long)st.gap_bytes);
+	flow_destroy(flows);
+return;
+}
+
 /*
  * dissect/print packet
  */
@@ -419,6 +462,7 @@ got_packet(u_char *args, const struct pcap_pkthdr *header, const u_char *packet)
 {
 
 	static int count = 1;                   /* packet counter */
+	struct flow_pkt pkt;                    /* parsed for the flow table */
 	
 	/* declare pointers to packet headers */
 	const struct sniff_ethernet *ethernet;  /* The ethernet header [1] */
@@ -430,6 +474,13 @@ got_packet(u_char *args, const struct pcap_pkthdr *header, const u_char *packet)
 	int size_tcp;
 	int size_payload;
 	
+	/* account the flow first, printing is optional [4] */
+	if (flow_parse(packet, header->caplen, &pkt) == 0)
+		flow_track(flows, (uint64_t)header->ts.tv_sec * 1000000 +
+		    header->ts.tv_usec, &pkt);
+	if (quiet)
+		return;
+
 	printf("\nPacket number %d:\n", count);
 	count++;
 	
@@ -512,14 +563,28 @@ int main(int argc, char **argv)
 	bpf_u_int32 mask;			/* subnet mask */
 	bpf_u_int32 net;			/* ip */
 	int num_packets = 10;			/* number of packets to capture */
+	char *fname = NULL;			/* capture file [4] */
+	struct flow_config config;
+	int opt;
 
 	print_app_banner();
 
+	while ((opt = getopt(argc, argv, "f:")) != -1) {
+		if (opt != 'f') {
+			print_app_usage();
+			exit(EXIT_FAILURE);
+		}
+		fname = optarg;
+	}
+
 	/* check for capture device name on command-line */
-	if (argc == 2) {
-		dev = argv[1];
+	if (fname != NULL && argc == optind) {
+		dev = fname;
 	}
-	else if (argc > 2) {
+	else if (fname == NULL && argc - optind == 1) {
+		dev = argv[optind];
+	}
+	else if (argc - optind > 0) {
 		fprintf(stderr, "error: unrecognized command-line options\n\n");
 		print_app_usage();
 		exit(EXIT_FAILURE);
@@ -535,20 +600,41 @@ int main(int argc, char **argv)
 	}
 	
 	/* get network number and mask associated with capture device */
-	if (pcap_lookupnet(dev, &net, &mask, errbuf) == -1) {
+	if (fname != NULL) {
+		net = 0;
+		mask = 0;
+	}
+	else if (pcap_lookupnet(dev, &net, &mask, errbuf) == -1) {
 		fprintf(stderr, "Couldn't get netmask for device %s: %s\n",
 		    dev, errbuf);
 		net = 0;
 		mask = 0;
 	}
 
+	/* a file is read to the end, quietly [4] */
+	if (fname != NULL) {
+		num_packets = -1;
+		quiet = 1;
+	}
+
 	/* print capture info */
-	printf("Device: %s\n", dev);
+	printf("%s: %s\n", fname ? "File" : "Device", dev);
 	printf("Number of packets: %d\n", num_packets);
 	printf("Filter expression: %s\n", filter_exp);
 
-	/* open capture device */
-	handle = pcap_open_live(dev, SNAP_LEN, 1, 1000, errbuf);
+	memset(&config, 0, sizeof(config));
+	config.reassemble = 1;
+	flows = flow_create(&config);
+	if (flows == NULL) {
+		fprintf(stderr, "Couldn't create flow table\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* open capture device or file */
+	if (fname != NULL)
+		handle = pcap_open_offline(fname, errbuf);
+	else
+		handle = pcap_open_live(dev, SNAP_LEN, 1, 1000, errbuf);
 	if (handle == NULL) {
 		fprintf(stderr, "Couldn't open device %s: %s\n", dev, errbuf);
 		exit(EXIT_FAILURE);
@@ -582,6 +668,7 @@ int main(int argc, char **argv)
 	pcap_close(handle);
 
 	printf("\nCapture complete.\n");
+	print_flows();
 
 return 0;
 }
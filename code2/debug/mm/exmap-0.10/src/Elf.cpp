@@ -6,6 +6,10 @@
 #include <sstream>
 #include <unistd.h> // getpagesize()
 #include <string.h>
+#include <fcntl.h>
+#include <sys/fsuid.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 using namespace std;
 using namespace jutil;
@@ -41,10 +45,52 @@ Address Elf::page_align_up(const Address &addr)
 
 // ------------------------------------------------------------
 
+void MemBuf::set(const char *data, size_t len)
+{
+    char *p = const_cast<char *>(data);
+    setg(p, p, p + len);
+}
+
+MemBuf::pos_type MemBuf::seekoff(off_type off,
+				 ios_base::seekdir dir,
+				 ios_base::openmode which)
+{
+    char *pos;
+    if (dir == ios_base::beg) {
+	pos = eback() + off;
+    }
+    else if (dir == ios_base::cur) {
+	pos = gptr() + off;
+    }
+    else {
+	pos = egptr() + off;
+    }
+    if (!(which & ios_base::in) || pos < eback() || pos > egptr()) {
+	return pos_type(off_type(-1));
+    }
+    setg(eback(), pos, egptr());
+    return pos_type(pos - eback());
+}
+
+MemBuf::pos_type MemBuf::seekpos(pos_type pos, ios_base::openmode which)
+{
+    return seekoff(off_type(pos), ios_base::beg, which);
+}
+
+// ------------------------------------------------------------
+
 File::File()
-    : _started_lazy_load_sections(false)
+    : _started_lazy_load_sections(false),
+      _map(NULL),
+      _map_len(0),
+      _is(&_buf)
 { }
 
+File::~File()
+{
+    unload();
+}
+
 unsigned long File::elf_file_type()
 {
     return _filestruct->type();
@@ -81,8 +127,13 @@ bool File::load(const string &fname, bool warn_if_non_elf)
 void File::unload(void)
 {
     _started_lazy_load_sections = false;
-    _ifs.clear();
-    _ifs.close();
+    _buf.set(NULL, 0);
+    _is.clear();
+    if (_map != NULL) {
+	munmap(const_cast<char *>(_map), _map_len);
+	_map = NULL;
+	_map_len = 0;
+    }
     _fname.clear();
     _segments.clear();
     _sections.clear();
@@ -262,32 +313,42 @@ bool File::lazy_load_sections()
 
 bool File::open_file()
 {
-    uid_t new_euid = 0, orig_euid = 0;
+    uid_t new_fsuid = 0;
+    int fd;
 
     // If we are root, become the file owner. Otherwise, we might not
     // be able to open the file (e.g. a file on an NFS mount with root
-    // squash).
-    orig_euid = geteuid();
-    if (orig_euid == 0
-	&& file_owner(_fname, new_euid)
-	&& new_euid != 0) {
-	seteuid(new_euid);
+    // squash). The fsuid is per thread, unlike the euid, so this
+    // doesn't disturb other threads loading files.
+    if (geteuid() == 0
+	&& file_owner(_fname, new_fsuid)
+	&& new_fsuid != 0) {
+	setfsuid(new_fsuid);
     }
-    
-    if (_ifs.is_open()) {
-	_ifs.close();
+    fd = open(_fname.c_str(), O_RDONLY);
+    if (new_fsuid != 0) {
+	setfsuid(0);
     }
-    _ifs.clear();
-    _ifs.open(_fname.c_str());
-    if (!_ifs.is_open()) {
+
+    if (fd < 0) {
 	warn << "Can't open file: " << _fname << "\n";
+	return false;
     }
 
-    if (new_euid != 0) {
-	seteuid(orig_euid); // ok, it will always be 0...
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+	void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p != MAP_FAILED) {
+	    _map = (const char *) p;
+	    _map_len = st.st_size;
+	}
     }
-    
-    return _ifs.is_open();
+    close(fd);
+
+    // An empty (or unmappable) file just reads as EOF
+    _buf.set(_map, _map_len);
+    _is.clear();
+    return true;
 }
 
 bool File::correlate_string_sections()
@@ -306,14 +367,14 @@ bool File::correlate_string_sections()
     }
 
     for (it = _sections.begin(); it != _sections.end(); ++it) {
-	(*it)->set_name(_ifs, string_table);
+	(*it)->set_name(_is, string_table);
 	SectionPtr &sect = *it;
 	if (sect->is_symbol_table()) {
 	    if (!sect->is_dynsym_table() || !_symbol_table_section) {
 		_symbol_table_section = sect;
 	    }
 	    SectionPtr string_table = section(sect->link());
-	    sect->load_symbols(_ifs, string_table);
+	    sect->load_symbols(_is, string_table);
 	}
     }
     return true;
@@ -324,9 +385,9 @@ bool File::load_file_header()
     char ident_buf[EI_NIDENT];
 
     memset(ident_buf, '\0', sizeof(ident_buf));
-    binary_read(_ifs, ident_buf);
-    _ifs.clear();
-    _ifs.seekg(0, ios::beg);
+    binary_read(_is, ident_buf);
+    _is.clear();
+    _is.seekg(0, ios::beg);
 
     if (memcmp(ident_buf, "\x7f\x45\x4c\x46", 4) != 0) {
 	/* Not an ELF file */
@@ -336,10 +397,10 @@ bool File::load_file_header()
     char e_class = ident_buf[EI_CLASS];
     switch (e_class) {
 	case ELFCLASS32:
-	    _filestruct.reset(new FileStruct<Elf32_Ehdr>(_ifs));
+	    _filestruct.reset(new FileStruct<Elf32_Ehdr>(_is));
 	    break;
 	case ELFCLASS64:
-	    _filestruct.reset(new FileStruct<Elf64_Ehdr>(_ifs));
+	    _filestruct.reset(new FileStruct<Elf64_Ehdr>(_is));
 	    break;
 	default:
 	    warn << "Unrecognised ELF class: " << e_class << "\n";
@@ -347,7 +408,7 @@ bool File::load_file_header()
 	    break;
     }
 
-    return _ifs.good();
+    return _is.good();
 }
 
 bool File::load_sections()
@@ -355,7 +416,7 @@ bool File::load_sections()
     list<string> entries;
     list<string>::iterator it;
     
-    if (!load_table(_ifs,
+    if (!load_table(_is,
 		    "section header table",
 		    _filestruct->shoff(),
 		    _filestruct->shnum(),
@@ -382,7 +443,7 @@ bool File::load_segments()
     list<string> entries;
     list<string>::iterator it;
     
-    if (!load_table(_ifs,
+    if (!load_table(_is,
 		    "segment header table",
 		    _filestruct->phoff(),
 		    _filestruct->phnum(),
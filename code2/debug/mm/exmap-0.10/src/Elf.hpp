@@ -234,11 +234,28 @@ namespace Elf
 	    StructType _data;
     };
 
-    /// Hold information on a single ELF file, 32- or 64-bit
+    /// Read-only, seekable streambuf over a block of memory, so the
+    /// parsing code can keep using istreams on an mmapped file.
+    class MemBuf : public std::streambuf
+    {
+    public:
+	void set(const char *data, size_t len);
+    protected:
+	pos_type seekoff(off_type off,
+			 std::ios_base::seekdir dir,
+			 std::ios_base::openmode which = std::ios_base::in);
+	pos_type seekpos(pos_type pos,
+			 std::ios_base::openmode which = std::ios_base::in);
+    };
+
+    /// Hold information on a single ELF file, 32- or 64-bit. The file
+    /// is mmapped (and the descriptor closed) while loaded, so keeping
+    /// many of them costs no file descriptors or read syscalls.
     class File
     {
     public:
 	File();
+	~File();
 	/// Load information from the specified file. Returns false if not
 	/// an elf file (or does not exist). Will also warn unless
 	/// 'warn_if_non_elf' is false.
@@ -289,7 +306,10 @@ namespace Elf
 	bool load_segments();
 
 	bool _started_lazy_load_sections;
-	std::ifstream _ifs;
+	const char *_map;
+	size_t _map_len;
+	MemBuf _buf;
+	std::istream _is;
 	std::string _fname;
 	std::list<Elf::SegmentPtr> _segments;
 	std::list<Elf::SectionPtr> _sections;
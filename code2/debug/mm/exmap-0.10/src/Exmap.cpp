@@ -8,7 +8,14 @@
 #include <sstream>
 #include <set>
 
+#include <algorithm>
+
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -37,6 +44,12 @@ Snapshot::Snapshot(SysInfoPtr &sys_info)
       _file_pool(new FilePool),
       _sys_info(sys_info)
 {
+    set_num_threads(sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+void Snapshot::set_num_threads(int num_threads)
+{
+    _num_threads = num_threads > 0 ? num_threads : 1;
 }
 
 const list<ProcessPtr> Snapshot::procs()
@@ -99,10 +112,104 @@ bool Snapshot::load()
     return true;
 }
 
+// Both halves of a snapshot load are spread over a few worker
+// threads. Work items are handed out one at a time by atomically
+// bumping an index, so a few huge processes don't leave the other
+// workers idle.
+
+/// Run fn once per arg, each in its own thread (the first in the
+/// calling thread), and wait for them all.
+static void run_workers(void *(*fn)(void *), const vector<void *> &args)
+{
+    vector<pthread_t> threads(args.size());
+    vector<char> started(args.size(), 0);
+    size_t i;
+
+    for (i = 1; i < args.size(); ++i) {
+	// If we can't start a thread the others just do its share
+	started[i] = pthread_create(&threads[i], NULL, fn, args[i]) == 0;
+    }
+    fn(args[0]);
+    for (i = 1; i < args.size(); ++i) {
+	if (started[i]) {
+	    pthread_join(threads[i], NULL);
+	}
+    }
+}
+
+/// How many workers to use for num_items items
+static size_t num_workers(int num_threads, size_t num_items)
+{
+    size_t n = num_threads;
+    if (n > num_items) { n = num_items; }
+    return n > 0 ? n : 1;
+}
+
+namespace
+{
+    struct LoadProcsJob
+    {
+	SysInfoPtr *sys_info;
+	const PagePoolPtr *page_pool;
+	vector<pid_t> pids;
+	vector<ProcessPtr> procs; // null if not loaded
+	size_t next;
+    };
+
+    /// Each worker counts pages into its own pool, merged at the end
+    struct LoadProcsWorker
+    {
+	LoadProcsJob *job;
+	PagePool counts;
+    };
+
+    struct CalcMapsJob
+    {
+	FilePoolPtr *file_pool;
+	vector<ProcessPtr> procs;
+	vector<char> worked;
+	size_t next;
+    };
+};
+
+static void *load_procs_worker(void *arg)
+{
+    LoadProcsWorker *worker = (LoadProcsWorker *) arg;
+    LoadProcsJob *job = worker->job;
+    size_t i;
+
+    while ((i = __sync_fetch_and_add(&job->next, 1)) < job->pids.size()) {
+	ProcessPtr proc(new Process(*job->page_pool, job->pids[i]));
+	proc->selfptr(proc);
+	if (!proc->load(*job->sys_info, worker->counts)) {
+	    warn << "Snapshot::load_procs - can't load pid "
+		 << job->pids[i] << "\n";
+	    continue;
+	}
+	if (proc->has_mm()) {
+	    job->procs[i] = proc;
+	}
+    }
+    return NULL;
+}
+
+static void *calc_maps_worker(void *arg)
+{
+    CalcMapsJob *job = (CalcMapsJob *) arg;
+    size_t i;
+
+    while ((i = __sync_fetch_and_add(&job->next, 1)) < job->procs.size()) {
+	job->worked[i] = job->procs[i]->prepare_maps(*job->file_pool);
+    }
+    return NULL;
+}
+
 bool Snapshot::load_procs(const list<pid_t> &pids)
 {
     list<pid_t>::const_iterator it;
     pid_t mypid = getpid();
+    LoadProcsJob job;
+    size_t i;
 
     _procs.clear();
     _page_pool->clear();
@@ -112,16 +219,31 @@ bool Snapshot::load_procs(const list<pid_t> &pids)
 	    // Don't monitor ourselves
 	    continue;
 	}
-
-	ProcessPtr proc(new Process(_page_pool, *it));
-	proc->selfptr(proc);
-	if (!proc->load(_sys_info)) {
-	    warn << "Snapshot::load_procs - can't load pid " << *it << "\n";
-	    continue;
-	}
-
-	if (proc->has_mm()) {
-	    _procs[*it] = proc;
+	job.pids.push_back(*it);
+    }
+    job.sys_info = &_sys_info;
+    job.page_pool = &_page_pool;
+    job.procs.resize(job.pids.size());
+    job.next = 0;
+
+    // The module interface (and the test mocks) read through shared
+    // state, so only go wide if the sysinfo says so
+    size_t nworkers = _sys_info->is_thread_safe()
+	? num_workers(_num_threads, job.pids.size()) : 1;
+    vector<LoadProcsWorker> workers(nworkers);
+    vector<void *> args;
+    for (i = 0; i < nworkers; ++i) {
+	workers[i].job = &job;
+	args.push_back(&workers[i]);
+    }
+    run_workers(load_procs_worker, args);
+
+    for (i = 0; i < nworkers; ++i) {
+	_page_pool->merge(workers[i].counts);
+    }
+    for (i = 0; i < job.pids.size(); ++i) {
+	if (job.procs[i]) {
+	    _procs[job.pids[i]] = job.procs[i];
 	}
     }
     
@@ -130,28 +252,122 @@ bool Snapshot::load_procs(const list<pid_t> &pids)
 
 bool Snapshot::calculate_file_mappings()
 {
-    list<ProcessPtr>::iterator it;
     list<ProcessPtr> processes = procs();
-
-    for (it = processes.begin(); it != processes.end(); ++it) {
-	if (!(*it)->calculate_maps(_file_pool)) {
-	    warn << "Failed to process maps for pid " << (*it)->pid() << "\n";
-	    return false;
+    CalcMapsJob job;
+    size_t i;
+
+    job.file_pool = &_file_pool;
+    job.procs.assign(processes.begin(), processes.end());
+    job.worked.resize(job.procs.size());
+    job.next = 0;
+
+    size_t nworkers = num_workers(_num_threads, job.procs.size());
+    vector<void *> args(nworkers, &job);
+    run_workers(calc_maps_worker, args);
+
+    // Associate in pid order, so the file map lists come out the
+    // same however the work was split up
+    bool worked = true;
+    for (i = 0; i < job.procs.size(); ++i) {
+	if (!job.worked[i]) {
+	    warn << "Failed to process maps for pid "
+		 << job.procs[i]->pid() << "\n";
+	    worked = false;
+	    continue;
 	}
+	job.procs[i]->associate_maps();
     }
-    return !_file_pool->files().empty();
+    return worked && !_file_pool->files().empty();
 }
 
 
 // ------------------------------------------------------------
 
+// Initial number of hash slots (a power of two)
+static const int PAGEPOOL_INITIAL_BITS = 12;
+
+PagePool::PagePool()
+{
+    clear();
+}
+
 void PagePool::clear()
 {
-    _counts.clear();
+    _slots.assign(1 << PAGEPOOL_INITIAL_BITS, Slot());
+    _shift = 64 - PAGEPOOL_INITIAL_BITS;
+    _used = 0;
+    _unmapped_count = 0;
+}
+
+void PagePool::inc_pages_count(const vector<Page> &pages)
+{
+    vector<Page>::const_iterator it;
+    for (it = pages.begin(); it != pages.end(); ++it) {
+	inc_page_count(*it);
+    }
+}
+
+void PagePool::merge(const PagePool &other)
+{
+    vector<Slot>::const_iterator it;
+    for (it = other._slots.begin(); it != other._slots.end(); ++it) {
+	if (it->cookie == 0) {
+	    continue;
+	}
+	Slot &slot = _slots[find_slot(it->cookie)];
+	if (slot.cookie == 0) {
+	    slot.cookie = it->cookie;
+	    if (++_used * 2 > _slots.size()) {
+		grow();
+		_slots[find_slot(it->cookie)].count += it->count;
+		continue;
+	    }
+	}
+	slot.count += it->count;
+    }
+    _unmapped_count += other._unmapped_count;
+}
+
+void PagePool::grow()
+{
+    vector<Slot> old;
+    old.swap(_slots);
+    _slots.assign(old.size() * 2, Slot());
+    --_shift;
+
+    vector<Slot>::const_iterator it;
+    for (it = old.begin(); it != old.end(); ++it) {
+	if (it->cookie != 0) {
+	    _slots[find_slot(it->cookie)] = *it;
+	}
+    }
 }
 
 // ------------------------------------------------------------
 
+namespace
+{
+    /// Hold a mutex for the lifetime of the object
+    class ScopedLock
+    {
+    public:
+	ScopedLock(pthread_mutex_t &m) : _m(m) { pthread_mutex_lock(&_m); }
+	~ScopedLock() { pthread_mutex_unlock(&_m); }
+    private:
+	pthread_mutex_t &_m;
+    };
+};
+
+FilePool::FilePool()
+{
+    pthread_mutex_init(&_lock, NULL);
+}
+
+FilePool::~FilePool()
+{
+    pthread_mutex_destroy(&_lock);
+}
+
 void FilePool::clear()
 {
     _files.clear();
@@ -166,11 +382,23 @@ FilePtr FilePool::get_or_make_file(const string &name)
 {
     map<string, FilePtr>::iterator it;
 
+    {
+	ScopedLock lock(_lock);
+	it = _files.find(name);
+	if (it != _files.end()) {
+	    return it->second;
+	}
+    }
+
+    // Loading the ELF info is the slow part, don't hold the lock for
+    // it. If another thread gets in first, we use theirs.
+    FilePtr f(new File(name));
+
+    ScopedLock lock(_lock);
     it = _files.find(name);
     if (it == _files.end()) {
-	FilePtr f(new File(name));
 	_files[name] = f;
-	it = _files.find(name);
+	return f;
     }
     return it->second;
 }
@@ -204,6 +432,11 @@ void Process::selfptr(boost::shared_ptr<Process> &p)
 }
 
 bool Process::load(SysInfoPtr &sys_info)
+{
+    return load(sys_info, *_page_pool);
+}
+
+bool Process::load(SysInfoPtr &sys_info, PagePool &counts)
 {
     _cmdline = sys_info->read_cmdline(_pid);
     if (_cmdline.empty()) {
@@ -222,7 +455,7 @@ bool Process::load(SysInfoPtr &sys_info)
     // Can't load pages if we don't have any...
     if (!has_mm()) { return true; }
     
-    if (!load_page_info(sys_info)) {
+    if (!load_page_info(sys_info, counts)) {
 	warn << "Process::load - can't load page info: " << _pid << "\n";
 	return false;
     }
@@ -263,6 +496,11 @@ list<MapPtr> Process::maps()
     return _maps;
 }
 
+list<VmaPtr> Process::vmas()
+{
+    return _vmas;
+}
+
 
 pid_t Process::pid()
 {
@@ -326,16 +564,35 @@ void Process::add_file(const FilePtr &file)
 
 bool Process::calculate_maps(FilePoolPtr &file_pool)
 {
-    MapCalculator mc(_vmas, file_pool, selfptr());
-
-    return mc.calc_maps(_maps) && !_maps.empty();
+    if (!prepare_maps(file_pool)) {
+	return false;
+    }
+    associate_maps();
+    return true;
 }
 
+bool Process::prepare_maps(FilePoolPtr &file_pool)
+{
+    _map_calc.reset(new MapCalculator(_vmas, file_pool, selfptr()));
+    if (!_map_calc->calc_maps(_maps) || _maps.empty()) {
+	// The calculator holds a ref to us
+	_map_calc.reset();
+	return false;
+    }
+    return true;
+}
 
+void Process::associate_maps()
+{
+    if (_map_calc) {
+	_map_calc->associate();
+	_map_calc.reset();
+    }
+}
 
-bool Process::load_page_info(SysInfoPtr &sys_info)
+bool Process::load_page_info(SysInfoPtr &sys_info, PagePool &counts)
 {
-    map<Address, list<Page> > page_info;
+    map<Address, vector<Page> > page_info;
     stringstream pref;
     pref << pid() << " load_page_info: ";
 
@@ -344,11 +601,18 @@ bool Process::load_page_info(SysInfoPtr &sys_info)
 	return false;
     }
 
-    map<Address, list<Page> >::iterator pi_it;
+    map<Address, VmaPtr> vmas_by_addr;
+    list<VmaPtr>::const_iterator vma_it;
+    for (vma_it = _vmas.begin(); vma_it != _vmas.end(); ++vma_it) {
+	vmas_by_addr[(*vma_it)->start()] = *vma_it;
+    }
+
+    map<Address, vector<Page> >::iterator pi_it;
     for (pi_it = page_info.begin(); pi_it != page_info.end(); ++pi_it) {
 	Address start_address = pi_it->first;
-	VmaPtr vma;
-	if (!find_vma_by_addr(start_address, vma)) {
+	map<Address, VmaPtr>::iterator found;
+	found = vmas_by_addr.find(start_address);
+	if (found == vmas_by_addr.end()) {
 	    // This can happen, a process can alloc whilst we are
 	    // running
 	    warn << pref.str() << "can't find vma at "
@@ -359,8 +623,8 @@ bool Process::load_page_info(SysInfoPtr &sys_info)
 	if (pi_it->second.size() == 0) {
 	    warn << pref.str() << "VMA with no pages " << start_address << "\n";
 	}
-	vma->add_pages(pi_it->second);
-	_page_pool->inc_pages_count(pi_it->second);
+	counts.inc_pages_count(pi_it->second);
+	found->second->add_pages(pi_it->second);
     }
 
     return true;
@@ -372,21 +636,6 @@ bool Process::has_mm()
     return _vmas.size() > 0;
 }
 
-bool Process::find_vma_by_addr(Address start,
-				VmaPtr &vma)
-{
-    list<VmaPtr>::const_iterator it;
-
-    for (it = _vmas.begin(); it != _vmas.end(); ++it) {
-	if ((*it)->start() == start) {
-	    vma = *it;
-	    return true;
-	}
-    }
-    return false;
-}
-
-
 void Process::print(ostream &os) const
 {
     os << "PID: " << _pid << "\n"
@@ -407,7 +656,9 @@ Vma::Vma(Elf::Address start,
 	 off_t offset,
 	 const std::string &fname)
     : _offset(offset),
-      _fname(fname)
+      _fname(fname),
+      _first_pgnum(0),
+      _num_pages(0)
 {
     _range = RangePtr(new Range(start, end));
 }
@@ -426,9 +677,11 @@ Elf::Address Vma::vm_size() { return _range->size(); }
 
 int Vma::num_pages()
 {
-    return _pages.size();
+    return _num_pages;
 }
 
+const Page Vma::UNMAPPED_PAGE;
+
 boost::shared_ptr<Vma> Vma::selfptr()
 {
     return _selfptr.lock();
@@ -440,11 +693,26 @@ void Vma::selfptr(boost::shared_ptr<Vma> &p)
 }
 
     
-void Vma::add_pages(const list<Page> &pages)
+void Vma::add_pages(vector<Page> &pages)
 {
-    list<Page>::const_iterator it;
-    for (it = pages.begin(); it != pages.end(); ++it) {
-	_pages.push_back(*it);
+    _num_pages = pages.size();
+    _first_pgnum = 0;
+    _pages.clear();
+
+    unsigned int first = 0, last = pages.size();
+    while (first < last && !pages[first].is_mapped()) {
+	++first;
+    }
+    while (last > first && !pages[last - 1].is_mapped()) {
+	--last;
+    }
+    if (first == 0 && last == pages.size()) {
+	_pages.swap(pages);
+    }
+    else {
+	_pages.assign(pages.begin() + first, pages.begin() + last);
+	_first_pgnum = first;
+	pages.clear();
     }
 }
 
@@ -483,7 +751,7 @@ bool Vma::addr_to_pgnum(Address addr, unsigned int &pgnum)
 }
 
 bool Vma::get_pages_for_range(const RangePtr &mrange,
-			      std::list<PartialPageInfo> &ppinfo)
+			      std::vector<PartialPageInfo> &ppinfo)
 {
     ppinfo.clear();
     
@@ -511,34 +779,35 @@ bool Vma::get_pages_for_range(const RangePtr &mrange,
 	     << start_pgnum << ", " << end_pgnum << "\n";
 	return false;
     }
-    if (start_pgnum >= _pages.size()) {
+    if (start_pgnum >= _num_pages) {
 	warn << "Vma::get_pages_for_range - start pgnum out of range: "
-	     << start_pgnum << ", " << _pages.size() << " " << _fname << "\n";
+	     << start_pgnum << ", " << _num_pages << " " << _fname << "\n";
 	return false;
     }
-    if (end_pgnum >= _pages.size()) {
+    if (end_pgnum >= _num_pages) {
 	warn << "Vma::get_pages_for_range - end pgnum out of range: "
-	     << end_pgnum << ", " << _pages.size() << "\n";
+	     << end_pgnum << ", " << _num_pages << "\n";
 	return false;
     }
 
     if (start_pgnum == end_pgnum) {
-	ppinfo.push_back(PartialPageInfo(_pages[start_pgnum], mrange->size()));
+	ppinfo.push_back(PartialPageInfo(page(start_pgnum), mrange->size()));
 	return true;
     }
 
+    ppinfo.reserve(end_pgnum - start_pgnum + 1);
     Address bytes = Elf::page_size()
 	- (mrange->start() - Elf::page_align_down(mrange->start()));
-    ppinfo.push_back(PartialPageInfo(_pages[start_pgnum], bytes));
+    ppinfo.push_back(PartialPageInfo(page(start_pgnum), bytes));
 
     bytes = mrange->end() - Elf::page_align_down(mrange->end() - 1);
     if (bytes > 0) {
-	ppinfo.push_back(PartialPageInfo(_pages[end_pgnum], bytes));
+	ppinfo.push_back(PartialPageInfo(page(end_pgnum), bytes));
     }
 
     bytes = Elf::page_size();
     for (unsigned int pgnum = start_pgnum + 1; pgnum < end_pgnum; ++pgnum) {
-	ppinfo.push_back(PartialPageInfo(_pages[pgnum], bytes));
+	ppinfo.push_back(PartialPageInfo(page(pgnum), bytes));
     }
 
     return true;
@@ -557,33 +826,17 @@ string Vma::to_string() const
 
 // ------------------------------------------------------------
 
-    Page::Page(PageCookie cookie, bool resident, bool writable)
-: _cookie(cookie), _resident(resident), _writable(writable)
-{ }
-
-PageCookie Page::cookie() const
+Page::Page(PageCookie cookie, bool resident, bool writable)
+    : _bits(cookie & ~(RESIDENT_BIT | WRITABLE_BIT))
 {
-    return _cookie;
-}
-
-bool Page::is_mapped() const
-{
-    return _cookie != 0;
-}
-
-bool Page::is_resident() const
-{
-    return _resident;
-}
-
-bool Page::is_writable() const
-{
-    return _writable;
+    if (resident) { _bits |= RESIDENT_BIT; }
+    if (writable) { _bits |= WRITABLE_BIT; }
 }
 
 void Page::print(ostream &os) const
 {
-    os << "(" << _cookie << ":" << _resident << ":" << _writable << ")";
+    os << "(" << (cookie() & ~RESIDENT_BIT) << ":" << is_resident()
+       << ":" << is_writable() << ")";
 }
 
 // ------------------------------------------------------------
@@ -797,6 +1050,11 @@ RangePtr Map::mem_range() const
     return _mem_range;
 }
 
+VmaPtr Map::vma() const
+{
+    return _vma;
+}
+
 RangePtr Map::elf_range() const
 {
     return _elf_range;
@@ -850,14 +1108,14 @@ SizesPtr Map::sizes_for_mem_range(const PagePoolPtr &pp,
 
     if (subrange->size() == 0) { return sizes; }
     
-    std::list<Vma::PartialPageInfo> ppi_info;
+    std::vector<Vma::PartialPageInfo> ppi_info;
     if (!_vma->get_pages_for_range(subrange, ppi_info)) {
 	warn << "sizes_for_mem_range: Can't get pages for range "
 	    << subrange->to_string() << "\n";
 	return null_sizes;
     }
 
-    std::list<Vma::PartialPageInfo>::iterator it;
+    std::vector<Vma::PartialPageInfo>::iterator it;
 
     for (it = ppi_info.begin(); it != ppi_info.end(); ++it) {
 	Page &page = (*it).page;
@@ -959,6 +1217,11 @@ list<MapPtr> Map::sort(const list<MapPtr> &maplist)
 SysInfo::~SysInfo()
 { }
 
+bool SysInfo::is_thread_safe()
+{
+    return false;
+}
+
 LinuxSysInfo::~LinuxSysInfo()
 { }
 
@@ -1001,7 +1264,7 @@ bool LinuxSysInfo::sanity_check()
 }
 
 bool LinuxSysInfo::read_page_info(pid_t pid,
-				  map<Address, list<Page> > &page_info)
+				  map<Address, vector<Page> > &page_info)
 {
     list<string> lines;
     page_info.clear();
@@ -1019,8 +1282,7 @@ bool LinuxSysInfo::read_page_info(pid_t pid,
 	return false;
     }
 
-    list<Page> empty_pagelist;
-    list<Page> *current_pagelist = NULL;
+    vector<Page> *current_pagelist = NULL;
     
     list<string>::const_iterator it;
     for (it = lines.begin(); it != lines.end(); ++it) {
@@ -1035,17 +1297,16 @@ bool LinuxSysInfo::read_page_info(pid_t pid,
 	    continue;
 	}
 
-	if (it->substr(0, 3) == "VMA") {
-	    Address start_addr;
-	    string token;
-	    sstr.str(it->substr(4)); // "VMA deadbeef"
-	    sstr >> hex >> start_addr;
+	if (it->compare(0, 3, "VMA") == 0) {
+	    // "VMA deadbeef npages"
+	    char *ep;
+	    Address start_addr = strtoul(it->c_str() + 4, &ep, 16);
+	    unsigned long npages = strtoul(ep, NULL, 10);
 
-	    // Put a (copy of) the empty pagelist in for this address
-	    page_info[start_addr] = empty_pagelist;
-
-	    // And remember where to put the pages
+	    // Remember where to put the pages
 	    current_pagelist = &(page_info[start_addr]);
+	    current_pagelist->clear();
+	    current_pagelist->reserve(npages);
 	}
 	else {
 	    bool writable, resident;
@@ -1071,19 +1332,23 @@ bool LinuxSysInfo::parse_page_line(const string &line,
 	bool &writable,
 	PageCookie &cookie)
 {
-    stringstream sstr(line);
-
-    int i, i_resident;
-
-    sstr >> i_resident;
-    resident = i_resident;
-    sstr >> i;
-    writable = i;
-
-    sstr >> hex >> cookie;
-    cookie |= (i_resident << 31);
+    // "<resident> <writable> <cookie as hex>"; Page keeps the
+    // resident (pfn) and non-resident (swap entry) cookies apart
+    const char *cp = line.c_str();
+    char *ep;
 
-    return true;
+    resident = strtoul(cp, &ep, 10);
+    if (ep == cp) {
+	return false;
+    }
+    cp = ep;
+    writable = strtoul(cp, &ep, 10);
+    if (ep == cp) {
+	return false;
+    }
+    cp = ep;
+    cookie = strtoul(cp, &ep, 16);
+    return ep != cp;
 }
 
 std::string LinuxSysInfo::read_cmdline(pid_t pid)
@@ -1181,6 +1446,474 @@ string LinuxSysInfo::proc_map_file(pid_t pid)
     return sstr.str();
 }
 
+SysInfoPtr LinuxSysInfo::best_available()
+{
+    SysInfoPtr sys_info;
+    if (file_exists(EXMAP_FILE)) {
+	sys_info.reset(new LinuxSysInfo);
+    }
+    else {
+	sys_info.reset(new PagemapSysInfo);
+    }
+    return sys_info;
+}
+
+// ------------------------------------------------------------
+
+// See Documentation/admin-guide/mm/pagemap.rst
+static const unsigned long long PM_PFN_MASK = (1ULL << 55) - 1;
+static const unsigned long long PM_SOFT_DIRTY = 1ULL << 55;
+static const unsigned long long PM_SWAP = 1ULL << 62;
+static const unsigned long long PM_PRESENT = 1ULL << 63;
+static const unsigned long long KPF_ANON = 1ULL << 12;
+
+// pagemap entries read per pread
+static const size_t PAGEMAP_BATCH = 16384;
+// kpagecount/kpageflags: read through gaps of up to this many pfns
+// rather than issuing another pread, but no more than KPAGE_BATCH at once
+static const unsigned long long KPAGE_GAP = 512;
+static const unsigned long long KPAGE_BATCH = 65536;
+
+static const string KPAGECOUNT_FILE("/proc/kpagecount");
+static const string KPAGEFLAGS_FILE("/proc/kpageflags");
+
+/// pread until len bytes or EOF, returning the count (-1 on error)
+static ssize_t pread_full(int fd, void *buf, size_t len, off_t offset)
+{
+    char *p = (char *) buf;
+    size_t done = 0;
+    while (done < len) {
+	ssize_t n = pread(fd, p + done, len - done, offset + done);
+	if (n < 0) {
+	    if (errno == EINTR) { continue; }
+	    return -1;
+	}
+	if (n == 0) { break; }
+	done += n;
+    }
+    return done;
+}
+
+PagemapSysInfo::PagemapSysInfo()
+    : _kpagecount_fd(-1), _kpageflags_fd(-1),
+      _refresh_every(0), _track_dirty(false),
+      _vmas_read(0), _vmas_reused(0)
+{
+    _kpagecount_fd = open(KPAGECOUNT_FILE.c_str(), O_RDONLY);
+    _kpageflags_fd = open(KPAGEFLAGS_FILE.c_str(), O_RDONLY);
+    pthread_mutex_init(&_cache_lock, NULL);
+}
+
+PagemapSysInfo::~PagemapSysInfo()
+{
+    if (_kpagecount_fd >= 0) { close(_kpagecount_fd); }
+    if (_kpageflags_fd >= 0) { close(_kpageflags_fd); }
+    pthread_mutex_destroy(&_cache_lock);
+}
+
+void PagemapSysInfo::set_incremental(int refresh_every)
+{
+    ScopedLock lock(_cache_lock);
+    _refresh_every = refresh_every > 0 ? refresh_every : 0;
+    _cache.clear();
+}
+
+void PagemapSysInfo::set_track_dirty(bool track_dirty)
+{
+    _track_dirty = track_dirty;
+}
+
+unsigned long PagemapSysInfo::dirty_pages(pid_t pid)
+{
+    ScopedLock lock(_cache_lock);
+    map<pid_t, Cached>::iterator it = _cache.find(pid);
+    return it == _cache.end() ? 0 : it->second.dirty;
+}
+
+void PagemapSysInfo::counts(unsigned long &vmas_read,
+			    unsigned long &vmas_reused)
+{
+    ScopedLock lock(_cache_lock);
+    vmas_read = _vmas_read;
+    vmas_reused = _vmas_reused;
+}
+
+void PagemapSysInfo::reset_counts()
+{
+    ScopedLock lock(_cache_lock);
+    _vmas_read = 0;
+    _vmas_reused = 0;
+}
+
+list<pid_t> PagemapSysInfo::accessible_pids()
+{
+    list<pid_t> pids = LinuxSysInfo::accessible_pids();
+
+    // Forget the pids which have gone
+    set<pid_t> live(pids.begin(), pids.end());
+    ScopedLock lock(_cache_lock);
+    map<pid_t, Cached>::iterator it = _cache.begin();
+    while (it != _cache.end()) {
+	if (live.find(it->first) == live.end()) {
+	    _cache.erase(it++);
+	}
+	else {
+	    ++it;
+	}
+    }
+    return pids;
+}
+
+bool PagemapSysInfo::Stamp::operator==(const Stamp &other) const
+{
+    return start_time == other.start_time
+	&& min_flt == other.min_flt
+	&& maj_flt == other.maj_flt;
+}
+
+bool PagemapSysInfo::read_stamp(pid_t pid, Stamp &stamp)
+{
+    stringstream fname;
+    fname << "/proc/" << pid << "/stat";
+    int fd = open(fname.str().c_str(), O_RDONLY);
+    if (fd < 0) {
+	return false;
+    }
+    char buf[1024];
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+	return false;
+    }
+    buf[n] = '\0';
+
+    // The comm can contain anything, so start after its last ')'
+    const char *cp = strrchr(buf, ')');
+    if (cp == NULL) {
+	return false;
+    }
+    return sscanf(cp + 1, " %*c %*d %*d %*d %*d %*d %*u %lu %*u %lu"
+		  " %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu",
+		  &stamp.min_flt, &stamp.maj_flt, &stamp.start_time) == 3;
+}
+
+bool PagemapSysInfo::is_thread_safe()
+{
+    return true;
+}
+
+bool PagemapSysInfo::sanity_check()
+{
+    if (!file_readable("/proc/self/pagemap")) {
+	warn << "Can't read /proc/self/pagemap: kernel too old?\n";
+	return false;
+    }
+    if (_kpagecount_fd < 0 || _kpageflags_fd < 0) {
+	warn << "Can't open " << KPAGECOUNT_FILE << " and "
+	     << KPAGEFLAGS_FILE << ": please run as root\n";
+	return false;
+    }
+    return true;
+}
+
+bool PagemapSysInfo::read_spans(pid_t pid, vector<Span> &spans,
+				bool keep_lines)
+{
+    spans.clear();
+
+    stringstream fname;
+    fname << "/proc/" << pid << "/maps";
+    int fd = open(fname.str().c_str(), O_RDONLY);
+    if (fd < 0) {
+	return false;
+    }
+
+    string text;
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+	if (n < 0) {
+	    if (errno == EINTR) { continue; }
+	    close(fd);
+	    return false;
+	}
+	text.append(buf, n);
+    }
+    close(fd);
+
+    // "start-end perms offset dev inode name", we only need the first
+    // three fields
+    const char *cp = text.c_str();
+    while (*cp) {
+	char *ep;
+	Span span;
+	span.start = strtoul(cp, &ep, 16);
+	if (*ep != '-') {
+	    warn << "read_spans - bad maps line for " << pid << "\n";
+	    return false;
+	}
+	span.end = strtoul(ep + 1, &ep, 16);
+	if (*ep != ' ' || strlen(ep) < 5) {
+	    warn << "read_spans - bad maps line for " << pid << "\n";
+	    return false;
+	}
+	span.writable = ep[2] == 'w';
+	span.shared = ep[4] == 's';
+
+	const char *eol = strchr(ep, '\n');
+	if (keep_lines) {
+	    span.line.assign(cp, eol == NULL ? strlen(cp) : eol - cp);
+	}
+	spans.push_back(span);
+
+	cp = eol;
+	if (cp == NULL) { break; }
+	++cp;
+    }
+    return true;
+}
+
+bool PagemapSysInfo::read_pagemap(int fd, const Span &span,
+				  vector<unsigned long long> &entries)
+{
+    size_t pagesize = Elf::page_size();
+    size_t npages = (span.end - span.start) / pagesize;
+    off_t offset = (span.start / pagesize) * sizeof(entries[0]);
+
+    entries.resize(npages);
+    for (size_t i = 0; i < npages; i += PAGEMAP_BATCH) {
+	size_t todo = min(PAGEMAP_BATCH, npages - i);
+	ssize_t n = pread_full(fd, &entries[i], todo * sizeof(entries[0]),
+			       offset + i * sizeof(entries[0]));
+	if (n < 0) {
+	    return false;
+	}
+	// Nothing past the end of the user address space (e.g. the
+	// [vsyscall] page): those pages read as unmapped
+	if ((size_t) n < todo * sizeof(entries[0])) {
+	    fill(entries.begin() + i + n / sizeof(entries[0]),
+		 entries.end(), 0ULL);
+	    break;
+	}
+    }
+    return true;
+}
+
+bool PagemapSysInfo::read_kpage_run(int fd,
+				    const vector<unsigned long long> &pfns,
+				    size_t from, size_t to,
+				    vector<unsigned long long> &out)
+{
+    unsigned long long first = pfns[from];
+    vector<unsigned long long> buf(pfns[to - 1] - first + 1);
+
+    ssize_t n = pread_full(fd, &buf[0], buf.size() * sizeof(buf[0]),
+			   first * sizeof(buf[0]));
+    if (n < 0) {
+	return false;
+    }
+    buf.resize(n / sizeof(buf[0]));
+    for (size_t i = from; i < to; ++i) {
+	if (pfns[i] - first < buf.size()) {
+	    out[i] = buf[pfns[i] - first];
+	}
+    }
+    return true;
+}
+
+bool PagemapSysInfo::read_kpage_info(const vector<unsigned long long> &pfns,
+				     vector<unsigned long long> &counts,
+				     vector<unsigned long long> &flags)
+{
+    counts.assign(pfns.size(), 0);
+    flags.assign(pfns.size(), 0);
+
+    // pfns is sorted, so nearby pages come out of one pread
+    size_t from = 0;
+    while (from < pfns.size()) {
+	size_t to = from + 1;
+	while (to < pfns.size()
+	       && pfns[to] - pfns[to - 1] <= KPAGE_GAP
+	       && pfns[to] - pfns[from] < KPAGE_BATCH) {
+	    ++to;
+	}
+	if (!read_kpage_run(_kpagecount_fd, pfns, from, to, counts)
+	    || !read_kpage_run(_kpageflags_fd, pfns, from, to, flags)) {
+	    return false;
+	}
+	from = to;
+    }
+    return true;
+}
+
+bool PagemapSysInfo::read_page_info(pid_t pid,
+				    map<Address, vector<Page> > &page_info)
+{
+    page_info.clear();
+    bool incremental = _refresh_every > 0;
+    bool remember = incremental || _track_dirty;
+
+    // Stamp first: a fault after this will show up next time
+    Stamp stamp = Stamp();
+    if (remember && !read_stamp(pid, stamp)) {
+	warn << "read_page_info - can't read stat: " << pid << "\n";
+	return false;
+    }
+
+    vector<Span> spans;
+    if (!read_spans(pid, spans, incremental)) {
+	warn << "read_page_info - can't read maps: " << pid << "\n";
+	return false;
+    }
+
+    // Take what we can from last time
+    vector<char> reused(spans.size(), 0);
+    size_t num_reused = 0;
+    int age = 0;
+    if (incremental) {
+	ScopedLock lock(_cache_lock);
+	map<pid_t, Cached>::iterator cached = _cache.find(pid);
+	if (cached != _cache.end()
+	    && cached->second.stamp == stamp
+	    && cached->second.age + 1 < _refresh_every) {
+	    map<string, vector<Page> > &vmas = cached->second.vmas;
+	    for (size_t i = 0; i < spans.size(); ++i) {
+		map<string, vector<Page> >::iterator vma;
+		vma = vmas.find(spans[i].line);
+		if (vma != vmas.end()) {
+		    page_info[spans[i].start] = vma->second;
+		    reused[i] = 1;
+		    ++num_reused;
+		}
+	    }
+	    age = cached->second.age + 1;
+	}
+    }
+
+    vector<vector<unsigned long long> > entries(spans.size());
+    vector<unsigned long long> pfns;
+    unsigned long dirty = 0;
+    if (num_reused < spans.size()) {
+	stringstream fname;
+	fname << "/proc/" << pid << "/pagemap";
+	int fd = open(fname.str().c_str(), O_RDONLY);
+	if (fd < 0) {
+	    warn << "read_page_info - can't open pagemap: " << pid << "\n";
+	    return false;
+	}
+
+	for (size_t i = 0; i < spans.size(); ++i) {
+	    if (reused[i]) {
+		continue;
+	    }
+	    if (!read_pagemap(fd, spans[i], entries[i])) {
+		warn << "read_page_info - can't read pagemap: " << pid << "\n";
+		close(fd);
+		return false;
+	    }
+	    const vector<unsigned long long> &e = entries[i];
+	    if (_track_dirty) {
+		for (size_t pg = 0; pg < e.size(); ++pg) {
+		    if (e[pg] & PM_SOFT_DIRTY) {
+			++dirty;
+		    }
+		}
+	    }
+	    // Only resident pages of private writable vmas need the
+	    // kpagecount/kpageflags lookup
+	    if (!spans[i].writable || spans[i].shared) {
+		continue;
+	    }
+	    for (size_t pg = 0; pg < e.size(); ++pg) {
+		if (e[pg] & PM_PRESENT) {
+		    pfns.push_back(e[pg] & PM_PFN_MASK);
+		}
+	    }
+	}
+	close(fd);
+
+	if (_track_dirty) {
+	    clear_soft_dirty(pid);
+	}
+    }
+
+    sort(pfns.begin(), pfns.end());
+    pfns.erase(unique(pfns.begin(), pfns.end()), pfns.end());
+    vector<unsigned long long> counts, flags;
+    if (!read_kpage_info(pfns, counts, flags)) {
+	warn << "read_page_info - can't read kpage info: " << pid << "\n";
+	return false;
+    }
+
+    for (size_t i = 0; i < spans.size(); ++i) {
+	if (reused[i]) {
+	    continue;
+	}
+	const Span &span = spans[i];
+	vector<unsigned long long> &e = entries[i];
+	vector<Page> &pages = page_info[span.start];
+	bool lookup = span.writable && !span.shared;
+
+	pages.reserve(e.size());
+	for (size_t pg = 0; pg < e.size(); ++pg) {
+	    unsigned long long entry = e[pg];
+	    bool resident = entry & PM_PRESENT;
+	    bool writable = false;
+	    PageCookie cookie = 0;
+
+	    if (resident) {
+		unsigned long long pfn = entry & PM_PFN_MASK;
+		cookie = pfn;
+		if (span.shared) {
+		    writable = span.writable;
+		}
+		else if (lookup) {
+		    size_t idx = lower_bound(pfns.begin(), pfns.end(), pfn)
+			- pfns.begin();
+		    writable = (flags[idx] & KPF_ANON) && counts[idx] == 1;
+		}
+	    }
+	    else if (entry & PM_SWAP) {
+		cookie = entry & PM_PFN_MASK;
+	    }
+	    pages.push_back(Page(cookie, resident, writable));
+	}
+	vector<unsigned long long>().swap(e);
+    }
+
+    if (remember) {
+	map<string, vector<Page> > vmas;
+	if (incremental) {
+	    for (size_t i = 0; i < spans.size(); ++i) {
+		vmas[spans[i].line] = page_info[spans[i].start];
+	    }
+	}
+	ScopedLock lock(_cache_lock);
+	Cached &cached = _cache[pid];
+	cached.stamp = stamp;
+	cached.age = age;
+	cached.dirty = dirty;
+	cached.vmas.swap(vmas);
+	_vmas_read += spans.size() - num_reused;
+	_vmas_reused += num_reused;
+    }
+
+    return true;
+}
+
+void PagemapSysInfo::clear_soft_dirty(pid_t pid)
+{
+    stringstream fname;
+    fname << "/proc/" << pid << "/clear_refs";
+    int fd = open(fname.str().c_str(), O_WRONLY);
+    if (fd < 0 || write(fd, "4", 1) != 1) {
+	warn << "clear_soft_dirty - can't clear refs: " << pid << "\n";
+    }
+    if (fd >= 0) {
+	close(fd);
+    }
+}
+
 
 
     
@@ -1221,6 +1954,19 @@ bool MapCalculator::calc_maps(list<MapPtr> &maps)
     return true;
 }
 
+void MapCalculator::associate()
+{
+    list<FilePtr>::iterator file_it;
+    for (file_it = _files.begin(); file_it != _files.end(); ++file_it) {
+	(*file_it)->add_proc(_proc);
+    }
+
+    list<pair<FilePtr, MapPtr> >::iterator it;
+    for (it = _file_maps.begin(); it != _file_maps.end(); ++it) {
+	it->first->add_map(it->second);
+    }
+}
+
 bool MapCalculator::add_holes()
 {
     stringstream pref;
@@ -1248,7 +1994,7 @@ bool MapCalculator::add_holes()
 		++hole_it) {
 	    MapPtr map(new Map(vma, *hole_it, null_range));
 	    _maps.push_back(map);
-	    file->add_map(map);
+	    _file_maps.push_back(make_pair(file, map));
 	    dbg << pref.str() << "adding hole " << map->to_string() << "\n";
 	}
     }
@@ -1404,7 +2150,7 @@ bool MapCalculator::calc_maps_for_nonelf_file(const string &fname,
 	}
 	MapPtr map(new Map(vma, vma->range(), null_range));
 	_maps.push_back(map);
-	file->add_map(map);
+	_file_maps.push_back(make_pair(file, map));
 	dbg << pref.str() << "adding nonelf map " << map->to_string() << "\n";
     }
 
@@ -1480,7 +2226,7 @@ bool MapCalculator::calc_map_for_seg(const FilePtr &file,
 	RangePtr elf_mem_range = working_mrange->subtract(seg_to_mem);
 	MapPtr map(new Map(vma, working_mrange, elf_mem_range));
 	_maps.push_back(map);
-	file->add_map(map);
+	_file_maps.push_back(make_pair(file, map));
 	dbg << pref.str() << "adding elf map " << map->to_string() << "\n";
 
 	if (!vma->is_file_backed()) {
@@ -1513,7 +2259,7 @@ void MapCalculator::walk_vma_files()
 	VmaPtr &vma = *it;
 
 	FilePtr file = _file_pool->get_or_make_file(vma->fname());
-	file->add_proc(_proc);
+	_files.push_back(file);
 	_proc->add_file(file);
 
 	// associate non-file-backed vmas with the last file backed
@@ -12,6 +12,7 @@
 
 #include <boost/smart_ptr.hpp>
 
+#include <pthread.h>
 #include <sys/types.h>
 #include "jutil.hpp"
 #include "Elf.hpp"
@@ -38,6 +39,7 @@ namespace Exmap
     typedef boost::shared_ptr<PagePool> PagePoolPtr;
     class Page;
     typedef boost::shared_ptr<Page> PagePtr;
+    class MapCalculator;
     class SysInfo;
     typedef boost::shared_ptr<SysInfo> SysInfoPtr;
 
@@ -57,10 +59,11 @@ namespace Exmap
 	/// kernel modules available, versions, etc).
 	virtual bool sanity_check() = 0;
 
-	/// Read the page info for a pid
+	/// Read the page info for a pid: for each vma start address,
+	/// one Page per page of the vma.
 	virtual bool read_page_info(pid_t pid,
 				    std::map<Elf::Address,
-				    std::list<Page> > &pi) = 0;
+				    std::vector<Page> > &pi) = 0;
 
 	/// Read cmdline for pid
 	virtual std::string read_cmdline(pid_t pid) = 0;
@@ -70,6 +73,10 @@ namespace Exmap
 			       pid_t pid,
 			       std::list<VmaPtr> &vmas) = 0;
 
+	/// True if the read_* methods may be called for different pids
+	/// from several threads at once.
+	virtual bool is_thread_safe();
+
     private:
     };
 
@@ -81,7 +88,7 @@ namespace Exmap
 	virtual std::list<pid_t> accessible_pids();
 	virtual bool sanity_check();
 	virtual bool read_page_info(pid_t pid,
-			    std::map<Elf::Address, std::list<Page> > &pi);
+			    std::map<Elf::Address, std::vector<Page> > &pi);
 	virtual std::string read_cmdline(pid_t pid);
 	virtual bool read_vmas(const PagePoolPtr &pp,
 			       pid_t pid,
@@ -99,6 +106,109 @@ namespace Exmap
 
         std::string proc_map_file(pid_t pid);
 	static const std::string EXMAP_FILE;
+    public:
+	/// The exmap module backed SysInfo if the module is loaded,
+	/// otherwise a PagemapSysInfo.
+	static SysInfoPtr best_available();
+    };
+
+    /// Linux SysInfo which doesn't need the exmap kernel module. Page
+    /// info comes from /proc/xxx/pagemap, read in large binary
+    /// batches. The pte writable bit the module reports isn't in
+    /// pagemap, so it is reconstructed from the vma permissions and
+    /// /proc/kpagecount and /proc/kpageflags: a resident page in a
+    /// writable vma is writable if the vma is shared, or if it is an
+    /// anonymous page (i.e. already COWed) mapped exactly once.
+    /// Needs CAP_SYS_ADMIN, without which the kernel hides the PFNs.
+    ///
+    /// When one PagemapSysInfo is used for a series of snapshots it
+    /// can be made incremental: the pages of each vma are kept, and
+    /// reused next time if the process has taken no page faults and
+    /// the vma's maps line is unchanged. Only the pagemap of new or
+    /// changed vmas (or of every vma, for a faulting process) is then
+    /// read. Every refresh_every'th read of a pid is a full one
+    /// anyway, to pick up reclaim and swapping, which the process
+    /// doesn't see as faults.
+    class PagemapSysInfo : public LinuxSysInfo
+    {
+    public:
+	PagemapSysInfo();
+	virtual ~PagemapSysInfo();
+	virtual std::list<pid_t> accessible_pids();
+	virtual bool sanity_check();
+	virtual bool read_page_info(pid_t pid,
+			    std::map<Elf::Address, std::vector<Page> > &pi);
+	/// Each call only uses pread on its own or shared fds
+	virtual bool is_thread_safe();
+
+	/// Turn incremental reading on (refresh_every > 0) or off
+	void set_incremental(int refresh_every);
+	/// Count the pages each process writes between reads, using
+	/// the soft-dirty bits. This clears the bits after each read
+	/// (via /proc/xxx/clear_refs), so it costs the monitored
+	/// processes a minor fault on the next write to each page, and
+	/// will upset anything else using soft-dirty (e.g. CRIU). Counts
+	/// are always zero unless the kernel has CONFIG_MEM_SOFT_DIRTY.
+	void set_track_dirty(bool track_dirty);
+	/// With track_dirty, the pages pid wrote between its last two
+	/// reads.
+	unsigned long dirty_pages(pid_t pid);
+	/// Vmas whose pagemap was read, and reused from the last read,
+	/// since the last reset_counts()
+	void counts(unsigned long &vmas_read, unsigned long &vmas_reused);
+	void reset_counts();
+    private:
+	/// The bits of a /proc/xxx/maps line we need
+	struct Span
+	{
+	    Elf::Address start;
+	    Elf::Address end;
+	    bool writable;
+	    bool shared;
+	    /// The whole line, when incremental
+	    std::string line;
+	};
+	/// /proc/xxx/stat values which change if the page tables may
+	/// have
+	struct Stamp
+	{
+	    unsigned long long start_time;
+	    unsigned long min_flt;
+	    unsigned long maj_flt;
+	    bool operator==(const Stamp &other) const;
+	};
+	/// What we remember of a pid between reads
+	struct Cached
+	{
+	    Stamp stamp;
+	    int age;
+	    unsigned long dirty;
+	    std::map<std::string, std::vector<Page> > vmas;
+	};
+	bool read_spans(pid_t pid, std::vector<Span> &spans,
+			bool keep_lines = false);
+	bool read_stamp(pid_t pid, Stamp &stamp);
+	void clear_soft_dirty(pid_t pid);
+	bool read_pagemap(int fd, const Span &span,
+			  std::vector<unsigned long long> &entries);
+	bool read_kpage_info(const std::vector<unsigned long long> &pfns,
+			     std::vector<unsigned long long> &counts,
+			     std::vector<unsigned long long> &flags);
+	bool read_kpage_run(int fd,
+			    const std::vector<unsigned long long> &pfns,
+			    size_t from, size_t to,
+			    std::vector<unsigned long long> &out);
+
+	int _kpagecount_fd;
+	int _kpageflags_fd;
+
+	int _refresh_every;
+	bool _track_dirty;
+	/// Guards the members below
+	pthread_mutex_t _cache_lock;
+	std::map<pid_t, Cached> _cache;
+	unsigned long _vmas_read;
+	unsigned long _vmas_reused;
     };
 
 
@@ -162,20 +272,27 @@ namespace Exmap
 	static std::string _scale_name;
     };
 
-    /// Thin class to hold information about a single page
+    /// Thin class to hold information about a single page. It is
+    /// packed into one word: the resident and writable flags live in
+    /// the top two bits, the cookie (pfn or swap entry) in the rest.
+    /// The resident bit stays part of the cookie, so a pfn and a swap
+    /// entry with the same value are different pages.
     class Page
     {
     public:
+	/// An unmapped page
+	Page() : _bits(0) { }
 	Page(PageCookie cookie, bool resident, bool writable);
-	bool is_mapped() const;
-	bool is_resident() const;
-	bool is_writable() const;
-	PageCookie cookie() const;
+	inline bool is_mapped() const { return cookie() != 0; }
+	inline bool is_resident() const { return _bits & RESIDENT_BIT; }
+	inline bool is_writable() const { return _bits & WRITABLE_BIT; }
+	inline PageCookie cookie() const { return _bits & ~WRITABLE_BIT; }
 	void print(std::ostream &os) const;
     private:
-	PageCookie _cookie;
-	int _resident : 1;
-	int _writable : 1;
+	static const PageCookie RESIDENT_BIT =
+	    (PageCookie) 1 << (sizeof(PageCookie) * 8 - 1);
+	static const PageCookie WRITABLE_BIT = RESIDENT_BIT >> 1;
+	PageCookie _bits;
     };
     
 
@@ -191,8 +308,9 @@ namespace Exmap
 
 	PagePoolPtr &page_pool();
 	
-	/// Record that we own these pages
-	void add_pages(const std::list<Page> &pages);
+	/// Record that we own these pages, one per page of the vma. The
+	/// vector is swapped out (left empty).
+	void add_pages(std::vector<Page> &pages);
 
 	/// The vma start address
 	Elf::Address start();
@@ -234,6 +352,12 @@ namespace Exmap
 
 	int num_pages();
 
+	/// The page at index pgnum (which must be < num_pages())
+	inline const Page &page(unsigned int pgnum) const {
+	    pgnum -= _first_pgnum;
+	    return pgnum < _pages.size() ? _pages[pgnum] : UNMAPPED_PAGE;
+	}
+
 	/// Struct to hold page + overlap info
 	struct PartialPageInfo
 	{
@@ -248,7 +372,7 @@ namespace Exmap
 	/// (i.e. always page-size except at the start and end)
 	/// Does a lot of error checking, too.
 	bool get_pages_for_range(const RangePtr &mrange,
-				 std::list<PartialPageInfo> &info);
+				 std::vector<PartialPageInfo> &info);
 	
     private:
 	/// Get the pgnum (index into the page vector) of the given
@@ -258,8 +382,14 @@ namespace Exmap
 	RangePtr _range;
 	off_t _offset;
 	std::string _fname;
+	/// Only the pages from the first to the last mapped one are
+	/// kept, _pages[0] being page _first_pgnum of the vma. Sparse
+	/// reservations thus cost next to nothing.
 	std::vector<Page> _pages;
+	unsigned int _first_pgnum;
+	unsigned int _num_pages;
 	boost::weak_ptr<Vma> _selfptr;
+	static const Page UNMAPPED_PAGE;
     };
 
     /// A map represents a range of memory (mem_range) within a
@@ -283,6 +413,8 @@ namespace Exmap
 	RangePtr mem_range() const;
 	/// The 'ELF virtual memory' of the map (may be NULL)
 	RangePtr elf_range() const;
+	/// The vma the map lies in
+	VmaPtr vma() const;
 	/// Convert an elf-mem-range to a VMA memory range
 	RangePtr elf_to_mem_range(const RangePtr &elf_range);
 	/// Return the sizes for the whole Map VMA mem range
@@ -345,44 +477,91 @@ namespace Exmap
 	Elf::FilePtr _elf;
     };
 
-    /// Holds all the file objects, indexed by name
+    /// Holds all the file objects, indexed by name. Each file's ELF
+    /// info is loaded once, by whichever caller first asks for it.
     class FilePool
     {
     public:
+	FilePool();
+	~FilePool();
 	void clear();
 	FilePtr name_to_file(const std::string &name);
+	/// Safe to call from several threads at once (the other
+	/// methods aren't).
 	FilePtr get_or_make_file(const std::string &name);
 	std::list<FilePtr> files();
     private:
 	std::map<std::string, FilePtr> _files;
+	pthread_mutex_t _lock;
     };
     typedef boost::shared_ptr<FilePool> FilePoolPtr;
 
-    /// Hold information regarding each page in use
+    /// Hold information regarding each page in use. This is an open
+    /// addressing (linear probing) hash of page cookie to use count,
+    /// so it costs 16 bytes per distinct page and no allocations
+    /// beyond the occasional doubling.
     class PagePool
     {
     public:
+	PagePool();
 	/// Empty the pagepool
 	void clear();
 	/// Fetch the usage count of a page
-	inline int count(const Page &page) {
-	    return _counts[page.cookie()];
+	inline int count(const Page &page) const {
+	    PageCookie cookie = page.cookie();
+	    if (cookie == 0) {
+		return _unmapped_count;
+	    }
+	    const Slot &slot = _slots[find_slot(cookie)];
+	    return slot.cookie == cookie ? slot.count : 0;
 	};
 	/// Increase the count of a page (to 1 if the page is previously
 	/// unseen).
 	inline void inc_page_count(const Page &page) {
-	    _counts[page.cookie()] = _counts[page.cookie()]++;
-	};
-	/// Increase the count of a list of pages.
-	inline void inc_pages_count(const std::list<Page> &pages) {
-	    std::list<Page>::const_iterator it;
-	    for (it = pages.begin(); it != pages.end(); ++it) {
-		inc_page_count(*it);
+	    PageCookie cookie = page.cookie();
+	    if (cookie == 0) {
+		++_unmapped_count;
+		return;
+	    }
+	    Slot &slot = _slots[find_slot(cookie)];
+	    if (slot.cookie == 0) {
+		slot.cookie = cookie;
+		if (++_used * 2 > _slots.size()) {
+		    grow();
+		    ++_slots[find_slot(cookie)].count;
+		    return;
+		}
 	    }
+	    ++slot.count;
 	};
+	/// Increase the count of a vector of pages.
+	void inc_pages_count(const std::vector<Page> &pages);
+	/// Add all the counts from another pool into this one
+	void merge(const PagePool &other);
+	/// The number of distinct (mapped) pages seen
+	inline size_t num_pages() const { return _used; }
 
     private:
-	std::map<PageCookie, int> _counts;
+	struct Slot
+	{
+	    PageCookie cookie;	// 0 if the slot is empty
+	    int count;
+	};
+	/// The slot holding cookie, or the empty one where it would go
+	inline size_t find_slot(PageCookie cookie) const {
+	    size_t mask = _slots.size() - 1;
+	    // Fibonacci hashing: pfns are dense, spread them out
+	    size_t i = (cookie * 0x9e3779b97f4a7c15ULL) >> _shift;
+	    while (_slots[i].cookie != cookie && _slots[i].cookie != 0) {
+		i = (i + 1) & mask;
+	    }
+	    return i;
+	}
+	void grow();
+	std::vector<Slot> _slots;
+	int _shift;
+	size_t _used;
+	int _unmapped_count;
     };
 
     
@@ -393,6 +572,10 @@ namespace Exmap
 	Process(const PagePoolPtr &pp, pid_t pid);
 	/// Load the pid-specific information from the sysinfo
 	bool load(SysInfoPtr &sys_info);
+	/// As above, but count the pages into the given pool rather
+	/// than our page_pool() (which it is up to the caller to merge
+	/// them into). Lets several procs be loaded in parallel.
+	bool load(SysInfoPtr &sys_info, PagePool &counts);
 	/// True if the process has its own memory region (some kernel threads
 	/// have pids but no mem).
 	bool has_mm();
@@ -404,6 +587,8 @@ namespace Exmap
 	std::list<FilePtr> files();
 	/// List of all maps which refer to this process (over all files)
 	std::list<MapPtr> maps();
+	/// The process vmas, in address order
+	std::list<VmaPtr> vmas();
 	/// The sizes over all the process maps
 	SizesPtr sizes();
 	/// The sizes over all the maps associated with a given file
@@ -414,6 +599,11 @@ namespace Exmap
 	/// Process the vma info into a collection of maps. Also associates
 	/// the maps with the files and processes.
 	bool calculate_maps(FilePoolPtr &file_pool);
+	/// The first half of calculate_maps: work out the maps without
+	/// touching the files. May be run for several procs at once.
+	bool prepare_maps(FilePoolPtr &file_pool);
+	/// The second half: associate the prepared maps with the files.
+	void associate_maps();
 	/// Todo - private ctors and write a factory method which removes the
 	/// need for selfptr()
 	boost::shared_ptr<Process> selfptr();
@@ -429,9 +619,7 @@ namespace Exmap
     private:
 	void remove_vdso_if_nopages();
 	boost::weak_ptr<Process> _selfptr;
-	bool load_page_info(SysInfoPtr &sys_info);
-	bool find_vma_by_addr(Elf::Address start,
-			       VmaPtr &current_vma);
+	bool load_page_info(SysInfoPtr &sys_info, PagePool &counts);
 	std::list<MapPtr> restrict_maps_to_file(const FilePtr &file);
 	/// The ordered list of vmas read from /proc/xxx/maps.
 	std::list<VmaPtr> _vmas;
@@ -447,6 +635,9 @@ namespace Exmap
 	std::set<FilePtr> _files;
 
 	const PagePoolPtr &_page_pool;
+
+	/// Between prepare_maps and associate_maps
+	boost::shared_ptr<MapCalculator> _map_calc;
     };
 
     /// Hold info about one complete snapshot of process info
@@ -476,6 +667,10 @@ namespace Exmap
 	
 	/// Load the snapshot
 	bool load();
+
+	/// Number of threads to load with (default: one per online
+	/// cpu). Only used if the sysinfo is_thread_safe().
+	void set_num_threads(int num_threads);
     private:
 
 	// ----------------------------------------
@@ -503,6 +698,8 @@ namespace Exmap
 
 	/// Source of our information about processes
 	SysInfoPtr &_sys_info;
+
+	int _num_threads;
     };
     typedef boost::shared_ptr<Snapshot> SnapshotPtr;
 
@@ -515,8 +712,12 @@ namespace Exmap
 		    FilePoolPtr &file_pool,
 		    const ProcessPtr &proc);
 
-	    /// Do the calculation.
+	    /// Do the calculation. The files aren't changed, so
+	    /// calculators for different procs may run at once.
 	    bool calc_maps(std::list<MapPtr> &maps);
+
+	    /// Register the calculated maps and the proc with the files.
+	    void associate();
 	private:
 
 	    bool calc_maps_for_file(const std::string &fname);
@@ -537,6 +738,10 @@ namespace Exmap
 	    FilePoolPtr _file_pool;
 	    const ProcessPtr _proc;
 	    std::list<MapPtr> _maps;
+	    /// Every file the proc maps, and each map with its file,
+	    /// in the order found, for associate()
+	    std::list<FilePtr> _files;
+	    std::list<std::pair<FilePtr, MapPtr> > _file_maps;
     };
 
 };
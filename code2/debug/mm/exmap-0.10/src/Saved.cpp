@@ -0,0 +1,599 @@
+/*
+ * (c) John Berthels 2005 <jjberthels@gmail.com>. See COPYING for license.
+ */
+#include "Saved.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <vector>
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace Exmap;
+using namespace std;
+using namespace jutil;
+using Elf::Address;
+
+namespace Exmap
+{
+    enum Column {
+	COL_STR_OFFSETS = 0,	// uint64, num_strings + 1 of them
+	COL_STR_DATA,		// char, the nul-terminated strings
+	COL_PROC_PID,		// int32
+	COL_PROC_CMDLINE,	// uint32 string id
+	COL_PROC_FIRST_VMA,	// uint32
+	COL_PROC_NUM_VMAS,	// uint32
+	COL_PROC_SIZES,		// double, all procs' measure 0, then 1...
+	COL_FILE_NAME,		// uint32 string id
+	COL_FILE_SIZES,		// double, as for procs
+	COL_VMA_START,		// uint64
+	COL_VMA_END,		// uint64
+	COL_VMA_OFFSET,		// uint64
+	COL_VMA_FNAME,		// uint32 string id
+	COL_VMA_FIRST_RUN,	// uint32
+	COL_VMA_NUM_RUNS,	// uint32
+	COL_MAP_FILE,		// uint32
+	COL_MAP_VMA,		// uint32
+	COL_MAP_MEM_START,	// uint64
+	COL_MAP_MEM_END,	// uint64
+	COL_MAP_ELF_START,	// uint64, NO_ELF_START if none
+	COL_RUN_PGNUM,		// uint32
+	COL_RUN_LENGTH,		// uint32
+	COL_RUN_COOKIE,		// uint64, cookie of the first page
+	COL_RUN_WRITABLE,	// uint8
+	COL_COUNT_COOKIE,	// uint64, ascending
+	COL_COUNT,		// uint32
+	NUM_COLUMNS
+    };
+
+    struct SavedHeader
+    {
+	char magic[8];
+	uint32_t byte_order;
+	uint32_t version;
+	uint32_t page_size;
+	uint32_t num_sizes;
+	uint64_t num_strings;
+	uint64_t num_procs;
+	uint64_t num_files;
+	uint64_t num_vmas;
+	uint64_t num_maps;
+	uint64_t num_runs;
+	uint64_t num_counts;
+	struct
+	{
+	    uint64_t offset;
+	    uint64_t length;
+	} columns[NUM_COLUMNS];
+    };
+};
+
+static const char SAVED_MAGIC[8] = { 'E', 'X', 'M', 'S', 'N', 'A', 'P', 0 };
+static const uint32_t SAVED_BYTE_ORDER = 0x01020304;
+static const uint32_t SAVED_VERSION = 1;
+static const uint64_t NO_ELF_START = ~0ULL;
+static const int COOKIE_BITS = sizeof(PageCookie) * 8;
+
+/// Bytes each column should have, for the counts in the header
+static uint64_t column_length(const SavedHeader &h, int col)
+{
+    switch (col) {
+    case COL_STR_OFFSETS: return (h.num_strings + 1) * sizeof(uint64_t);
+    case COL_STR_DATA: return h.columns[col].length; // anything
+    case COL_PROC_PID:
+    case COL_PROC_CMDLINE:
+    case COL_PROC_FIRST_VMA:
+    case COL_PROC_NUM_VMAS: return h.num_procs * 4;
+    case COL_PROC_SIZES: return h.num_procs * h.num_sizes * sizeof(double);
+    case COL_FILE_NAME: return h.num_files * 4;
+    case COL_FILE_SIZES: return h.num_files * h.num_sizes * sizeof(double);
+    case COL_VMA_START:
+    case COL_VMA_END:
+    case COL_VMA_OFFSET: return h.num_vmas * 8;
+    case COL_VMA_FNAME:
+    case COL_VMA_FIRST_RUN:
+    case COL_VMA_NUM_RUNS: return h.num_vmas * 4;
+    case COL_MAP_FILE:
+    case COL_MAP_VMA: return h.num_maps * 4;
+    case COL_MAP_MEM_START:
+    case COL_MAP_MEM_END:
+    case COL_MAP_ELF_START: return h.num_maps * 8;
+    case COL_RUN_PGNUM:
+    case COL_RUN_LENGTH: return h.num_runs * 4;
+    case COL_RUN_COOKIE: return h.num_runs * 8;
+    case COL_RUN_WRITABLE: return h.num_runs;
+    case COL_COUNT_COOKIE: return h.num_counts * 8;
+    case COL_COUNT: return h.num_counts * 4;
+    }
+    return 0;
+}
+
+template <typename T> static void append(string &col, T v)
+{
+    col.append((const char *) &v, sizeof(v));
+}
+
+/// The id of s in the string table, adding it if need be
+static uint32_t intern(const string &s,
+		       map<string, uint32_t> &ids,
+		       vector<string> &strings)
+{
+    map<string, uint32_t>::iterator found = ids.find(s);
+    if (found != ids.end()) {
+	return found->second;
+    }
+    uint32_t id = strings.size();
+    ids[s] = id;
+    strings.push_back(s);
+    return id;
+}
+
+// ------------------------------------------------------------
+
+bool SavedSnapshot::save(const SnapshotPtr &snap, const string &fname)
+{
+    string cols[NUM_COLUMNS];
+    SavedHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SAVED_MAGIC, sizeof(h.magic));
+    h.byte_order = SAVED_BYTE_ORDER;
+    h.version = SAVED_VERSION;
+    h.page_size = Elf::page_size();
+    h.num_sizes = Sizes::NUM_SIZES;
+
+    map<string, uint32_t> string_ids;
+    vector<string> strings;
+    map<Vma *, uint32_t> vma_ids;
+    vector<PageCookie> cookies;
+
+    list<ProcessPtr> procs = snap->procs();
+    list<ProcessPtr>::iterator proc_it;
+    vector<SizesPtr> proc_sizes;
+    for (proc_it = procs.begin(); proc_it != procs.end(); ++proc_it) {
+	ProcessPtr &proc = *proc_it;
+	uint64_t first_vma = h.num_vmas;
+	append<int32_t>(cols[COL_PROC_PID], proc->pid());
+	append<uint32_t>(cols[COL_PROC_CMDLINE],
+			 intern(proc->cmdline(), string_ids, strings));
+	append<uint32_t>(cols[COL_PROC_FIRST_VMA], first_vma);
+	proc_sizes.push_back(proc->sizes());
+
+	list<VmaPtr> vmas = proc->vmas();
+	list<VmaPtr>::iterator vma_it;
+	for (vma_it = vmas.begin(); vma_it != vmas.end(); ++vma_it) {
+	    VmaPtr &vma = *vma_it;
+	    vma_ids[vma.get()] = h.num_vmas++;
+	    append<uint64_t>(cols[COL_VMA_START], vma->start());
+	    append<uint64_t>(cols[COL_VMA_END], vma->end());
+	    append<uint64_t>(cols[COL_VMA_OFFSET], vma->offset());
+	    append<uint32_t>(cols[COL_VMA_FNAME],
+			     intern(vma->fname(), string_ids, strings));
+	    append<uint32_t>(cols[COL_VMA_FIRST_RUN], h.num_runs);
+
+	    // Runs of mapped pages with consecutive cookies
+	    int num_pages = vma->num_pages();
+	    int pg = 0;
+	    uint32_t num_runs = 0;
+	    while (pg < num_pages) {
+		const Page &first = vma->page(pg);
+		if (!first.is_mapped()) {
+		    ++pg;
+		    continue;
+		}
+		int len = 1;
+		while (pg + len < num_pages) {
+		    const Page &next = vma->page(pg + len);
+		    if (next.cookie() != first.cookie() + len
+			|| next.is_writable() != first.is_writable()) {
+			break;
+		    }
+		    ++len;
+		}
+		append<uint32_t>(cols[COL_RUN_PGNUM], pg);
+		append<uint32_t>(cols[COL_RUN_LENGTH], len);
+		append<uint64_t>(cols[COL_RUN_COOKIE], first.cookie());
+		append<uint8_t>(cols[COL_RUN_WRITABLE], first.is_writable());
+		for (int i = 0; i < len; ++i) {
+		    cookies.push_back(first.cookie() + i);
+		}
+		++num_runs;
+		pg += len;
+	    }
+	    h.num_runs += num_runs;
+	    append<uint32_t>(cols[COL_VMA_NUM_RUNS], num_runs);
+	}
+	append<uint32_t>(cols[COL_PROC_NUM_VMAS], h.num_vmas - first_vma);
+	++h.num_procs;
+    }
+
+    list<FilePtr> files = snap->files();
+    list<FilePtr>::iterator file_it;
+    vector<SizesPtr> file_sizes;
+    for (file_it = files.begin(); file_it != files.end(); ++file_it) {
+	FilePtr &file = *file_it;
+	append<uint32_t>(cols[COL_FILE_NAME],
+			 intern(file->name(), string_ids, strings));
+	file_sizes.push_back(file->sizes());
+
+	list<MapPtr> maps = file->maps();
+	list<MapPtr>::iterator map_it;
+	for (map_it = maps.begin(); map_it != maps.end(); ++map_it) {
+	    MapPtr &fmap = *map_it;
+	    map<Vma *, uint32_t>::iterator vma_id;
+	    vma_id = vma_ids.find(fmap->vma().get());
+	    if (vma_id == vma_ids.end()) {
+		// e.g. a vdso removed after the maps were made
+		continue;
+	    }
+	    RangePtr elf_range = fmap->elf_range();
+	    append<uint32_t>(cols[COL_MAP_FILE], h.num_files);
+	    append<uint32_t>(cols[COL_MAP_VMA], vma_id->second);
+	    append<uint64_t>(cols[COL_MAP_MEM_START],
+			     fmap->mem_range()->start());
+	    append<uint64_t>(cols[COL_MAP_MEM_END], fmap->mem_range()->end());
+	    append<uint64_t>(cols[COL_MAP_ELF_START],
+			     elf_range ? elf_range->start() : NO_ELF_START);
+	    ++h.num_maps;
+	}
+	++h.num_files;
+    }
+
+    // Sizes are stored a measure at a time, so a query over one
+    // measure reads one contiguous array
+    for (int m = 0; m < Sizes::NUM_SIZES; ++m) {
+	for (size_t i = 0; i < proc_sizes.size(); ++i) {
+	    append<double>(cols[COL_PROC_SIZES], proc_sizes[i]->val(m));
+	}
+	for (size_t i = 0; i < file_sizes.size(); ++i) {
+	    append<double>(cols[COL_FILE_SIZES],
+			   file_sizes[i] ? file_sizes[i]->val(m) : 0.0);
+	}
+    }
+
+    sort(cookies.begin(), cookies.end());
+    size_t i = 0;
+    while (i < cookies.size()) {
+	size_t j = i + 1;
+	while (j < cookies.size() && cookies[j] == cookies[i]) {
+	    ++j;
+	}
+	append<uint64_t>(cols[COL_COUNT_COOKIE], cookies[i]);
+	append<uint32_t>(cols[COL_COUNT], j - i);
+	++h.num_counts;
+	i = j;
+    }
+    vector<PageCookie>().swap(cookies);
+
+    append<uint64_t>(cols[COL_STR_OFFSETS], 0);
+    for (i = 0; i < strings.size(); ++i) {
+	cols[COL_STR_DATA].append(strings[i].c_str(), strings[i].size() + 1);
+	append<uint64_t>(cols[COL_STR_OFFSETS], cols[COL_STR_DATA].size());
+    }
+    h.num_strings = strings.size();
+
+    // Lay the columns out after the header, 8-byte aligned
+    uint64_t offset = (sizeof(h) + 7) & ~7ULL;
+    for (int col = 0; col < NUM_COLUMNS; ++col) {
+	h.columns[col].offset = offset;
+	h.columns[col].length = cols[col].size();
+	offset = (offset + cols[col].size() + 7) & ~7ULL;
+    }
+
+    ofstream os(fname.c_str(), ios::out | ios::binary | ios::trunc);
+    if (!os.is_open()) {
+	warn << "SavedSnapshot::save - can't open " << fname << "\n";
+	return false;
+    }
+    const char pad[8] = { 0 };
+    os.write((const char *) &h, sizeof(h));
+    os.write(pad, h.columns[0].offset - sizeof(h));
+    for (int col = 0; col < NUM_COLUMNS; ++col) {
+	os.write(cols[col].data(), cols[col].size());
+	os.write(pad, (8 - cols[col].size() % 8) % 8);
+    }
+    os.close();
+    if (!os) {
+	warn << "SavedSnapshot::save - can't write " << fname << "\n";
+	return false;
+    }
+    return true;
+}
+
+// ------------------------------------------------------------
+
+SavedSnapshot::SavedSnapshot()
+    : _map(NULL), _map_len(0), _header(NULL)
+{ }
+
+SavedSnapshot::~SavedSnapshot()
+{
+    close();
+}
+
+void SavedSnapshot::close()
+{
+    if (_map != NULL) {
+	munmap(const_cast<char *>(_map), _map_len);
+    }
+    _map = NULL;
+    _map_len = 0;
+    _header = NULL;
+}
+
+bool SavedSnapshot::open(const string &fname)
+{
+    close();
+
+    int fd = ::open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+	warn << "SavedSnapshot::open - can't open " << fname << "\n";
+	return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(SavedHeader)) {
+	warn << "SavedSnapshot::open - too short: " << fname << "\n";
+	::close(fd);
+	return false;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+	warn << "SavedSnapshot::open - can't map " << fname << "\n";
+	return false;
+    }
+    _map = (const char *) p;
+    _map_len = st.st_size;
+    _header = (const SavedHeader *) _map;
+
+    if (!check()) {
+	warn << "SavedSnapshot::open - not a valid snapshot: " << fname << "\n";
+	close();
+	return false;
+    }
+    return true;
+}
+
+template <typename T> const T *SavedSnapshot::column(int col) const
+{
+    return (const T *) (_map + _header->columns[col].offset);
+}
+
+/// Check everything the accessors rely on, so they needn't
+bool SavedSnapshot::check()
+{
+    const SavedHeader &h = *_header;
+    if (memcmp(h.magic, SAVED_MAGIC, sizeof(h.magic)) != 0
+	|| h.byte_order != SAVED_BYTE_ORDER
+	|| h.version != SAVED_VERSION
+	|| h.num_sizes != Sizes::NUM_SIZES) {
+	return false;
+    }
+    // Keep the column length sums below from overflowing
+    const uint64_t limit = _map_len;
+    if (h.num_strings > limit || h.num_procs > limit || h.num_files > limit
+	|| h.num_vmas > limit || h.num_maps > limit || h.num_runs > limit
+	|| h.num_counts > limit) {
+	return false;
+    }
+    for (int col = 0; col < NUM_COLUMNS; ++col) {
+	uint64_t offset = h.columns[col].offset;
+	uint64_t length = h.columns[col].length;
+	if (offset % 8 != 0
+	    || offset > _map_len
+	    || length > _map_len - offset
+	    || length != column_length(h, col)) {
+	    return false;
+	}
+    }
+
+    size_t i;
+    const uint64_t *str_offsets = column<uint64_t>(COL_STR_OFFSETS);
+    const char *str_data = column<char>(COL_STR_DATA);
+    if (str_offsets[0] != 0
+	|| str_offsets[h.num_strings] != h.columns[COL_STR_DATA].length) {
+	return false;
+    }
+    for (i = 0; i < h.num_strings; ++i) {
+	if (str_offsets[i + 1] <= str_offsets[i]
+	    || str_data[str_offsets[i + 1] - 1] != '\0') {
+	    return false;
+	}
+    }
+
+    const uint32_t *cmdline = column<uint32_t>(COL_PROC_CMDLINE);
+    const uint32_t *first_vma = column<uint32_t>(COL_PROC_FIRST_VMA);
+    const uint32_t *num_vmas = column<uint32_t>(COL_PROC_NUM_VMAS);
+    for (i = 0; i < h.num_procs; ++i) {
+	if (cmdline[i] >= h.num_strings
+	    || first_vma[i] > h.num_vmas
+	    || num_vmas[i] > h.num_vmas - first_vma[i]) {
+	    return false;
+	}
+    }
+    const uint32_t *file_name = column<uint32_t>(COL_FILE_NAME);
+    for (i = 0; i < h.num_files; ++i) {
+	if (file_name[i] >= h.num_strings) {
+	    return false;
+	}
+    }
+    const uint32_t *vma_fname = column<uint32_t>(COL_VMA_FNAME);
+    const uint32_t *first_run = column<uint32_t>(COL_VMA_FIRST_RUN);
+    const uint32_t *num_runs = column<uint32_t>(COL_VMA_NUM_RUNS);
+    for (i = 0; i < h.num_vmas; ++i) {
+	if (vma_fname[i] >= h.num_strings
+	    || first_run[i] > h.num_runs
+	    || num_runs[i] > h.num_runs - first_run[i]) {
+	    return false;
+	}
+    }
+    const uint32_t *map_file = column<uint32_t>(COL_MAP_FILE);
+    const uint32_t *map_vma = column<uint32_t>(COL_MAP_VMA);
+    for (i = 0; i < h.num_maps; ++i) {
+	if (map_file[i] >= h.num_files || map_vma[i] >= h.num_vmas) {
+	    return false;
+	}
+    }
+    const uint64_t *count_cookie = column<uint64_t>(COL_COUNT_COOKIE);
+    for (i = 1; i < h.num_counts; ++i) {
+	if (count_cookie[i] <= count_cookie[i - 1]) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+const char *SavedSnapshot::string_at(uint32_t id) const
+{
+    return column<char>(COL_STR_DATA) + column<uint64_t>(COL_STR_OFFSETS)[id];
+}
+
+size_t SavedSnapshot::num_procs() const
+{
+    return _header->num_procs;
+}
+
+pid_t SavedSnapshot::proc_pid(size_t proc) const
+{
+    return column<int32_t>(COL_PROC_PID)[proc];
+}
+
+const char *SavedSnapshot::proc_cmdline(size_t proc) const
+{
+    return string_at(column<uint32_t>(COL_PROC_CMDLINE)[proc]);
+}
+
+double SavedSnapshot::proc_size(size_t proc, int measure) const
+{
+    return column<double>(COL_PROC_SIZES)[measure * _header->num_procs + proc];
+}
+
+size_t SavedSnapshot::proc_first_vma(size_t proc) const
+{
+    return column<uint32_t>(COL_PROC_FIRST_VMA)[proc];
+}
+
+size_t SavedSnapshot::proc_num_vmas(size_t proc) const
+{
+    return column<uint32_t>(COL_PROC_NUM_VMAS)[proc];
+}
+
+size_t SavedSnapshot::num_files() const
+{
+    return _header->num_files;
+}
+
+const char *SavedSnapshot::file_name(size_t file) const
+{
+    return string_at(column<uint32_t>(COL_FILE_NAME)[file]);
+}
+
+double SavedSnapshot::file_size(size_t file, int measure) const
+{
+    return column<double>(COL_FILE_SIZES)[measure * _header->num_files + file];
+}
+
+size_t SavedSnapshot::num_vmas() const
+{
+    return _header->num_vmas;
+}
+
+Address SavedSnapshot::vma_start(size_t vma) const
+{
+    return column<uint64_t>(COL_VMA_START)[vma];
+}
+
+Address SavedSnapshot::vma_end(size_t vma) const
+{
+    return column<uint64_t>(COL_VMA_END)[vma];
+}
+
+off_t SavedSnapshot::vma_offset(size_t vma) const
+{
+    return column<uint64_t>(COL_VMA_OFFSET)[vma];
+}
+
+const char *SavedSnapshot::vma_fname(size_t vma) const
+{
+    return string_at(column<uint32_t>(COL_VMA_FNAME)[vma]);
+}
+
+size_t SavedSnapshot::vma_first_run(size_t vma) const
+{
+    return column<uint32_t>(COL_VMA_FIRST_RUN)[vma];
+}
+
+size_t SavedSnapshot::vma_num_runs(size_t vma) const
+{
+    return column<uint32_t>(COL_VMA_NUM_RUNS)[vma];
+}
+
+size_t SavedSnapshot::num_maps() const
+{
+    return _header->num_maps;
+}
+
+size_t SavedSnapshot::map_file(size_t map) const
+{
+    return column<uint32_t>(COL_MAP_FILE)[map];
+}
+
+size_t SavedSnapshot::map_vma(size_t map) const
+{
+    return column<uint32_t>(COL_MAP_VMA)[map];
+}
+
+Address SavedSnapshot::map_mem_start(size_t map) const
+{
+    return column<uint64_t>(COL_MAP_MEM_START)[map];
+}
+
+Address SavedSnapshot::map_mem_end(size_t map) const
+{
+    return column<uint64_t>(COL_MAP_MEM_END)[map];
+}
+
+bool SavedSnapshot::map_elf_start(size_t map, Address &start) const
+{
+    uint64_t v = column<uint64_t>(COL_MAP_ELF_START)[map];
+    start = v;
+    return v != NO_ELF_START;
+}
+
+size_t SavedSnapshot::num_runs() const
+{
+    return _header->num_runs;
+}
+
+unsigned int SavedSnapshot::run_pgnum(size_t run) const
+{
+    return column<uint32_t>(COL_RUN_PGNUM)[run];
+}
+
+unsigned int SavedSnapshot::run_length(size_t run) const
+{
+    return column<uint32_t>(COL_RUN_LENGTH)[run];
+}
+
+Page SavedSnapshot::run_page(size_t run, unsigned int i) const
+{
+    PageCookie cookie = column<uint64_t>(COL_RUN_COOKIE)[run] + i;
+    bool resident = cookie >> (COOKIE_BITS - 1);
+    return Page(cookie, resident, column<uint8_t>(COL_RUN_WRITABLE)[run]);
+}
+
+int SavedSnapshot::page_count(const Page &page) const
+{
+    const uint64_t *begin = column<uint64_t>(COL_COUNT_COOKIE);
+    const uint64_t *end = begin + _header->num_counts;
+    const uint64_t *found = lower_bound(begin, end,
+					(uint64_t) page.cookie());
+    if (found == end || *found != page.cookie()) {
+	return 0;
+    }
+    return column<uint32_t>(COL_COUNT)[found - begin];
+}
@@ -0,0 +1,101 @@
+/*
+ * (c) John Berthels 2005 <jjberthels@gmail.com>. See COPYING for license.
+ */
+#ifndef _SAVED_H
+#define _SAVED_H
+
+#include <string>
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "Exmap.hpp"
+
+/// A Snapshot saved to disk, to be analysed later (and elsewhere).
+///
+/// The file is a header, a directory of columns and then the columns
+/// themselves, each an 8-byte aligned array of fixed-size values, so
+/// that it can be mmapped and used in place: opening costs a check of
+/// the indices, not a parse. All names (cmdlines, file names) are
+/// interned in one string table and referred to by index. The sizes
+/// of each process and file are saved ready calculated, so queries
+/// over them don't need the page info; the vmas, maps and page runs
+/// (with the use count of every page) are there for finer analysis.
+///
+/// Values are in the byte order of the saving machine, which is
+/// checked when opening.
+namespace Exmap
+{
+    class SavedSnapshot
+    {
+    public:
+	SavedSnapshot();
+	~SavedSnapshot();
+
+	/// Write a loaded snapshot to fname
+	static bool save(const SnapshotPtr &snap, const std::string &fname);
+
+	/// Map a saved snapshot. False if it can't be read or is
+	/// inconsistent.
+	bool open(const std::string &fname);
+	void close();
+
+	/// Processes, in pid order
+	size_t num_procs() const;
+	pid_t proc_pid(size_t proc) const;
+	const char *proc_cmdline(size_t proc) const;
+	/// One of the Sizes measures, in bytes
+	double proc_size(size_t proc, int measure) const;
+	/// The range of the proc's vmas (first, first + count)
+	size_t proc_first_vma(size_t proc) const;
+	size_t proc_num_vmas(size_t proc) const;
+
+	/// Files, in name order
+	size_t num_files() const;
+	const char *file_name(size_t file) const;
+	double file_size(size_t file, int measure) const;
+
+	size_t num_vmas() const;
+	Elf::Address vma_start(size_t vma) const;
+	Elf::Address vma_end(size_t vma) const;
+	off_t vma_offset(size_t vma) const;
+	const char *vma_fname(size_t vma) const;
+	/// The range of the vma's page runs
+	size_t vma_first_run(size_t vma) const;
+	size_t vma_num_runs(size_t vma) const;
+
+	/// Maps, grouped by file
+	size_t num_maps() const;
+	size_t map_file(size_t map) const;
+	size_t map_vma(size_t map) const;
+	Elf::Address map_mem_start(size_t map) const;
+	Elf::Address map_mem_end(size_t map) const;
+	/// False for maps with no ELF range (holes, non-ELF files)
+	bool map_elf_start(size_t map, Elf::Address &start) const;
+
+	/// A run of mapped pages in a vma, with consecutive cookies
+	/// and the same flags
+	size_t num_runs() const;
+	/// Index of the first page of the run within its vma
+	unsigned int run_pgnum(size_t run) const;
+	unsigned int run_length(size_t run) const;
+	/// The i'th page of the run
+	Page run_page(size_t run, unsigned int i) const;
+
+	/// How many times the page is mapped over all the procs
+	int page_count(const Page &page) const;
+
+    private:
+	SavedSnapshot(const SavedSnapshot &);
+	SavedSnapshot &operator=(const SavedSnapshot &);
+
+	template <typename T> const T *column(int col) const;
+	bool check();
+	const char *string_at(uint32_t id) const;
+
+	const char *_map;
+	size_t _map_len;
+	const struct SavedHeader *_header;
+    };
+};
+
+#endif
@@ -0,0 +1,315 @@
+/*
+ * (c) John Berthels 2005 <jjberthels@gmail.com>. See COPYING for license.
+ */
+#include "Series.hpp"
+
+#include <math.h>
+
+using namespace Exmap;
+using namespace std;
+using namespace jutil;
+
+static const char SERIES_MAGIC[] = "EXMS";
+static const char SERIES_VERSION = 1;
+
+static void put(string &out, unsigned long long v)
+{
+    while (v >= 0x80) {
+	out += (char) ((v & 0x7f) | 0x80);
+	v >>= 7;
+    }
+    out += (char) v;
+}
+
+static void put_signed(string &out, long long v)
+{
+    put(out, ((unsigned long long) v << 1) ^ (unsigned long long) (v >> 63));
+}
+
+// ------------------------------------------------------------
+
+SeriesEntry::SeriesEntry()
+    : kind(PROC), pid(0), pss(0), uss(0),
+      pss_delta(0), uss_delta(0), dirty(0), gone(false)
+{ }
+
+// ------------------------------------------------------------
+
+bool SeriesWriter::Key::operator<(const Key &other) const
+{
+    if (kind != other.kind) { return kind < other.kind; }
+    if (pid != other.pid) { return pid < other.pid; }
+    return name < other.name;
+}
+
+SeriesWriter::SeriesWriter()
+    : _last_time(0)
+{ }
+
+bool SeriesWriter::open(const string &fname)
+{
+    _os.open(fname.c_str(), ios::out | ios::binary | ios::trunc);
+    if (!_os.is_open()) {
+	warn << "SeriesWriter::open - can't open " << fname << "\n";
+	return false;
+    }
+    _last_time = 0;
+    _ids.clear();
+    _last.clear();
+    _os.write(SERIES_MAGIC, 4);
+    _os.put(SERIES_VERSION);
+    _os.flush();
+    return _os.good();
+}
+
+unsigned long SeriesWriter::intern(const string &name,
+				   string &new_names,
+				   unsigned long &num_new)
+{
+    map<string, unsigned long>::iterator it = _ids.find(name);
+    if (it != _ids.end()) {
+	return it->second;
+    }
+    unsigned long id = _ids.size();
+    _ids[name] = id;
+    put(new_names, name.size());
+    new_names += name;
+    ++num_new;
+    return id;
+}
+
+bool SeriesWriter::write(unsigned long long time_ms,
+			 const list<SeriesEntry> &entries)
+{
+    string names, body;
+    unsigned long num_names = 0, num_entries = 0;
+    map<Key, Last> seen;
+
+    list<SeriesEntry>::const_iterator it;
+    for (it = entries.begin(); it != entries.end(); ++it) {
+	Key key;
+	key.kind = it->kind;
+	key.pid = it->kind == SeriesEntry::PROC ? it->pid : 0;
+	key.name = it->name;
+
+	Last now;
+	now.pss = it->pss;
+	now.uss = it->uss;
+	map<Key, Last>::iterator last = _last.find(key);
+	if (last == _last.end()) {
+	    now.id = intern(it->name, names, num_names);
+	}
+	else {
+	    now.id = last->second.id;
+	}
+	long long dpss = now.pss - (last == _last.end() ? 0 : last->second.pss);
+	long long duss = now.uss - (last == _last.end() ? 0 : last->second.uss);
+	seen[key] = now;
+
+	if (last != _last.end() && dpss == 0 && duss == 0 && it->dirty == 0) {
+	    continue;
+	}
+	put(body, (now.id << 2) | key.kind);
+	if (key.kind == SeriesEntry::PROC) {
+	    put(body, key.pid);
+	}
+	put_signed(body, dpss);
+	put_signed(body, duss);
+	if (key.kind == SeriesEntry::PROC) {
+	    put(body, it->dirty);
+	}
+	++num_entries;
+    }
+
+    map<Key, Last>::iterator last;
+    for (last = _last.begin(); last != _last.end(); ++last) {
+	if (seen.find(last->first) != seen.end()) {
+	    continue;
+	}
+	put(body, (last->second.id << 2) | 2 | last->first.kind);
+	if (last->first.kind == SeriesEntry::PROC) {
+	    put(body, last->first.pid);
+	}
+	++num_entries;
+    }
+    _last.swap(seen);
+
+    string record;
+    put(record, time_ms - _last_time);
+    _last_time = time_ms;
+    put(record, num_names);
+    record += names;
+    put(record, num_entries);
+    record += body;
+
+    // One write per interval, so a reader never sees half a record
+    // (unless we die mid-write)
+    _os.write(record.data(), record.size());
+    _os.flush();
+    return _os.good();
+}
+
+void SeriesWriter::collect(const SnapshotPtr &snap,
+			   list<SeriesEntry> &entries)
+{
+    entries.clear();
+
+    list<ProcessPtr> procs = snap->procs();
+    list<ProcessPtr>::iterator proc_it;
+    for (proc_it = procs.begin(); proc_it != procs.end(); ++proc_it) {
+	SizesPtr sizes = (*proc_it)->sizes();
+	SeriesEntry entry;
+	entry.kind = SeriesEntry::PROC;
+	entry.pid = (*proc_it)->pid();
+	entry.name = (*proc_it)->cmdline();
+	entry.pss = llrint(sizes->val(Sizes::EFFECTIVE_RESIDENT));
+	entry.uss = llrint(sizes->val(Sizes::SOLE_MAPPED));
+	entries.push_back(entry);
+    }
+
+    list<FilePtr> files = snap->files();
+    list<FilePtr>::iterator file_it;
+    for (file_it = files.begin(); file_it != files.end(); ++file_it) {
+	SizesPtr sizes = (*file_it)->sizes();
+	if (!sizes) {
+	    continue;
+	}
+	SeriesEntry entry;
+	entry.kind = SeriesEntry::FILE;
+	entry.name = (*file_it)->name();
+	entry.pss = llrint(sizes->val(Sizes::EFFECTIVE_RESIDENT));
+	entry.uss = llrint(sizes->val(Sizes::SOLE_MAPPED));
+	entries.push_back(entry);
+    }
+}
+
+// ------------------------------------------------------------
+
+SeriesReader::SeriesReader()
+    : _pos(0), _error(false), _time(0)
+{ }
+
+bool SeriesReader::open(const string &fname)
+{
+    ifstream is(fname.c_str(), ios::in | ios::binary);
+    if (!is.is_open()) {
+	warn << "SeriesReader::open - can't open " << fname << "\n";
+	return false;
+    }
+    _data.assign(istreambuf_iterator<char>(is), istreambuf_iterator<char>());
+    _names.clear();
+    _totals.clear();
+    _time = 0;
+    _error = false;
+
+    if (_data.size() < 5
+	|| _data.compare(0, 4, SERIES_MAGIC) != 0
+	|| _data[4] != SERIES_VERSION) {
+	warn << "SeriesReader::open - not a series file: " << fname << "\n";
+	_error = true;
+	return false;
+    }
+    _pos = 5;
+    return true;
+}
+
+bool SeriesReader::error()
+{
+    return _error;
+}
+
+bool SeriesReader::get(unsigned long long &v)
+{
+    v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+	if (_pos >= _data.size()) {
+	    _error = true;
+	    return false;
+	}
+	unsigned char c = _data[_pos++];
+	v |= (unsigned long long) (c & 0x7f) << shift;
+	if (!(c & 0x80)) {
+	    return true;
+	}
+    }
+    _error = true;
+    return false;
+}
+
+bool SeriesReader::get_signed(long long &v)
+{
+    unsigned long long u;
+    if (!get(u)) {
+	return false;
+    }
+    v = (long long) (u >> 1) ^ -(long long) (u & 1);
+    return true;
+}
+
+bool SeriesReader::next(unsigned long long &time_ms,
+			list<SeriesEntry> &changed)
+{
+    changed.clear();
+    if (_error || _pos >= _data.size()) {
+	return false;
+    }
+
+    unsigned long long v, count;
+    if (!get(v)) { return false; }
+    _time += v;
+    time_ms = _time;
+
+    if (!get(count)) { return false; }
+    for (unsigned long long i = 0; i < count; ++i) {
+	if (!get(v) || v > _data.size() - _pos) {
+	    _error = true;
+	    return false;
+	}
+	_names.push_back(_data.substr(_pos, v));
+	_pos += v;
+    }
+
+    if (!get(count)) { return false; }
+    for (unsigned long long i = 0; i < count; ++i) {
+	SeriesEntry entry;
+	if (!get(v)) { return false; }
+	unsigned long id = v >> 2;
+	entry.gone = v & 2;
+	entry.kind = (v & 1) ? SeriesEntry::FILE : SeriesEntry::PROC;
+	if (id >= _names.size()) {
+	    _error = true;
+	    return false;
+	}
+	entry.name = _names[id];
+	if (entry.kind == SeriesEntry::PROC) {
+	    if (!get(v)) { return false; }
+	    entry.pid = v;
+	}
+
+	pair<pair<int, pid_t>, unsigned long> key;
+	key.first = make_pair((int) entry.kind, entry.pid);
+	key.second = id;
+	pair<long long, long long> &total = _totals[key];
+	if (entry.gone) {
+	    entry.pss_delta = -total.first;
+	    entry.uss_delta = -total.second;
+	    _totals.erase(key);
+	}
+	else {
+	    if (!get_signed(entry.pss_delta)
+		|| !get_signed(entry.uss_delta)) {
+		return false;
+	    }
+	    total.first += entry.pss_delta;
+	    total.second += entry.uss_delta;
+	    entry.pss = total.first;
+	    entry.uss = total.second;
+	    if (entry.kind == SeriesEntry::PROC) {
+		if (!get(v)) { return false; }
+		entry.dirty = v;
+	    }
+	}
+	changed.push_back(entry);
+    }
+    return true;
+}
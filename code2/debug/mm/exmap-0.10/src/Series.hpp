@@ -0,0 +1,126 @@
+/*
+ * (c) John Berthels 2005 <jjberthels@gmail.com>. See COPYING for license.
+ */
+#ifndef _SERIES_H
+#define _SERIES_H
+
+#include <fstream>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+#include "Exmap.hpp"
+
+/// A time series of per-process and per-file memory use, written one
+/// snapshot at a time and kept small enough to leave running on a
+/// whole fleet.
+///
+/// The file is a header ("EXMS" and a version byte) followed by one
+/// record per interval. All numbers are LEB128 varints (zigzagged if
+/// signed). A record is:
+///
+///   ms since the previous record (since the epoch for the first)
+///   count, then that many new names (length, bytes), which get the
+///     next free ids in order
+///   count, then that many entries:
+///     (name id << 2) | (gone << 1) | kind
+///     pid (procs only)
+///     if not gone: PSS delta, USS delta (bytes)
+///     dirty pages (procs only, if not gone)
+///
+/// Only the procs and files whose sizes changed (or which have a
+/// dirty page count) get an entry, so a quiet system costs a few
+/// bytes per interval. An entry marked gone has left the snapshot.
+namespace Exmap
+{
+    struct SeriesEntry
+    {
+	enum Kind { PROC = 0, FILE = 1 };
+	SeriesEntry();
+	Kind kind;
+	/// Zero for files
+	pid_t pid;
+	/// The cmdline of a process, or the file name
+	std::string name;
+	/// Effective resident and sole mapped sizes, in bytes
+	long long pss;
+	long long uss;
+	/// Change since the previous interval (from SeriesReader only)
+	long long pss_delta;
+	long long uss_delta;
+	/// Pages written during the interval, if known
+	unsigned long dirty;
+	/// Gone since the previous interval (from SeriesReader only)
+	bool gone;
+    };
+
+    /// Appends intervals to a series file
+    class SeriesWriter
+    {
+    public:
+	SeriesWriter();
+	/// Create (truncating) the file and write the header
+	bool open(const std::string &fname);
+	/// Write the interval ending at time_ms, given the sizes of
+	/// everything in it. Entries missing since last time are
+	/// recorded as gone.
+	bool write(unsigned long long time_ms,
+		   const std::list<SeriesEntry> &entries);
+	/// Fill in the entries (without dirty counts) for a snapshot
+	static void collect(const SnapshotPtr &snap,
+			    std::list<SeriesEntry> &entries);
+    private:
+	struct Key
+	{
+	    int kind;
+	    pid_t pid;
+	    std::string name;
+	    bool operator<(const Key &other) const;
+	};
+	struct Last
+	{
+	    unsigned long id;
+	    long long pss;
+	    long long uss;
+	};
+	unsigned long intern(const std::string &name,
+			     std::string &new_names,
+			     unsigned long &num_new);
+
+	std::ofstream _os;
+	unsigned long long _last_time;
+	std::map<std::string, unsigned long> _ids;
+	std::map<Key, Last> _last;
+    };
+
+    /// Reads a series file back, one interval at a time
+    class SeriesReader
+    {
+    public:
+	SeriesReader();
+	bool open(const std::string &fname);
+	/// Read the next interval: its time and the entries which
+	/// changed in it, with both their deltas and (running) totals.
+	/// False at the end of the file, or if it is corrupt (see
+	/// error()).
+	bool next(unsigned long long &time_ms,
+		  std::list<SeriesEntry> &changed);
+	bool error();
+    private:
+	bool get(unsigned long long &v);
+	bool get_signed(long long &v);
+
+	std::string _data;
+	size_t _pos;
+	bool _error;
+	unsigned long long _time;
+	std::vector<std::string> _names;
+	/// Running totals, by (kind, pid, name id)
+	std::map<std::pair<std::pair<int, pid_t>, unsigned long>,
+		 std::pair<long long, long long> > _totals;
+    };
+};
+
+#endif
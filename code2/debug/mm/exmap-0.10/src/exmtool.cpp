@@ -2,11 +2,18 @@
  * (c) John Berthels 2005 <jjberthels@gmail.com>. See COPYING for license.
  */
 #include "Exmap.hpp"
+#include "Saved.hpp"
+#include "Series.hpp"
 
 #include <sstream>
 #include <iostream>
+#include <iomanip>
 #include <vector>
+#include <algorithm>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
 
 using namespace std;
 using namespace Exmap;
@@ -15,6 +22,10 @@ static int usage();
 static int do_showmaps(SnapshotPtr &snap, char *args[]);
 static int do_procs(SnapshotPtr &snap, char *args[]);
 static int do_files(SnapshotPtr &snap, char *args[]);
+static int do_watch(SnapshotPtr &snap, char *args[]);
+static int do_series(SnapshotPtr &snap, char *args[]);
+static int do_save(SnapshotPtr &snap, char *args[]);
+static int do_top(SnapshotPtr &snap, char *args[]);
 typedef int (*Handler)(SnapshotPtr &snap, char *args[]);
 
 struct command
@@ -22,19 +33,50 @@ struct command
     char *command;
     Handler handler;
     char *usage;
+    bool live;	// needs a snapshot of the running system
 } cmd_handles[] = {
     { "procs",
       do_procs,
-    "list the known processes"},
+    "list the known processes", true},
     { "files",
       do_files,
-    "list the known files"},
+    "list the known files", true},
     { "showmaps",
       do_showmaps,
-    "list the maps of a particular process"},
-    { NULL, NULL, NULL },
+    "list the maps of a particular process", true},
+    { "watch",
+      do_watch,
+    "[-d] file [secs [count]]: write PSS/USS changes every secs seconds\n"
+    "\tto a series file (-d: also count pages written, via soft-dirty)",
+    false},
+    { "series",
+      do_series,
+    "file: print the changes recorded in a series file", false},
+    { "save",
+      do_save,
+    "file: save the snapshot for later analysis", true},
+    { "top",
+      do_top,
+    "file [files|procs [measure [n]]]: the n (default 10) biggest files\n"
+    "\tor procs in a saved snapshot by measure (default shared, i.e.\n"
+    "\tmapped but not sole mapped). Measures: eres emap writable vm\n"
+    "\tsole mapped resident shared", false},
+    { NULL, NULL, NULL, false },
 };
 
+static SnapshotPtr load_snapshot(SysInfoPtr &sysinfo)
+{
+    SnapshotPtr snapshot(new Snapshot(sysinfo));
+    const char *threads = getenv("EXMAP_THREADS");
+    if (threads != NULL) {
+	snapshot->set_num_threads(atoi(threads));
+    }
+    if (!snapshot->load()) {
+	snapshot.reset();
+    }
+    return snapshot;
+}
+
 int main(int argc, char *argv[])
 {
     if (argc < 2) {
@@ -56,11 +98,15 @@ int main(int argc, char *argv[])
 	return usage();
     }
 
-    SysInfoPtr sysinfo(new LinuxSysInfo);
-    SnapshotPtr snapshot(new Snapshot(sysinfo));
-    if (!snapshot->load()) {
-	cerr << "Failed to load snapshot - aborting" << endl;
-	return -1;
+    SysInfoPtr sysinfo;
+    SnapshotPtr snapshot;
+    if (chandler->live) {
+	sysinfo = LinuxSysInfo::best_available();
+	snapshot = load_snapshot(sysinfo);
+	if (!snapshot) {
+	    cerr << "Failed to load snapshot - aborting" << endl;
+	    return -1;
+	}
     }
 
     return chandler->handler(snapshot, argv + 2);
@@ -152,3 +198,228 @@ static int do_showmaps(SnapshotPtr &snap, char *args[])
     
     return 0;
 }
+
+static unsigned long long now_ms()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000ULL + tv.tv_usec / 1000;
+}
+
+static int do_watch(SnapshotPtr &snap, char *args[])
+{
+    bool track_dirty = false;
+    if (args[0] != NULL && strcmp(args[0], "-d") == 0) {
+	track_dirty = true;
+	++args;
+    }
+    if (args[0] == NULL) {
+	cerr << "no series file specified\n";
+	return usage();
+    }
+    string fname = args[0];
+    int secs = args[1] != NULL ? atoi(args[1]) : 10;
+    int count = args[1] != NULL && args[2] != NULL ? atoi(args[2]) : 0;
+    if (secs <= 0) {
+	cerr << "invalid interval: " << args[1] << "\n";
+	return usage();
+    }
+
+    // Keep one sysinfo for the whole run, so that the pagemap one
+    // can skip the processes (and vmas) which haven't changed
+    SysInfoPtr sysinfo = LinuxSysInfo::best_available();
+    boost::shared_ptr<PagemapSysInfo> pagemap
+	= boost::dynamic_pointer_cast<PagemapSysInfo>(sysinfo);
+    if (pagemap) {
+	pagemap->set_incremental(10);
+	pagemap->set_track_dirty(track_dirty);
+    }
+    else if (track_dirty) {
+	cerr << "-d needs the pagemap interface (unload the exmap module)\n";
+	return -1;
+    }
+
+    SeriesWriter writer;
+    if (!writer.open(fname)) {
+	return -1;
+    }
+
+    for (int i = 0; count == 0 || i < count; ++i) {
+	if (i > 0) {
+	    sleep(secs);
+	}
+	unsigned long long started = now_ms();
+	SnapshotPtr snapshot = load_snapshot(sysinfo);
+	if (!snapshot) {
+	    cerr << "Failed to load snapshot - aborting" << endl;
+	    return -1;
+	}
+
+	list<SeriesEntry> entries;
+	SeriesWriter::collect(snapshot, entries);
+	if (pagemap && track_dirty) {
+	    list<SeriesEntry>::iterator it;
+	    for (it = entries.begin(); it != entries.end(); ++it) {
+		if (it->kind == SeriesEntry::PROC) {
+		    it->dirty = pagemap->dirty_pages(it->pid);
+		}
+	    }
+	}
+	if (!writer.write(started, entries)) {
+	    cerr << "Can't write to " << fname << endl;
+	    return -1;
+	}
+
+	cerr << "interval " << i << ": " << snapshot->num_procs()
+	     << " procs in " << now_ms() - started << "ms";
+	if (pagemap) {
+	    unsigned long read, reused;
+	    pagemap->counts(read, reused);
+	    pagemap->reset_counts();
+	    cerr << ", " << reused << "/" << read + reused << " vmas reused";
+	}
+	cerr << "\n";
+    }
+    return 0;
+}
+
+static int do_series(SnapshotPtr &snap, char *args[])
+{
+    if (args[0] == NULL) {
+	cerr << "no series file specified\n";
+	return usage();
+    }
+
+    SeriesReader reader;
+    if (!reader.open(args[0])) {
+	return -1;
+    }
+
+    unsigned long long time_ms;
+    list<SeriesEntry> changed;
+    cout << "TIME\tKIND\tPID\tPSS\tUSS\tPSS+\tUSS+\tDIRTY\tNAME\n";
+    while (reader.next(time_ms, changed)) {
+	list<SeriesEntry>::iterator it;
+	for (it = changed.begin(); it != changed.end(); ++it) {
+	    cout << time_ms / 1000 << "."
+		 << setw(3) << setfill('0') << time_ms % 1000 << setfill(' ')
+		 << "\t" << (it->kind == SeriesEntry::PROC ? "proc" : "file")
+		 << "\t" << it->pid;
+	    if (it->gone) {
+		cout << "\t-\t-";
+	    }
+	    else {
+		cout << "\t" << it->pss / 1024 << "\t" << it->uss / 1024;
+	    }
+	    cout << "\t" << it->pss_delta / 1024
+		 << "\t" << it->uss_delta / 1024
+		 << "\t" << it->dirty
+		 << "\t" << it->name << "\n";
+	}
+    }
+    if (reader.error()) {
+	cerr << "Corrupt series file: " << args[0] << "\n";
+	return -1;
+    }
+    return 0;
+}
+
+static int do_save(SnapshotPtr &snap, char *args[])
+{
+    if (args[0] == NULL) {
+	cerr << "no file specified\n";
+	return usage();
+    }
+    if (!SavedSnapshot::save(snap, args[0])) {
+	cerr << "Failed to save snapshot to " << args[0] << "\n";
+	return -1;
+    }
+    return 0;
+}
+
+/// Short names for the Sizes measures, in order, then the extras
+static const char *measure_keys[] = {
+    "eres", "emap", "writable", "vm", "sole", "mapped", "resident",
+    "shared", NULL
+};
+static const int SHARED_MEASURE = Sizes::NUM_SIZES;
+
+/// Orders indices by a value, biggest first
+struct ByValue
+{
+    ByValue(const vector<double> &values) : _values(values) { }
+    bool operator()(size_t a, size_t b) const {
+	return _values[a] > _values[b];
+    }
+    const vector<double> &_values;
+};
+
+static int do_top(SnapshotPtr &snap, char *args[])
+{
+    if (args[0] == NULL) {
+	cerr << "no file specified\n";
+	return usage();
+    }
+    bool files = true;
+    int measure = SHARED_MEASURE;
+    size_t n = 10;
+    if (args[1] != NULL) {
+	if (strcmp(args[1], "procs") == 0) {
+	    files = false;
+	}
+	else if (strcmp(args[1], "files") != 0) {
+	    cerr << "expected files or procs: " << args[1] << "\n";
+	    return usage();
+	}
+	if (args[2] != NULL) {
+	    for (measure = 0; measure_keys[measure] != NULL; ++measure) {
+		if (strcmp(measure_keys[measure], args[2]) == 0) {
+		    break;
+		}
+	    }
+	    if (measure_keys[measure] == NULL) {
+		cerr << "unknown measure: " << args[2] << "\n";
+		return usage();
+	    }
+	    if (args[3] != NULL) {
+		n = atoi(args[3]);
+	    }
+	}
+    }
+
+    SavedSnapshot saved;
+    if (!saved.open(args[0])) {
+	return -1;
+    }
+
+    size_t count = files ? saved.num_files() : saved.num_procs();
+    vector<double> values(count);
+    vector<size_t> order(count);
+    for (size_t i = 0; i < count; ++i) {
+	int m = measure == SHARED_MEASURE ? (int) Sizes::MAPPED : measure;
+	values[i] = files ? saved.file_size(i, m) : saved.proc_size(i, m);
+	if (measure == SHARED_MEASURE) {
+	    values[i] -= files ? saved.file_size(i, Sizes::SOLE_MAPPED)
+		: saved.proc_size(i, Sizes::SOLE_MAPPED);
+	}
+	order[i] = i;
+    }
+    n = min(n, count);
+    partial_sort(order.begin(), order.begin() + n, order.end(),
+		 ByValue(values));
+
+    cout << measure_keys[measure] << " (K)\t"
+	 << (files ? "NAME" : "PID\tCMD") << "\n";
+    for (size_t i = 0; i < n; ++i) {
+	size_t idx = order[i];
+	cout << values[idx] / 1024 << "\t";
+	if (files) {
+	    cout << saved.file_name(idx);
+	}
+	else {
+	    cout << saved.proc_pid(idx) << "\t" << saved.proc_cmdline(idx);
+	}
+	cout << "\n";
+    }
+    return 0;
+}
@@ -1051,7 +1051,7 @@ int main(int argc, char *argv[])
 
     // If you change the scale you may want to change SIZES_PRINTF_FORMAT
     Sizes::scale_kbytes();
-    SysInfoPtr sysinfo(new LinuxSysInfo);
+    SysInfoPtr sysinfo = LinuxSysInfo::best_available();
     SnapshotPtr snapshot(new Snapshot(sysinfo));
     TopWin topwin(snapshot);
 
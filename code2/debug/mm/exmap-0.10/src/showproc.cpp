@@ -14,7 +14,7 @@ int main(int argc, char **argv)
 
     pid_t pid = atoi(argv[1]);
 
-    SysInfoPtr sysinfo(new LinuxSysInfo);
+    SysInfoPtr sysinfo = LinuxSysInfo::best_available();
     SnapshotPtr snapshot(new Snapshot(sysinfo));
     if(!snapshot->load()) {
 	cerr << "Failed to load snapshot\n";
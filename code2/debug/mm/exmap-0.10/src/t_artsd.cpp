@@ -18,7 +18,7 @@ public:
     std::list<pid_t> accessible_pids();
     bool sanity_check();
     bool read_page_info(pid_t pid,
-			    std::map<Elf::Address, std::list<Exmap::Page> >&pi);
+			    std::map<Elf::Address, std::vector<Exmap::Page> >&pi);
     std::string read_cmdline(pid_t pid);
     bool read_vmas(const Exmap::PagePoolPtr &pp,
 		       pid_t pid,
@@ -84,7 +84,7 @@ bool TestSysInfo::sanity_check()
 
 // Make up some random page data
 bool TestSysInfo::read_page_info(pid_t pid,
-				 map<Elf::Address, list<Page> > &pi)
+				 map<Elf::Address, vector<Page> > &pi)
 {
     list<VmaPtr>::iterator vma_it;
     stringstream sstr;
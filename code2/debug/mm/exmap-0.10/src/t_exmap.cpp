@@ -81,7 +81,7 @@ int ExmapTest::num_initialised_arrays()
 
 bool ExmapTest::run()
 {
-    SysInfoPtr sysinfo(new LinuxSysInfo);
+    SysInfoPtr sysinfo = LinuxSysInfo::best_available();
     Snapshot snap(sysinfo);
 
     is(snap.num_procs(), 0, "zero procs before load");
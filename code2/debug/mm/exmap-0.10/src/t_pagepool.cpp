@@ -0,0 +1,99 @@
+/*
+ * (c) John Berthels 2005 <jjberthels@gmail.com>. See COPYING for license.
+ */
+#include <Trun.hpp>
+#include "Exmap.hpp"
+
+#include <vector>
+
+class PagePoolTest : public Test
+{
+public:
+    bool run();
+};
+
+using namespace std;
+using namespace Exmap;
+
+RUN_TEST_CLASS(PagePoolTest);
+
+bool PagePoolTest::run()
+{
+    plan(27);
+
+    // Page packing
+    Page unmapped;
+    notok(unmapped.is_mapped(), "default page is unmapped");
+    notok(unmapped.is_resident(), "default page isn't resident");
+    is(unmapped.cookie(), 0UL, "default page has zero cookie");
+
+    Page resident(0x1234, true, true);
+    ok(resident.is_mapped(), "resident page is mapped");
+    ok(resident.is_resident(), "resident page is resident");
+    ok(resident.is_writable(), "writable flag kept");
+    Page ro(0x1234, true, false);
+    notok(ro.is_writable(), "readonly flag kept");
+    is(ro.cookie(), resident.cookie(), "writable doesn't change cookie");
+    Page swapped(0x1234, false, false);
+    ok(swapped.is_mapped(), "swapped page is mapped");
+    notok(swapped.is_resident(), "swapped page isn't resident");
+    isnt(swapped.cookie(), resident.cookie(),
+	 "swap entry and pfn with the same value differ");
+    is((int) sizeof(Page), (int) sizeof(PageCookie), "page is one word");
+
+    // Counting
+    PagePool pp;
+    is(pp.count(resident), 0, "unseen page has zero count");
+    pp.inc_page_count(resident);
+    pp.inc_page_count(ro);
+    is(pp.count(resident), 2, "counted twice, whatever the writable bit");
+    is(pp.count(swapped), 0, "swap entry counted separately");
+    pp.inc_page_count(unmapped);
+    is(pp.count(unmapped), 1, "unmapped pages are counted");
+    is((int) pp.num_pages(), 1, "one distinct mapped page");
+
+    // Enough dense pfns to force a few grow()s, each one mapped
+    // twice, every tenth three times
+    const int NUM = 100000;
+    vector<Page> pages;
+    for (int i = 1; i <= NUM; ++i) {
+	pages.push_back(Page(i, true, false));
+	pages.push_back(Page(i, true, true));
+	if (i % 10 == 0) {
+	    pages.push_back(Page(i, true, false));
+	}
+    }
+    pp.clear();
+    pp.inc_pages_count(pages);
+    is((int) pp.num_pages(), NUM, "all distinct pages present after growth");
+
+    bool counts_ok = true;
+    for (int i = 1; i <= NUM; ++i) {
+	int expected = i % 10 == 0 ? 3 : 2;
+	if (pp.count(Page(i, true, false)) != expected) {
+	    counts_ok = false;
+	}
+    }
+    ok(counts_ok, "all counts correct after growth");
+    is(pp.count(Page(NUM + 1, true, false)), 0, "missing page still zero");
+    is(pp.count(Page(1, false, false)), 0, "swap namespace still separate");
+
+    // Merging per-thread pools
+    PagePool merged, other;
+    merged.inc_page_count(Page(1, true, false));
+    merged.inc_page_count(unmapped);
+    other.inc_page_count(Page(1, true, true));
+    other.inc_page_count(unmapped);
+    merged.merge(other);
+    merged.merge(pp);
+    is(merged.count(Page(1, true, false)), 4, "merged counts add up");
+    is(merged.count(Page(10, true, false)), 3, "merge brings in new pages");
+    is((int) merged.num_pages(), NUM, "merge grows as needed");
+    is(merged.count(unmapped), 2, "merged unmapped counts add up");
+
+    pp.clear();
+    is((int) pp.num_pages(), 0, "clear empties the pool");
+    is(pp.count(Page(1, true, false)), 0, "clear resets counts");
+
+    return true;
+}
@@ -0,0 +1,176 @@
+/*
+ * (c) John Berthels 2005 <jjberthels@gmail.com>. See COPYING for license.
+ */
+#include <Trun.hpp>
+#include "Exmap.hpp"
+#include "Saved.hpp"
+
+#include <fstream>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/// Two procs sharing a (non-ELF) file, with made-up but predictable
+/// pages: runs of consecutive pfns with the odd gap.
+class SavedSysInfo : public Exmap::LinuxSysInfo
+{
+public:
+    std::list<pid_t> accessible_pids();
+    bool sanity_check();
+    bool read_page_info(pid_t pid,
+			std::map<Elf::Address, std::vector<Exmap::Page> >&pi);
+    std::string read_cmdline(pid_t pid);
+    bool read_vmas(const Exmap::PagePoolPtr &pp,
+		   pid_t pid,
+		   std::list<Exmap::VmaPtr> &vmas);
+};
+
+class SavedTest : public Test
+{
+public:
+    bool run();
+};
+
+using namespace std;
+using namespace Exmap;
+using namespace jutil;
+
+RUN_TEST_CLASS(SavedTest);
+
+// ------------------------------------------------------------
+
+list<pid_t> SavedSysInfo::accessible_pids()
+{
+    list<pid_t> pids;
+    pids.push_back(100);
+    pids.push_back(200);
+    return pids;
+}
+
+bool SavedSysInfo::sanity_check()
+{
+    return true;
+}
+
+string SavedSysInfo::read_cmdline(pid_t pid)
+{
+    return pid == 100 ? "first" : "second";
+}
+
+bool SavedSysInfo::read_vmas(const PagePoolPtr &pp,
+			     pid_t pid,
+			     list<VmaPtr> &vmas)
+{
+    vmas.clear();
+    const char *lines[] = {
+	"10000000-10010000 r--s 00000000 00:00 1 /no/such/shared.dat",
+	"20000000-20008000 rw-p 00000000 00:00 0",
+    };
+    for (int i = 0; i < 2; ++i) {
+	VmaPtr vma = parse_vma_line(lines[i]);
+	vma->selfptr(vma);
+	vmas.push_back(vma);
+    }
+    return true;
+}
+
+bool SavedSysInfo::read_page_info(pid_t pid,
+				  map<Elf::Address, vector<Page> > &pi)
+{
+    pi.clear();
+    // The shared file: 16 pages, both procs map pfns 1000-1007 then
+    // a hole then 2009-2015
+    vector<Page> &shared = pi[0x10000000];
+    for (int i = 0; i < 16; ++i) {
+	if (i < 8) {
+	    shared.push_back(Page(1000 + i, true, false));
+	}
+	else if (i == 8) {
+	    shared.push_back(Page());
+	}
+	else {
+	    shared.push_back(Page(2000 + i, true, false));
+	}
+    }
+    // Private anon: 8 pages each, pid-specific pfns
+    vector<Page> &anon = pi[0x20000000];
+    for (int i = 0; i < 8; ++i) {
+	anon.push_back(Page(pid * 100 + i, true, true));
+    }
+    return true;
+}
+
+// ------------------------------------------------------------
+
+bool SavedTest::run()
+{
+    plan(26);
+
+    SysInfoPtr si(new SavedSysInfo);
+    SnapshotPtr snap(new Snapshot(si));
+    ok(snap->load(), "can load test snapshot");
+
+    char fname[] = "/tmp/t_saved.XXXXXX";
+    int fd = mkstemp(fname);
+    close(fd);
+    ok(SavedSnapshot::save(snap, fname), "can save");
+
+    SavedSnapshot saved;
+    ok(saved.open(fname), "can open saved");
+    is((int) saved.num_procs(), 2, "two procs");
+    is(saved.proc_pid(0), 100, "first pid");
+    is(string(saved.proc_cmdline(1)), string("second"), "second cmdline");
+    is((int) saved.proc_num_vmas(1), 2, "vmas per proc");
+    is((int) saved.proc_first_vma(1), 2, "second proc's vmas follow");
+
+    ProcessPtr proc = snap->proc(100);
+    bool sizes_match = true;
+    for (int m = 0; m < Sizes::NUM_SIZES; ++m) {
+	if (saved.proc_size(0, m) != proc->sizes()->val(m)) {
+	    sizes_match = false;
+	}
+    }
+    ok(sizes_match, "proc sizes saved");
+
+    is((int) saved.num_files(), 2, "two files");
+    size_t shared = 0;
+    while (shared < saved.num_files()
+	   && strcmp(saved.file_name(shared), "/no/such/shared.dat") != 0) {
+	++shared;
+    }
+    ok(shared < saved.num_files(), "shared file present");
+    FilePtr file = snap->file("/no/such/shared.dat");
+    is(saved.file_size(shared, Sizes::SOLE_MAPPED),
+       file->sizes()->val(Sizes::SOLE_MAPPED), "file sole mapped saved");
+    is(saved.file_size(shared, Sizes::EFFECTIVE_RESIDENT),
+       15.0 * Elf::page_size(), "file effective resident saved");
+
+    // Runs: the shared vma is two runs (the hole splits it and the
+    // pfns jump), the anon one a single run
+    size_t vma = saved.proc_first_vma(0);
+    is(string(saved.vma_fname(vma)), string("/no/such/shared.dat"),
+       "vma file name");
+    is(saved.vma_start(vma), (Elf::Address) 0x10000000, "vma start");
+    is((int) saved.vma_num_runs(vma), 2, "hole splits runs");
+    size_t run = saved.vma_first_run(vma) + 1;
+    is(saved.run_pgnum(run), 9U, "second run starts after the hole");
+    is(saved.run_length(run), 7U, "second run length");
+    Page page = saved.run_page(run, 2);
+    is(page.cookie(), Page(2011, true, false).cookie(), "run page cookie");
+    ok(page.is_resident(), "run page resident");
+    is(saved.page_count(page), 2, "shared page counted twice");
+    is(saved.vma_num_runs(vma + 1), (size_t) 1, "anon vma one run");
+    Page anon = saved.run_page(saved.vma_first_run(vma + 1), 0);
+    ok(anon.is_writable(), "writable flag saved");
+    is(saved.page_count(anon), 1, "private page counted once");
+
+    // Chop the end off: the column length checks catch it
+    ifstream in(fname, ios::binary | ios::ate);
+    truncate(fname, (off_t) in.tellg() - 16);
+    SavedSnapshot bad;
+    notok(bad.open(fname), "truncated file rejected");
+    unlink(fname);
+    notok(bad.open(fname), "missing file rejected");
+
+    return true;
+}
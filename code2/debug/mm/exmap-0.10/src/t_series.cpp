@@ -0,0 +1,120 @@
+/*
+ * (c) John Berthels 2005 <jjberthels@gmail.com>. See COPYING for license.
+ */
+#include <Trun.hpp>
+#include "Series.hpp"
+
+#include <fstream>
+#include <list>
+#include <stdio.h>
+#include <unistd.h>
+
+class SeriesTest : public Test
+{
+public:
+    bool run();
+};
+
+using namespace std;
+using namespace Exmap;
+
+RUN_TEST_CLASS(SeriesTest);
+
+static SeriesEntry make_entry(SeriesEntry::Kind kind, pid_t pid,
+			      const string &name,
+			      long long pss, long long uss)
+{
+    SeriesEntry e;
+    e.kind = kind;
+    e.pid = pid;
+    e.name = name;
+    e.pss = pss;
+    e.uss = uss;
+    return e;
+}
+
+bool SeriesTest::run()
+{
+    plan(26);
+
+    char fname[] = "/tmp/t_series.XXXXXX";
+    int fd = mkstemp(fname);
+    ok(fd >= 0, "can make temp file");
+    close(fd);
+
+    SeriesWriter writer;
+    ok(writer.open(fname), "can open writer");
+
+    list<SeriesEntry> entries;
+    entries.push_back(make_entry(SeriesEntry::PROC, 100, "bash", 4096, 2048));
+    entries.push_back(make_entry(SeriesEntry::PROC, 101, "bash", 8192, 0));
+    entries.push_back(make_entry(SeriesEntry::FILE, 0, "/bin/bash",
+				 12288, 0));
+    ok(writer.write(1000000, entries), "write first interval");
+
+    // 100 grows, 101 unchanged, the file unchanged but 101 wrote pages
+    entries.front().pss += 10000;
+    entries.front().uss += 10000;
+    (++entries.begin())->dirty = 7;
+    ok(writer.write(1005000, entries), "write second interval");
+
+    // 101 goes away, a new file appears
+    entries.erase(++entries.begin());
+    entries.push_back(make_entry(SeriesEntry::FILE, 0, "/lib/libc.so",
+				 1000, 500));
+    ok(writer.write(1010000, entries), "write third interval");
+
+    SeriesReader reader;
+    ok(reader.open(fname), "can open reader");
+
+    unsigned long long t;
+    list<SeriesEntry> changed;
+    ok(reader.next(t, changed), "read first interval");
+    is(t, 1000000ULL, "first time is absolute");
+    is((int) changed.size(), 3, "everything is new first time");
+
+    ok(reader.next(t, changed), "read second interval");
+    is(t, 1005000ULL, "second time");
+    is((int) changed.size(), 2, "only changed or dirty entries");
+    const SeriesEntry &grown = changed.front();
+    is(grown.pid, 100, "grown proc");
+    is(grown.pss, 14096LL, "pss total");
+    is(grown.pss_delta, 10000LL, "pss delta");
+    is(grown.uss, 12048LL, "uss total");
+    const SeriesEntry &dirty = changed.back();
+    is(dirty.pid, 101, "dirty proc");
+    is((int) dirty.dirty, 7, "dirty count");
+    is(dirty.pss_delta, 0LL, "dirty proc didn't grow");
+
+    ok(reader.next(t, changed), "read third interval");
+    bool saw_gone = false, saw_libc = false;
+    list<SeriesEntry>::iterator it;
+    for (it = changed.begin(); it != changed.end(); ++it) {
+	if (it->gone && it->pid == 101 && it->pss_delta == -8192) {
+	    saw_gone = true;
+	}
+	if (it->name == "/lib/libc.so" && it->uss == 500) {
+	    saw_libc = true;
+	}
+    }
+    ok(saw_gone, "departed proc is gone");
+    ok(saw_libc, "new file name interned");
+
+    notok(reader.next(t, changed), "no more intervals");
+    notok(reader.error(), "clean end of file");
+
+    // Chop the last byte off: corrupt
+    {
+	ifstream in(fname, ios::binary);
+	string data((istreambuf_iterator<char>(in)),
+		    istreambuf_iterator<char>());
+	ofstream out(fname, ios::binary | ios::trunc);
+	out.write(data.data(), data.size() - 1);
+    }
+    ok(reader.open(fname), "can reopen truncated");
+    while (reader.next(t, changed)) { }
+    ok(reader.error(), "truncated file is an error");
+
+    unlink(fname);
+    return true;
+}
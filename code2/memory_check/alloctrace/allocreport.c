@@ -0,0 +1,560 @@
+/*
+ * allocreport.c - replay an alloctrace file
+ *
+ *	gcc -O2 -o allocreport allocreport.c
+ *	./allocreport [-n sites] trace.out
+ *
+ * Merges the per-thread chunks into one timeline and replays it to
+ * report the peak footprint, fragmentation of the live heap at the
+ * peak and at exit, a histogram of request sizes and the blocks still
+ * live at exit, by allocation stack. Frames are printed as file+offset,
+ * for addr2line -e file offset.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "alloctrace.h"
+
+/* gaps between live blocks bigger than this are between heaps, not holes */
+#define HOLE_MAX	(64 * 1024)
+#define BUCKETS		48
+
+struct event {
+	uint64_t t;
+	uint64_t addr;
+	uint64_t old;
+	uint64_t size;
+	uint32_t stack;
+	uint32_t seq;
+	uint8_t type;
+};
+
+struct block {
+	uint64_t addr;		/* 0: empty slot */
+	uint64_t size;
+	uint32_t stack;
+	uint8_t mapped;
+};
+
+struct stack {
+	int depth;
+	uint64_t *pcs;
+};
+
+struct site {
+	uint32_t stack;
+	uint64_t count;
+	uint64_t bytes;
+};
+
+struct replay {
+	uint64_t heap, peak_heap;
+	uint64_t mapped, peak_mapped;
+	uint64_t peak_total;
+	size_t peak_at;
+	uint64_t unmatched;
+};
+
+static struct event *events;
+static size_t nevents, maxevents;
+static struct stack stacks[AT_STACKS + 1];
+static char *maps;
+static size_t maps_len;
+static uint64_t nchunks, nthreads_seen;
+
+static struct block *live;
+static size_t live_mask, nlive;
+
+static void die(const char *msg)
+{
+	fprintf(stderr, "allocreport: %s\n", msg);
+	exit(1);
+}
+
+static struct event *new_event(void)
+{
+	if (nevents == maxevents) {
+		maxevents = maxevents ? maxevents * 2 : 65536;
+		events = realloc(events, maxevents * sizeof(*events));
+		if (!events)
+			die("out of memory");
+	}
+	return &events[nevents++];
+}
+
+/* ------------------------------------------------------------------ */
+
+#define GET(v)	do { if (!(p = at_get(p, end, &(v)))) return -1; } while (0)
+
+static int parse_chunk(const unsigned char *p, const unsigned char *end,
+		       const struct at_chunk *c)
+{
+	uint64_t type, v, t = c->t0, addr = 0, id, n, i, pc;
+	struct event *e;
+
+	while (p < end) {
+		GET(type);
+		if (type == AT_STACK) {
+			GET(id);
+			GET(n);
+			if (!id || id > AT_STACKS || n > AT_MAX_DEPTH)
+				return -1;
+			free(stacks[id].pcs);
+			stacks[id].pcs = malloc((n + 1) * sizeof(uint64_t));
+			stacks[id].depth = n;
+			for (i = 0, pc = 0; i < n; i++) {
+				GET(v);
+				pc += at_unzigzag(v);
+				stacks[id].pcs[i] = pc;
+			}
+			continue;
+		}
+		if (type == AT_MAPS) {
+			GET(n);
+			if (n > (uint64_t)(end - p))
+				return -1;
+			maps = malloc(n + 1);
+			memcpy(maps, p, n);
+			maps[n] = 0;
+			maps_len = n;
+			p += n;
+			continue;
+		}
+		if (type > AT_MUNMAP)
+			return -1;
+
+		e = new_event();
+		memset(e, 0, sizeof(*e));
+		e->type = type;
+		e->seq = nevents - 1;
+		GET(v);
+		t += v;
+		e->t = t;
+		GET(v);
+		addr += at_unzigzag(v);
+		e->addr = addr;
+		if (type == AT_REALLOC) {
+			GET(v);
+			e->old = addr + at_unzigzag(v);
+		}
+		if (type != AT_FREE)
+			GET(e->size);
+		if (type != AT_FREE && type != AT_MUNMAP) {
+			GET(v);
+			e->stack = v <= AT_STACKS ? v : 0;
+		}
+	}
+	return 0;
+}
+
+static void load(const char *fname)
+{
+	const unsigned char *data, *p, *end;
+	struct at_header h;
+	struct at_chunk c;
+	uint32_t tids[1024];
+	size_t len = 0, cap = 1 << 20, i;
+	unsigned char *buf;
+	ssize_t n;
+	FILE *f;
+
+	if (!(f = fopen(fname, "rb"))) {
+		fprintf(stderr, "allocreport: %s: %s\n", fname, strerror(errno));
+		exit(1);
+	}
+	buf = malloc(cap);
+	while (buf && (n = fread(buf + len, 1, cap - len, f)) > 0) {
+		len += n;
+		if (len == cap)
+			buf = realloc(buf, cap *= 2);
+	}
+	fclose(f);
+	if (!buf)
+		die("out of memory");
+
+	data = buf;
+	end = data + len;
+	if (len < sizeof(h))
+		die("not a trace file");
+	memcpy(&h, data, sizeof(h));
+	if (memcmp(h.magic, AT_MAGIC, 4) || h.version != AT_VERSION)
+		die("not a trace file, or a different version");
+
+	for (p = data + sizeof(h); p < end; p += c.len) {
+		if ((size_t)(end - p) < sizeof(c)) {
+			fprintf(stderr, "allocreport: ignoring a truncated "
+				"chunk at the end\n");
+			break;
+		}
+		memcpy(&c, p, sizeof(c));
+		p += sizeof(c);
+		if (c.len > (size_t)(end - p)) {
+			fprintf(stderr, "allocreport: ignoring a truncated "
+				"chunk at the end\n");
+			break;
+		}
+		if (parse_chunk(p, p + c.len, &c) < 0)
+			fprintf(stderr, "allocreport: corrupt chunk at %ld, "
+				"skipped\n", (long)(p - data));
+		nchunks++;
+		for (i = 0; i < nthreads_seen && tids[i] != c.tid; i++)
+			;
+		if (c.tid && i == nthreads_seen && i < 1024)
+			tids[nthreads_seen++] = c.tid;
+	}
+	free(buf);
+}
+
+static int by_time(const void *a, const void *b)
+{
+	const struct event *x = a, *y = b;
+
+	if (x->t != y->t)
+		return x->t < y->t ? -1 : 1;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* ------------------------------------------------------------------ */
+
+static size_t hash(uint64_t addr)
+{
+	return (addr * 0x9e3779b97f4a7c15ULL) >> 20;
+}
+
+static void live_clear(void)
+{
+	if (!live) {
+		live_mask = 65535;
+		live = malloc((live_mask + 1) * sizeof(*live));
+		if (!live)
+			die("out of memory");
+	}
+	memset(live, 0, (live_mask + 1) * sizeof(*live));
+	nlive = 0;
+}
+
+static struct block *live_find(uint64_t addr)
+{
+	size_t i;
+
+	for (i = hash(addr) & live_mask; live[i].addr; i = (i + 1) & live_mask)
+		if (live[i].addr == addr)
+			return &live[i];
+	return NULL;
+}
+
+static void live_add(const struct block *b)
+{
+	struct block *old = live;
+	size_t i, n = live_mask + 1;
+
+	if (nlive * 2 >= live_mask) {
+		live_mask = live_mask * 2 + 1;
+		live = calloc(live_mask + 1, sizeof(*live));
+		if (!live)
+			die("out of memory");
+		nlive = 0;
+		for (i = 0; i < n; i++)
+			if (old[i].addr)
+				live_add(&old[i]);
+		free(old);
+	}
+	for (i = hash(b->addr) & live_mask; live[i].addr;
+	     i = (i + 1) & live_mask)
+		;
+	live[i] = *b;
+	nlive++;
+}
+
+/* Linear probing: shift back the entries that probed past the hole */
+static void live_del(struct block *b)
+{
+	size_t i = b - live, j = i, k;
+
+	for (;;) {
+		j = (j + 1) & live_mask;
+		if (!live[j].addr)
+			break;
+		k = hash(live[j].addr) & live_mask;
+		if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+			live[i] = live[j];
+			i = j;
+		}
+	}
+	live[i].addr = 0;
+	nlive--;
+}
+
+/* ------------------------------------------------------------------ */
+
+static int bucket(uint64_t size)
+{
+	int b = 0;
+
+	while (size > 1 && b < BUCKETS - 1) {
+		size = (size + 1) >> 1;
+		b++;
+	}
+	return b;
+}
+
+static void account(struct replay *r, const struct block *b, int sign)
+{
+	uint64_t *total = b->mapped ? &r->mapped : &r->heap;
+
+	*total += sign * b->size;
+}
+
+static int release(struct replay *r, uint64_t addr, int mapped)
+{
+	struct block *b = live_find(addr);
+
+	if (!b || b->mapped != mapped) {
+		r->unmatched++;
+		return -1;
+	}
+	account(r, b, -1);
+	live_del(b);
+	return 0;
+}
+
+static void acquire(struct replay *r, const struct event *e, int mapped)
+{
+	struct block b, *old;
+
+	/* already live: we missed its free (or the clocks tied) */
+	if ((old = live_find(e->addr)) != NULL) {
+		account(r, old, -1);
+		live_del(old);
+		r->unmatched++;
+	}
+	b.addr = e->addr;
+	b.size = e->size;
+	b.stack = e->stack;
+	b.mapped = mapped;
+	account(r, &b, 1);
+	live_add(&b);
+}
+
+/* Replay the first limit events, leaving what's live in the table */
+static void replay(struct replay *r, size_t limit, uint64_t *hist_count,
+		   uint64_t *hist_bytes)
+{
+	const struct event *e;
+	size_t i;
+
+	memset(r, 0, sizeof(*r));
+	live_clear();
+	for (i = 0; i < limit; i++) {
+		e = &events[i];
+		switch (e->type) {
+		case AT_MALLOC:
+			acquire(r, e, 0);
+			break;
+		case AT_FREE:
+			release(r, e->addr, 0);
+			break;
+		case AT_REALLOC:
+			release(r, e->old, 0);
+			acquire(r, e, 0);
+			break;
+		case AT_MMAP:
+			acquire(r, e, 1);
+			break;
+		case AT_MUNMAP:
+			release(r, e->addr, 1);
+			break;
+		}
+		if ((e->type == AT_MALLOC || e->type == AT_REALLOC) &&
+		    hist_count) {
+			hist_count[bucket(e->size)]++;
+			hist_bytes[bucket(e->size)] += e->size;
+		}
+		if (r->heap > r->peak_heap)
+			r->peak_heap = r->heap;
+		if (r->mapped > r->peak_mapped)
+			r->peak_mapped = r->mapped;
+		if (r->heap + r->mapped > r->peak_total) {
+			r->peak_total = r->heap + r->mapped;
+			r->peak_at = i + 1;
+		}
+	}
+}
+
+/* ------------------------------------------------------------------ */
+
+static int by_addr(const void *a, const void *b)
+{
+	const struct block *x = a, *y = b;
+
+	return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+static void fragmentation(const char *when)
+{
+	struct block *v = malloc((nlive + 1) * sizeof(*v));
+	uint64_t holes = 0, largest = 0, used = 0, gap;
+	size_t i, n = 0;
+
+	if (!v)
+		die("out of memory");
+	for (i = 0; i <= live_mask; i++)
+		if (live[i].addr && !live[i].mapped)
+			v[n++] = live[i];
+	qsort(v, n, sizeof(*v), by_addr);
+	for (i = 0; i < n; i++) {
+		used += v[i].size;
+		if (i + 1 == n || v[i + 1].addr < v[i].addr + v[i].size)
+			continue;
+		gap = v[i + 1].addr - (v[i].addr + v[i].size);
+		if (gap < HOLE_MAX) {
+			holes += gap;
+			if (gap > largest)
+				largest = gap;
+		}
+	}
+	printf("%-8s %10zu blocks %12llu bytes live, %12llu in holes "
+	       "(largest %llu), %5.1f%% fragmented\n", when, n,
+	       (unsigned long long)used, (unsigned long long)holes,
+	       (unsigned long long)largest,
+	       used + holes ? 100.0 * holes / (used + holes) : 0.0);
+	free(v);
+}
+
+/* The mapping holding pc, as file+offset */
+static void print_frame(uint64_t pc)
+{
+	unsigned long long start, end, off;
+	const char *line = maps;
+	char path[4096];
+
+	while (line && *line) {
+		path[0] = 0;
+		if (sscanf(line, "%llx-%llx %*s %llx %*s %*s %4095s",
+			   &start, &end, &off, path) >= 3 &&
+		    pc >= start && pc < end && path[0] == '/') {
+			printf("\t\t%s+0x%llx\n", path,
+			       (unsigned long long)(pc - start + off));
+			return;
+		}
+		line = strchr(line, '\n');
+		if (line)
+			line++;
+	}
+	printf("\t\t0x%llx\n", (unsigned long long)pc);
+}
+
+static int by_bytes(const void *a, const void *b)
+{
+	const struct site *x = a, *y = b;
+
+	return x->bytes > y->bytes ? -1 : x->bytes < y->bytes;
+}
+
+static void leaks(int nsites)
+{
+	struct site *sites = calloc(AT_STACKS + 1, sizeof(*sites));
+	uint64_t count = 0, bytes = 0;
+	size_t i;
+	int s, f;
+
+	if (!sites)
+		die("out of memory");
+	for (i = 0; i <= AT_STACKS; i++)
+		sites[i].stack = i;
+	for (i = 0; i <= live_mask; i++) {
+		if (!live[i].addr || live[i].mapped)
+			continue;
+		sites[live[i].stack].count++;
+		sites[live[i].stack].bytes += live[i].size;
+		count++;
+		bytes += live[i].size;
+	}
+	printf("\nLive at exit: %llu bytes in %llu blocks\n",
+	       (unsigned long long)bytes, (unsigned long long)count);
+	qsort(sites, AT_STACKS + 1, sizeof(*sites), by_bytes);
+	for (s = 0; s < nsites && sites[s].count; s++) {
+		printf("  %llu bytes in %llu blocks from\n",
+		       (unsigned long long)sites[s].bytes,
+		       (unsigned long long)sites[s].count);
+		if (!sites[s].stack || !stacks[sites[s].stack].pcs) {
+			printf("\t\t(no stack)\n");
+			continue;
+		}
+		for (f = 0; f < stacks[sites[s].stack].depth; f++)
+			print_frame(stacks[sites[s].stack].pcs[f]);
+	}
+	free(sites);
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t hist_count[BUCKETS] = { 0 }, hist_bytes[BUCKETS] = { 0 };
+	uint64_t counts[AT_MUNMAP + 1] = { 0 };
+	struct replay r, at_peak;
+	int nsites = 10, opt, b;
+	size_t i;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		if (opt == 'n')
+			nsites = atoi(optarg);
+		else
+			break;
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "usage: allocreport [-n sites] trace.out\n");
+		return 2;
+	}
+	load(argv[optind]);
+	qsort(events, nevents, sizeof(*events), by_time);
+	for (i = 0; i < nevents; i++)
+		counts[events[i].type]++;
+
+	printf("%zu events in %llu chunks from %llu threads over %.3fs\n",
+	       nevents, (unsigned long long)nchunks,
+	       (unsigned long long)nthreads_seen,
+	       nevents ? (events[nevents - 1].t - events[0].t) / 1e9 : 0.0);
+	printf("  malloc %llu  free %llu  realloc %llu  mmap %llu  "
+	       "munmap %llu\n",
+	       (unsigned long long)counts[AT_MALLOC],
+	       (unsigned long long)counts[AT_FREE],
+	       (unsigned long long)counts[AT_REALLOC],
+	       (unsigned long long)counts[AT_MMAP],
+	       (unsigned long long)counts[AT_MUNMAP]);
+
+	/* once to the peak for its live set, then to the end */
+	replay(&r, nevents, hist_count, hist_bytes);
+	replay(&at_peak, r.peak_at, NULL, NULL);
+
+	printf("\nPeak: %llu bytes (heap %llu, mmap %llu) %.3fs in\n",
+	       (unsigned long long)r.peak_total,
+	       (unsigned long long)at_peak.heap,
+	       (unsigned long long)at_peak.mapped,
+	       r.peak_at ? (events[r.peak_at - 1].t - events[0].t) / 1e9 : 0.0);
+	printf("  heap alone peaked at %llu, mmap at %llu\n",
+	       (unsigned long long)r.peak_heap,
+	       (unsigned long long)r.peak_mapped);
+	if (r.unmatched)
+		printf("  %llu frees of unknown blocks (allocated before "
+		       "tracing started?)\n", (unsigned long long)r.unmatched);
+
+	printf("\nFragmentation of the live heap (gaps under %dKB "
+	       "between blocks)\n", HOLE_MAX / 1024);
+	fragmentation("at peak");
+	replay(&r, nevents, NULL, NULL);
+	fragmentation("at exit");
+
+	printf("\nRequest sizes\n");
+	printf("  %-12s %12s %14s\n", "up to", "requests", "bytes");
+	for (b = 0; b < BUCKETS; b++)
+		if (hist_count[b])
+			printf("  %-12llu %12llu %14llu\n",
+			       1ULL << b, (unsigned long long)hist_count[b],
+			       (unsigned long long)hist_bytes[b]);
+
+	leaks(nsites);
+	return 0;
+}
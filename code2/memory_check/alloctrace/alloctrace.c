@@ -0,0 +1,654 @@
+/*
+ * alloctrace.c - record malloc/free/realloc/mmap of an unmodified program
+ *
+ *	gcc -shared -fPIC -O2 -fno-omit-frame-pointer -o alloctrace.so \
+ *		alloctrace.c -ldl -lpthread -lm
+ *	ALLOCTRACE_OUT=trace.out LD_PRELOAD=./alloctrace.so ./prog
+ *	./allocreport trace.out
+ *
+ * Every thread encodes its events into a private 64KB buffer, so the
+ * hooks never take a lock; a full buffer goes to the file with a single
+ * write(), which O_APPEND keeps whole. Stacks are hashed into a shared
+ * table with compare-and-swap and written out once, the events only
+ * carry the id. See alloctrace.h for the format.
+ *
+ * Environment:
+ *	ALLOCTRACE_OUT		file name, default alloctrace.<pid>
+ *	ALLOCTRACE_DEPTH	stack depth, default 16, 0 for no stacks
+ *	ALLOCTRACE_UNWIND	"fp" to follow frame pointers instead of
+ *				backtrace(); only as deep as the code
+ *				keeps them (-fno-omit-frame-pointer)
+ *	ALLOCTRACE_SAMPLE	take the stack of about one allocation per
+ *				this many bytes, the others have none
+ *
+ * The stack is most of the cost: backtrace() reads the unwind tables
+ * for every frame, a frame pointer walk is a load per frame.
+ * Sampling leaves out the stack, but never the event, so the
+ * footprint stays exact; the intervals are random and exponential,
+ * so a stack is sampled in proportion to the bytes it allocates.
+ *
+ * Events still buffered are written out by a destructor at exit (not
+ * on _exit() or a crash). Memory freed by destructors that run after
+ * ours shows up as leaked.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "alloctrace.h"
+
+/* initial-exec: the default model may call malloc on first access */
+#define TLS		__thread __attribute__((tls_model("initial-exec")))
+
+#define BUF_SIZE	(64 * 1024)
+#define MAX_RECORD	1024	/* a stack definition plus one event */
+#define BOOT_SIZE	8192
+
+#define BUF_FREE	0
+#define BUF_LIVE	1
+
+struct buffer {
+	struct buffer *next;	/* every buffer ever made, never unlinked */
+	volatile int state;
+	pid_t tid;
+	uint64_t t0;		/* 0 until the chunk's first event */
+	uint64_t tlast;
+	uintptr_t last;
+	size_t len;
+	unsigned char data[BUF_SIZE];	/* a struct at_chunk, then records */
+};
+
+static void *(*real_malloc)(size_t);
+static void (*real_free)(void *);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void *(*real_memalign)(size_t, size_t);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static void *(*real_aligned_alloc)(size_t, size_t);
+static void *(*real_valloc)(size_t);
+static void *(*real_pvalloc)(size_t);
+static void *(*real_mmap)(void *, size_t, int, int, int, off_t);
+static int (*real_munmap)(void *, size_t);
+
+static int trace_fd = -1;
+static int depth = 16;
+static int fp_unwind;
+static long sample_bytes;	/* 0: every allocation's stack */
+static volatile int active;
+static struct buffer *volatile buffers;
+static pthread_key_t buffer_key;
+static volatile uint64_t stack_keys[AT_STACKS];
+
+/* dlsym() allocates; serve that from here until the hooks are resolved */
+static char boot[BOOT_SIZE] __attribute__((aligned(16)));
+static size_t boot_used;
+static int resolving;
+
+static TLS struct buffer *cur;
+static TLS int in_trace;
+static TLS uintptr_t stack_lo, stack_hi;	/* for the frame pointer walk */
+static TLS long sample_left;
+static TLS uint64_t sample_rand;
+
+static void resolve(void);
+static void flush(struct buffer *b);
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* each block is preceded by 16 bytes holding its size, for realloc */
+static void *boot_alloc(size_t size)
+{
+	char *p;
+
+	if (size > BOOT_SIZE)
+		return NULL;
+	size = (size + 15) & ~(size_t)15;
+	if (boot_used + 16 + size > BOOT_SIZE)
+		return NULL;
+	p = boot + boot_used;
+	*(size_t *)p = size;
+	boot_used += 16 + size;
+	return p + 16;
+}
+
+static size_t boot_size(const void *p)
+{
+	return *(const size_t *)((const char *)p - 16);
+}
+
+static int is_boot(const void *p)
+{
+	return (const char *)p >= boot && (const char *)p < boot + BOOT_SIZE;
+}
+
+static void buffer_exit(void *arg)
+{
+	struct buffer *b = arg;
+
+	in_trace = 1;
+	flush(b);
+	cur = NULL;
+	b->state = BUF_FREE;
+	in_trace = 0;
+}
+
+static struct buffer *get_buffer(void)
+{
+	struct buffer *b;
+
+	if (cur)
+		return cur;
+	/* reuse the buffer of a thread that has gone */
+	for (b = buffers; b; b = b->next)
+		if (b->state == BUF_FREE &&
+		    __sync_bool_compare_and_swap(&b->state, BUF_FREE, BUF_LIVE))
+			break;
+	if (!b) {
+		b = real_mmap(NULL, sizeof(*b), PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (b == MAP_FAILED)
+			return NULL;
+		b->state = BUF_LIVE;
+		b->len = sizeof(struct at_chunk);
+		do {
+			b->next = buffers;
+		} while (!__sync_bool_compare_and_swap(&buffers, b->next, b));
+	}
+	b->tid = syscall(SYS_gettid);
+	pthread_setspecific(buffer_key, b);
+	cur = b;
+	return b;
+}
+
+static void flush(struct buffer *b)
+{
+	struct at_chunk c;
+	const unsigned char *p = b->data;
+	size_t left = b->len;
+	ssize_t n;
+
+	if (b->len == sizeof(c))
+		return;
+	c.tid = b->tid;
+	c.len = b->len - sizeof(c);
+	c.t0 = b->t0;
+	memcpy(b->data, &c, sizeof(c));
+	while (left > 0) {
+		n = write(trace_fd, p, left);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		p += n;
+		left -= n;
+	}
+	b->len = sizeof(c);
+	b->t0 = 0;
+	b->last = 0;
+}
+
+/*
+ * backtrace() for code built with frame pointers: each frame starts
+ * with the caller's frame pointer and the return address. The chain
+ * ends, or runs into code that uses the register for something else,
+ * wherever it leaves the thread's stack or stops going up it.
+ */
+static __attribute__((noinline)) int fp_backtrace(void **pcs, int max)
+{
+	uintptr_t *fp = __builtin_frame_address(0), *next;
+	pthread_attr_t attr;
+	void *lo;
+	size_t size;
+	int n = 0;
+
+	if (!stack_hi) {
+		if (pthread_getattr_np(pthread_self(), &attr) != 0)
+			return 0;
+		if (pthread_attr_getstack(&attr, &lo, &size) == 0) {
+			stack_lo = (uintptr_t)lo;
+			stack_hi = stack_lo + size;
+		}
+		pthread_attr_destroy(&attr);
+		if (!stack_hi)
+			return 0;
+	}
+	/* this frame, like backtrace()'s own, isn't reported */
+	while (n < max) {
+		if ((uintptr_t)fp < stack_lo ||
+		    (uintptr_t)fp + 2 * sizeof(*fp) > stack_hi ||
+		    ((uintptr_t)fp & (sizeof(*fp) - 1)))
+			break;
+		if (!fp[1])
+			break;
+		pcs[n++] = (void *)fp[1];
+		next = (uintptr_t *)fp[0];
+		if (next <= fp)
+			break;
+		fp = next;
+	}
+	return n;
+}
+
+/* Bytes until the next sampled allocation, exponentially distributed */
+static long sample_next(void)
+{
+	double u;
+
+	if (!sample_rand)
+		sample_rand = ((uint64_t)(uintptr_t)&sample_rand ^ now_ns()) | 1;
+	sample_rand ^= sample_rand >> 12;
+	sample_rand ^= sample_rand << 25;
+	sample_rand ^= sample_rand >> 27;
+	u = (double)((sample_rand * 2685821657736338717ULL) >> 11) /
+	    9007199254740992.0;
+	return (long)(-log(1.0 - u) * sample_bytes) + 1;
+}
+
+/* Hash the caller's stack, defining it in b the first time it's seen */
+static __attribute__((noinline)) unsigned stack_id(struct buffer *b)
+{
+	void *pcs[AT_MAX_DEPTH + 3];
+	uint64_t h = 14695981039346656037ULL;
+	uintptr_t prev = 0;
+	unsigned char *p;
+	unsigned slot;
+	int i, n;
+
+	/* skip our own frames: stack_id, record and the hook */
+	if (fp_unwind)
+		n = fp_backtrace(pcs, depth + 3) - 3;
+	else
+		n = backtrace(pcs, depth + 3) - 3;
+	if (n <= 0)
+		return 0;
+	for (i = 0; i < n; i++)
+		h = (h ^ (uintptr_t)pcs[i + 3]) * 1099511628211ULL;
+	h |= 1;
+
+	for (i = 0; i < 64; i++) {
+		slot = (h + i) & (AT_STACKS - 1);
+		if (stack_keys[slot] == h)
+			return slot + 1;
+		if (stack_keys[slot] == 0 &&
+		    __sync_bool_compare_and_swap(&stack_keys[slot], 0, h))
+			break;
+		if (stack_keys[slot] == h)
+			return slot + 1;
+	}
+	if (i == 64)
+		return 0;
+
+	p = b->data + b->len;
+	p = at_put(p, AT_STACK);
+	p = at_put(p, slot + 1);
+	p = at_put(p, n);
+	for (i = 0; i < n; i++) {
+		p = at_put(p, at_zigzag((uintptr_t)pcs[i + 3] - prev));
+		prev = (uintptr_t)pcs[i + 3];
+	}
+	b->len = p - b->data;
+	return slot + 1;
+}
+
+static __attribute__((noinline))
+void record(int type, const void *addr, const void *old, size_t size)
+{
+	struct buffer *b;
+	unsigned char *p;
+	unsigned stack = 0;
+	uint64_t now;
+
+	in_trace = 1;
+	b = get_buffer();
+	if (!b)
+		goto out;
+	if (b->len > BUF_SIZE - MAX_RECORD)
+		flush(b);
+	now = now_ns();
+	if (!b->t0)
+		b->t0 = b->tlast = now;
+	if (depth && type != AT_FREE && type != AT_MUNMAP) {
+		if (!sample_bytes) {
+			stack = stack_id(b);
+		} else {
+			if (!sample_left)
+				sample_left = sample_next();
+			sample_left -= size;
+			if (sample_left <= 0) {
+				stack = stack_id(b);
+				sample_left = sample_next();
+			}
+		}
+	}
+
+	p = b->data + b->len;
+	p = at_put(p, type);
+	p = at_put(p, now - b->tlast);
+	p = at_put(p, at_zigzag((uintptr_t)addr - b->last));
+	b->tlast = now;
+	b->last = (uintptr_t)addr;
+	if (type == AT_REALLOC)
+		p = at_put(p, at_zigzag((uintptr_t)old - (uintptr_t)addr));
+	if (type != AT_FREE)
+		p = at_put(p, size);
+	if (type != AT_FREE && type != AT_MUNMAP)
+		p = at_put(p, stack);
+	b->len = p - b->data;
+out:
+	in_trace = 0;
+}
+
+#define TRACING()	(active && !in_trace)
+
+static int open_trace(void)
+{
+	struct at_header h;
+	char name[4096];
+	const char *out = getenv("ALLOCTRACE_OUT");
+
+	if (!out)
+		snprintf(name, sizeof(name), "alloctrace.%d", (int)getpid());
+	else if (trace_fd >= 0)	/* a forked child: don't share the parent's */
+		snprintf(name, sizeof(name), "%s.%d", out, (int)getpid());
+	else
+		snprintf(name, sizeof(name), "%s", out);
+
+	if (trace_fd >= 0)
+		close(trace_fd);
+	trace_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND |
+			O_CLOEXEC, 0644);
+	if (trace_fd < 0)
+		return -1;
+	memcpy(h.magic, AT_MAGIC, 4);
+	h.version = AT_VERSION;
+	return write(trace_fd, &h, sizeof(h)) == sizeof(h) ? 0 : -1;
+}
+
+static void fork_child(void)
+{
+	struct buffer *b;
+
+	/* the other threads are gone, and the parent writes out
+	 * everything buffered so far */
+	for (b = buffers; b; b = b->next) {
+		b->len = sizeof(struct at_chunk);
+		b->t0 = 0;
+		b->last = 0;
+		if (b != cur)
+			b->state = BUF_FREE;
+	}
+	if (cur)
+		cur->tid = syscall(SYS_gettid);
+	/* and the stacks it has defined are in its file, not ours */
+	memset((void *)stack_keys, 0, sizeof(stack_keys));
+	if (open_trace() < 0)
+		active = 0;
+}
+
+static void resolve(void)
+{
+	resolving = 1;
+	real_malloc = dlsym(RTLD_NEXT, "malloc");
+	real_free = dlsym(RTLD_NEXT, "free");
+	real_calloc = dlsym(RTLD_NEXT, "calloc");
+	real_realloc = dlsym(RTLD_NEXT, "realloc");
+	real_memalign = dlsym(RTLD_NEXT, "memalign");
+	real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+	real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+	real_valloc = dlsym(RTLD_NEXT, "valloc");
+	real_pvalloc = dlsym(RTLD_NEXT, "pvalloc");
+	real_mmap = dlsym(RTLD_NEXT, "mmap");
+	real_munmap = dlsym(RTLD_NEXT, "munmap");
+	resolving = 0;
+}
+
+__attribute__((constructor))
+static void alloctrace_init(void)
+{
+	const char *s;
+	void *pc;
+
+	if (!real_malloc)
+		resolve();
+	in_trace = 1;
+	if ((s = getenv("ALLOCTRACE_DEPTH")) != NULL) {
+		depth = atoi(s);
+		if (depth < 0)
+			depth = 0;
+		if (depth > AT_MAX_DEPTH)
+			depth = AT_MAX_DEPTH;
+	}
+	if ((s = getenv("ALLOCTRACE_UNWIND")) != NULL && !strcmp(s, "fp"))
+		fp_unwind = 1;
+	if ((s = getenv("ALLOCTRACE_SAMPLE")) != NULL && atol(s) > 0)
+		sample_bytes = atol(s);
+	/* the first backtrace() loads libgcc_s, which allocates */
+	backtrace(&pc, 1);
+	if (pthread_key_create(&buffer_key, buffer_exit) == 0 &&
+	    pthread_atfork(NULL, NULL, fork_child) == 0 &&
+	    open_trace() == 0)
+		active = 1;
+	else
+		fprintf(stderr, "alloctrace: can't start, not tracing\n");
+	in_trace = 0;
+}
+
+__attribute__((destructor))
+static void alloctrace_fini(void)
+{
+	static char maps[256 * 1024];
+	unsigned char head[sizeof(struct at_chunk) + 20], *p;
+	struct at_chunk c;
+	struct buffer *b;
+	size_t len = 0;
+	ssize_t n;
+	int mfd;
+
+	if (!active)
+		return;
+	in_trace = 1;
+	active = 0;
+	for (b = buffers; b; b = b->next)
+		flush(b);
+
+	mfd = open("/proc/self/maps", O_RDONLY);
+	if (mfd < 0)
+		return;
+	while (len < sizeof(maps) &&
+	       (n = read(mfd, maps + len, sizeof(maps) - len)) > 0)
+		len += n;
+	close(mfd);
+	p = at_put(at_put(head + sizeof(c), AT_MAPS), len);
+	c.tid = 0;
+	c.len = (p - head - sizeof(c)) + len;
+	c.t0 = 0;
+	memcpy(head, &c, sizeof(c));
+	/* header and text apart: the maps chunk is the last write */
+	if (write(trace_fd, head, p - head) == p - head)
+		n = write(trace_fd, maps, len);
+}
+
+/* ------------------------------------------------------------------ */
+
+void *malloc(size_t size)
+{
+	void *p;
+
+	if (!real_malloc) {
+		if (resolving)
+			return boot_alloc(size);
+		resolve();
+	}
+	p = real_malloc(size);
+	if (p && TRACING())
+		record(AT_MALLOC, p, NULL, size);
+	return p;
+}
+
+void free(void *ptr)
+{
+	if (!ptr || is_boot(ptr))
+		return;
+	if (!real_free)
+		resolve();
+	if (TRACING())
+		record(AT_FREE, ptr, NULL, 0);
+	real_free(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	void *p;
+
+	if (!real_calloc) {
+		if (resolving)
+			return boot_alloc(nmemb * size);	/* bss: zeroed */
+		resolve();
+	}
+	p = real_calloc(nmemb, size);
+	if (p && TRACING())
+		record(AT_MALLOC, p, NULL, nmemb * size);
+	return p;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	void *p;
+
+	if (!real_realloc)
+		resolve();
+	if (is_boot(ptr)) {
+		p = malloc(size);
+		if (p)
+			memcpy(p, ptr, size < boot_size(ptr) ?
+			       size : boot_size(ptr));
+		return p;
+	}
+	p = real_realloc(ptr, size);
+	if (!TRACING())
+		return p;
+	if (!ptr) {
+		if (p)
+			record(AT_MALLOC, p, NULL, size);
+	} else if (!size) {
+		record(AT_FREE, ptr, NULL, 0);
+	} else if (p) {
+		record(AT_REALLOC, p, ptr, size);
+	}
+	return p;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+	void *p;
+
+	if (!real_memalign)
+		resolve();
+	p = real_memalign(alignment, size);
+	if (p && TRACING())
+		record(AT_MALLOC, p, NULL, size);
+	return p;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	int ret;
+
+	if (!real_posix_memalign)
+		resolve();
+	ret = real_posix_memalign(memptr, alignment, size);
+	if (!ret && TRACING())
+		record(AT_MALLOC, *memptr, NULL, size);
+	return ret;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	void *p;
+
+	if (!real_aligned_alloc)
+		resolve();
+	p = real_aligned_alloc(alignment, size);
+	if (p && TRACING())
+		record(AT_MALLOC, p, NULL, size);
+	return p;
+}
+
+void *valloc(size_t size)
+{
+	void *p;
+
+	if (!real_valloc)
+		resolve();
+	p = real_valloc(size);
+	if (p && TRACING())
+		record(AT_MALLOC, p, NULL, size);
+	return p;
+}
+
+void *pvalloc(size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	void *p;
+
+	if (!real_pvalloc)
+		resolve();
+	p = real_pvalloc(size);
+	/* it rounds the size up to whole pages, and so does the footprint */
+	size = size ? (size + page - 1) & ~(page - 1) : page;
+	if (p && TRACING())
+		record(AT_MALLOC, p, NULL, size);
+	return p;
+}
+
+/* the C library's goes to its realloc directly, past the hook */
+void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+	if (size && nmemb > (size_t)-1 / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return realloc(ptr, nmemb * size);
+}
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd,
+	   off_t offset)
+{
+	void *p;
+
+	if (!real_mmap)
+		resolve();
+	p = real_mmap(addr, length, prot, flags, fd, offset);
+	if (p != MAP_FAILED && TRACING())
+		record(AT_MMAP, p, NULL, length);
+	return p;
+}
+
+int munmap(void *addr, size_t length)
+{
+	int ret;
+
+	if (!real_munmap)
+		resolve();
+	ret = real_munmap(addr, length);
+	if (!ret && TRACING())
+		record(AT_MUNMAP, addr, NULL, length);
+	return ret;
+}
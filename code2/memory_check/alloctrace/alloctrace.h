@@ -0,0 +1,93 @@
+/*
+ * alloctrace.h - trace file format shared by alloctrace.so and allocreport
+ *
+ * The file is an 8 byte header ("ATRC" and a version) followed by
+ * chunks. Each thread records into its own buffer and writes it out
+ * whole as one chunk, so chunks of different threads are interleaved
+ * in the file but each one is self contained:
+ *
+ *	struct at_chunk, then len bytes of records
+ *
+ * A record is a type and its fields, all as LEB128 varints. Times are
+ * nanoseconds since the previous record of the chunk (the first one
+ * since t0), addresses are zigzag deltas from the previous address of
+ * the chunk, so a typical malloc takes 6-8 bytes instead of 32.
+ *
+ *	AT_MALLOC	dt addr size stack
+ *	AT_FREE		dt addr
+ *	AT_REALLOC	dt addr old size stack	(old relative to addr)
+ *	AT_MMAP		dt addr size stack
+ *	AT_MUNMAP	dt addr size
+ *	AT_STACK	id depth pc...		(pcs as deltas)
+ *	AT_MAPS		len text		(/proc/self/maps at exit)
+ *
+ * Stack ids are defined once per process by whichever thread first
+ * sees the stack, maybe in a later chunk than the first use, so a
+ * reader has to read the whole file before resolving them.
+ */
+#ifndef ALLOCTRACE_H
+#define ALLOCTRACE_H
+
+#include <stdint.h>
+
+#define AT_MAGIC	"ATRC"
+#define AT_VERSION	1
+
+#define AT_MALLOC	0
+#define AT_FREE		1
+#define AT_REALLOC	2
+#define AT_MMAP		3
+#define AT_MUNMAP	4
+#define AT_STACK	5
+#define AT_MAPS		6
+
+#define AT_MAX_DEPTH	64
+#define AT_STACKS	65536		/* stack ids are 1..AT_STACKS, 0 is none */
+
+struct at_header {
+	char magic[4];
+	uint32_t version;
+};
+
+struct at_chunk {
+	uint32_t tid;			/* 0 for the maps chunk */
+	uint32_t len;
+	uint64_t t0;			/* CLOCK_MONOTONIC ns */
+};
+
+static inline unsigned char *at_put(unsigned char *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = (unsigned char)(v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (unsigned char)v;
+	return p;
+}
+
+static inline uint64_t at_zigzag(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t at_unzigzag(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/* Returns the position after the varint, or NULL if it runs past end */
+static inline const unsigned char *at_get(const unsigned char *p,
+					  const unsigned char *end, uint64_t *v)
+{
+	int shift;
+
+	*v = 0;
+	for (shift = 0; shift < 64 && p < end; shift += 7) {
+		*v |= (uint64_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+	}
+	return NULL;
+}
+
+#endif
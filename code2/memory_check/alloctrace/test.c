@@ -0,0 +1,44 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+static void *worker(void *arg)
+{
+	char *keep[64], *p;
+	int i, j;
+
+	for (i = 0; i < 100000; i++) {
+		p = malloc(16 + i % 200);
+		p = realloc(p, 300 + i % 4000);
+		free(p);
+		/* held for a while, and the last 64 never freed */
+		keep[i % 64] = malloc(64);
+		if (i % 64 == 63 && i < 99968)
+			for (j = 0; j < 64; j++)
+				free(keep[j]);
+	}
+	return arg;
+}
+
+int main(void)
+{
+	pthread_t t[4];
+	char *leak;
+	void *m;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		pthread_create(&t[i], NULL, worker, NULL);
+	for (i = 0; i < 4; i++)
+		pthread_join(t[i], NULL);
+
+	/* malloc without free */
+	leak = malloc(1000);
+	strcpy(leak, "leaked");
+
+	m = mmap(NULL, 1 << 20, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	munmap(m, 1 << 20);
+	return 0;
+}
@@ -0,0 +1,5 @@
+gcc -shared -fPIC -O2 -fno-omit-frame-pointer -o alloctrace.so alloctrace.c -ldl -lpthread -lm
+gcc -O2 -o allocreport allocreport.c
+gcc -g -o test test.c -lpthread
+ALLOCTRACE_OUT=trace.out LD_PRELOAD=./alloctrace.so ./test
+./allocreport trace.out
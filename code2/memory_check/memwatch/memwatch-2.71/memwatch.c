@@ -92,6 +92,9 @@
 ** 020918 JLI	[2.69 changed to GPL, added C++ array allocation by Howard Cohen]
 ** 030212 JLI	[2.70 mwMalloc() bug for very large allocations (4GB on 32bits)]
 ** 030520 JLI	[2.71 added ULONG_LONG_MAX as a 64-bit detector (thanks Sami Salonen)]
+** 261019    	[2.72 MW_SCALABLE: per-thread arenas, no SIGSEGV probing]
+**				[fix: pthread mutex is recursive, mwRealloc() no longer self-deadlocks]
+**				[hashed module/line statistics; MW_PROFILE sampling heap profiler]
 */
 
 #define __MEMWATCH_C 1
@@ -126,20 +129,41 @@
 #include <windows.h>
 #endif
 
+#if defined(MW_SCALABLE) && !defined(MW_PTHREADS)
+#define MW_PTHREADS 1
+#endif
+
 #if defined(MW_PTHREADS) || defined(HAVE_PTHREAD_H)
 #define MW_HAVE_MUTEX 1
 #include <pthread.h>
 #endif
 
+#ifdef MW_SCALABLE
+#if !defined(__GNUC__) || !defined(__linux__)
+#error MW_SCALABLE needs gcc (thread-local storage, atomics) and Linux
+#endif
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#ifdef MW_PROFILE
+#if !defined(__GNUC__)
+#error MW_PROFILE needs gcc (__builtin_return_address) and backtrace()
+#endif
+#include <math.h>
+#include <execinfo.h>
+#endif
+
 /***********************************************************************
 ** Defines & other weird stuff
 ***********************************************************************/
 
 /*lint -save -e767 */
-#define VERSION     "2.71"         /* the current version number */
-#define CHKVAL(mw)  (0xFE0180L^(long)mw->count^(long)mw->size^(long)mw->line)
+#define VERSION     "2.72"         /* the current version number */
+#define CHKVAL(mw)  (0xFE0180L^(long)mw->count^(long)mw->size^(long)mw->line^MW_ARENA_NO(mw))
 #define FLUSH()     mwFlush()
-#define TESTS(f,l)  if(mwTestAlways) (void)mwTestNow(f,l,1)
+#define TESTS(f,l)  if(mwTestAlways) { MW_MUTEX_LOCK(); (void)mwTestNow(f,l,1); MW_MUTEX_UNLOCK(); }
 #define PRECHK      0x01234567L
 #define POSTCHK     0x76543210L
 #define mwBUFFER_TO_MW(p) ( (mwData*) (void*) ( ((char*)p)-mwDataSize-mwOverflowZoneSize ) )
@@ -177,6 +201,67 @@
 #define MW_MUTEX_UNLOCK()
 #endif
 
+/*
+** MW_SCALABLE splits the memory chain into MW_ARENAS arenas, each
+** with its own lock. A thread links its allocations into the arena
+** it was given on first use, so threads mostly don't contend at all.
+** The allocation handlers only take the lock of the block's arena
+** (and short-lived locks around the statistics, the free'd-pointer
+** list and the log). Anything that walks the whole chain takes the
+** global mutex, which also locks every arena. mwHead and mwTail are
+** the chain of the arena the thread is currently working on.
+**
+** Without MW_SCALABLE there is a single arena, and the allocation
+** handlers hold the global mutex as they always have.
+*/
+#ifdef MW_SCALABLE
+#ifndef MW_ARENAS
+#define MW_ARENAS			16
+#endif
+#define MW_HOT_LOCK()
+#define MW_HOT_UNLOCK()
+#define MW_ARENA_LOCK(a)	mwArenaLock(a)
+#define MW_ARENA_UNLOCK(a)	mwArenaUnlock(a)
+#define MW_SET_ARENA(a)		(mwCur = (a))
+#define MW_LEAF_LOCK(m)		pthread_mutex_lock( &(m) )
+#define MW_LEAF_UNLOCK(m)	pthread_mutex_unlock( &(m) )
+#define MW_ATOMIC_ADD(v,n)	__sync_add_and_fetch( &(v), (n) )
+#define MW_TLS				__thread
+#define MW_ARENA_NO(mw)		((long)(mw)->arena)
+#define mwHead				(mwCur->head)
+#define mwTail				(mwCur->tail)
+#else
+#define MW_ARENAS			1
+#define MW_HOT_LOCK()		MW_MUTEX_LOCK()
+#define MW_HOT_UNLOCK()		MW_MUTEX_UNLOCK()
+#define MW_ARENA_LOCK(a)	((void)(a))
+#define MW_ARENA_UNLOCK(a)	((void)(a))
+#define MW_SET_ARENA(a)		((void)(a))
+#define MW_LEAF_LOCK(m)
+#define MW_LEAF_UNLOCK(m)
+#define MW_ATOMIC_ADD(v,n)	((v) += (n))
+#define MW_TLS
+#define MW_ARENA_NO(mw)		0L
+#define mwHead				(mwArenas[0].head)
+#define mwTail				(mwArenas[0].tail)
+#endif
+
+/*
+** MW_PROFILE keeps the call stack of a sample of the allocations,
+** about one per mwSampleInterval bytes, and a count of those
+** still in use per stack. The entry points pass down their
+** return address so the stacks can start at the user's code.
+*/
+#ifdef MW_PROFILE
+#define MW_CALLER()					__builtin_return_address(0)
+#define MW_SAMPLE_ALLOC(mw,n,c)		((mw)->stack = mwSampleInterval ? mwSampleAlloc(n,c) : NULL)
+#define MW_SAMPLE_FREE(mw)			if( (mw)->stack ) mwSampleFree( mw )
+#else
+#define MW_CALLER()					NULL
+#define MW_SAMPLE_ALLOC(mw,n,c)
+#define MW_SAMPLE_FREE(mw)
+#endif
+
 /***********************************************************************
 ** If you really, really know what you're doing,
 ** you can predefine these things yourself.
@@ -250,6 +335,19 @@ typedef unsigned short mwDWORD;
 ** Typedefs & structures
 ***********************************************************************/
 
+/* a sampled call stack, with the allocations made from it */
+typedef struct mwStack_ mwStack;
+struct mwStack_ {
+    mwStack*    next;   /* next in hash bucket */
+    unsigned long hash;
+    int         depth;
+    long        inuse;  /* sampled allocations not yet freed */
+    long        inuse_bytes;
+    long        num;    /* all sampled allocations */
+    long        total;
+    void*       pc[MW_PROFILE_DEPTH];
+    };
+
 /* main data holding area, precedes actual allocation */
 typedef struct mwData_ mwData;
 struct mwData_ {
@@ -264,12 +362,19 @@ struct mwData_ {
     size_t      size;   /* size of allocation */
     int         line;   /* line number where allocated */
     unsigned    flag;   /* flag word */
+#ifdef MW_SCALABLE
+    unsigned    arena;  /* index of the arena holding the chain */
+#endif
+#ifdef MW_PROFILE
+    mwStack*    stack;  /* if sampled, where it was allocated */
+#endif
     };
 
 /* statistics structure */
 typedef struct mwStat_ mwStat;
 struct mwStat_ {
     mwStat*     next;   /* next statistic buffer */
+    mwStat*     hnext;  /* next in hash bucket */
     const char* file;
     long        total;  /* total bytes allocated */
     long        num;    /* total number of allocations */
@@ -302,6 +407,16 @@ typedef HANDLE          mwMutex;
 typedef pthread_mutex_t mwMutex;
 #endif
 
+/* one chain of allocations; see MW_SCALABLE */
+typedef struct mwArena_ mwArena;
+struct mwArena_ {
+    mwData*     head;
+    mwData*     tail;
+#ifdef MW_SCALABLE
+    mwMutex     mutex;
+#endif
+    };
+
 /***********************************************************************
 ** Static variables
 ***********************************************************************/
@@ -318,8 +433,7 @@ static long     mwAllocLimit =  0L;
 static int      mwUseLimit =    0;
 
 static long     mwNumCurAlloc = 0L;
-static mwData*  mwHead = 		NULL;
-static mwData*  mwTail = 		NULL;
+static mwArena  mwArenas[MW_ARENAS];
 static int		mwDataSize =	0;
 static unsigned char mwOverflowZoneTemplate[] = "mEmwAtch";
 static int		mwOverflowZoneSize = mwROUNDALLOC;
@@ -340,6 +454,7 @@ static FILE*    mwLogB1 =       NULL;
 static int      mwFlushingB1 =  0;
 
 static mwStat*  mwStatList = NULL;
+static mwStat*  mwStatHash[MW_STAT_HASH];
 static long     mwStatTotAlloc = 0L;
 static long     mwStatMaxAlloc = 0L;
 static long     mwStatNumAlloc = 0L;
@@ -357,6 +472,14 @@ static int      mwLFcur = 0;
 
 static mwMarker* mwFirstMark = NULL;
 
+#ifdef MW_PROFILE
+static long     mwSampleInterval = 0L;
+static MW_TLS long mwSampleLeft = 0L;         /* bytes to the next sample */
+static MW_TLS unsigned long long mwSampleRand = 0ULL;
+static mwStack* mwStackHash[MW_PROFILE_HASH];
+static long     mwStackCount = 0L;
+#endif
+
 static FILE*    mwLogB2 =       NULL;
 static int      mwFlushingB2 =  0;
 
@@ -364,6 +487,16 @@ static int      mwFlushingB2 =  0;
 static mwMutex	mwGlobalMutex;
 #endif
 
+#ifdef MW_SCALABLE
+static mwMutex	mwWriteMutex;       /* mwWrite() and the error counts */
+static mwMutex	mwStatMutex;        /* the statistics list */
+static mwMutex	mwLFMutex;          /* the last-free track */
+static unsigned	mwArenaNext = 0;
+static __thread mwArena* mwCur = mwArenas;     /* chain being worked on */
+static __thread mwArena* mwMine = NULL;        /* chain for our allocations */
+static __thread int mwLockDepth = 0;           /* global mutex nesting */
+#endif
+
 /***********************************************************************
 ** Static function declarations
 ***********************************************************************/
@@ -394,8 +527,20 @@ static unsigned mwDrop_( unsigned kb, int type, int silent );
 static int      mwARI( const char* text );
 static void     mwStatReport( void );
 static mwStat*  mwStatGet( const char*, int, int );
+static unsigned mwStatHashOf( const char*, int );
 static void     mwStatAlloc( size_t, const char*, int );
 static void     mwStatFree( size_t, const char*, int );
+static void     mwStatPeak( long );
+static void*    mwAlloc( size_t, const char*, int, int, void* );
+#ifdef MW_PROFILE
+static mwStack* mwSampleAlloc( size_t, void* );
+static void     mwSampleFree( mwData* );
+static void     mwSampleDrop( void );
+static long     mwSampleNext( void );
+#endif
+static mwArena* mwMyArena( void );
+static mwArena* mwArenaOf( mwData* );
+static int      mwTestArena( const char *file, int line, int *always_invoked );
 static int		mwCheckOF( const void * p );
 static void		mwWriteOF( void * p );
 static char		mwDummy( char c );
@@ -405,6 +550,10 @@ static void		mwMutexTerm( void );
 static void		mwMutexLock( void );
 static void		mwMutexUnlock( void );
 #endif
+#ifdef MW_SCALABLE
+static void		mwArenaLock( mwArena* );
+static void		mwArenaUnlock( mwArena* );
+#endif
 
 /***********************************************************************
 ** System functions
@@ -434,6 +583,7 @@ void mwInit( void ) {
 
     /* initialize the statistics */
     mwStatList = NULL;
+    memset( mwStatHash, 0, sizeof(mwStatHash) );
     mwStatTotAlloc = 0L;
     mwStatCurAlloc = 0L;
     mwStatMaxAlloc = 0L;
@@ -519,7 +669,7 @@ void mwAbort( void ) {
     mwMarker *mrk;
     char *data;
     time_t tid;
-    int c, i, j;
+    int c, i, j, a;
 	int errors;
 
     tid = time( NULL );
@@ -541,66 +691,74 @@ void mwAbort( void ) {
         mwErrors ++;
         }
 
+#ifdef MW_PROFILE
+    /* what's still allocated is the interesting part */
+    if( mwSampleInterval ) (void) mwProfileDump( "memwatch.heap" );
+#endif
+
     /* release all still allocated memory */
-	errors = 0;
-    while( mwHead != NULL && errors < 3 ) {
-		if( !mwIsOwned(mwHead, __FILE__, __LINE__ ) ) {
-			if( errors < 3 )
-			{
-				errors ++;
-				mwWrite( "internal: NML/unfreed scan restarting\n" );
+    for( a=0; a<MW_ARENAS; a++ ) {
+		MW_SET_ARENA( &mwArenas[a] );
+		errors = 0;
+        while( mwHead != NULL && errors < 3 ) {
+			if( !mwIsOwned(mwHead, __FILE__, __LINE__ ) ) {
+				if( errors < 3 )
+				{
+					errors ++;
+					mwWrite( "internal: NML/unfreed scan restarting\n" );
+					FLUSH();
+					mwHead = mwHead;
+					continue;
+				}
+				mwWrite( "internal: NML/unfreed scan aborted, heap too damaged\n" );
 				FLUSH();
-				mwHead = mwHead;
-				continue;
-			}
-			mwWrite( "internal: NML/unfreed scan aborted, heap too damaged\n" );
-			FLUSH();
-			break;
-			}
-        mwFlushW(0);
-        if( !(mwHead->flag & MW_NML) ) {
-            mwErrors++;
-            data = ((char*)mwHead)+mwDataSize;
-            mwWrite( "unfreed: <%ld> %s(%d), %ld bytes at %p ",
-                mwHead->count, mwHead->file, mwHead->line, (long)mwHead->size, data+mwOverflowZoneSize );
-            if( mwCheckOF( data ) ) {
-                mwWrite( "[underflowed] ");
-                FLUSH();
-                }
-            if( mwCheckOF( (data+mwOverflowZoneSize+mwHead->size) ) ) {
-                mwWrite( "[overflowed] ");
-                FLUSH();
-                }
-            mwWrite( " \t{" );
-            j = 16; if( mwHead->size < 16 ) j = (int) mwHead->size;
-            for( i=0;i<16;i++ ) {
-                if( i<j ) mwWrite( "%02X ",
-                    (unsigned char) *(data+mwOverflowZoneSize+i) );
-                else mwWrite( ".. " );
-                }
-            for( i=0;i<j;i++ ) {
-                c = *(data+mwOverflowZoneSize+i);
-                if( c < 32 || c > 126 ) c = '.';
-                mwWrite( "%c", c );
-                }
-            mwWrite( "}\n" );
-			mw = mwHead;
-			mwUnlink( mw, __FILE__, __LINE__ );
-            free( mw );
-            }
-        else {
-            data = ((char*)mwHead) + mwDataSize + mwOverflowZoneSize;
-            if( mwTestMem( data, mwHead->size, MW_VAL_NML ) ) {
+				break;
+				}
+            mwFlushW(0);
+            if( !(mwHead->flag & MW_NML) ) {
                 mwErrors++;
-                mwWrite( "wild pointer: <%ld> NoMansLand %p alloc'd at %s(%d)\n",
-                    mwHead->count, data + mwOverflowZoneSize, mwHead->file, mwHead->line );
-                FLUSH();
+                data = ((char*)mwHead)+mwDataSize;
+                mwWrite( "unfreed: <%ld> %s(%d), %ld bytes at %p ",
+                    mwHead->count, mwHead->file, mwHead->line, (long)mwHead->size, data+mwOverflowZoneSize );
+                if( mwCheckOF( data ) ) {
+                    mwWrite( "[underflowed] ");
+                    FLUSH();
+                    }
+                if( mwCheckOF( (data+mwOverflowZoneSize+mwHead->size) ) ) {
+                    mwWrite( "[overflowed] ");
+                    FLUSH();
+                    }
+                mwWrite( " \t{" );
+                j = 16; if( mwHead->size < 16 ) j = (int) mwHead->size;
+                for( i=0;i<16;i++ ) {
+                    if( i<j ) mwWrite( "%02X ",
+                        (unsigned char) *(data+mwOverflowZoneSize+i) );
+                    else mwWrite( ".. " );
+                    }
+                for( i=0;i<j;i++ ) {
+                    c = *(data+mwOverflowZoneSize+i);
+                    if( c < 32 || c > 126 ) c = '.';
+                    mwWrite( "%c", c );
+                    }
+                mwWrite( "}\n" );
+				mw = mwHead;
+				mwUnlink( mw, __FILE__, __LINE__ );
+                free( mw );
+                }
+            else {
+                data = ((char*)mwHead) + mwDataSize + mwOverflowZoneSize;
+                if( mwTestMem( data, mwHead->size, MW_VAL_NML ) ) {
+                    mwErrors++;
+                    mwWrite( "wild pointer: <%ld> NoMansLand %p alloc'd at %s(%d)\n",
+                        mwHead->count, data + mwOverflowZoneSize, mwHead->file, mwHead->line );
+                    FLUSH();
+                    }
+				mwNmlNumAlloc --;
+				mwNmlCurAlloc -= mwHead->size;
+				mw = mwHead;
+				mwUnlink( mw, __FILE__, __LINE__ );
+                free( mw );
                 }
-			mwNmlNumAlloc --;
-			mwNmlCurAlloc -= mwHead->size;
-			mw = mwHead;
-			mwUnlink( mw, __FILE__, __LINE__ );
-            free( mw );
             }
         }
 
@@ -610,9 +768,12 @@ void mwAbort( void ) {
     /* report statistics */
     mwStatReport();
     FLUSH();
+#ifdef MW_PROFILE
+    mwSampleDrop();
+#endif
 
     mwInited = 0;
-    mwHead = mwTail = NULL;
+    for( a=0; a<MW_ARENAS; a++ ) mwArenas[a].head = mwArenas[a].tail = NULL;
     if( mwErrors )
         fprintf(mwSTDERR,"MEMWATCH detected %ld anomalies\n",mwErrors);
     mwLogFile( NULL );
@@ -646,6 +807,95 @@ void mwStatistics( int level )
 	}
 }
 
+void mwProfile( long interval )
+{
+    mwAutoInit();
+#ifdef MW_PROFILE
+    if( interval<0 ) interval=0;
+    if( mwSampleInterval != interval )
+    {
+		if( interval ) mwWrite( "profile: sampling every %ld bytes\n", interval );
+		else mwWrite( "profile: sampling off\n" );
+	    mwSampleInterval = interval;
+	}
+#else
+    if( interval )
+		mwWrite( "profile: not available, compile memwatch.c with MW_PROFILE\n" );
+#endif
+}
+
+/*
+** Written in the heap profile format of gperftools, which pprof
+** reads: 'pprof prog memwatch.heap' for the sites still holding
+** the most memory, '-sample_index=alloc_space' for the heaviest
+** allocators. pprof scales the samples back up by the interval.
+*/
+int mwProfileDump( const char *filename )
+{
+#ifdef MW_PROFILE
+    FILE *fp, *maps;
+    mwStack *st;
+    long inuse = 0L, inuse_bytes = 0L, num = 0L, total = 0L;
+    char buf[512];
+    size_t n;
+    int i, j;
+
+    mwAutoInit();
+    fp = fopen( filename, "w" );
+    if( fp == NULL )
+    {
+		mwWrite( "profile: can't write '%s'\n", filename );
+		return 0;
+	}
+
+	MW_LEAF_LOCK( mwStatMutex );
+    for( i=0; i<MW_PROFILE_HASH; i++ ) {
+        for( st = mwStackHash[i]; st != NULL; st = st->next ) {
+            inuse += st->inuse;
+            inuse_bytes += st->inuse_bytes;
+            num += st->num;
+            total += st->total;
+            }
+        }
+    fprintf( fp, "heap profile: %6ld: %8ld [%6ld: %8ld] @ heap_v2/%ld\n",
+        inuse, inuse_bytes, num, total, mwSampleInterval );
+    for( i=0; i<MW_PROFILE_HASH; i++ ) {
+        for( st = mwStackHash[i]; st != NULL; st = st->next ) {
+            fprintf( fp, "%6ld: %8ld [%6ld: %8ld] @",
+                st->inuse, st->inuse_bytes, st->num, st->total );
+            for( j=0; j<st->depth; j++ )
+                fprintf( fp, " 0x%lx", (unsigned long) (size_t) st->pc[j] );
+            fprintf( fp, "\n" );
+            }
+        }
+	MW_LEAF_UNLOCK( mwStatMutex );
+
+    /* pprof needs the mappings to find the symbols */
+    fprintf( fp, "\nMAPPED_LIBRARIES:\n" );
+    maps = fopen( "/proc/self/maps", "r" );
+    if( maps != NULL )
+    {
+		while( (n = fread( buf, 1, sizeof(buf), maps )) > 0 )
+			fwrite( buf, 1, n, fp );
+		fclose( maps );
+	}
+
+    i = ferror( fp );
+    if( fclose( fp ) || i )
+    {
+		mwWrite( "profile: error writing '%s'\n", filename );
+		return 0;
+	}
+    mwWrite( "profile: %ld stacks written to %s\n", mwStackCount, filename );
+    return 1;
+#else
+    mwAutoInit();
+    mwWrite( "profile: not available, compile memwatch.c with MW_PROFILE\n" );
+    (void) filename;
+    return 0;
+#endif
+}
+
 void mwAutoCheck( int onoff ) {
     mwAutoInit();
     mwTestAlways = onoff;
@@ -683,9 +933,14 @@ static int mwCheckOF( const void *p )
 }
 
 int mwTest( const char *file, int line, int items ) {
+    int retv;
+
     mwAutoInit();
+	MW_MUTEX_LOCK();
     mwTestFlags = items;
-    return mwTestNow( file, line, 0 );
+    retv = mwTestNow( file, line, 0 );
+	MW_MUTEX_UNLOCK();
+    return retv;
     }
 
 /*
@@ -694,16 +949,23 @@ int mwTest( const char *file, int line, int items ) {
 */
 int mwTestBuffer( const char *file, int line, void *p ) {
     mwData* mw;
+    mwArena *arena;
+    int retv = 1;
 
     mwAutoInit();
+	MW_MUTEX_LOCK();
 
     /* do the quick ownership test */
     mw = (mwData*) mwBUFFER_TO_MW( p );
+    arena = mwArenaOf( mw );
+	MW_ARENA_LOCK( arena );
 
     if( mwIsOwned( mw, file, line ) ) {
-        return mwTestBuf( mw, file, line );
+        retv = mwTestBuf( mw, file, line );
 		}
-	return 1;
+	MW_ARENA_UNLOCK( arena );
+	MW_MUTEX_UNLOCK();
+	return retv;
 	}
 
 void mwBreakOut( const char* cause ) {
@@ -861,38 +1123,54 @@ void mwSetAriFunc( int (*func)(const char *) ) {
 ***********************************************************************/
 
 void* mwMalloc( size_t size, const char* file, int line) {
-    size_t needed;
+    return mwAlloc( size, file, line, 1, MW_CALLER() );
+    }
+
+/*
+** mwAlloc does the work for all the allocating entry points.
+** mwRealloc() gets around the allocation limit with it, checking
+** the size difference itself. 'caller' is the return address
+** into the user's code, for the profiler.
+*/
+static void* mwAlloc( size_t size, const char* file, int line, int limited, void *caller ) {
+    size_t needed, freed;
     mwData *mw;
+    mwArena *arena;
     char *ptr;
     void *p;
+    long count;
 
     mwAutoInit();
 
-	MW_MUTEX_LOCK();
+	MW_HOT_LOCK();
 
     TESTS(file,line);
 
-    mwCounter ++;
+    count = (long) MW_ATOMIC_ADD( mwCounter, 1 );
     needed = mwDataSize + mwOverflowZoneSize*2 + size;
     if( needed < size )
     {
     	/* theoretical case: req size + mw overhead exceeded size_t limits */
+		MW_HOT_UNLOCK();
     	return NULL;
     }
 
     /* if this allocation would violate the limit, fail it */
-    if( mwUseLimit && ((long)size + mwStatCurAlloc > mwAllocLimit) ) {
+    if( limited && mwUseLimit && ((long)size + mwStatCurAlloc > mwAllocLimit) ) {
         mwWrite( "limit fail: <%ld> %s(%d), %ld wanted %ld available\n",
-            mwCounter, file, line, (long)size, mwAllocLimit - mwStatCurAlloc );
+            count, file, line, (long)size, mwAllocLimit - mwStatCurAlloc );
         mwIncErr();
         FLUSH();
-		MW_MUTEX_UNLOCK();
+		MW_HOT_UNLOCK();
         return NULL;
         }
 
     mw = (mwData*) malloc( needed );
     if( mw == NULL ) {
-        if( mwFreeUp(needed,0) >= needed ) {
+		MW_MUTEX_LOCK();
+		freed = mwFreeUp(needed,0);
+		MW_MUTEX_UNLOCK();
+        if( freed >= needed ) {
             mw = (mwData*) malloc(needed);
             if( mw == NULL ) {
                 mwWrite( "internal: mwFreeUp(%u) reported success, but malloc() fails\n", needed );
@@ -902,26 +1180,26 @@ void* mwMalloc( size_t size, const char* file, int line) {
             }
         if( mw == NULL ) {
             mwWrite( "fail: <%ld> %s(%d), %ld wanted %ld allocated\n",
-                mwCounter, file, line, (long)size, mwStatCurAlloc );
+                count, file, line, (long)size, mwStatCurAlloc );
             mwIncErr();
             FLUSH();
-			MW_MUTEX_UNLOCK();
+			MW_HOT_UNLOCK();
             return NULL;
             }
         }
 
-    mw->count = mwCounter;
+    arena = mwMyArena();
+    mw->count = count;
     mw->prev = NULL;
-    mw->next = mwHead;
     mw->file = file;
     mw->size = size;
     mw->line = line;
     mw->flag = 0;
+#ifdef MW_SCALABLE
+    mw->arena = (unsigned) (arena - mwArenas);
+#endif
     mw->check = CHKVAL(mw);
-
-    if( mwHead ) mwHead->prev = mw;
-    mwHead = mw;
-    if( mwTail == NULL ) mwTail = mw;
+    MW_SAMPLE_ALLOC( mw, size, caller );
 
     ptr = ((char*)mw) + mwDataSize;
 	mwWriteOF( ptr ); /* '*(long*)ptr = PRECHK;' */
@@ -931,33 +1209,42 @@ void* mwMalloc( size_t size, const char* file, int line) {
     ptr += size;
     mwWriteOF( ptr ); /* '*(long*)ptr = POSTCHK;' */
 
-    mwNumCurAlloc ++;
-    mwStatCurAlloc += (long) size;
-    mwStatTotAlloc += (long) size;
-    if( mwStatCurAlloc > mwStatMaxAlloc )
-        mwStatMaxAlloc = mwStatCurAlloc;
-    mwStatNumAlloc ++;
+	MW_ARENA_LOCK( arena );
+    mw->next = mwHead;
+    if( mwHead ) mwHead->prev = mw;
+    mwHead = mw;
+    if( mwTail == NULL ) mwTail = mw;
+	MW_ARENA_UNLOCK( arena );
+
+    MW_ATOMIC_ADD( mwNumCurAlloc, 1 );
+    mwStatPeak( MW_ATOMIC_ADD( mwStatCurAlloc, (long) size ) );
+    MW_ATOMIC_ADD( mwStatTotAlloc, (long) size );
+    MW_ATOMIC_ADD( mwStatNumAlloc, 1 );
 
     if( mwStatLevel ) mwStatAlloc( size, file, line );
 
-	MW_MUTEX_UNLOCK();
+	MW_HOT_UNLOCK();
     return p;
     }
 
 void* mwRealloc( void *p, size_t size, const char* file, int line) {
-    int oldUseLimit, i;
+    int i;
+    size_t oldsize;
     mwData *mw;
+    mwArena *arena;
     char *ptr;
 
     mwAutoInit();
 
-    if( p == NULL ) return mwMalloc( size, file, line );
+    if( p == NULL ) return mwAlloc( size, file, line, 1, MW_CALLER() );
     if( size == 0 ) { mwFree( p, file, line ); return NULL; }
 
-	MW_MUTEX_LOCK();
+	MW_HOT_LOCK();
 
     /* do the quick ownership test */
     mw = (mwData*) mwBUFFER_TO_MW( p );
+    arena = mwArenaOf( mw );
+	MW_ARENA_LOCK( arena );
     if( mwIsOwned( mw, file, line ) ) {
 
 		/* if the buffer is an NML, treat this as a double-free */
@@ -969,41 +1256,43 @@ void* mwRealloc( void *p, size_t size, const char* file, int line) {
 				mwWrite( "internal: <%ld> %s(%d), no-mans-land MW-%p is corrupted\n",
 					mwCounter, file, line, mw );
 			}
+			MW_ARENA_UNLOCK( arena );
 			goto check_dbl_free;
 		}
+        oldsize = mw->size;
+		MW_ARENA_UNLOCK( arena );
 
         /* if this allocation would violate the limit, fail it */
-        if( mwUseLimit && ((long)size + mwStatCurAlloc - (long)mw->size > mwAllocLimit) ) {
+        if( mwUseLimit && ((long)size + mwStatCurAlloc - (long)oldsize > mwAllocLimit) ) {
             TESTS(file,line);
-            mwCounter ++;
+            MW_ATOMIC_ADD( mwCounter, 1 );
             mwWrite( "limit fail: <%ld> %s(%d), %ld wanted %ld available\n",
-                mwCounter, file, line, (unsigned long)size - mw->size, mwAllocLimit - mwStatCurAlloc );
+                mwCounter, file, line, (unsigned long)size - oldsize, mwAllocLimit - mwStatCurAlloc );
             mwIncErr();
             FLUSH();
-			MW_MUTEX_UNLOCK();
+			MW_HOT_UNLOCK();
             return NULL;
             }
 
         /* fake realloc operation */
-        oldUseLimit = mwUseLimit;
-        mwUseLimit = 0;
-        ptr = (char*) mwMalloc( size, file, line );
+        ptr = (char*) mwAlloc( size, file, line, 0, MW_CALLER() );
         if( ptr != NULL ) {
-            if( size < mw->size )
+            if( size < oldsize )
                 memcpy( ptr, p, size );
             else
-                memcpy( ptr, p, mw->size );
+                memcpy( ptr, p, oldsize );
             mwFree( p, file, line );
             }
-        mwUseLimit = oldUseLimit;
-		MW_MUTEX_UNLOCK();
+		MW_HOT_UNLOCK();
         return (void*) ptr;
         }
+	MW_ARENA_UNLOCK( arena );
 
     /* Unknown pointer! */
 
     /* using free'd pointer? */
 check_dbl_free:
+	MW_LEAF_LOCK( mwLFMutex );
     for(i=0;i<MW_FREE_LIST;i++) {
         if( mwLastFree[i] == p ) {
             mwIncErr();
@@ -1012,17 +1301,19 @@ check_dbl_free:
                 mwCounter, file, line, p,
                 mwLFfile[i], mwLFline[i] );
             FLUSH();
-			MW_MUTEX_UNLOCK();
+			MW_LEAF_UNLOCK( mwLFMutex );
+			MW_HOT_UNLOCK();
             return NULL;
             }
         }
+	MW_LEAF_UNLOCK( mwLFMutex );
 
     /* some weird pointer */
     mwIncErr();
     mwWrite( "realloc: <%ld> %s(%d), unknown pointer %p\n",
         mwCounter, file, line, p );
     FLUSH();
-	MW_MUTEX_UNLOCK();
+	MW_HOT_UNLOCK();
     return NULL;
     }
 
@@ -1030,53 +1321,55 @@ char *mwStrdup( const char* str, const char* file, int line ) {
     size_t len;
     char *newstring;
 
-	MW_MUTEX_LOCK();
+	MW_HOT_LOCK();
 
     if( str == NULL ) {
         mwIncErr();
         mwWrite( "strdup: <%ld> %s(%d), strdup(NULL) called\n",
             mwCounter, file, line );
         FLUSH();
-		MW_MUTEX_UNLOCK();
+		MW_HOT_UNLOCK();
         return NULL;
         }
 
     len = strlen( str ) + 1;
-    newstring = (char*) mwMalloc( len, file, line );
+    newstring = (char*) mwAlloc( len, file, line, 1, MW_CALLER() );
     if( newstring != NULL ) memcpy( newstring, str, len );
-	MW_MUTEX_UNLOCK();
+	MW_HOT_UNLOCK();
     return newstring;
     }
 
 void mwFree( void* p, const char* file, int line ) {
     int i;
     mwData* mw;
+    mwArena *arena;
     char buffer[ sizeof(mwData) + (mwROUNDALLOC*3) + 64 ];
 
     /* this code is in support of C++ delete */
     if( file == NULL ) {
         mwFree_( p );
-		MW_MUTEX_UNLOCK();
         return;
         }
 
     mwAutoInit();
 
-	MW_MUTEX_LOCK();
+	MW_HOT_LOCK();
     TESTS(file,line);
-    mwCounter ++;
+    MW_ATOMIC_ADD( mwCounter, 1 );
 
     /* on NULL free, write a warning and return */
     if( p == NULL ) {
         mwWrite( "NULL free: <%ld> %s(%d), NULL pointer free'd\n",
             mwCounter, file, line );
         FLUSH();
-		MW_MUTEX_UNLOCK();
+		MW_HOT_UNLOCK();
         return;
         }
 
     /* do the quick ownership test */
     mw = (mwData*) mwBUFFER_TO_MW( p );
+    arena = mwArenaOf( mw );
+	MW_ARENA_LOCK( arena );
 
     if( mwIsOwned( mw, file, line ) ) {
         (void) mwTestBuf( mw, file, line );
@@ -1089,24 +1382,28 @@ void mwFree( void* p, const char* file, int line ) {
 				mwWrite( "internal: <%ld> %s(%d), no-mans-land MW-%p is corrupted\n",
 					mwCounter, file, line, mw );
 			}
+			MW_ARENA_UNLOCK( arena );
 			goto check_dbl_free;
 		}
 
         /* update the statistics */
-        mwNumCurAlloc --;
-        mwStatCurAlloc -= (long) mw->size;
+        MW_ATOMIC_ADD( mwNumCurAlloc, -1 );
+        MW_ATOMIC_ADD( mwStatCurAlloc, -(long) mw->size );
         if( mwStatLevel ) mwStatFree( mw->size, mw->file, mw->line );
+        MW_SAMPLE_FREE( mw );
 
         /* we should either free the allocation or keep it as NML */
         if( mwNML ) {
             mw->flag |= MW_NML;
-			mwNmlNumAlloc ++;
-			mwNmlCurAlloc += (long) mw->size;
+			MW_ATOMIC_ADD( mwNmlNumAlloc, 1 );
+			MW_ATOMIC_ADD( mwNmlCurAlloc, (long) mw->size );
             memset( ((char*)mw)+mwDataSize+mwOverflowZoneSize, MW_VAL_NML, mw->size );
+			MW_ARENA_UNLOCK( arena );
             }
         else {
             /* unlink the allocation, and enter the post-free data */
             mwUnlink( mw, file, line );
+			MW_ARENA_UNLOCK( arena );
             memset( mw, MW_VAL_DEL,
                 mw->size + mwDataSize+mwOverflowZoneSize+mwOverflowZoneSize );
             if( mwFBI ) {
@@ -1118,17 +1415,21 @@ void mwFree( void* p, const char* file, int line ) {
             }
 
         /* add the pointer to the last-free track */
+		MW_LEAF_LOCK( mwLFMutex );
         mwLFfile[ mwLFcur ] = file;
         mwLFline[ mwLFcur ] = line;
         mwLastFree[ mwLFcur++ ] = p;
         if( mwLFcur == MW_FREE_LIST ) mwLFcur = 0;
+		MW_LEAF_UNLOCK( mwLFMutex );
 
-		MW_MUTEX_UNLOCK();
+		MW_HOT_UNLOCK();
         return;
         }
+	MW_ARENA_UNLOCK( arena );
 
     /* check for double-freeing */
 check_dbl_free:
+	MW_LEAF_LOCK( mwLFMutex );
     for(i=0;i<MW_FREE_LIST;i++) {
         if( mwLastFree[i] == p ) {
             mwIncErr();
@@ -1137,54 +1438,48 @@ check_dbl_free:
                 mwCounter, file, line, p,
                 mwLFfile[i], mwLFline[i] );
             FLUSH();
-			MW_MUTEX_UNLOCK();
+			MW_LEAF_UNLOCK( mwLFMutex );
+			MW_HOT_UNLOCK();
             return;
             }
         }
+	MW_LEAF_UNLOCK( mwLFMutex );
 
     /* some weird pointer... block the free */
     mwIncErr();
     mwWrite( "WILD free: <%ld> %s(%d), unknown pointer %p\n",
         mwCounter, file, line, p );
     FLUSH();
-	MW_MUTEX_UNLOCK();
+	MW_HOT_UNLOCK();
     return;
     }
 
 void* mwCalloc( size_t a, size_t b, const char *file, int line ) {
     void *p;
     size_t size = a * b;
-    p = mwMalloc( size, file, line );
+    p = mwAlloc( size, file, line, 1, MW_CALLER() );
     if( p == NULL ) return NULL;
     memset( p, 0, size );
     return p;
     }
 
 void mwFree_( void *p ) {
-	MW_MUTEX_LOCK();
     TESTS(NULL,0);
-	MW_MUTEX_UNLOCK();
     free(p);
     }
 
 void* mwMalloc_( size_t size ) {
-	MW_MUTEX_LOCK();
     TESTS(NULL,0);
-	MW_MUTEX_UNLOCK();
     return malloc( size );
     }
 
 void* mwRealloc_( void *p, size_t size ) {
-	MW_MUTEX_LOCK();
     TESTS(NULL,0);
-	MW_MUTEX_UNLOCK();
     return realloc( p, size );
     }
 
 void* mwCalloc_( size_t a, size_t b ) {
-	MW_MUTEX_LOCK();
     TESTS(NULL,0);
-	MW_MUTEX_UNLOCK();
     return calloc( a, b );
     }
 
@@ -1555,9 +1850,11 @@ static void mwFlushW( int n ) {
     }
 
 static void mwIncErr() {
+	MW_LEAF_LOCK( mwWriteMutex );
     mwErrors++;
     mwFlushW( mwFlushR()+1 );
     FLUSH();
+	MW_LEAF_UNLOCK( mwWriteMutex );
     }
 
 static void mwFlush() {
@@ -1703,7 +2000,9 @@ static int mwRelink( mwData* mw, const char* file, int line ) {
 
     /* restore MW info where possible */
     if( mwIsReadAddr( mw->file, 1 ) ) {
+		MW_LEAF_LOCK( mwStatMutex );
         ms = mwStatGet( mw->file, -1, 0 );
+		MW_LEAF_UNLOCK( mwStatMutex );
         if( ms == NULL ) mw->file = "<relinked>";
         }
     mw->check = CHKVAL(mw);
@@ -1939,7 +2238,9 @@ static int mwIsOwned( mwData* mw, const char *file, int line ) {
                 mwCounter, file, line, mw );
             mwIncErr();
             if( mwIsReadAddr( mw->file, 1 ) ) {
+				MW_LEAF_LOCK( mwStatMutex );
                 ms = mwStatGet( mw->file, -1, 0 );
+				MW_LEAF_UNLOCK( mwStatMutex );
                 if( ms == NULL ) mw->file = "<relinked>";
                 }
             else mw->file = "<unknown>";
@@ -2046,6 +2347,7 @@ static void mwWrite( const char *format, ... ) {
     int tot, oflow = 0;
     va_list mark;
     mwAutoInit();
+	MW_LEAF_LOCK( mwWriteMutex );
     if( mwOutFunction == NULL ) mwOutFunction = mwDefaultOutFunc;
     va_start( mark, format );
     tot = vsprintf( mwPrintBuf, format, mark );
@@ -2057,6 +2359,7 @@ static void mwWrite( const char *format, ... ) {
         mwWrite( "\ninternal: mwWrite(): WARNING! OUTPUT EXCEEDED %u CHARS: SYSTEM UNSTABLE\n", MW_TRACE_BUFFER-1 );
         FLUSH();
         }
+	MW_LEAF_UNLOCK( mwWriteMutex );
     return;
     }
 
@@ -2083,6 +2386,7 @@ static size_t mwFreeUp( size_t needed, int urgent ) {
     void *p;
     mwData *mw, *mw2;
     char *data;
+    int a;
 
     /* free grabbed NML memory */
     for(;;) {
@@ -2094,24 +2398,27 @@ static size_t mwFreeUp( size_t needed, int urgent ) {
         }
 
     /* free normal NML memory */
-    mw = mwHead;
-    while( mw != NULL ) {
-        if( !(mw->flag & MW_NML) ) mw = mw->next;
-        else {
-            data = ((char*)mw)+mwDataSize+mwOverflowZoneSize;
-            if( mwTestMem( data, mw->size, MW_VAL_NML ) ) {
-                mwIncErr();
-                mwWrite( "wild pointer: <%ld> NoMansLand %p alloc'd at %s(%d)\n",
-                    mw->count, data + mwOverflowZoneSize, mw->file, mw->line );
+    for( a=0; a<MW_ARENAS; a++ ) {
+		MW_SET_ARENA( &mwArenas[a] );
+        mw = mwHead;
+        while( mw != NULL ) {
+            if( !(mw->flag & MW_NML) ) mw = mw->next;
+            else {
+                data = ((char*)mw)+mwDataSize+mwOverflowZoneSize;
+                if( mwTestMem( data, mw->size, MW_VAL_NML ) ) {
+                    mwIncErr();
+                    mwWrite( "wild pointer: <%ld> NoMansLand %p alloc'd at %s(%d)\n",
+                        mw->count, data + mwOverflowZoneSize, mw->file, mw->line );
+                    }
+                mw2 = mw->next;
+                mwUnlink( mw, "mwFreeUp", 0 );
+                free( mw );
+                mw = mw2;
+                p = malloc( needed );
+                if( p == NULL ) continue;
+                free( p );
+                return needed;
                 }
-            mw2 = mw->next;
-            mwUnlink( mw, "mwFreeUp", 0 );
-            free( mw );
-            mw = mw2;
-            p = malloc( needed );
-            if( p == NULL ) continue;
-            free( p );
-            return needed;
             }
         }
 
@@ -2149,12 +2456,11 @@ static int mwStrCmpI( const char *s1, const char *s2 ) {
     return 0;
     }
 
-#define AIPH() if( always_invoked ) { mwWrite("autocheck: <%ld> %s(%d) ", mwCounter, file, line ); always_invoked = 0; }
+#define AIPH() if( *always_invoked ) { mwWrite("autocheck: <%ld> %s(%d) ", mwCounter, file, line ); *always_invoked = 0; }
 
 static int mwTestNow( const char *file, int line, int always_invoked ) {
     int retv = 0;
-    mwData *mw;
-    char *data;
+    int a;
 
     if( file && !always_invoked )
         mwWrite("check: <%ld> %s(%d), checking %s%s%s\n",
@@ -2164,6 +2470,22 @@ static int mwTestNow( const char *file, int line, int always_invoked ) {
 		    (mwTestFlags & MW_TEST_NML) ? "nomansland ": ""
 			);
 
+    for( a=0; a<MW_ARENAS; a++ ) {
+		MW_SET_ARENA( &mwArenas[a] );
+        retv += mwTestArena( file, line, &always_invoked );
+        }
+
+	if( file && !always_invoked && !retv )
+        mwWrite("check: <%ld> %s(%d), complete; no errors\n",
+            mwCounter, file, line );
+    return retv;
+    }
+
+static int mwTestArena( const char *file, int line, int *always_invoked ) {
+    int retv = 0;
+    mwData *mw;
+    char *data;
+
     if( mwTestFlags & MW_TEST_CHAIN ) {
         for( mw = mwHead; mw; mw=mw->next ) {
 			if( !mwIsSafeAddr(mw, mwDataSize) ) {
@@ -2226,10 +2548,6 @@ static int mwTestNow( const char *file, int line, int always_invoked ) {
             }
         }
 
-
-	if( file && !always_invoked && !retv )
-        mwWrite("check: <%ld> %s(%d), complete; no errors\n",
-            mwCounter, file, line );
     return retv;
     }
 
@@ -2285,12 +2603,26 @@ static void mwStatReport()
 	}
 }
 
+/*
+** Statistics are hashed on the file name's text, not its address:
+** the same name can be at different addresses in different modules.
+*/
+static unsigned mwStatHashOf( const char *file, int line ) {
+    unsigned long h = 2166136261UL;
+    if( file != NULL )
+        while( *file ) h = (h ^ (unsigned char) *file++) * 16777619UL;
+    h ^= (unsigned long) line * 2654435761UL;
+    return (unsigned) (h ^ (h >> 15)) & (MW_STAT_HASH-1);
+    }
+
 static mwStat* mwStatGet( const char *file, int line, int makenew ) {
     mwStat* ms;
+    unsigned bucket;
 
     if( mwStatLevel < 2 ) line = -1;
 
-    for( ms=mwStatList; ms!=NULL; ms=ms->next ) {
+    bucket = mwStatHashOf( file, line );
+    for( ms=mwStatHash[bucket]; ms!=NULL; ms=ms->hnext ) {
         if( line != ms->line ) continue;
         if( file==NULL ) {
             if( ms->file == NULL ) break;
@@ -2306,8 +2638,13 @@ static mwStat* mwStatGet( const char *file, int line, int makenew ) {
 
     ms = (mwStat*) malloc( sizeof(mwStat) );
     if( ms == NULL ) {
+#ifdef MW_SCALABLE
+		/* can't walk the chains from here; an arena may be locked */
+        {
+#else
         if( mwFreeUp( sizeof(mwStat), 0 ) < sizeof(mwStat) ||
             (ms=(mwStat*)malloc(sizeof(mwStat))) == NULL ) {
+#endif
             mwWrite("internal: memory low, statistics incomplete for '%s'\n", file );
             return NULL;
             }
@@ -2320,12 +2657,16 @@ static mwStat* mwStatGet( const char *file, int line, int makenew ) {
     ms->curr = 0L;
     ms->next = mwStatList;
     mwStatList = ms;
+    ms->hnext = mwStatHash[bucket];
+    mwStatHash[bucket] = ms;
     return ms;
     }
 
 static void mwStatAlloc( size_t size, const char* file, int line ) {
     mwStat* ms;
 
+	MW_LEAF_LOCK( mwStatMutex );
+
     /* update the module statistics */
     ms = mwStatGet( file, -1, 1 );
     if( ms != NULL ) {
@@ -2346,11 +2687,14 @@ static void mwStatAlloc( size_t size, const char* file, int line ) {
             }
         }
 
+	MW_LEAF_UNLOCK( mwStatMutex );
     }
 
 static void mwStatFree( size_t size, const char* file, int line ) {
     mwStat* ms;
 
+	MW_LEAF_LOCK( mwStatMutex );
+
     /* update the module statistics */
     ms = mwStatGet( file, -1, 1 );
     if( ms != NULL ) ms->curr -= (long) size;
@@ -2360,8 +2704,115 @@ static void mwStatFree( size_t size, const char* file, int line ) {
         ms = mwStatGet( file, line, 1 );
         if( ms != NULL ) ms->curr -= (long) size;
         }
+
+	MW_LEAF_UNLOCK( mwStatMutex );
+    }
+
+/* track the peak of mwStatCurAlloc, given its new value */
+static void mwStatPeak( long curr ) {
+#ifdef MW_SCALABLE
+    long max;
+    while( curr > (max = mwStatMaxAlloc) )
+        if( __sync_bool_compare_and_swap( &mwStatMaxAlloc, max, curr ) ) break;
+#else
+    if( curr > mwStatMaxAlloc ) mwStatMaxAlloc = curr;
+#endif
+    }
+
+/**********************************************************************
+** Sampling profiler
+**********************************************************************/
+
+#ifdef MW_PROFILE
+
+/*
+** Sample intervals are exponentially distributed, so each byte
+** allocated has the same chance of being sampled. That is what
+** pprof assumes when it scales heap_v2 profiles back up.
+*/
+static long mwSampleNext( void ) {
+    double u;
+    if( mwSampleRand == 0 )
+        mwSampleRand = ((unsigned long long) (size_t) &mwSampleLeft ^ (unsigned long long) time( NULL )) | 1;
+    mwSampleRand ^= mwSampleRand >> 12;
+    mwSampleRand ^= mwSampleRand << 25;
+    mwSampleRand ^= mwSampleRand >> 27;
+    u = (double) ((mwSampleRand * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+    return (long) (-log( 1.0 - u ) * (double) mwSampleInterval) + 1;
+    }
+
+static mwStack* mwSampleAlloc( size_t size, void *caller ) {
+    void *pc[MW_PROFILE_DEPTH+8];
+    int depth, first, i;
+    unsigned long h;
+    mwStack *st, **bucket;
+
+    if( mwSampleLeft == 0 ) mwSampleLeft = mwSampleNext();
+    mwSampleLeft -= (long) size;
+    if( mwSampleLeft > 0 ) return NULL;
+    mwSampleLeft = mwSampleNext();
+
+    /* drop memwatch's own frames, the stack starts at the user's call */
+    depth = backtrace( pc, MW_PROFILE_DEPTH+8 );
+    for( first=0; first<depth && pc[first]!=caller; first++ ) ;
+    if( first == depth ) first = 0;
+    depth -= first;
+    if( depth > MW_PROFILE_DEPTH ) depth = MW_PROFILE_DEPTH;
+
+    h = (unsigned long) depth;
+    for( i=0; i<depth; i++ )
+        h = (h ^ (unsigned long) (size_t) pc[first+i]) * 16777619UL;
+    bucket = &mwStackHash[ (h ^ (h >> 17)) & (MW_PROFILE_HASH-1) ];
+
+	MW_LEAF_LOCK( mwStatMutex );
+    for( st = *bucket; st != NULL; st = st->next )
+        if( st->hash == h && st->depth == depth &&
+            !memcmp( st->pc, pc+first, depth * sizeof(void*) ) ) break;
+    if( st == NULL ) {
+        st = (mwStack*) malloc( sizeof(mwStack) );
+        if( st == NULL ) {
+			MW_LEAF_UNLOCK( mwStatMutex );
+            return NULL;
+            }
+        st->hash = h;
+        st->depth = depth;
+        memcpy( st->pc, pc+first, depth * sizeof(void*) );
+        st->inuse = st->inuse_bytes = st->num = st->total = 0L;
+        st->next = *bucket;
+        *bucket = st;
+        mwStackCount ++;
+        }
+    st->inuse ++;
+    st->inuse_bytes += (long) size;
+    st->num ++;
+    st->total += (long) size;
+	MW_LEAF_UNLOCK( mwStatMutex );
+    return st;
+    }
+
+static void mwSampleFree( mwData *mw ) {
+	MW_LEAF_LOCK( mwStatMutex );
+    mw->stack->inuse --;
+    mw->stack->inuse_bytes -= (long) mw->size;
+	MW_LEAF_UNLOCK( mwStatMutex );
+    mw->stack = NULL;
+    }
+
+static void mwSampleDrop( void ) {
+    mwStack *st, *st2;
+    int i;
+    for( i=0; i<MW_PROFILE_HASH; i++ ) {
+        for( st = mwStackHash[i]; st != NULL; st = st2 ) {
+            st2 = st->next;
+            free( st );
+            }
+        mwStackHash[i] = NULL;
+        }
+    mwStackCount = 0L;
     }
 
+#endif /* MW_PROFILE */
+
 /***********************************************************************
 ** Safe memory checkers
 **
@@ -2397,6 +2848,132 @@ int mwIsSafeAddr( void *p, unsigned len )
 #endif /* WIN32 */
 #endif /* MW_SAFEADDR */
 
+#ifndef MW_SAFEADDR
+#ifdef MW_SCALABLE
+#define MW_SAFEADDR
+
+/*
+** Catching SIGSEGV doesn't work with threads: the handler is
+** process-wide and a fault in one thread would longjmp() with
+** another thread's jmp_buf. Instead, keep a copy of the mappings
+** from /proc/self/maps, read again whenever an address isn't in
+** it or lacks the access asked for. Mappings can go away as well
+** as appear, so ranges the copy approves are also checked with
+** the kernel; if that check isn't allowed (seccomp) the copy
+** alone decides.
+*/
+
+#ifndef MW_VMA_MAX
+#define MW_VMA_MAX      2048
+#endif
+#define MW_VMA_READ     1
+#define MW_VMA_WRITE    2
+
+typedef struct mwVma_ mwVma;
+struct mwVma_ {
+    unsigned long   start;
+    unsigned long   end;
+    int             prot;
+    };
+
+static mwVma    mwVmaMap[MW_VMA_MAX];
+static int      mwVmaCount = 0;
+static int      mwVmaNoProbe = 0;
+static pthread_rwlock_t mwVmaLock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void mwVmaLoad( void )
+{
+    FILE *fp;
+    char line[512], perms[8];
+    unsigned long start, end;
+
+    mwVmaCount = 0;
+    fp = fopen( "/proc/self/maps", "r" );
+    if( fp == NULL ) return;
+    while( mwVmaCount < MW_VMA_MAX && fgets( line, sizeof(line), fp ) != NULL ) {
+        if( sscanf( line, "%lx-%lx %7s", &start, &end, perms ) != 3 ) continue;
+        mwVmaMap[mwVmaCount].start = start;
+        mwVmaMap[mwVmaCount].end = end;
+        mwVmaMap[mwVmaCount].prot =
+            (perms[0] == 'r' ? MW_VMA_READ : 0) | (perms[1] == 'w' ? MW_VMA_WRITE : 0);
+        mwVmaCount ++;
+        /* a line longer than the buffer: skip the rest of it */
+        while( strchr( line, '\n' ) == NULL && fgets( line, sizeof(line), fp ) != NULL )
+            ;
+        }
+    fclose( fp );
+}
+
+/* nonzero if [lo,hi) is covered by mappings with all of 'prot' */
+static int mwVmaCovers( unsigned long lo, unsigned long hi, int prot )
+{
+    int first = 0, last = mwVmaCount, mid;
+
+    /* find the first mapping ending above lo */
+    while( first < last ) {
+        mid = (first + last) / 2;
+        if( mwVmaMap[mid].end <= lo ) first = mid + 1;
+        else last = mid;
+        }
+    for( ; first < mwVmaCount; first++ ) {
+        if( mwVmaMap[first].start > lo ) return 0;
+        if( (mwVmaMap[first].prot & prot) != prot ) return 0;
+        if( mwVmaMap[first].end >= hi ) return 1;
+        lo = mwVmaMap[first].end;
+        }
+    return 0;
+}
+
+/*
+** Is [lo,hi) still mapped? msync() fails with ENOMEM if it isn't,
+** and with MS_ASYNC it does nothing else: a VMA lookup in the kernel,
+** cheaper than the two signal() calls it replaces.
+*/
+static int mwVmaProbe( unsigned long lo, unsigned long hi )
+{
+    unsigned long page = (unsigned long) sysconf( _SC_PAGESIZE );
+
+    if( mwVmaNoProbe ) return 1;
+    lo &= ~(page-1);
+    if( msync( (void*) lo, hi - lo, MS_ASYNC ) == 0 ) return 1;
+    if( errno == ENOMEM ) return 0;
+    mwVmaNoProbe = 1;
+    return 1;
+}
+
+static int mwVmaCheck( const void *p, unsigned len, int prot )
+{
+    unsigned long lo = (unsigned long) p, hi = lo + len;
+    int ok;
+
+    if( p == NULL ) return 0;
+    if( !len ) return 1;
+    if( hi < lo ) return 0;
+
+    pthread_rwlock_rdlock( &mwVmaLock );
+    ok = mwVmaCovers( lo, hi, prot );
+    pthread_rwlock_unlock( &mwVmaLock );
+    if( !ok ) {
+        /* new mapping, or a bad pointer: look again to find out */
+        pthread_rwlock_wrlock( &mwVmaLock );
+        mwVmaLoad();
+        ok = mwVmaCovers( lo, hi, prot );
+        pthread_rwlock_unlock( &mwVmaLock );
+        }
+    return ok && mwVmaProbe( lo, hi );
+}
+
+int mwIsReadAddr( const void *p, unsigned len )
+{
+    return mwVmaCheck( p, len, MW_VMA_READ );
+}
+int mwIsSafeAddr( void *p, unsigned len )
+{
+    return mwVmaCheck( p, len, MW_VMA_READ|MW_VMA_WRITE );
+}
+#endif /* MW_SCALABLE */
+#endif /* MW_SAFEADDR */
+
 #ifndef MW_SAFEADDR
 #ifdef SIGSEGV
 #define MW_SAFEADDR
@@ -2539,32 +3116,131 @@ static void	mwMutexUnlock( void )
 
 #if defined(MW_PTHREADS) || defined(HAVE_PTHREAD_H)
 
+/*
+** The global mutex is recursive, like the Win32 one: mwRealloc()
+** and mwStrdup() allocate and free with it held.
+*/
 static void	mwMutexInit( void )
 {
-	pthread_mutex_init( &mwGlobalMutex, NULL );
+	pthread_mutexattr_t attr;
+#ifdef MW_SCALABLE
+	int i;
+#endif
+	pthread_mutexattr_init( &attr );
+	pthread_mutexattr_settype( &attr, PTHREAD_MUTEX_RECURSIVE );
+	pthread_mutex_init( &mwGlobalMutex, &attr );
+#ifdef MW_SCALABLE
+	pthread_mutex_init( &mwWriteMutex, &attr );
+	pthread_mutex_init( &mwStatMutex, NULL );
+	pthread_mutex_init( &mwLFMutex, NULL );
+	for( i=0; i<MW_ARENAS; i++ )
+		pthread_mutex_init( &mwArenas[i].mutex, NULL );
+#endif
+	pthread_mutexattr_destroy( &attr );
 	return;
 }
 
 static void	mwMutexTerm( void )
 {
+#ifdef MW_SCALABLE
+	int i;
+	for( i=0; i<MW_ARENAS; i++ )
+		pthread_mutex_destroy( &mwArenas[i].mutex );
+	pthread_mutex_destroy( &mwLFMutex );
+	pthread_mutex_destroy( &mwStatMutex );
+	pthread_mutex_destroy( &mwWriteMutex );
+#endif
 	pthread_mutex_destroy( &mwGlobalMutex );
 	return;
 }
 
 static void	mwMutexLock( void )
 {
+#ifdef MW_SCALABLE
+	int i;
+#endif
 	pthread_mutex_lock(&mwGlobalMutex);
+#ifdef MW_SCALABLE
+	/* the outermost lock also stops all allocation handlers */
+	if( mwLockDepth++ == 0 )
+		for( i=0; i<MW_ARENAS; i++ )
+			pthread_mutex_lock( &mwArenas[i].mutex );
+#endif
 	return;
 }
 
 static void	mwMutexUnlock( void )
 {
+#ifdef MW_SCALABLE
+	int i;
+	if( --mwLockDepth == 0 )
+		for( i=MW_ARENAS-1; i>=0; i-- )
+			pthread_mutex_unlock( &mwArenas[i].mutex );
+#endif
 	pthread_mutex_unlock(&mwGlobalMutex);
 	return;
 }
 
 #endif
 
+/**********************************************************************
+** Arenas
+**********************************************************************/
+
+#ifdef MW_SCALABLE
+
+/*
+** With the global mutex held all arenas are locked already;
+** otherwise lock just the one. Either way, mwHead and mwTail
+** refer to it afterwards.
+*/
+static void	mwArenaLock( mwArena *arena )
+{
+	if( !mwLockDepth ) pthread_mutex_lock( &arena->mutex );
+	mwCur = arena;
+	return;
+}
+
+static void	mwArenaUnlock( mwArena *arena )
+{
+	if( !mwLockDepth ) pthread_mutex_unlock( &arena->mutex );
+	return;
+}
+
+/* threads are handed arenas round-robin on their first allocation */
+static mwArena* mwMyArena( void )
+{
+	if( mwMine == NULL )
+		mwMine = &mwArenas[ __sync_fetch_and_add( &mwArenaNext, 1 ) % MW_ARENAS ];
+	return mwMine;
+}
+
+/*
+** The arena a block claims to be in. If the header can't be
+** trusted, any arena will do: mwIsOwned() will reject it.
+*/
+static mwArena* mwArenaOf( mwData *mw )
+{
+	if( !mwIsSafeAddr( mw, mwDataSize ) || mw->arena >= MW_ARENAS )
+		return mwArenas;
+	return &mwArenas[ mw->arena ];
+}
+
+#else
+
+static mwArena* mwMyArena( void )
+{
+	return mwArenas;
+}
+
+static mwArena* mwArenaOf( mwData *mw )
+{
+	(void) mw;
+	return mwArenas;
+}
+
+#endif
+
 /**********************************************************************
 ** C++ new & delete
 **********************************************************************/
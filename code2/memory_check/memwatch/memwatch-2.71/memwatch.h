@@ -377,6 +377,9 @@ extern "C" {
 */
 #define MW_TRACE_BUFFER 2048    /* (min 160) size of TRACE()'s output buffer */
 #define MW_FREE_LIST    64      /* (min 4) number of free()'s to track */
+#define MW_STAT_HASH    1024    /* (power of 2) buckets for module/line statistics */
+#define MW_PROFILE_DEPTH 32     /* frames kept per sampled allocation stack */
+#define MW_PROFILE_HASH 4096    /* (power of 2) buckets for sampled stacks */
 
 /*
 ** Exported variables
@@ -436,6 +439,13 @@ void  mwAbort( void );
 **      is used. Slows down performance, of course.
 **  - mwCalcCheck() calculates checksums for all data buffers. Slow!
 **  - mwDumpCheck() logs buffers where stored & calc'd checksums differ. Slow!!
+**  - mwProfile() samples about one allocation per 'interval' bytes
+**      allocated, and records its call stack. Zero turns sampling off.
+**      Only available if memwatch.c was compiled with MW_PROFILE
+**      (gcc & glibc; link with -lm).
+**  - mwProfileDump() writes the sampled allocations that are still in
+**      use as a heap profile that pprof reads; at exit, the profile is
+**      also written to "memwatch.heap". Returns nonzero on success.
 **  - mwMark() sets a generic marker. Returns the pointer given.
 **  - mwUnmark() removes a generic marker. If, at the end of execution, some
 **      markers are still in existence, these will be reported as leakage.
@@ -452,6 +462,8 @@ void        mwFreeBufferInfo( int onoff );
 void        mwAutoCheck( int onoff );
 void        mwCalcCheck( void );
 void        mwDumpCheck( void );
+void        mwProfile( long interval );
+int         mwProfileDump( const char *filename );
 void *      mwMark( void *p, const char *description, const char *file, unsigned line );
 void *      mwUnmark( void *p, const char *file, unsigned line );
 
@@ -625,6 +637,8 @@ extern void mwDummyTraceFunction(const char *,...);
 #define mwDefaultAri()
 #define mwNomansland()
 #define mwStatistics(f)
+#define mwProfile(n)
+#define mwProfileDump(f)    0
 #define mwMark(p,t,f,n)     (p)
 #define mwUnmark(p,f,n)     (p)
 #define mwMalloc(n,f,l)     malloc(n)
@@ -0,0 +1,72 @@
+
+/*
+**  Stress test for the thread-safe modes: threads allocate and
+**  free while the main thread checks the whole heap, and each
+**  thread checks its own buffers, over and over. Build with
+**  "make test_threads" (MW_SCALABLE) or with -DMW_PTHREADS
+**  instead. memwatch must not crash, and should report no
+**  errors in memwatch.log.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "memwatch.h"
+
+#ifndef MEMWATCH
+#error "You really, really don't want to run this without memwatch. Trust me."
+#endif
+
+#define THREADS		8
+#define ROUNDS		20000
+#define SLOTS		64
+
+static void *worker( void *arg )
+{
+	char *slot[SLOTS];
+	unsigned seed = (unsigned)(long) arg;
+	int i, n;
+
+	memset( slot, 0, sizeof(slot) );
+	for( i=0; i<ROUNDS; i++ )
+	{
+		seed = seed * 1103515245 + 12345;
+		n = (seed >> 16) % SLOTS;
+		if( slot[n] != NULL )
+		{
+			if( (i & 15) == 0 ) CHECK_BUFFER( slot[n] );
+			if( (i & 1023) == 0 ) CHECK();
+			free( slot[n] );
+			slot[n] = NULL;
+		}
+		else
+		{
+			slot[n] = malloc( 16 + (seed >> 8) % 512 );
+			if( slot[n] != NULL ) memset( slot[n], 'x', 16 );
+		}
+	}
+	for( n=0; n<SLOTS; n++ )
+		if( slot[n] != NULL ) free( slot[n] );
+	return NULL;
+}
+
+int main()
+{
+	pthread_t thread[THREADS];
+	int i, checks = 0;
+
+	mwInit();
+	for( i=0; i<THREADS; i++ )
+		pthread_create( &thread[i], NULL, worker, (void*)(long)(i + 1) );
+	for( i=0; i<THREADS; i++ )
+	{
+		while( pthread_tryjoin_np( thread[i], NULL ) != 0 )
+		{
+			CHECK();
+			checks++;
+		}
+	}
+	printf( "%d heap checks while %d threads ran\n", checks, THREADS );
+	mwTerm();
+	return 0;
+}
@@ -0,0 +1,434 @@
+//
+// a load generator for echoserver
+//
+// Opens connections from a few threads, each with its own epoll
+// set, and has every connection send a message, wait for all of it
+// to come back and do it again, at once or after an interval. The
+// connections are opened a few hundred at a time per thread, so a
+// big run doesn't overflow the server's accept queue; the
+// measurement starts once all of them are up. It reports the
+// request rate and latency percentiles.
+//
+// One client address can only have ~28000 connections (the local
+// port range) to one server address; for more, spread them over
+// several local addresses with -b, e.g. -b 127.0.0.2:8 on loopback.
+//
+// build: g++ -O2 -pthread -o echoload echoload.cpp
+// usage: echoload [-h host] [-p port] [-c conns] [-t threads] [-m size]
+//                 [-r interval_ms] [-d seconds] [-b addr:count]
+//
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+#define MAX_EVENTS      512
+#define MAX_CONNECTING  256             // connects in flight per thread
+#define HIST_SUB        16              // histogram buckets per power of 2
+#define HIST_SIZE       (64 * HIST_SUB)
+
+struct client_s;
+struct lconn_s
+{
+    int fd;
+    int status; // 0: unused/dead, 1: connecting, 2: up
+    size_t toSend, toRecv; // of the current message
+    long sentAt; // ns
+    long dueAt; // ns, when waiting out the interval
+    lconn_s *next; // interval queue
+};
+struct client_s
+{
+    int id;
+    pthread_t thread;
+    int epollFd;
+    lconn_s *conns;
+    int count; // connections to open
+    int opened, connecting;
+    long up, failed, dropped;
+    long requests;
+    long hist[HIST_SIZE]; // latency, ns, log-linear buckets
+    lconn_s *waitHead, *waitTail; // in due order: the interval is fixed
+} __attribute__((aligned(64)));
+
+sockaddr_in g_Server;
+in_addr_t g_Source; // host order, 0 for any
+int g_Sources = 1;
+size_t g_Size = 64;
+long g_Interval; // ns between a reply and the next request
+char *g_Message;
+volatile int g_Measure, g_Stop;
+
+long NowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+int HistBucket(long ns)
+{
+    if(ns < HIST_SUB)
+        return ns < 0 ? 0 : ns;
+    int bits = 63 - __builtin_clzl(ns); // >= log2(HIST_SUB)
+    int shift = bits - 4; // HIST_SUB == 1 << 4
+    return (shift + 1) * HIST_SUB + ((ns >> shift) & (HIST_SUB - 1));
+}
+long HistValue(int bucket)
+{
+    if(bucket < HIST_SUB)
+        return bucket;
+    int shift = bucket / HIST_SUB - 1;
+    return (long)(HIST_SUB + bucket % HIST_SUB) << shift;
+}
+void CloseConn(client_s *cl, lconn_s *c)
+{
+    close(c->fd);
+    if(c->status == 1)
+        cl->connecting--;
+    c->status = 0;
+}
+// start the next message, or send more of this one
+void SendMore(client_s *cl, lconn_s *c)
+{
+    while(c->toSend > 0)
+    {
+        ssize_t len = send(c->fd, g_Message + g_Size - c->toSend, c->toSend, MSG_NOSIGNAL);
+        if(len < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if(errno == EINTR)
+                continue;
+            cl->dropped++;
+            CloseConn(cl, c);
+            return;
+        }
+        c->toSend -= len;
+    }
+}
+void StartRequest(client_s *cl, lconn_s *c)
+{
+    c->toSend = c->toRecv = g_Size;
+    c->sentAt = NowNs();
+    SendMore(cl, c);
+}
+void RecvData(client_s *cl, lconn_s *c, char *buf, size_t size)
+{
+    while(c->status == 2)
+    {
+        ssize_t len = recv(c->fd, buf, size, 0);
+        if(len < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if(errno == EINTR)
+                continue;
+        }
+        if(len <= 0 || (size_t)len > c->toRecv)
+        {
+            cl->dropped++; // closed, failed or garbled
+            CloseConn(cl, c);
+            return;
+        }
+        c->toRecv -= len;
+        if(c->toRecv > 0)
+            continue;
+        long now = NowNs();
+        if(g_Measure)
+        {
+            cl->requests++;
+            cl->hist[HistBucket(now - c->sentAt)]++;
+        }
+        if(g_Interval == 0)
+            StartRequest(cl, c);
+        else
+        {
+            c->dueAt = now + g_Interval;
+            c->next = NULL;
+            if(cl->waitTail == NULL)
+                cl->waitHead = c;
+            else
+                cl->waitTail->next = c;
+            cl->waitTail = c;
+            return;
+        }
+    }
+}
+// open connections until MAX_CONNECTING are in flight
+void OpenMore(client_s *cl)
+{
+    while(cl->opened < cl->count && cl->connecting < MAX_CONNECTING)
+    {
+        lconn_s *c = &cl->conns[cl->opened];
+        int index = cl->opened++;
+        c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if(c->fd < 0)
+        {
+            cl->failed++;
+            continue;
+        }
+        int one = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if(g_Source != 0)
+        {
+            sockaddr_in sin;
+            memset(&sin, 0, sizeof(sin));
+            sin.sin_family = AF_INET;
+            sin.sin_addr.s_addr = htonl(g_Source + (index + cl->id) % g_Sources);
+            // pick the port at connect time, per destination
+            setsockopt(c->fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+            if(bind(c->fd, (const sockaddr*)&sin, sizeof(sin)) < 0)
+            {
+                close(c->fd);
+                cl->failed++;
+                continue;
+            }
+        }
+        if(connect(c->fd, (const sockaddr*)&g_Server, sizeof(g_Server)) < 0
+            && errno != EINPROGRESS)
+        {
+            close(c->fd);
+            cl->failed++;
+            continue;
+        }
+        struct epoll_event epv = {0, {0}};
+        epv.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        epv.data.ptr = c;
+        if(epoll_ctl(cl->epollFd, EPOLL_CTL_ADD, c->fd, &epv) < 0)
+        {
+            close(c->fd);
+            cl->failed++;
+            continue;
+        }
+        c->status = 1;
+        cl->connecting++;
+    }
+}
+void *ClientRun(void *arg)
+{
+    client_s *cl = (client_s*)arg;
+    struct epoll_event events[MAX_EVENTS];
+    char *buf = (char*)malloc(65536);
+    if(buf == NULL)
+        return NULL;
+    OpenMore(cl);
+    while(!g_Stop)
+    {
+        int timeout = 100;
+        if(cl->waitHead != NULL)
+        {
+            long wait = (cl->waitHead->dueAt - NowNs()) / 1000000;
+            timeout = wait < 0 ? 0 : wait < timeout ? wait : timeout;
+        }
+        int fds = epoll_wait(cl->epollFd, events, MAX_EVENTS, timeout);
+        for(int i = 0; i < fds; i++)
+        {
+            lconn_s *c = (lconn_s*)events[i].data.ptr;
+            uint32_t ev = events[i].events;
+            if(c->status == 0)
+                continue;
+            if(c->status == 1)
+            {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if(err != 0 || (ev & (EPOLLERR | EPOLLHUP)))
+                {
+                    CloseConn(cl, c);
+                    cl->failed++;
+                    continue;
+                }
+                if(!(ev & EPOLLOUT))
+                    continue;
+                cl->connecting--;
+                cl->up++;
+                c->status = 2;
+                StartRequest(cl, c);
+                continue;
+            }
+            if(ev & (EPOLLERR | EPOLLHUP))
+            {
+                cl->dropped++;
+                CloseConn(cl, c);
+                continue;
+            }
+            if(ev & EPOLLOUT)
+                SendMore(cl, c);
+            if(c->status == 2 && (ev & (EPOLLIN | EPOLLRDHUP)))
+                RecvData(cl, c, buf, 65536);
+        }
+        long now = NowNs();
+        while(cl->waitHead != NULL && cl->waitHead->dueAt <= now)
+        {
+            lconn_s *c = cl->waitHead;
+            cl->waitHead = c->next;
+            if(cl->waitHead == NULL)
+                cl->waitTail = NULL;
+            if(c->status == 2)
+                StartRequest(cl, c);
+        }
+        OpenMore(cl);
+    }
+    free(buf);
+    return NULL;
+}
+void Stop(int sig)
+{
+    g_Stop = 1;
+}
+int main(int argc, char **argv)
+{
+    const char *host = "127.0.0.1";
+    int port = 12345, conns = 1000, threads = 1, seconds = 10, opt;
+    long interval = 0;
+    while((opt = getopt(argc, argv, "h:p:c:t:m:r:d:b:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'h': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'c': conns = atoi(optarg); break;
+        case 't': threads = atoi(optarg); break;
+        case 'm': g_Size = atol(optarg); break;
+        case 'r': interval = atol(optarg); break;
+        case 'd': seconds = atoi(optarg); break;
+        case 'b':
+        {
+            char *colon = strchr(optarg, ':');
+            if(colon != NULL)
+            {
+                *colon = '\0';
+                g_Sources = atoi(colon + 1);
+            }
+            struct in_addr a;
+            if(inet_pton(AF_INET, optarg, &a) != 1 || g_Sources < 1)
+            {
+                fprintf(stderr, "%s: bad source address\n", argv[0]);
+                return 1;
+            }
+            g_Source = ntohl(a.s_addr);
+            break;
+        }
+        default:
+            fprintf(stderr, "usage: %s [-h host] [-p port] [-c conns] [-t threads] [-m size]\n"
+                "       [-r interval_ms] [-d seconds] [-b addr:count]\n", argv[0]);
+            return 1;
+        }
+    }
+    memset(&g_Server, 0, sizeof(g_Server));
+    g_Server.sin_family = AF_INET;
+    g_Server.sin_port = htons(port);
+    if(inet_pton(AF_INET, host, &g_Server.sin_addr) != 1 || conns < 1
+        || threads < 1 || g_Size < 1 || interval < 0 || seconds < 1)
+    {
+        fprintf(stderr, "%s: bad arguments\n", argv[0]);
+        return 1;
+    }
+    if(threads > conns)
+        threads = conns;
+    g_Interval = interval * 1000000;
+    g_Message = (char*)malloc(g_Size);
+    if(g_Message == NULL)
+        return 1;
+    for(size_t i = 0; i < g_Size; i++)
+        g_Message[i] = 'a' + i % 26;
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, Stop);
+
+    client_s *clients;
+    if(posix_memalign((void**)&clients, 64, threads * sizeof(client_s)) != 0)
+        return 1;
+    memset(clients, 0, threads * sizeof(client_s));
+    for(int i = 0; i < threads; i++)
+    {
+        client_s *cl = &clients[i];
+        cl->id = i;
+        cl->count = conns / threads + (i < conns % threads);
+        cl->conns = (lconn_s*)calloc(cl->count, sizeof(lconn_s));
+        cl->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if(cl->conns == NULL || cl->epollFd < 0
+            || pthread_create(&cl->thread, NULL, ClientRun, cl) != 0)
+        {
+            fprintf(stderr, "%s: can't start client thread\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // wait for every connection to be up or failed, then measure
+    long start = NowNs(), up = 0, failed = 0;
+    while(!g_Stop)
+    {
+        up = failed = 0;
+        for(int i = 0; i < threads; i++)
+        {
+            up += __atomic_load_n(&clients[i].up, __ATOMIC_RELAXED);
+            failed += __atomic_load_n(&clients[i].failed, __ATOMIC_RELAXED);
+        }
+        if(up + failed >= conns || NowNs() - start > 60000000000L)
+            break;
+        usleep(10000);
+    }
+    printf("connections: %ld up, %ld failed in %.2f s\n", up, failed,
+        (NowNs() - start) / 1e9);
+    fflush(stdout);
+    g_Measure = 1;
+    start = NowNs();
+    for(int i = 0; i < seconds * 10 && !g_Stop; i++)
+        usleep(100000);
+    g_Measure = 0;
+    double elapsed = (NowNs() - start) / 1e9;
+    g_Stop = 1;
+
+    long requests = 0, dropped = 0;
+    static long hist[HIST_SIZE];
+    for(int i = 0; i < threads; i++)
+    {
+        pthread_join(clients[i].thread, NULL);
+        requests += clients[i].requests;
+        dropped += clients[i].dropped;
+        for(int b = 0; b < HIST_SIZE; b++)
+            hist[b] += clients[i].hist[b];
+    }
+    printf("requests: %ld in %.2f s, %.0f/s, %.1f MB/s each way, %ld connections dropped\n",
+        requests, elapsed, requests / elapsed, requests * g_Size / elapsed / 1e6, dropped);
+    if(requests > 0)
+    {
+        const double pct[] = {50, 90, 99, 99.9, 100};
+        long seen = 0;
+        int p = 0;
+        printf("latency us:");
+        for(int b = 0; b < HIST_SIZE && p < 5; b++)
+        {
+            seen += hist[b];
+            while(p < 5 && seen >= requests * pct[p] / 100)
+            {
+                // report the top of the bucket
+                printf(" p%g %.1f", pct[p], HistValue(b + 1) / 1000.0);
+                p++;
+            }
+        }
+        printf("\n");
+    }
+    return 0;
+}
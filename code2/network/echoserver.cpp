@@ -1,227 +1,681 @@
-//   
-// a simple echo server using epoll in linux  
-//   
-// 2009-11-05  
-// by sparkling  
-//   
-#include <sys/socket.h>  
-#include <sys/epoll.h>  
-#include <netinet/in.h>  
-#include <arpa/inet.h>  
-#include <fcntl.h>  
-#include <unistd.h>  
-#include <stdio.h>  
-#include <errno.h>  
+//
+// a multi-reactor echo server using epoll in linux
+//
+// 2009-11-05
+// by sparkling
+//
+// One reactor per processor: a thread with its own epoll set, its
+// own listening socket and its own connections. The listening
+// sockets share the port with SO_REUSEPORT, so the kernel spreads
+// new connections over the reactors and they never share
+// anything; a connection lives and dies on the reactor that
+// accepted it.
+//
+// Connections are registered once, edge triggered for both
+// directions, and never modified: a reader reads until EAGAIN, a
+// writer writes until EAGAIN and EPOLLOUT tells it when to go on.
+// Connection objects and buffer chunks come from per-reactor slabs
+// and free lists. Data sits in chains of chunks, read with readv
+// and written with sendmsg, so a handler can pass what it got
+// straight through without copying (echo just moves the input
+// chain to the output chain). Idle connections are closed by a
+// timing wheel with one-second slots, which costs nothing per
+// event: activity just stamps the connection, and the wheel looks
+// at the stamp when the slot comes round.
+//
+// build: g++ -O2 -pthread -o echoserver echoserver.cpp
+// usage: echoserver [-p port] [-t threads] [-i idle_seconds] [-s stat_seconds]
+//
+// For 100k connections raise the hard limit on open files
+// (ulimit -Hn), and net.core.somaxconn for bursts of connects.
+//
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sched.h>
+#include <stdio.h>
+#include <errno.h>
 #include <stdlib.h>
-#include <strings.h>
 #include <string.h>
-#include <iostream>  
-using namespace std;  
-#define MAX_EVENTS 500  
-struct myevent_s  
-{  
-    int fd;  
-    void (*call_back)(int fd, int events, void *arg);  
-    int events;  
-    void *arg;  
-    int status; // 1: in epoll wait list, 0 not in  
-    char buff[128]; // recv data buffer  
-    int len;  
-    long last_active; // last active time  
-};  
-// set event  
-void EventSet(myevent_s *ev, int fd, void (*call_back)(int, int, void*), void *arg)  
-{  
-    ev->fd = fd;  
-    ev->call_back = call_back;  
-    ev->events = 0;  
-    ev->arg = arg;  
-    ev->status = 0;  
-    ev->last_active = time(NULL);  
-}  
-// add/mod an event to epoll  
-void EventAdd(int epollFd, int events, myevent_s *ev)  
-{  
-    struct epoll_event epv = {0, {0}};  
-    int op;  
-    epv.data.ptr = ev;  
-    epv.events = ev->events = events;  
-    if(ev->status == 1){  
-        op = EPOLL_CTL_MOD;  
-    }  
-    else{  
-        op = EPOLL_CTL_ADD;  
-        ev->status = 1;  
-    }  
-    if(epoll_ctl(epollFd, op, ev->fd, &epv) < 0)  
-        printf("Event Add failed[fd=%d]/n", ev->fd);  
-    else  
-        printf("Event Add OK[fd=%d]/n", ev->fd);  
-}  
-// delete an event from epoll  
-void EventDel(int epollFd, myevent_s *ev)  
-{  
-    struct epoll_event epv = {0, {0}};  
-    if(ev->status != 1) return;  
-    epv.data.ptr = ev;  
-    ev->status = 0;  
-    epoll_ctl(epollFd, EPOLL_CTL_DEL, ev->fd, &epv);  
-}  
-int g_epollFd;  
-myevent_s g_Events[MAX_EVENTS+1]; // g_Events[MAX_EVENTS] is used by listen fd  
-void RecvData(int fd, int events, void *arg);  
-void SendData(int fd, int events, void *arg);  
-// accept new connections from clients  
-void AcceptConn(int fd, int events, void *arg)  
-{  
-    struct sockaddr_in sin;  
-    socklen_t len = sizeof(struct sockaddr_in);  
-    int nfd, i;  
-    // accept  
-    if((nfd = accept(fd, (struct sockaddr*)&sin, &len)) == -1)  
-    {  
-        if(errno != EAGAIN && errno != EINTR)  
-        {  
-            printf("%s: bad accept", __func__);  
-        }  
-        return;  
-    }  
-    do  
-    {  
-        for(i = 0; i < MAX_EVENTS; i++)  
-        {  
-            if(g_Events[i].status == 0)  
-            {  
-                break;  
-            }  
-        }  
-        if(i == MAX_EVENTS)  
-        {  
-            printf("%s:max connection limit[%d].", __func__, MAX_EVENTS);  
-            break;  
-        }  
-        // set nonblocking  
-        if(fcntl(nfd, F_SETFL, O_NONBLOCK) < 0) break;  
-        // add a read event for receive data  
-        EventSet(&g_Events[i], nfd, RecvData, &g_Events[i]);  
-        EventAdd(g_epollFd, EPOLLIN|EPOLLET, &g_Events[i]);  
-        printf("new conn[%s:%d][time:%d]\n", inet_ntoa(sin.sin_addr), ntohs(sin.sin_port), g_Events[i].last_active);  
-    }while(0);  
-}  
-// receive data  
-void RecvData(int fd, int events, void *arg)  
-{  
-    struct myevent_s *ev = (struct myevent_s*)arg;  
-    int len;  
-    // receive data  
-    len = recv(fd, ev->buff, sizeof(ev->buff)-1, 0);    
-    EventDel(g_epollFd, ev);  
-    if(len > 0)  
-    {  
-        ev->len = len;  
-        ev->buff[len] = '/0';  
-        printf("C[%d]:%s\n", fd, ev->buff);  
-        // change to send event  
-        EventSet(ev, fd, SendData, ev);  
-        EventAdd(g_epollFd, EPOLLOUT|EPOLLET, ev);  
-    }  
-    else if(len == 0)  
-    {  
-        close(ev->fd);  
-        printf("[fd=%d] closed gracefully.\n", fd);  
-    }  
-    else  
-    {  
-        close(ev->fd);  
-        printf("recv[fd=%d] error[%d]:%s\n", fd, errno, strerror(errno));  
-    }  
-}  
-// send data  
-void SendData(int fd, int events, void *arg)  
-{  
-    struct myevent_s *ev = (struct myevent_s*)arg;  
-    int len;  
-    // send data  
-    len = send(fd, ev->buff, ev->len, 0);  
-    ev->len = 0;  
-    EventDel(g_epollFd, ev);  
-    if(len > 0)  
-    {  
-        // change to receive event  
-        EventSet(ev, fd, RecvData, ev);  
-        EventAdd(g_epollFd, EPOLLIN|EPOLLET, ev);  
-    }  
-    else  
-    {  
-        close(ev->fd);  
-        printf("recv[fd=%d] error[%d]\n", fd, errno);  
-    }  
-}  
-void InitListenSocket(int epollFd, short port)  
-{  
-    int listenFd = socket(AF_INET, SOCK_STREAM, 0);  
-    fcntl(listenFd, F_SETFL, O_NONBLOCK); // set non-blocking  
-    printf("server listen fd=%d/n", listenFd);  
-    EventSet(&g_Events[MAX_EVENTS], listenFd, AcceptConn, &g_Events[MAX_EVENTS]);  
-    // add listen socket  
-    EventAdd(epollFd, EPOLLIN|EPOLLET, &g_Events[MAX_EVENTS]);  
-    // bind & listen  
-    sockaddr_in sin;  
-    bzero(&sin, sizeof(sin));  
-    sin.sin_family = AF_INET;  
-    sin.sin_addr.s_addr = INADDR_ANY;  
-    sin.sin_port = htons(port);  
-    bind(listenFd, (const sockaddr*)&sin, sizeof(sin));  
-    listen(listenFd, 5);  
-}  
-int main(int argc, char **argv)  
-{  
-    short port = 12345; // default port  
-    if(argc == 2){  
-        port = atoi(argv[1]);  
-    }  
-    // create epoll  
-    g_epollFd = epoll_create(MAX_EVENTS);  
-    if(g_epollFd <= 0) printf("create epoll failed.%d\n", g_epollFd);  
-    // create & bind listen socket, and add to epoll, set non-blocking  
-    InitListenSocket(g_epollFd, port);  
-    // event loop  
-    struct epoll_event events[MAX_EVENTS];  
-    printf("server running:port[%d]\n", port);  
-    int checkPos = 0;  
-    while(1){  
-        // a simple timeout check here, every time 100, better to use a mini-heap, and add timer event  
-        long now = time(NULL);  
-        for(int i = 0; i < 100; i++, checkPos++) // doesn't check listen fd  
-        {  
-            if(checkPos == MAX_EVENTS) checkPos = 0; // recycle  
-            if(g_Events[checkPos].status != 1) continue;  
-            long duration = now - g_Events[checkPos].last_active;  
-            if(duration >= 60) // 60s timeout  
-            {  
-                close(g_Events[checkPos].fd);  
-                printf("[fd=%d] timeout[%d--%d].\n", g_Events[checkPos].fd, g_Events[checkPos].last_active, now);  
-                EventDel(g_epollFd, &g_Events[checkPos]);  
-            }  
-        }  
-        // wait for events to happen  
-        int fds = epoll_wait(g_epollFd, events, MAX_EVENTS, 1000);  
-        if(fds < 0){  
-            printf("epoll_wait error, exit\n");  
-            break;  
-        }  
-        for(int i = 0; i < fds; i++){  
-            myevent_s *ev = (struct myevent_s*)events[i].data.ptr;  
-            if((events[i].events&EPOLLIN)&&(ev->events&EPOLLIN)) // read event  
-            {  
-                ev->call_back(ev->fd, events[i].events, ev->arg);  
-            }  
-            if((events[i].events&EPOLLOUT)&&(ev->events&EPOLLOUT)) // write event  
-            {  
-                ev->call_back(ev->fd, events[i].events, ev->arg);  
-            }  
-        }  
-    }  
-    // free resource  
-    return 0;  
-}  
+#include <time.h>
+
+#define MAX_EVENTS      512             // events per epoll_wait
+#define MAX_ACCEPTS     64              // accepts per wakeup, for fairness
+#define MAX_IOV         64              // chunks per sendmsg
+#define CHUNK_SIZE      4096            // buffer chunk, header included
+#define SLAB_CONNS      1024            // connections allocated at a time
+#define SLAB_CHUNKS     256             // chunks allocated at a time
+#define READ_EXTRA      65536           // overflow space for one read
+#define HIGH_WATER      (1024 * 1024)   // queued output that stops reading
+
+// a piece of a buffer: data[start, end) is unread
+struct chunk_s
+{
+    chunk_s *next;
+    int start, end;
+    char data[CHUNK_SIZE - sizeof(chunk_s*) - 2 * sizeof(int)];
+};
+// a chain of chunks
+struct buffer_s
+{
+    chunk_s *head, *tail;
+    size_t len;
+};
+struct reactor_s;
+struct conn_s
+{
+    int fd;
+    int status; // 1: open, 2: flushing before close, 0: closed (or free)
+    int blocked; // reading stopped until output drains
+    int rdhup; // the peer has shut down its side: read to the EOF
+    reactor_s *reactor;
+    buffer_s in, out;
+    long last_active; // reactor clock, seconds
+    long slot; // timer wheel slot
+    conn_s *prev, *next; // in the slot, or on a free list
+};
+// The handler gets the connection when there is new input in c->in;
+// it consumes what it can and queues replies on c->out.
+typedef void (*handler_t)(conn_s *c);
+struct reactor_s
+{
+    int id;
+    int cpu; // pinned to, or -1
+    pthread_t thread;
+    int epollFd;
+    int listenFd;
+    int spareFd; // given up to accept and drop when out of fds
+    conn_s *freeConns;
+    conn_s *closed; // closed in this batch of events, freed after it
+    chunk_s *freeChunks;
+    conn_s **wheel; // idle timer slots, by second
+    long wheelMask;
+    long now; // seconds
+    char *extra; // READ_EXTRA
+    // statistics, written by the reactor only
+    long conns, accepted, timeouts, bytesIn, bytesOut;
+} __attribute__((aligned(64)));
+
+int g_Port = 12345; // default port
+int g_Idle = 60; // 60s timeout
+volatile sig_atomic_t g_Stop;
+handler_t g_Handler;
+
+#define STAT_ADD(x, n) __atomic_store_n(&(x), (x) + (n), __ATOMIC_RELAXED)
+
+long Now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+// get a chunk from the reactor's free list
+chunk_s *ChunkGet(reactor_s *r)
+{
+    chunk_s *ch;
+    if(r->freeChunks == NULL)
+    {
+        chunk_s *slab = (chunk_s*)malloc(SLAB_CHUNKS * sizeof(chunk_s));
+        if(slab == NULL)
+            return NULL;
+        for(int i = 0; i < SLAB_CHUNKS; i++)
+        {
+            slab[i].next = r->freeChunks;
+            r->freeChunks = &slab[i];
+        }
+    }
+    ch = r->freeChunks;
+    r->freeChunks = ch->next;
+    ch->next = NULL;
+    ch->start = ch->end = 0;
+    return ch;
+}
+void ChunkPut(reactor_s *r, chunk_s *ch)
+{
+    ch->next = r->freeChunks;
+    r->freeChunks = ch;
+}
+// copy data onto the end of a buffer
+int BufAppend(reactor_s *r, buffer_s *buf, const char *data, size_t len)
+{
+    while(len > 0)
+    {
+        chunk_s *ch = buf->tail;
+        if(ch == NULL || ch->end == (int)sizeof(ch->data))
+        {
+            if((ch = ChunkGet(r)) == NULL)
+                return -1;
+            if(buf->tail == NULL)
+                buf->head = ch;
+            else
+                buf->tail->next = ch;
+            buf->tail = ch;
+        }
+        size_t n = sizeof(ch->data) - ch->end;
+        if(n > len)
+            n = len;
+        memcpy(ch->data + ch->end, data, n);
+        ch->end += n;
+        buf->len += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+// move all of src onto the end of dst, without copying
+void BufMove(buffer_s *dst, buffer_s *src)
+{
+    if(src->head == NULL)
+        return;
+    if(dst->tail == NULL)
+        dst->head = src->head;
+    else
+        dst->tail->next = src->head;
+    dst->tail = src->tail;
+    dst->len += src->len;
+    src->head = src->tail = NULL;
+    src->len = 0;
+}
+// drop len bytes from the front of a buffer
+void BufConsume(reactor_s *r, buffer_s *buf, size_t len)
+{
+    buf->len -= len;
+    while(len > 0)
+    {
+        chunk_s *ch = buf->head;
+        size_t n = ch->end - ch->start;
+        if(n > len)
+        {
+            ch->start += len;
+            break;
+        }
+        len -= n;
+        buf->head = ch->next;
+        if(buf->head == NULL)
+            buf->tail = NULL;
+        ChunkPut(r, ch);
+    }
+}
+void BufFree(reactor_s *r, buffer_s *buf)
+{
+    BufConsume(r, buf, buf->len);
+}
+// echo: everything read goes back out as it is
+void EchoHandler(conn_s *c)
+{
+    BufMove(&c->out, &c->in);
+}
+// idle timers: a connection sits in the slot of the second it would
+// time out if nothing happened since it was put there
+void TimerAdd(reactor_s *r, conn_s *c)
+{
+    c->slot = (c->last_active + g_Idle) & r->wheelMask;
+    conn_s **slot = &r->wheel[c->slot];
+    c->prev = NULL;
+    c->next = *slot;
+    if(*slot != NULL)
+        (*slot)->prev = c;
+    *slot = c;
+}
+void TimerDel(reactor_s *r, conn_s *c)
+{
+    if(c->prev != NULL)
+        c->prev->next = c->next;
+    else
+        r->wheel[c->slot] = c->next;
+    if(c->next != NULL)
+        c->next->prev = c->prev;
+}
+// close a connection that is off the wheel
+void DropConn(reactor_s *r, conn_s *c)
+{
+    close(c->fd); // also takes it out of the epoll set
+    c->status = 0;
+    BufFree(r, &c->in);
+    BufFree(r, &c->out);
+    c->next = r->closed;
+    r->closed = c;
+    STAT_ADD(r->conns, -1);
+}
+void CloseConn(reactor_s *r, conn_s *c)
+{
+    TimerDel(r, c);
+    DropConn(r, c);
+}
+// run the wheel up to the current second
+void TimerRun(reactor_s *r, long from, long to)
+{
+    if(to - from > r->wheelMask + 1)
+        from = to - r->wheelMask - 1;
+    for(long t = from + 1; t <= to; t++)
+    {
+        conn_s *c = r->wheel[t & r->wheelMask];
+        r->wheel[t & r->wheelMask] = NULL;
+        while(c != NULL)
+        {
+            conn_s *next = c->next;
+            if(to - c->last_active >= g_Idle)
+            {
+                DropConn(r, c);
+                STAT_ADD(r->timeouts, 1);
+            }
+            else
+                TimerAdd(r, c); // active since: refile
+            c = next;
+        }
+    }
+}
+// free the connections closed in the last batch of events; they can't
+// turn up in any later batch, their fds being closed
+void FreeClosed(reactor_s *r)
+{
+    while(r->closed != NULL)
+    {
+        conn_s *c = r->closed;
+        r->closed = c->next;
+        c->next = r->freeConns;
+        r->freeConns = c;
+    }
+}
+// get a connection object from the reactor's slab
+conn_s *ConnGet(reactor_s *r)
+{
+    if(r->freeConns == NULL)
+    {
+        conn_s *slab = (conn_s*)calloc(SLAB_CONNS, sizeof(conn_s));
+        if(slab == NULL)
+            return NULL;
+        for(int i = 0; i < SLAB_CONNS; i++)
+        {
+            slab[i].next = r->freeConns;
+            r->freeConns = &slab[i];
+        }
+    }
+    conn_s *c = r->freeConns;
+    r->freeConns = c->next;
+    return c;
+}
+void RecvData(reactor_s *r, conn_s *c);
+// send queued output until it's gone or the socket is full
+void SendData(reactor_s *r, conn_s *c)
+{
+    while(c->out.len > 0)
+    {
+        struct iovec iov[MAX_IOV];
+        struct msghdr msg;
+        int n = 0;
+        for(chunk_s *ch = c->out.head; ch != NULL && n < MAX_IOV; ch = ch->next, n++)
+        {
+            iov[n].iov_base = ch->data + ch->start;
+            iov[n].iov_len = ch->end - ch->start;
+        }
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        ssize_t len = sendmsg(c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(len < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return; // EPOLLOUT will bring us back
+            if(errno == EINTR)
+                continue;
+            CloseConn(r, c);
+            return;
+        }
+        BufConsume(r, &c->out, len);
+        STAT_ADD(r->bytesOut, len);
+        c->last_active = r->now; // a slow reader isn't an idle one
+    }
+    if(c->status == 2)
+        CloseConn(r, c); // all sent after the peer's FIN
+    else if(c->blocked)
+    {
+        // the edge that said there was input went by while reading
+        // was stopped; look again
+        c->blocked = 0;
+        RecvData(r, c);
+    }
+}
+// read until the socket is empty, handing input to the handler
+void RecvData(reactor_s *r, conn_s *c)
+{
+    while(c->status == 1)
+    {
+        if(c->out.len >= HIGH_WATER)
+        {
+            c->blocked = 1; // the peer isn't reading its replies
+            return;
+        }
+        // read into the tail chunk, or into a new one that is
+        // linked only if the read fills some of it; the extra
+        // space takes whatever is left and is copied in after
+        struct iovec iov[2];
+        chunk_s *tail = c->in.tail, *fresh = NULL;
+        if(tail == NULL || tail->end == (int)sizeof(tail->data))
+        {
+            if((fresh = ChunkGet(r)) == NULL)
+            {
+                CloseConn(r, c);
+                return;
+            }
+            tail = fresh;
+        }
+        size_t room = sizeof(tail->data) - tail->end;
+        iov[0].iov_base = tail->data + tail->end;
+        iov[0].iov_len = room;
+        iov[1].iov_base = r->extra;
+        iov[1].iov_len = READ_EXTRA;
+        ssize_t len = readv(c->fd, iov, 2);
+        if(len <= 0 && fresh != NULL)
+            ChunkPut(r, fresh);
+        if(len < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if(errno == EINTR)
+                continue;
+            CloseConn(r, c);
+            return;
+        }
+        if(len == 0)
+        {
+            // closed by peer: finish sending what it asked for first
+            if(c->out.len > 0)
+                c->status = 2;
+            else
+                CloseConn(r, c);
+            return;
+        }
+        STAT_ADD(r->bytesIn, len);
+        c->last_active = r->now;
+        size_t got = (size_t)len;
+        if(fresh != NULL)
+        {
+            if(c->in.tail == NULL)
+                c->in.head = fresh;
+            else
+                c->in.tail->next = fresh;
+            c->in.tail = fresh;
+        }
+        size_t n0 = got < room ? got : room;
+        tail->end += n0;
+        c->in.len += n0;
+        got -= n0;
+        if(got > 0 && BufAppend(r, &c->in, r->extra, got) < 0)
+        {
+            CloseConn(r, c);
+            return;
+        }
+        g_Handler(c);
+        if(c->out.len > 0)
+            SendData(r, c);
+        // a short read means the socket is empty, unless the FIN came
+        // in the same edge as the data: then only the EOF read says
+        // so, and there won't be another edge to go back for it
+        if((size_t)len < room + READ_EXTRA && !c->rdhup)
+            return;
+    }
+}
+// accept new connections from clients
+void AcceptConn(reactor_s *r)
+{
+    for(int i = 0; i < MAX_ACCEPTS; i++)
+    {
+        int nfd = accept4(r->listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(nfd == -1)
+        {
+            if(errno == EMFILE || errno == ENFILE)
+            {
+                // out of fds: take the connection off the queue and
+                // drop it, or the listen socket stays readable forever
+                close(r->spareFd);
+                nfd = accept(r->listenFd, NULL, NULL);
+                if(nfd >= 0)
+                    close(nfd);
+                r->spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                continue;
+            }
+            if(errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+                printf("%s: bad accept: %s\n", __func__, strerror(errno));
+            return;
+        }
+        conn_s *c = ConnGet(r);
+        if(c == NULL)
+        {
+            close(nfd);
+            return;
+        }
+        int one = 1;
+        setsockopt(nfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        c->fd = nfd;
+        c->status = 1;
+        c->blocked = 0;
+        c->rdhup = 0;
+        c->reactor = r;
+        c->in.head = c->in.tail = c->out.head = c->out.tail = NULL;
+        c->in.len = c->out.len = 0;
+        c->last_active = r->now;
+        struct epoll_event epv = {0, {0}};
+        epv.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        epv.data.ptr = c;
+        if(epoll_ctl(r->epollFd, EPOLL_CTL_ADD, nfd, &epv) < 0)
+        {
+            printf("%s: epoll add failed[fd=%d]: %s\n", __func__, nfd, strerror(errno));
+            close(nfd);
+            c->next = r->freeConns;
+            r->freeConns = c;
+            continue;
+        }
+        TimerAdd(r, c);
+        STAT_ADD(r->conns, 1);
+        STAT_ADD(r->accepted, 1);
+    }
+}
+int InitListenSocket(reactor_s *r, short port)
+{
+    int listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    if(listenFd < 0)
+        return -1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if(setsockopt(listenFd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+    {
+        close(listenFd);
+        return -1;
+    }
+    // bind & listen
+    sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = INADDR_ANY;
+    sin.sin_port = htons(port);
+    if(bind(listenFd, (const sockaddr*)&sin, sizeof(sin)) < 0
+        || listen(listenFd, SOMAXCONN) < 0)
+    {
+        close(listenFd);
+        return -1;
+    }
+    r->listenFd = listenFd;
+    // the listen socket is level triggered, so that accepting at most
+    // MAX_ACCEPTS at a time leaves no connection behind
+    struct epoll_event epv = {0, {0}};
+    epv.events = EPOLLIN;
+    epv.data.ptr = NULL;
+    return epoll_ctl(r->epollFd, EPOLL_CTL_ADD, listenFd, &epv);
+}
+void *ReactorRun(void *arg)
+{
+    reactor_s *r = (reactor_s*)arg;
+    struct epoll_event events[MAX_EVENTS];
+    if(r->cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(r->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    while(!g_Stop)
+    {
+        // wake up once a second for the wheel (and to notice g_Stop)
+        int fds = epoll_wait(r->epollFd, events, MAX_EVENTS, 1000);
+        if(fds < 0 && errno != EINTR)
+        {
+            printf("epoll_wait error, exit\n");
+            break;
+        }
+        long now = Now();
+        if(now != r->now)
+        {
+            long then = r->now;
+            r->now = now;
+            TimerRun(r, then, now);
+        }
+        for(int i = 0; i < fds; i++)
+        {
+            conn_s *c = (conn_s*)events[i].data.ptr;
+            uint32_t ev = events[i].events;
+            if(c == NULL)
+            {
+                AcceptConn(r);
+                continue;
+            }
+            if(c->status == 0)
+                continue; // closed earlier in this batch
+            if(ev & (EPOLLERR | EPOLLHUP))
+            {
+                CloseConn(r, c);
+                continue;
+            }
+            if(ev & EPOLLRDHUP)
+                c->rdhup = 1;
+            if(ev & EPOLLOUT)
+                SendData(r, c);
+            if(c->status == 1 && !c->blocked && (ev & (EPOLLIN | EPOLLRDHUP)))
+                RecvData(r, c);
+        }
+        FreeClosed(r);
+    }
+    return NULL;
+}
+void Stop(int sig)
+{
+    g_Stop = 1;
+}
+void PrintStats(reactor_s *reactors, int threads, const char *what)
+{
+    long conns = 0, accepted = 0, timeouts = 0, in = 0, out = 0;
+    for(int i = 0; i < threads; i++)
+    {
+        conns += __atomic_load_n(&reactors[i].conns, __ATOMIC_RELAXED);
+        accepted += __atomic_load_n(&reactors[i].accepted, __ATOMIC_RELAXED);
+        timeouts += __atomic_load_n(&reactors[i].timeouts, __ATOMIC_RELAXED);
+        in += __atomic_load_n(&reactors[i].bytesIn, __ATOMIC_RELAXED);
+        out += __atomic_load_n(&reactors[i].bytesOut, __ATOMIC_RELAXED);
+    }
+    printf("%s: conns %ld accepted %ld timeouts %ld in %ld out %ld\n",
+        what, conns, accepted, timeouts, in, out);
+    fflush(stdout);
+}
+int main(int argc, char **argv)
+{
+    // a reactor for each of the CPUs we are allowed, not all that are online
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE], ncpus = 0;
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    {
+        for(int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if(CPU_ISSET(cpu, &allowed))
+                cpus[ncpus++] = cpu;
+    }
+    int threads = ncpus > 0 ? ncpus : sysconf(_SC_NPROCESSORS_ONLN);
+    int statInterval = 0, opt;
+    while((opt = getopt(argc, argv, "p:t:i:s:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'p': g_Port = atoi(optarg); break;
+        case 't': threads = atoi(optarg); break;
+        case 'i': g_Idle = atoi(optarg); break;
+        case 's': statInterval = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-p port] [-t threads] [-i idle_seconds] [-s stat_seconds]\n", argv[0]);
+            return 1;
+        }
+    }
+    if(threads < 1 || g_Idle < 1 || g_Port <= 0 || g_Port > 65535)
+    {
+        fprintf(stderr, "%s: bad arguments\n", argv[0]);
+        return 1;
+    }
+    g_Handler = EchoHandler;
+    // one fd per connection: use all we may
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, Stop);
+    signal(SIGTERM, Stop);
+
+    // the wheel needs more slots than the timeout has seconds
+    long slots = 1;
+    while(slots <= g_Idle)
+        slots <<= 1;
+    reactor_s *reactors;
+    if(posix_memalign((void**)&reactors, 64, threads * sizeof(reactor_s)) != 0)
+        return 1;
+    memset(reactors, 0, threads * sizeof(reactor_s));
+    for(int i = 0; i < threads; i++)
+    {
+        reactor_s *r = &reactors[i];
+        r->id = i;
+        r->cpu = ncpus > 0 ? cpus[i % ncpus] : -1;
+        r->now = Now();
+        r->wheelMask = slots - 1;
+        r->wheel = (conn_s**)calloc(slots, sizeof(conn_s*));
+        r->extra = (char*)malloc(READ_EXTRA);
+        r->spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        // create epoll, & bind listen socket, and add to epoll
+        r->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if(r->wheel == NULL || r->extra == NULL || r->epollFd < 0)
+        {
+            printf("create reactor failed: %s\n", strerror(errno));
+            return 1;
+        }
+        if(InitListenSocket(r, g_Port) < 0)
+        {
+            printf("listen on port %d failed: %s\n", g_Port, strerror(errno));
+            return 1;
+        }
+    }
+    for(int i = 0; i < threads; i++)
+    {
+        if(pthread_create(&reactors[i].thread, NULL, ReactorRun, &reactors[i]) != 0)
+        {
+            printf("create reactor thread failed\n");
+            return 1;
+        }
+    }
+    printf("server running:port[%d] reactors[%d] idle timeout[%ds]\n", g_Port, threads, g_Idle);
+    fflush(stdout);
+    for(long t = 1; !g_Stop; t++)
+    {
+        sleep(1);
+        if(statInterval > 0 && t % statInterval == 0)
+            PrintStats(reactors, threads, "stats");
+    }
+    for(int i = 0; i < threads; i++)
+        pthread_join(reactors[i].thread, NULL);
+    PrintStats(reactors, threads, "total");
+    return 0;
+}
@@ -0,0 +1,557 @@
+/*
+ * flow.c
+ *
+ * Flow table and TCP reassembly, see flow.h.
+ *
+ * Example compiler command-line for GCC:
+ *   gcc -Wall -c flow.c
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include "flow.h"
+
+#define FLOW_MIN_SLOTS		4096
+#define FLOW_SWEEP		4	/* slots checked for idle flows per packet */
+#define FLOW_LINGER		2	/* seconds a closed flow is kept for its
+					   last ACKs and retransmissions */
+
+#define TH_FIN			0x01
+#define TH_SYN			0x02
+#define TH_RST			0x04
+#define TH_ACK			0x10
+
+/* a TCP segment that arrived before the ones in front of it */
+struct flow_seg {
+	struct flow_seg *next;
+	uint32_t seq;
+	unsigned int len;		/* on the wire */
+	unsigned int caplen;		/* held */
+	u_char data[];
+};
+
+struct flow_stream {
+	uint32_t next_seq[2];
+	uint8_t have_seq[2];
+	unsigned int held[2];
+	struct flow_seg *early[2];	/* in seq order */
+	uint32_t next_free;
+};
+
+struct flow_table {
+	struct flow_config config;
+	struct flow *slots;
+	size_t mask;
+	size_t sweep;
+	uint64_t now;
+	uint64_t timeout;		/* usec */
+	struct flow_stream *streams;	/* [0] unused: stream 0 is none */
+	uint32_t nstreams;		/* used, including [0] */
+	uint32_t streams_size;		/* allocated */
+	uint32_t free_stream;
+	struct flow_stats stats;
+};
+
+static uint32_t
+flow_hash(const struct flow_key *key)
+{
+	uint32_t h;
+
+	h = key->addr[0] * 0x9e3779b1;
+	h = (h ^ key->addr[1]) * 0x85ebca6b;
+	h = (h ^ ((uint32_t)key->port[0] << 16 | key->port[1])) * 0xc2b2ae35;
+	h ^= key->proto;
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	return h;
+}
+
+int
+flow_parse(const u_char *packet, unsigned int caplen, struct flow_pkt *pkt)
+{
+	const u_char *ip, *l4, *end = packet + caplen, *pend;
+	unsigned int off = 12, type, hl, thl, ip_len, frag;
+	uint32_t saddr, daddr;
+	uint16_t sport = 0, dport = 0;
+
+	/* the ethertype, past any VLAN tags */
+	for (;;) {
+		if (caplen < off + 2)
+			return -1;
+		type = (packet[off] << 8) | packet[off + 1];
+		if (type != 0x8100 && type != 0x88a8)
+			break;
+		off += 4;
+	}
+	if (type != 0x0800)
+		return -1;
+	ip = packet + off + 2;
+	if (end - ip < 20 || (ip[0] >> 4) != 4)
+		return -1;
+	hl = (ip[0] & 0x0f) * 4;
+	ip_len = (ip[2] << 8) | ip[3];
+	if (hl < 20 || (unsigned int)(end - ip) < hl || ip_len < hl)
+		return -1;
+	memcpy(&saddr, ip + 12, 4);
+	memcpy(&daddr, ip + 16, 4);
+	memset(pkt, 0, sizeof(*pkt));
+	pkt->len = ip_len;
+	pkt->key.proto = ip[9];
+
+	/* a fragment other than the first has no ports: a flow of its own */
+	frag = ((ip[6] & 0x1f) << 8) | ip[7];
+	l4 = ip + hl;
+	pend = ip_len < (unsigned int)(end - ip) ? ip + ip_len : end;
+	if (!frag && pkt->key.proto == IPPROTO_TCP) {
+		if (pend - l4 < 20)
+			return -1;
+		thl = (l4[12] >> 4) * 4;
+		if (thl < 20 || (unsigned int)(pend - l4) < thl)
+			return -1;
+		sport = (l4[0] << 8) | l4[1];
+		dport = (l4[2] << 8) | l4[3];
+		pkt->seq = (uint32_t)l4[4] << 24 | l4[5] << 16 | l4[6] << 8 | l4[7];
+		pkt->tcp_flags = l4[13];
+		pkt->payload = l4 + thl;
+		pkt->payload_len = pend - pkt->payload;
+		pkt->seg_len = ip_len - hl >= thl ? ip_len - hl - thl : 0;
+	}
+	else if (!frag && pkt->key.proto == IPPROTO_UDP) {
+		if (pend - l4 < 8)
+			return -1;
+		sport = (l4[0] << 8) | l4[1];
+		dport = (l4[2] << 8) | l4[3];
+		pkt->payload = l4 + 8;
+		pkt->payload_len = pend - pkt->payload;
+	}
+
+	/* lower endpoint first, so both directions share a key */
+	if (saddr < daddr || (saddr == daddr && sport <= dport)) {
+		pkt->key.addr[0] = saddr;
+		pkt->key.addr[1] = daddr;
+		pkt->key.port[0] = sport;
+		pkt->key.port[1] = dport;
+		pkt->dir = 0;
+	}
+	else {
+		pkt->key.addr[0] = daddr;
+		pkt->key.addr[1] = saddr;
+		pkt->key.port[0] = dport;
+		pkt->key.port[1] = sport;
+		pkt->dir = 1;
+	}
+	pkt->hash = flow_hash(&pkt->key);
+	return 0;
+}
+
+/*
+ * TCP reassembly
+ */
+static uint32_t
+stream_alloc(struct flow_table *t)
+{
+	struct flow_stream *s;
+	uint32_t id, n;
+
+	if (t->free_stream) {
+		id = t->free_stream;
+		t->free_stream = t->streams[id].next_free;
+	}
+	else {
+		if (t->nstreams == t->streams_size) {
+			n = t->streams_size ? t->streams_size * 2 : 1024;
+			s = realloc(t->streams, n * sizeof(*s));
+			if (s == NULL)
+				return 0;
+			t->streams = s;
+			t->streams_size = n;
+		}
+		if (t->nstreams == 0)
+			t->nstreams = 1;
+		id = t->nstreams++;
+	}
+	memset(&t->streams[id], 0, sizeof(t->streams[id]));
+	return id;
+}
+
+static void
+stream_deliver(struct flow_table *t, const struct flow *f, int dir,
+    const u_char *data, unsigned int caplen, unsigned int len)
+{
+	if (caplen > len)
+		caplen = len;
+	if (caplen && t->config.data)
+		t->config.data(f, dir, data, caplen, t->config.arg);
+	t->stats.tcp_bytes += caplen;
+	t->stats.gap_bytes += len - caplen;
+}
+
+static void
+stream_unhold(struct flow_table *t, struct flow_stream *s, int dir,
+    struct flow_seg *seg)
+{
+	s->held[dir] -= seg->caplen;
+	t->stats.buffered -= seg->caplen;
+	free(seg);
+}
+
+/* hand over the held segments that have become next in line */
+static void
+stream_drain(struct flow_table *t, const struct flow *f,
+    struct flow_stream *s, int dir)
+{
+	struct flow_seg *seg;
+	uint32_t skip;
+
+	while ((seg = s->early[dir]) != NULL &&
+	    (int32_t)(seg->seq - s->next_seq[dir]) <= 0) {
+		s->early[dir] = seg->next;
+		skip = s->next_seq[dir] - seg->seq;
+		if (skip >= seg->len) {
+			t->stats.overlap_bytes += seg->len;
+		}
+		else {
+			t->stats.overlap_bytes += skip;
+			stream_deliver(t, f, dir, seg->data + skip,
+			    seg->caplen > skip ? seg->caplen - skip : 0,
+			    seg->len - skip);
+			s->next_seq[dir] += seg->len - skip;
+		}
+		stream_unhold(t, s, dir, seg);
+	}
+}
+
+/* give up on the hole before the first held segment */
+static void
+stream_skip(struct flow_table *t, const struct flow *f,
+    struct flow_stream *s, int dir)
+{
+	t->stats.gap_bytes += s->early[dir]->seq - s->next_seq[dir];
+	s->next_seq[dir] = s->early[dir]->seq;
+	stream_drain(t, f, s, dir);
+}
+
+static void
+stream_segment(struct flow_table *t, const struct flow *f,
+    struct flow_stream *s, int dir, uint32_t seq, const u_char *data,
+    unsigned int caplen, unsigned int len)
+{
+	struct flow_seg *seg, **pos;
+	int32_t d = seq - s->next_seq[dir];
+
+	if (d < 0) {
+		/* some or all of it has been handed over already */
+		if ((uint32_t)-d >= len) {
+			t->stats.overlap_bytes += len;
+			return;
+		}
+		t->stats.overlap_bytes += -d;
+		data += -d;
+		caplen = caplen > (uint32_t)-d ? caplen + d : 0;
+		len += d;
+		d = 0;
+	}
+	if (d == 0) {
+		stream_deliver(t, f, dir, data, caplen, len);
+		s->next_seq[dir] += len;
+		stream_drain(t, f, s, dir);
+		return;
+	}
+
+	/* early: hold it, making room by giving up on old holes */
+	while (s->early[dir] &&
+	    (s->held[dir] + caplen > t->config.stream_max ||
+	    t->stats.buffered + caplen > t->config.buffer_max)) {
+		stream_skip(t, f, s, dir);
+		if ((int32_t)(seq - s->next_seq[dir]) <= 0) {
+			stream_segment(t, f, s, dir, seq, data, caplen, len);
+			return;
+		}
+	}
+	if (s->held[dir] + caplen > t->config.stream_max ||
+	    t->stats.buffered + caplen > t->config.buffer_max ||
+	    (seg = malloc(sizeof(*seg) + caplen)) == NULL) {
+		t->stats.gap_bytes += seq - s->next_seq[dir];
+		s->next_seq[dir] = seq;
+		stream_segment(t, f, s, dir, seq, data, caplen, len);
+		return;
+	}
+	for (pos = &s->early[dir]; *pos &&
+	    (int32_t)((*pos)->seq - seq) < 0; pos = &(*pos)->next)
+		;
+	if (*pos && (*pos)->seq == seq && (*pos)->len >= len) {
+		t->stats.overlap_bytes += len;
+		free(seg);
+		return;
+	}
+	seg->seq = seq;
+	seg->len = len;
+	seg->caplen = caplen;
+	memcpy(seg->data, data, caplen);
+	seg->next = *pos;
+	*pos = seg;
+	s->held[dir] += caplen;
+	t->stats.buffered += caplen;
+	if (t->stats.buffered > t->stats.max_buffered)
+		t->stats.max_buffered = t->stats.buffered;
+	t->stats.ooo_segments++;
+}
+
+static void
+flow_tcp(struct flow_table *t, struct flow *f, const struct flow_pkt *pkt)
+{
+	struct flow_stream *s;
+	uint32_t seq = pkt->seq;
+	int dir = pkt->dir;
+
+	if (!f->stream && (f->stream = stream_alloc(t)) == 0)
+		return;
+	s = &t->streams[f->stream];
+	if (pkt->tcp_flags & TH_SYN) {
+		s->next_seq[dir] = ++seq;
+		s->have_seq[dir] = 1;
+	}
+	else if (!s->have_seq[dir]) {
+		/* picked up in the middle */
+		s->next_seq[dir] = seq;
+		s->have_seq[dir] = 1;
+	}
+	if (pkt->seg_len)
+		stream_segment(t, f, s, dir, seq, pkt->payload,
+		    pkt->payload_len, pkt->seg_len);
+}
+
+static void
+stream_free(struct flow_table *t, struct flow *f)
+{
+	struct flow_stream *s = &t->streams[f->stream];
+	int dir;
+
+	/* whatever is still held goes out, holes and all */
+	for (dir = 0; dir < 2; dir++)
+		while (s->early[dir])
+			stream_skip(t, f, s, dir);
+	s->next_free = t->free_stream;
+	t->free_stream = f->stream;
+	f->stream = 0;
+}
+
+/*
+ * the table
+ */
+struct flow_table *
+flow_create(const struct flow_config *config)
+{
+	struct flow_table *t;
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		return NULL;
+	t->config = *config;
+	if (t->config.max_flows == 0)
+		t->config.max_flows = 1 << 20;
+	if (t->config.timeout == 0)
+		t->config.timeout = 60;
+	if (t->config.stream_max == 0)
+		t->config.stream_max = 256 * 1024;
+	if (t->config.buffer_max == 0)
+		t->config.buffer_max = 64 * 1024 * 1024;
+	t->timeout = (uint64_t)t->config.timeout * 1000000;
+	t->mask = FLOW_MIN_SLOTS - 1;
+	if (posix_memalign((void **)&t->slots, 64,
+	    FLOW_MIN_SLOTS * sizeof(struct flow)) != 0) {
+		free(t);
+		return NULL;
+	}
+	memset(t->slots, 0, FLOW_MIN_SLOTS * sizeof(struct flow));
+	return t;
+}
+
+static int
+flow_grow(struct flow_table *t)
+{
+	struct flow *old = t->slots, *slots;
+	size_t n = t->mask + 1, i, j;
+
+	if (posix_memalign((void **)&slots, 64, 2 * n * sizeof(*slots)) != 0)
+		return -1;
+	memset(slots, 0, 2 * n * sizeof(*slots));
+	t->slots = slots;
+	t->mask = 2 * n - 1;
+	t->sweep = 0;
+	for (i = 0; i < n; i++) {
+		if (!(old[i].flags & FLOW_USED))
+			continue;
+		for (j = flow_hash(&old[i].key) & t->mask;
+		    slots[j].flags & FLOW_USED; j = (j + 1) & t->mask)
+			;
+		slots[j] = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+static int
+flow_is_closed(const struct flow *f)
+{
+	return (f->flags & FLOW_RST) ||
+	    (f->flags & (FLOW_FIN0 | FLOW_FIN1)) == (FLOW_FIN0 | FLOW_FIN1);
+}
+
+static int
+flow_is_idle(const struct flow_table *t, const struct flow *f)
+{
+	uint64_t limit = flow_is_closed(f) ?
+	    (uint64_t)FLOW_LINGER * 1000000 : t->timeout;
+
+	return t->now > f->last && t->now - f->last > limit;
+}
+
+/* end a flow and close up the gap it leaves behind */
+static void
+flow_remove(struct flow_table *t, struct flow *f, int why)
+{
+	size_t i = f - t->slots, j = i, k;
+
+	if (f->stream)
+		stream_free(t, f);
+	if (flow_is_closed(f))
+		why = FLOW_CLOSED;
+	if (why == FLOW_CLOSED)
+		t->stats.closed++;
+	else if (why == FLOW_IDLE)
+		t->stats.idle++;
+	if (t->config.end)
+		t->config.end(f, why, t->config.arg);
+	t->stats.active--;
+
+	for (;;) {
+		j = (j + 1) & t->mask;
+		if (!(t->slots[j].flags & FLOW_USED))
+			break;
+		k = flow_hash(&t->slots[j].key) & t->mask;
+		if ((j > i && (k <= i || k > j)) ||
+		    (j < i && k <= i && k > j)) {
+			t->slots[i] = t->slots[j];
+			i = j;
+		}
+	}
+	t->slots[i].flags = 0;
+}
+
+static struct flow *
+flow_lookup(struct flow_table *t, const struct flow_pkt *pkt)
+{
+	struct flow *f;
+	size_t i;
+
+	for (;;) {
+		for (i = pkt->hash & t->mask; t->slots[i].flags & FLOW_USED;
+		    i = (i + 1) & t->mask) {
+			if (memcmp(&t->slots[i].key, &pkt->key,
+			    sizeof(pkt->key)) == 0)
+				return &t->slots[i];
+		}
+		if (t->stats.active >= t->config.max_flows)
+			return NULL;
+		if ((t->stats.active + 1) * 2 <= t->mask + 1 ||
+		    flow_grow(t) < 0)
+			break;
+	}
+	f = &t->slots[i];
+	memset(f, 0, sizeof(*f));
+	f->key = pkt->key;
+	f->flags = FLOW_USED;
+	f->first = t->now;
+	t->stats.flows++;
+	if (++t->stats.active > t->stats.max_active)
+		t->stats.max_active = t->stats.active;
+	return f;
+}
+
+void
+flow_track(struct flow_table *t, uint64_t usec, const struct flow_pkt *pkt)
+{
+	struct flow *f;
+	int n;
+
+	if (usec > t->now)
+		t->now = usec;
+	f = flow_lookup(t, pkt);
+	if (f == NULL) {
+		t->stats.table_full++;
+		return;
+	}
+	/* the same 5-tuple after a long silence, or a new connection
+	 * reusing the ports of one just closed, is a new flow */
+	if (f->packets[0] + f->packets[1] != 0 && (flow_is_idle(t, f) ||
+	    (flow_is_closed(f) &&
+	    (pkt->tcp_flags & (TH_SYN | TH_ACK)) == TH_SYN))) {
+		flow_remove(t, f, FLOW_IDLE);
+		f = flow_lookup(t, pkt);
+		if (f == NULL) {
+			t->stats.table_full++;
+			return;
+		}
+	}
+
+	f->last = t->now;
+	f->packets[pkt->dir]++;
+	f->bytes[pkt->dir] += pkt->len;
+	t->stats.packets++;
+	t->stats.bytes += pkt->len;
+	if (pkt->key.proto == IPPROTO_TCP) {
+		if (t->config.reassemble && !flow_is_closed(f))
+			flow_tcp(t, f, pkt);
+		if (pkt->tcp_flags & TH_RST)
+			f->flags |= FLOW_RST;
+		if (pkt->tcp_flags & TH_FIN)
+			f->flags |= pkt->dir ? FLOW_FIN1 : FLOW_FIN0;
+		/* done with the stream, keep the flow a while for stragglers */
+		if (f->stream && flow_is_closed(f))
+			stream_free(t, f);
+	}
+
+	/* a few slots further through the table, ending idle flows */
+	for (n = 0; n < FLOW_SWEEP; n++) {
+		f = &t->slots[t->sweep];
+		if ((f->flags & FLOW_USED) && flow_is_idle(t, f))
+			flow_remove(t, f, FLOW_IDLE);
+		else
+			t->sweep = (t->sweep + 1) & t->mask;
+	}
+}
+
+void
+flow_flush(struct flow_table *t)
+{
+	size_t i;
+
+	for (i = 0; i <= t->mask; i++) {
+		/* removing shifts later flows back into slot i */
+		while (t->slots[i].flags & FLOW_USED)
+			flow_remove(t, &t->slots[i], FLOW_FLUSHED);
+	}
+}
+
+void
+flow_stats(const struct flow_table *t, struct flow_stats *stats)
+{
+	*stats = t->stats;
+}
+
+void
+flow_destroy(struct flow_table *t)
+{
+	size_t i;
+
+	for (i = 0; i <= t->mask; i++)
+		if ((t->slots[i].flags & FLOW_USED) && t->slots[i].stream)
+			stream_free(t, &t->slots[i]);
+	free(t->streams);
+	free(t->slots);
+	free(t);
+}
@@ -0,0 +1,140 @@
+/*
+ * flow.h
+ *
+ * Flow tracking and TCP reassembly for the sniffers.
+ *
+ * A flow is an IPv4 5-tuple, both directions together: the key holds
+ * the lower endpoint first and each packet says which way it went.
+ * The table is open addressing with linear probing over 64 byte
+ * entries, one cache line each, and grows by doubling up to a limit.
+ * Flows that have been idle longer than the timeout are expired a few
+ * slots at a time as packets arrive, and TCP flows end on RST or FIN
+ * from both sides. Time is the packets' time, so a trace replays the
+ * same however fast it is read.
+ *
+ * TCP payload is handed to a callback in sequence order. Segments that
+ * arrive early are held, up to a limit per direction and one for the
+ * whole table; when a limit is hit the hole before the earliest held
+ * segment is given up on (counted in gap_bytes) and reassembly carries
+ * on from there, so memory stays bounded whatever the traffic does.
+ *
+ * A table is not locked: use one per thread, and partition packets
+ * between the threads with FLOW_PARTITION, which is the same for both
+ * directions of a flow.
+ */
+#ifndef FLOW_H
+#define FLOW_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#define FLOW_USED	0x01
+#define FLOW_FIN0	0x02		/* FIN seen from key.addr[0] */
+#define FLOW_FIN1	0x04
+#define FLOW_RST	0x08
+
+/* why a flow ended */
+#define FLOW_IDLE	0
+#define FLOW_CLOSED	1
+#define FLOW_FLUSHED	2		/* flow_flush, e.g. at end of file */
+
+struct flow_key {
+	uint32_t addr[2];		/* network order, addr[0] <= addr[1] */
+	uint16_t port[2];		/* host order, 0 if not TCP or UDP */
+	uint8_t proto;
+	uint8_t pad[3];
+};
+
+/* one cache line */
+struct flow {
+	struct flow_key key;
+	uint32_t flags;
+	uint32_t stream;		/* reassembly state, 0 if none */
+	uint64_t first;			/* usec */
+	uint64_t last;
+	uint32_t packets[2];		/* [0]: from addr[0] to addr[1] */
+	uint64_t bytes[2];		/* IP length */
+};
+
+/* a parsed packet */
+struct flow_pkt {
+	struct flow_key key;
+	uint32_t hash;
+	int dir;			/* 0: from key.addr[0] */
+	unsigned int len;		/* IP total length */
+	uint8_t tcp_flags;
+	uint32_t seq;
+	const u_char *payload;		/* TCP or UDP payload, as captured */
+	unsigned int payload_len;
+	unsigned int seg_len;		/* TCP payload on the wire, more than
+					   payload_len if the capture cut it */
+};
+
+struct flow_stats {
+	uint64_t packets;		/* tracked */
+	uint64_t bytes;
+	uint64_t flows;			/* started */
+	uint64_t active;		/* in the table now */
+	uint64_t max_active;
+	uint64_t idle;			/* ended by timeout */
+	uint64_t closed;		/* ended by FIN/RST */
+	uint64_t table_full;		/* packets of flows that didn't fit */
+	uint64_t tcp_bytes;		/* delivered in order */
+	uint64_t ooo_segments;		/* held for a while */
+	uint64_t overlap_bytes;		/* retransmitted, dropped */
+	uint64_t gap_bytes;		/* never seen, skipped */
+	uint64_t buffered;		/* held now, all streams */
+	uint64_t max_buffered;
+};
+
+/* in-order TCP payload of a flow, dir as in flow_pkt */
+typedef void (*flow_data_fn)(const struct flow *flow, int dir,
+    const u_char *data, unsigned int len, void *arg);
+/* a flow is leaving the table, why is FLOW_IDLE etc. */
+typedef void (*flow_end_fn)(const struct flow *flow, int why, void *arg);
+
+struct flow_config {
+	unsigned long max_flows;	/* default 1M */
+	unsigned int timeout;		/* idle seconds, default 60 */
+	int reassemble;			/* keep TCP stream state */
+	unsigned int stream_max;	/* early bytes held per direction,
+					   default 256KB */
+	unsigned long buffer_max;	/* and in all, default 64MB */
+	flow_data_fn data;
+	flow_end_fn end;
+	void *arg;
+};
+
+struct flow_table;
+
+/* which of n threads a packet belongs to: the high bits of the hash,
+ * the table uses the low ones */
+#define FLOW_PARTITION(pkt, n) \
+	((unsigned int)(((uint64_t)(pkt)->hash * (n)) >> 32))
+
+/*
+ * parse an Ethernet frame (VLAN tags skipped) of an IPv4 packet;
+ * 0 on success, -1 if it isn't one or is cut short
+ */
+int
+flow_parse(const u_char *packet, unsigned int caplen, struct flow_pkt *pkt);
+
+struct flow_table *
+flow_create(const struct flow_config *config);
+
+/* account a parsed packet seen at usec */
+void
+flow_track(struct flow_table *table, uint64_t usec,
+    const struct flow_pkt *pkt);
+
+/* end every flow still in the table */
+void
+flow_flush(struct flow_table *table);
+
+void
+flow_stats(const struct flow_table *table, struct flow_stats *stats);
+
+void
+flow_destroy(struct flow_table *table);
+
+#endif
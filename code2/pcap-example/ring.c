@@ -0,0 +1,339 @@
+/*
+ * ring.c
+ *
+ * TPACKET_V3 capture workers, see ring.h.
+ *
+ * Example compiler command-line for GCC:
+ *   gcc -Wall -c ring.c
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include "ring.h"
+
+#define RING_BLOCK_SIZE		(1 << 20)
+#define RING_BLOCK_NR		64
+#define RING_RETIRE_MS		50	/* hand over a block part full after this */
+#define RING_POLL_MS		100	/* how often an idle worker checks for stop */
+
+/* one per worker, a cache line each so the counters don't bounce */
+struct ring_worker {
+	struct ring *ring;
+	int id;
+	int fd;
+	u_char *map;
+	size_t map_len;
+	pthread_t thread;
+	int started;
+	/* written by the worker only, read by ring_stats */
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t blocks;
+} __attribute__((aligned(64)));
+
+struct ring {
+	struct ring_config config;
+	int ncpus;
+	volatile int stop;
+	pthread_mutex_t stats_lock;	/* PACKET_STATISTICS reads and resets */
+	uint64_t drops;
+	uint64_t freezes;
+	struct ring_worker worker[RING_MAX_WORKERS];
+};
+
+static int
+ring_open(struct ring *ring, struct ring_worker *w, int ifindex, int fanout_id,
+    char *errbuf, size_t errlen)
+{
+	const struct ring_config *c = &ring->config;
+	struct tpacket_req3 req;
+	struct sockaddr_ll ll;
+	struct packet_mreq mreq;
+	int version = TPACKET_V3;
+	int fanout;
+	/* accepts nothing: held over the socket until it is in the group */
+	struct sock_filter drop_insn = BPF_STMT(BPF_RET | BPF_K, 0);
+	struct sock_fprog drop = { 1, &drop_insn };
+	const struct sock_fprog *filter;
+	int unused = 0, err;
+
+	/*
+	 * Protocol 0: the socket receives nothing until bind() gives it
+	 * one, together with the interface. With ETH_P_ALL here it would
+	 * take in every interface's traffic from the start.
+	 */
+	w->fd = socket(AF_PACKET, SOCK_RAW, 0);
+	if (w->fd < 0) {
+		snprintf(errbuf, errlen, "socket: %s", strerror(errno));
+		return -1;
+	}
+	if (setsockopt(w->fd, SOL_PACKET, PACKET_VERSION, &version,
+	    sizeof(version)) < 0) {
+		snprintf(errbuf, errlen, "TPACKET_V3: %s", strerror(errno));
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = c->block_size;
+	req.tp_block_nr = c->block_nr;
+	/* frames are variable length in V3, this only has to be sane */
+	req.tp_frame_size = TPACKET_ALIGN(TPACKET3_HDRLEN + c->snap_len);
+	req.tp_frame_nr = (c->block_size / req.tp_frame_size) * c->block_nr;
+	req.tp_retire_blk_tov = RING_RETIRE_MS;
+	req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+	if (setsockopt(w->fd, SOL_PACKET, PACKET_RX_RING, &req,
+	    sizeof(req)) < 0) {
+		snprintf(errbuf, errlen, "PACKET_RX_RING: %s", strerror(errno));
+		return -1;
+	}
+	w->map_len = (size_t)c->block_size * c->block_nr;
+	w->map = mmap(NULL, w->map_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, w->fd, 0);
+	if (w->map == MAP_FAILED) {
+		w->map = NULL;
+		snprintf(errbuf, errlen, "mmap ring: %s", strerror(errno));
+		return -1;
+	}
+
+	/*
+	 * Before bind, so nothing unfiltered gets into the ring. Joining
+	 * the fanout group takes a bound socket, so until then a worker
+	 * would get a copy of every packet: it drops them all instead.
+	 */
+	filter = c->workers > 1 ? &drop : c->filter;
+	if (filter && setsockopt(w->fd, SOL_SOCKET, SO_ATTACH_FILTER,
+	    filter, sizeof(*filter)) < 0) {
+		snprintf(errbuf, errlen, "SO_ATTACH_FILTER: %s",
+		    strerror(errno));
+		return -1;
+	}
+
+	memset(&ll, 0, sizeof(ll));
+	ll.sll_family = AF_PACKET;
+	ll.sll_protocol = htons(ETH_P_ALL);
+	ll.sll_ifindex = ifindex;
+	if (bind(w->fd, (struct sockaddr *)&ll, sizeof(ll)) < 0) {
+		snprintf(errbuf, errlen, "bind %s: %s", c->dev,
+		    strerror(errno));
+		return -1;
+	}
+
+	if (c->promisc) {
+		memset(&mreq, 0, sizeof(mreq));
+		mreq.mr_ifindex = ifindex;
+		mreq.mr_type = PACKET_MR_PROMISC;
+		if (setsockopt(w->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+		    &mreq, sizeof(mreq)) < 0) {
+			snprintf(errbuf, errlen, "promiscuous mode: %s",
+			    strerror(errno));
+			return -1;
+		}
+	}
+
+	/* both directions of a flow hash alike, so they meet in one worker */
+	if (c->workers > 1) {
+		fanout = fanout_id |
+		    ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+		if (setsockopt(w->fd, SOL_PACKET, PACKET_FANOUT, &fanout,
+		    sizeof(fanout)) < 0) {
+			snprintf(errbuf, errlen, "PACKET_FANOUT: %s",
+			    strerror(errno));
+			return -1;
+		}
+		/* in the group: the real filter, or none, replaces drop */
+		if (c->filter)
+			err = setsockopt(w->fd, SOL_SOCKET, SO_ATTACH_FILTER,
+			    c->filter, sizeof(*c->filter));
+		else
+			err = setsockopt(w->fd, SOL_SOCKET, SO_DETACH_FILTER,
+			    &unused, sizeof(unused));
+		if (err < 0) {
+			snprintf(errbuf, errlen, "SO_ATTACH_FILTER: %s",
+			    strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void *
+ring_worker(void *arg)
+{
+	struct ring_worker *w = arg;
+	struct ring *ring = w->ring;
+	const struct ring_config *c = &ring->config;
+	struct tpacket_block_desc *bd;
+	struct tpacket3_hdr *hdr;
+	struct pollfd pfd;
+	cpu_set_t cpus;
+	unsigned int cur = 0;
+	unsigned int i;
+	uint64_t bytes;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(w->id % ring->ncpus, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+	pfd.fd = w->fd;
+	pfd.events = POLLIN | POLLERR;
+	pfd.revents = 0;
+	while (!ring->stop) {
+		bd = (struct tpacket_block_desc *)
+		    (w->map + (size_t)cur * c->block_size);
+		if (!(__atomic_load_n(&bd->hdr.bh1.block_status,
+		    __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+			poll(&pfd, 1, RING_POLL_MS);
+			continue;
+		}
+
+		/* the whole block in one go */
+		hdr = (struct tpacket3_hdr *)
+		    ((u_char *)bd + bd->hdr.bh1.offset_to_first_pkt);
+		bytes = 0;
+		for (i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+			c->handler(w->id, (uint64_t)hdr->tp_sec * 1000000 +
+			    hdr->tp_nsec / 1000, (u_char *)hdr + hdr->tp_mac,
+			    hdr->tp_snaplen, hdr->tp_len, c->arg);
+			bytes += hdr->tp_len;
+			hdr = (struct tpacket3_hdr *)
+			    ((u_char *)hdr + hdr->tp_next_offset);
+		}
+		__atomic_store_n(&w->packets, w->packets + i, __ATOMIC_RELAXED);
+		__atomic_store_n(&w->bytes, w->bytes + bytes, __ATOMIC_RELAXED);
+		__atomic_store_n(&w->blocks, w->blocks + 1, __ATOMIC_RELAXED);
+
+		/* give it back */
+		__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+		    __ATOMIC_RELEASE);
+		cur = (cur + 1) % c->block_nr;
+	}
+	return NULL;
+}
+
+struct ring *
+ring_start(const struct ring_config *config, char *errbuf, size_t errlen)
+{
+	struct ring *ring;
+	int ifindex, i, err;
+
+	ifindex = if_nametoindex(config->dev);
+	if (ifindex == 0) {
+		snprintf(errbuf, errlen, "%s: %s", config->dev,
+		    strerror(errno));
+		return NULL;
+	}
+	ring = calloc(1, sizeof(*ring));
+	if (ring == NULL) {
+		snprintf(errbuf, errlen, "out of memory");
+		return NULL;
+	}
+	ring->config = *config;
+	ring->ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ring->ncpus < 1)
+		ring->ncpus = 1;
+	if (ring->config.workers <= 0)
+		ring->config.workers = ring->ncpus;
+	if (ring->config.workers > RING_MAX_WORKERS)
+		ring->config.workers = RING_MAX_WORKERS;
+	if (ring->config.block_size == 0)
+		ring->config.block_size = RING_BLOCK_SIZE;
+	if (ring->config.block_nr == 0)
+		ring->config.block_nr = RING_BLOCK_NR;
+	if (ring->config.snap_len == 0)
+		ring->config.snap_len = 2048;
+	pthread_mutex_init(&ring->stats_lock, NULL);
+	for (i = 0; i < RING_MAX_WORKERS; i++)
+		ring->worker[i].fd = -1;
+
+	/* open every socket before starting any worker, so the fanout
+	 * group is complete when packets start to arrive */
+	for (i = 0; i < ring->config.workers; i++) {
+		ring->worker[i].ring = ring;
+		ring->worker[i].id = i;
+		if (ring_open(ring, &ring->worker[i], ifindex,
+		    getpid() & 0xffff, errbuf, errlen) < 0) {
+			ring_stop(ring);
+			return NULL;
+		}
+	}
+	for (i = 0; i < ring->config.workers; i++) {
+		err = pthread_create(&ring->worker[i].thread, NULL,
+		    ring_worker, &ring->worker[i]);
+		if (err != 0) {
+			snprintf(errbuf, errlen, "pthread_create: %s",
+			    strerror(err));
+			ring_stop(ring);
+			return NULL;
+		}
+		ring->worker[i].started = 1;
+	}
+	return ring;
+}
+
+int
+ring_workers(const struct ring *ring)
+{
+	return ring->config.workers;
+}
+
+void
+ring_stats(struct ring *ring, struct ring_stats *stats)
+{
+	struct tpacket_stats_v3 st;
+	socklen_t len;
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	pthread_mutex_lock(&ring->stats_lock);
+	for (i = 0; i < ring->config.workers; i++) {
+		struct ring_worker *w = &ring->worker[i];
+
+		stats->packets += __atomic_load_n(&w->packets,
+		    __ATOMIC_RELAXED);
+		stats->bytes += __atomic_load_n(&w->bytes, __ATOMIC_RELAXED);
+		stats->blocks += __atomic_load_n(&w->blocks, __ATOMIC_RELAXED);
+		/* the kernel's counters are reset by reading them */
+		len = sizeof(st);
+		if (w->fd >= 0 && getsockopt(w->fd, SOL_PACKET,
+		    PACKET_STATISTICS, &st, &len) == 0) {
+			ring->drops += st.tp_drops;
+			ring->freezes += st.tp_freeze_q_cnt;
+		}
+	}
+	stats->drops = ring->drops;
+	stats->freezes = ring->freezes;
+	pthread_mutex_unlock(&ring->stats_lock);
+}
+
+void
+ring_stop(struct ring *ring)
+{
+	int i;
+
+	ring->stop = 1;
+	for (i = 0; i < RING_MAX_WORKERS; i++) {
+		struct ring_worker *w = &ring->worker[i];
+
+		if (w->started)
+			pthread_join(w->thread, NULL);
+		if (w->map)
+			munmap(w->map, w->map_len);
+		if (w->fd >= 0)
+			close(w->fd);
+	}
+	pthread_mutex_destroy(&ring->stats_lock);
+	free(ring);
+}
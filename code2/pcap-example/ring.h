@@ -0,0 +1,64 @@
+/*
+ * ring.h
+ *
+ * High rate capture with AF_PACKET TPACKET_V3 rings.
+ *
+ * Each worker thread opens its own packet socket with a mmapped block
+ * ring, and all the sockets join one PACKET_FANOUT group, so the kernel
+ * spreads flows (by hash) over the workers and no packet is ever copied
+ * or passed between threads. The kernel fills a whole block before
+ * handing it over, so a worker wakes once per block, not per packet.
+ * Workers are pinned one per CPU.
+ */
+#ifndef RING_H
+#define RING_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <linux/filter.h>
+
+#define RING_MAX_WORKERS	64
+
+/* called by worker for every packet of a block, on the worker's thread;
+ * usec is the kernel's timestamp */
+typedef void (*ring_handler)(int worker, uint64_t usec, const u_char *packet,
+    unsigned int caplen, unsigned int len, void *arg);
+
+struct ring_config {
+	const char *dev;		/* interface to capture on */
+	int workers;			/* 0: one per online CPU */
+	unsigned int block_size;	/* bytes per block, a power of 2 pages */
+	unsigned int block_nr;		/* blocks per worker */
+	unsigned int snap_len;		/* frame size hint */
+	int promisc;
+	const struct sock_fprog *filter;	/* optional, a classic BPF program */
+	ring_handler handler;
+	void *arg;
+};
+
+/* counters are totals over all the workers since ring_start */
+struct ring_stats {
+	uint64_t packets;		/* handed to the handler */
+	uint64_t bytes;			/* on the wire */
+	uint64_t blocks;
+	uint64_t drops;			/* dropped by the kernel, ring full */
+	uint64_t freezes;		/* times a ring was full */
+};
+
+struct ring;
+
+struct ring *
+ring_start(const struct ring_config *config, char *errbuf, size_t errlen);
+
+int
+ring_workers(const struct ring *ring);
+
+/* safe to call from any thread while capturing */
+void
+ring_stats(struct ring *ring, struct ring_stats *stats);
+
+/* stop the workers and free the rings */
+void
+ring_stop(struct ring *ring);
+
+#endif
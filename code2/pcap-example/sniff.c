@@ -153,6 +153,8 @@
  * 
  * Example compiler command-line for GCC:
  *   gcc -Wall -o sniffex sniffex.c -lpcap
+ * or, with the ring capture [4] and offline [5] modes of this copy:
+ *   gcc -Wall -o sniff sniff.c ring.c flow.c -lpcap -lpthread
  * 
  ****************************************************************************
  *
@@ -187,6 +189,28 @@
  * tcp port 80			Capture only TCP packets with a port equal to 80.
  * ip host 10.1.2.3		Capture all IP packets to or from host 10.1.2.3.
  *
+ * 4. pcap_loop() hands over one packet at a time, and printing every one
+ * of them is far slower than the packets arrive on a busy link, so most
+ * get dropped. With -r the capture goes through ring.c instead: a
+ * TPACKET_V3 ring per worker thread, the workers joined in a fanout
+ * group so each sees whole flows, and packets are only counted, with
+ * one in every -s printed as a one line summary. The counters and the
+ * kernel's drop count are printed every -i seconds while capturing. The
+ * filter expression is still compiled by libpcap, and attached to each
+ * ring's socket as a classic BPF program.
+ *
+ * 5. With -f the packets come from a capture file instead. The file is
+ * mapped, not read, and every worker walks all of it, parsing only the
+ * headers of packets that belong to other workers, so there's no queue
+ * between threads and no copying. Workers split the traffic by flow
+ * (FLOW_PARTITION in flow.h) and each tracks its flows in a table of its
+ * own. Classic pcap files are walked directly; anything else (pcapng)
+ * is handed to pcap_open_offline() on a single worker.
+ *
+ * In both modes the flow table reassembles TCP streams, with bounded
+ * memory, and ends flows idle for -t seconds. The totals and the
+ * biggest flows are printed at the end.
+ *
  ****************************************************************************
  *
  */
@@ -204,6 +228,16 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/filter.h>
+#include "ring.h"
+#include "flow.h"
 /* default snap length (maximum bytes per packet to capture) */
 #define SNAP_LEN 1518
 /* ethernet headers are always exactly 14 bytes [1] */
@@ -267,6 +301,11 @@ void
 print_app_banner(void);
 void
 print_app_usage(void);
+int
+ring_capture(const char *dev, const char *filter_exp, int workers,
+    int interval);
+int
+offline_capture(const char *fname, const char *filter_exp, int workers);
 /*
  * app name/banner
  */
@@ -285,10 +324,21 @@ return;
 void
 print_app_usage(void)
 {
-	printf("Usage: %s [interface]\n", APP_NAME);
+	printf("Usage: %s [-r workers [-s every] [-i secs]] [interface]\n",
+	    APP_NAME);
+	printf("       %s -f file [-r workers] [-s every]\n", APP_NAME);
 	printf("\n");
 	printf("Options:\n");
 	printf("    interface    Listen on <interface> for packets.\n");
+	printf("    -r workers   Capture with TPACKET_V3 rings and <workers>\n");
+	printf("                 threads (0: one per CPU), counting packets\n");
+	printf("                 instead of printing them [4].\n");
+	printf("    -s every     With -r, print a summary of one packet in\n");
+	printf("                 <every> per worker (default 100000, 0: none).\n");
+	printf("    -i secs      With -r, print counters every <secs> (default 1).\n");
+	printf("    -f file      Read packets from a capture file, with <workers>\n");
+	printf("                 threads (default one per CPU) [5].\n");
+	printf("    -t secs      End flows idle for <secs> (default 60).\n");
 	printf("\n");
 return;
 }
@@ -463,6 +513,491 @@ got_packet(u_char *args, const struct pcap_pkthdr *header, const u_char *packet)
 	}
 return;
 }
+/*
+ * ring [4] and offline [5] modes: per worker counters and flow tables,
+ * each worker's on cache lines of their own
+ */
+#define TOP_FLOWS	10
+struct top_flow {
+	struct flow_key key;
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t usec;				/* how long it lasted */
+};
+struct sniff_worker {
+	unsigned long ip;
+	unsigned long tcp;
+	unsigned long udp;
+	unsigned long icmp;
+	unsigned long other;
+	unsigned long invalid;
+	unsigned long payload;			/* tcp payload bytes */
+	struct flow_table *flows;
+	struct top_flow top[TOP_FLOWS];		/* the biggest ended flows */
+	int ntop;
+} __attribute__((aligned(64)));
+static struct sniff_worker sniff_workers[RING_MAX_WORKERS];
+static long sample_every = 100000;
+static unsigned int flow_timeout = 60;
+static volatile sig_atomic_t ring_done;
+static void
+ring_signal(int sig)
+{
+	ring_done = 1;
+}
+/*
+ * a flow left the table: keep it if it's one of the biggest
+ */
+static void
+flow_ended(const struct flow *flow, int why, void *arg)
+{
+	struct sniff_worker *w = arg;
+	uint64_t bytes = flow->bytes[0] + flow->bytes[1];
+	int i;
+	if (w->ntop == TOP_FLOWS && bytes <= w->top[TOP_FLOWS - 1].bytes)
+		return;
+	i = w->ntop < TOP_FLOWS ? w->ntop++ : TOP_FLOWS - 1;
+	for (; i > 0 && w->top[i - 1].bytes < bytes; i--)
+		w->top[i] = w->top[i - 1];
+	w->top[i].key = flow->key;
+	w->top[i].packets = flow->packets[0] + flow->packets[1];
+	w->top[i].bytes = bytes;
+	w->top[i].usec = flow->last - flow->first;
+}
+static void
+sniff_init_workers(int workers)
+{
+	struct flow_config config;
+	int i;
+	for (i = 0; i < workers; i++) {
+		memset(&config, 0, sizeof(config));
+		config.timeout = flow_timeout;
+		config.reassemble = 1;
+		config.end = flow_ended;
+		config.arg = &sniff_workers[i];
+		sniff_workers[i].flows = flow_create(&config);
+		if (sniff_workers[i].flows == NULL) {
+			fprintf(stderr, "Couldn't create flow table\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+/*
+ * count a parsed packet, track its flow, and print a one line summary
+ * of the odd one
+ */
+static void
+sniff_count(int worker, uint64_t usec, const struct flow_pkt *pkt,
+    unsigned int len)
+{
+	struct sniff_worker *w = &sniff_workers[worker];
+	char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN], line[160];
+	const char *proto;
+	unsigned long n;
+	int s = pkt->dir, d = !pkt->dir;
+	n = ++w->ip;
+	switch(pkt->key.proto) {
+		case IPPROTO_TCP:
+			w->tcp++;
+			w->payload += pkt->seg_len;
+			proto = "TCP";
+			break;
+		case IPPROTO_UDP:
+			w->udp++;
+			proto = "UDP";
+			break;
+		case IPPROTO_ICMP:
+			w->icmp++;
+			proto = "ICMP";
+			break;
+		default:
+			w->other++;
+			proto = "other";
+			break;
+	}
+	flow_track(w->flows, usec, pkt);
+	if (sample_every <= 0 || n % sample_every != 0)
+		return;
+	/* inet_ntoa's static buffer isn't safe with several workers */
+	inet_ntop(AF_INET, &pkt->key.addr[s], src, sizeof(src));
+	inet_ntop(AF_INET, &pkt->key.addr[d], dst, sizeof(dst));
+	if (pkt->key.port[0] || pkt->key.port[1])
+		snprintf(line, sizeof(line), "[%d] %s:%d -> %s:%d %s %u bytes\n",
+		    worker, src, pkt->key.port[s], dst, pkt->key.port[d],
+		    proto, len);
+	else
+		snprintf(line, sizeof(line), "[%d] %s -> %s %s %u bytes\n",
+		    worker, src, dst, proto, len);
+	fputs(line, stdout);
+}
+static void
+ring_packet(int worker, uint64_t usec, const u_char *packet,
+    unsigned int caplen, unsigned int len, void *arg)
+{
+	struct flow_pkt pkt;
+	/* the filter passes only IP, but a short capture can still cut
+	 * the headers off: flow_parse checks against caplen as well [1] */
+	if (flow_parse(packet, caplen, &pkt) < 0) {
+		sniff_workers[worker].invalid++;
+		return;
+	}
+	sniff_count(worker, usec, &pkt, len);
+}
+/*
+ * end the flows still open, and print the totals of all the workers
+ */
+static void
+sniff_report(int workers)
+{
+	struct sniff_worker sum;
+	struct flow_stats fs, all;
+	struct top_flow top[TOP_FLOWS * RING_MAX_WORKERS], t;
+	char a[INET_ADDRSTRLEN], b[INET_ADDRSTRLEN];
+	int i, j, n = 0;
+	memset(&sum, 0, sizeof(sum));
+	memset(&all, 0, sizeof(all));
+	for (i = 0; i < workers; i++) {
+		struct sniff_worker *w = &sniff_workers[i];
+		flow_flush(w->flows);
+		flow_stats(w->flows, &fs);
+		sum.ip += w->ip;
+		sum.tcp += w->tcp;
+		sum.udp += w->udp;
+		sum.icmp += w->icmp;
+		sum.other += w->other;
+		sum.invalid += w->invalid;
+		sum.payload += w->payload;
+		all.flows += fs.flows;
+		all.max_active += fs.max_active;
+		all.idle += fs.idle;
+		all.closed += fs.closed;
+		all.table_full += fs.table_full;
+		all.tcp_bytes += fs.tcp_bytes;
+		all.ooo_segments += fs.ooo_segments;
+		all.overlap_bytes += fs.overlap_bytes;
+		all.gap_bytes += fs.gap_bytes;
+		all.max_buffered += fs.max_buffered;
+		for (j = 0; j < w->ntop; j++)
+			top[n++] = w->top[j];
+		flow_destroy(w->flows);
+	}
+	printf("        IP: %lu\n", sum.ip);
+	printf("       TCP: %lu (%lu payload bytes)\n", sum.tcp, sum.payload);
+	printf("       UDP: %lu\n", sum.udp);
+	printf("      ICMP: %lu\n", sum.icmp);
+	printf("     Other: %lu\n", sum.other);
+	printf("   Invalid: %lu\n", sum.invalid);
+	printf("     Flows: %lu (at most %lu at once), %lu timed out, "
+	    "%lu closed, %lu packets not tracked\n",
+	    (unsigned long)all.flows, (unsigned long)all.max_active,
+	    (unsigned long)all.idle, (unsigned long)all.closed,
+	    (unsigned long)all.table_full);
+	printf("    Stream: %lu bytes in order, %lu out-of-order segments "
+	    "(at most %lu bytes held), %lu retransmitted, %lu missing\n",
+	    (unsigned long)all.tcp_bytes, (unsigned long)all.ooo_segments,
+	    (unsigned long)all.max_buffered, (unsigned long)all.overlap_bytes,
+	    (unsigned long)all.gap_bytes);
+	/* each worker's are sorted already, this is a handful */
+	for (i = 1; i < n; i++) {
+		t = top[i];
+		for (j = i; j > 0 && top[j - 1].bytes < t.bytes; j--)
+			top[j] = top[j - 1];
+		top[j] = t;
+	}
+	if (n > 0)
+		printf("\nBiggest flows:\n");
+	for (i = 0; i < n && i < TOP_FLOWS; i++) {
+		inet_ntop(AF_INET, &top[i].key.addr[0], a, sizeof(a));
+		inet_ntop(AF_INET, &top[i].key.addr[1], b, sizeof(b));
+		printf("   %s:%d <-> %s:%d proto %d: %lu bytes, "
+		    "%lu packets, %.3fs\n", a, top[i].key.port[0],
+		    b, top[i].key.port[1], top[i].key.proto,
+		    (unsigned long)top[i].bytes, (unsigned long)top[i].packets,
+		    top[i].usec / 1e6);
+	}
+}
+/*
+ * capture with TPACKET_V3 rings until interrupted, printing counters
+ * every interval seconds
+ */
+int
+ring_capture(const char *dev, const char *filter_exp, int workers,
+    int interval)
+{
+	char errbuf[PCAP_ERRBUF_SIZE];
+	struct ring_config config;
+	struct ring_stats st, last;
+	struct bpf_program fp;
+	struct sock_fprog filter;
+	struct ring *ring;
+	pcap_t *dead;
+	double mbits;
+	/* libpcap compiles the filter, the kernel runs it on each socket */
+	dead = pcap_open_dead(DLT_EN10MB, SNAP_LEN);
+	if (dead == NULL || pcap_compile(dead, &fp, filter_exp, 1,
+	    PCAP_NETMASK_UNKNOWN) == -1) {
+		fprintf(stderr, "Couldn't parse filter %s: %s\n",
+		    filter_exp, dead ? pcap_geterr(dead) : "pcap_open_dead");
+		exit(EXIT_FAILURE);
+	}
+	filter.len = fp.bf_len;
+	filter.filter = (struct sock_filter *)fp.bf_insns;
+	memset(&config, 0, sizeof(config));
+	config.dev = dev;
+	config.snap_len = SNAP_LEN;
+	config.promisc = 1;
+	config.filter = &filter;
+	config.handler = ring_packet;
+	/* the tables have to be there before the first packet */
+	if (workers <= 0)
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers < 1)
+		workers = 1;
+	if (workers > RING_MAX_WORKERS)
+		workers = RING_MAX_WORKERS;
+	config.workers = workers;
+	sniff_init_workers(workers);
+	ring = ring_start(&config, errbuf, sizeof(errbuf));
+	if (ring == NULL) {
+		fprintf(stderr, "Couldn't open rings on %s: %s\n", dev, errbuf);
+		exit(EXIT_FAILURE);
+	}
+	/* the kernel has its own copy of the filter now */
+	pcap_freecode(&fp);
+	pcap_close(dead);
+	printf("Device: %s\n", dev);
+	printf("Workers: %d\n", ring_workers(ring));
+	printf("Filter expression: %s\n", filter_exp);
+	signal(SIGINT, ring_signal);
+	signal(SIGTERM, ring_signal);
+	memset(&last, 0, sizeof(last));
+	while (!ring_done) {
+		sleep(interval);
+		ring_stats(ring, &st);
+		mbits = (st.bytes - last.bytes) * 8.0 / 1e6 / interval;
+		fprintf(stderr, "%10.0f pkts/s %10.1f Mbit/s %10lu drops "
+		    "%8lu freezes %12lu packets\n",
+		    (double)(st.packets - last.packets) / interval, mbits,
+		    (unsigned long)(st.drops - last.drops),
+		    (unsigned long)(st.freezes - last.freezes),
+		    (unsigned long)st.packets);
+		last = st;
+	}
+	ring_stats(ring, &st);
+	ring_stop(ring);
+	printf("\nCapture complete.\n");
+	printf("   Packets: %lu (%lu bytes), %lu dropped by the kernel\n",
+	    (unsigned long)st.packets, (unsigned long)st.bytes,
+	    (unsigned long)st.drops);
+	sniff_report(workers);
+return 0;
+}
+/*
+ * offline mode [5]: every worker walks the whole mapped file and takes
+ * the packets of its own flows
+ */
+#define PCAP_MAGIC		0xa1b2c3d4
+#define PCAP_MAGIC_NSEC		0xa1b23c4d
+struct offline_worker {
+	pthread_t thread;
+	int id;
+	int workers;
+	const u_char *map;
+	size_t len;
+	int swapped;				/* other byte order */
+	int nsec;				/* nanosecond timestamps */
+	const struct bpf_program *fp;
+	unsigned long packets;			/* records in the file */
+	unsigned long bytes;
+	int truncated;
+};
+static uint32_t
+offline_u32(const struct offline_worker *o, const u_char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return o->swapped ? __builtin_bswap32(v) : v;
+}
+static void *
+offline_walk(void *arg)
+{
+	struct offline_worker *o = arg;
+	struct pcap_pkthdr h;
+	struct flow_pkt pkt;
+	const u_char *rec, *data;
+	size_t off = 24;
+	uint32_t caplen;
+	uint64_t usec;
+	while (off + 16 <= o->len) {
+		rec = o->map + off;
+		caplen = offline_u32(o, rec + 8);
+		if (caplen > o->len - off - 16) {
+			o->truncated = 1;
+			break;
+		}
+		data = rec + 16;
+		off += 16 + caplen;
+		o->packets++;
+		h.len = offline_u32(o, rec + 12);
+		o->bytes += h.len;
+		/* only the headers are read for other workers' packets */
+		if (flow_parse(data, caplen, &pkt) < 0) {
+			if (o->id == 0)
+				sniff_workers[0].invalid++;
+			continue;
+		}
+		if (FLOW_PARTITION(&pkt, o->workers) != (unsigned int)o->id)
+			continue;
+		h.ts.tv_sec = offline_u32(o, rec);
+		h.ts.tv_usec = offline_u32(o, rec + 4);
+		h.caplen = caplen;
+		if (o->fp && !pcap_offline_filter(o->fp, &h, data))
+			continue;
+		usec = (uint64_t)h.ts.tv_sec * 1000000 +
+		    (o->nsec ? h.ts.tv_usec / 1000 : h.ts.tv_usec);
+		sniff_count(o->id, usec, &pkt, h.len);
+	}
+	return NULL;
+}
+/*
+ * libpcap reads what we don't (pcapng, for one), on one thread
+ */
+static void
+offline_pcap(const char *fname, struct bpf_program *fp,
+    unsigned long *packets, unsigned long *bytes)
+{
+	char errbuf[PCAP_ERRBUF_SIZE];
+	struct pcap_pkthdr *h;
+	const u_char *data;
+	struct flow_pkt pkt;
+	pcap_t *handle;
+	handle = pcap_open_offline(fname, errbuf);
+	if (handle == NULL) {
+		fprintf(stderr, "Couldn't open %s: %s\n", fname, errbuf);
+		exit(EXIT_FAILURE);
+	}
+	if (pcap_datalink(handle) != DLT_EN10MB) {
+		fprintf(stderr, "%s is not an Ethernet capture\n", fname);
+		exit(EXIT_FAILURE);
+	}
+	while (pcap_next_ex(handle, &h, &data) == 1) {
+		(*packets)++;
+		*bytes += h->len;
+		if (fp && !pcap_offline_filter(fp, h, data))
+			continue;
+		if (flow_parse(data, h->caplen, &pkt) < 0) {
+			sniff_workers[0].invalid++;
+			continue;
+		}
+		sniff_count(0, (uint64_t)h->ts.tv_sec * 1000000 +
+		    h->ts.tv_usec, &pkt, h->len);
+	}
+	pcap_close(handle);
+}
+int
+offline_capture(const char *fname, const char *filter_exp, int workers)
+{
+	struct offline_worker o[RING_MAX_WORKERS];
+	struct bpf_program fp;
+	struct timespec t0, t1;
+	struct stat sb;
+	unsigned long packets = 0, bytes = 0;
+	uint32_t magic = 0, linktype;
+	const u_char *map = NULL;
+	pcap_t *dead;
+	double secs;
+	int fd, i, err, swapped = 0, nsec = 0;
+	fd = open(fname, O_RDONLY);
+	if (fd < 0 || fstat(fd, &sb) < 0) {
+		fprintf(stderr, "Couldn't open %s: %s\n", fname, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (sb.st_size >= 24) {
+		map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			fprintf(stderr, "Couldn't map %s: %s\n", fname,
+			    strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		madvise((void *)map, sb.st_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+		memcpy(&magic, map, 4);
+	}
+	close(fd);
+	if (magic == __builtin_bswap32(PCAP_MAGIC) ||
+	    magic == __builtin_bswap32(PCAP_MAGIC_NSEC)) {
+		swapped = 1;
+		magic = __builtin_bswap32(magic);
+	}
+	nsec = magic == PCAP_MAGIC_NSEC;
+	dead = pcap_open_dead(DLT_EN10MB, SNAP_LEN);
+	if (dead == NULL || pcap_compile(dead, &fp, filter_exp, 1,
+	    PCAP_NETMASK_UNKNOWN) == -1) {
+		fprintf(stderr, "Couldn't parse filter %s: %s\n",
+		    filter_exp, dead ? pcap_geterr(dead) : "pcap_open_dead");
+		exit(EXIT_FAILURE);
+	}
+	if (workers <= 0)
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers < 1)
+		workers = 1;
+	if (workers > RING_MAX_WORKERS)
+		workers = RING_MAX_WORKERS;
+	printf("File: %s\n", fname);
+	printf("Filter expression: %s\n", filter_exp);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (magic != PCAP_MAGIC && magic != PCAP_MAGIC_NSEC) {
+		/* not a classic capture file: libpcap, one worker */
+		workers = 1;
+		sniff_init_workers(workers);
+		printf("Workers: 1 (not a classic pcap file, read by libpcap)\n");
+		offline_pcap(fname, &fp, &packets, &bytes);
+	}
+	else {
+		memcpy(&linktype, map + 20, 4);
+		if ((swapped ? __builtin_bswap32(linktype) : linktype) !=
+		    DLT_EN10MB) {
+			fprintf(stderr, "%s is not an Ethernet capture\n", fname);
+			exit(EXIT_FAILURE);
+		}
+		sniff_init_workers(workers);
+		printf("Workers: %d\n", workers);
+		for (i = 0; i < workers; i++) {
+			memset(&o[i], 0, sizeof(o[i]));
+			o[i].id = i;
+			o[i].workers = workers;
+			o[i].map = map;
+			o[i].len = sb.st_size;
+			o[i].swapped = swapped;
+			o[i].nsec = nsec;
+			o[i].fp = &fp;
+			err = pthread_create(&o[i].thread, NULL, offline_walk, &o[i]);
+			if (err != 0) {
+				fprintf(stderr, "pthread_create: %s\n",
+				    strerror(err));
+				exit(EXIT_FAILURE);
+			}
+		}
+		for (i = 0; i < workers; i++)
+			pthread_join(o[i].thread, NULL);
+		packets = o[0].packets;
+		bytes = o[0].bytes;
+		if (o[0].truncated)
+			fprintf(stderr, "%s: the last packet is cut short\n",
+			    fname);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("\nCapture complete.\n");
+	printf("   Packets: %lu (%lu bytes) in %.3fs, %.1f MB/s of file\n",
+	    packets, bytes, secs,
+	    secs > 0 ? (double)sb.st_size / 1e6 / secs : 0.0);
+	sniff_report(workers);
+	pcap_freecode(&fp);
+	pcap_close(dead);
+	if (map)
+		munmap((void *)map, sb.st_size);
+return 0;
+}
 int main(int argc, char **argv)
 {
 	char *dev = NULL;			/* capture device name */
@@ -473,12 +1008,40 @@ int main(int argc, char **argv)
 	bpf_u_int32 mask;			/* subnet mask */
 	bpf_u_int32 net;			/* ip */
 	int num_packets = 10;			/* number of packets to capture */
+	int workers = -1;			/* ring capture threads [4] */
+	int interval = 1;			/* seconds between counters */
+	char *fname = NULL;			/* capture file [5] */
+	int opt;
 	print_app_banner();
+	while ((opt = getopt(argc, argv, "r:s:i:f:t:")) != -1) {
+		switch (opt) {
+		case 'r':
+			workers = atoi(optarg);
+			break;
+		case 's':
+			sample_every = atol(optarg);
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'f':
+			fname = optarg;
+			break;
+		case 't':
+			flow_timeout = atoi(optarg);
+			break;
+		default:
+			print_app_usage();
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (fname != NULL && argc == optind)
+		return offline_capture(fname, filter_exp, workers);
 	/* check for capture device name on command-line */
-	if (argc == 2) {
-		dev = argv[1];
+	if (argc - optind == 1) {
+		dev = argv[optind];
 	}
-	else if (argc > 2) {
+	else if (argc - optind > 1) {
 		fprintf(stderr, "error: unrecognized command-line options\n\n");
 		print_app_usage();
 		exit(EXIT_FAILURE);
@@ -500,6 +1063,9 @@ int main(int argc, char **argv)
 		net = 0;
 		mask = 0;
 	}
+	if (workers >= 0)
+		return ring_capture(dev, filter_exp, workers,
+		    interval > 0 ? interval : 1);
 	/* print capture info */
 	printf("Device: %s\n", dev);
 	printf("Number of packets: %d\n", num_packets);
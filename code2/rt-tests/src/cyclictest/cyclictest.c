@@ -35,8 +35,10 @@
 #include <sys/utsname.h>
 #include <sys/mman.h>
 #include "rt_numa.h"
+#include "latattr.h"
 
 #include "rt-utils.h"
+#include "rt-hist.h"
 
 #define DEFAULT_INTERVAL 1000
 #define DEFAULT_DISTANCE 500
@@ -103,6 +105,15 @@ extern int clock_nanosleep(clockid_t __clock_id, int __flags,
 /* Must be power of 2 ! */
 #define VALBUF_SIZE		16384
 
+/* Per thread sample stream ring, must be power of 2 ! */
+#define SAMPLE_RING_SIZE	(1 << 20)
+#define SAMPLE_RING_MASK	(SAMPLE_RING_SIZE - 1)
+
+#define CACHELINE_SIZE		64
+#define __cacheline_aligned	__attribute__((aligned(CACHELINE_SIZE)))
+
+#define DEFAULT_REFRESH		10	/* ms between two statistics updates */
+
 #define KVARS			32
 #define KVARNAMELEN		32
 #define KVALUELEN		32
@@ -140,23 +151,59 @@ struct thread_param {
 	int node;
 };
 
-/* Struct for statistics */
+/*
+ * Lockless single producer/single consumer ring of raw samples.  The
+ * measuring thread advances head, the sample writer thread advances tail.
+ * A full ring is never waited on, the sample is counted in drops instead.
+ */
+struct sample_ring {
+	int32_t *buf;
+	unsigned long head;
+	unsigned long drops;
+	unsigned long tail __cacheline_aligned;
+};
+
+/*
+ * Copy of the running statistics for the main thread, published by the
+ * measuring thread under a sequence count, see stat_publish() and
+ * stat_snapshot().
+ */
+struct stat_snapshot {
+	unsigned int seq;
+	unsigned long cycles;
+	long min;
+	long max;
+	long act;
+	double avg;
+};
+
+/*
+ * Struct for statistics
+ *
+ * Grouped by writer so that the monitoring loop never pulls the cache
+ * lines the measuring thread updates on every cycle: the first block is
+ * private to the measuring thread, the main thread only reads snap and
+ * only writes the last block.
+ */
 struct thread_stat {
 	unsigned long cycles;
-	unsigned long cyclesread;
 	long min;
 	long max;
 	long act;
 	double avg;
 	long *values;
 	long *hist_array;
-	pthread_t thread;
+	struct loghist *loghist;
+	long hist_overflow;
 	int threadstarted;
 	int tid;
+	struct sample_ring ring;
+	struct stat_snapshot snap __cacheline_aligned;
+	unsigned long cyclesread __cacheline_aligned;
 	long reduce;
 	long redmax;
 	long cycleofmax;
-	long hist_overflow;
+	pthread_t thread;
 };
 
 static int shutdown;
@@ -169,11 +216,14 @@ static int lockall = 0;
 static int tracetype = NOTRACE;
 static int histogram = 0;
 static int histofall = 0;
+static int loghist = 0;
+static char *samplefile;
 static int duration = 0;
 static int use_nsecs = 0;
 static int refresh_on_max;
 static int force_sched_other;
 static int priospread = 0;
+static int refresh = DEFAULT_REFRESH;
 
 static pthread_cond_t refresh_on_max_cond = PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t refresh_on_max_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -181,6 +231,9 @@ static pthread_mutex_t refresh_on_max_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t break_thread_id_lock = PTHREAD_MUTEX_INITIALIZER;
 static pid_t break_thread_id = 0;
 static uint64_t break_thread_value = 0;
+static int attribution = 0;
+static int break_cpu = -1;
+static int64_t break_expected_ns, break_actual_ns, break_interval_ns;
 
 /* Backup of kernel variables that we modify */
 static struct kvars {
@@ -662,6 +715,44 @@ try_again:
 	return err;
 }
 
+/*
+ * Seqlock writer side: an odd sequence count marks an update in progress.
+ * There is exactly one writer per thread_stat, so no lock is needed.
+ */
+static inline void stat_publish(struct thread_stat *stat)
+{
+	struct stat_snapshot *snap = &stat->snap;
+	unsigned int seq = snap->seq;
+
+	__atomic_store_n(&snap->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	snap->cycles = stat->cycles;
+	snap->min = stat->min;
+	snap->max = stat->max;
+	snap->act = stat->act;
+	snap->avg = stat->avg;
+	__atomic_store_n(&snap->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Seqlock reader side: retry until a consistent copy has been read */
+static void stat_snapshot(struct thread_stat *stat, struct stat_snapshot *copy)
+{
+	struct stat_snapshot *snap = &stat->snap;
+	unsigned int seq;
+
+	do {
+		while ((seq = __atomic_load_n(&snap->seq, __ATOMIC_ACQUIRE)) & 1)
+			sched_yield();
+		copy->cycles = snap->cycles;
+		copy->min = snap->min;
+		copy->max = snap->max;
+		copy->act = snap->act;
+		copy->avg = snap->avg;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&snap->seq, __ATOMIC_RELAXED) != seq);
+	copy->seq = seq;
+}
+
 /*
  * timer thread
  *
@@ -838,8 +929,16 @@ void *timerthread(void *param)
 			tracing(0);
 			shutdown++;
 			pthread_mutex_lock(&break_thread_id_lock);
-			if (break_thread_id == 0)
+			if (break_thread_id == 0) {
 				break_thread_id = stat->tid;
+				if (attribution) {
+					latattr_freeze();
+					break_cpu = sched_getcpu();
+					break_expected_ns = (int64_t) next.tv_sec * NSEC_PER_SEC + next.tv_nsec;
+					break_actual_ns = (int64_t) now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+					break_interval_ns = (int64_t) par->interval * 1000;
+				}
+			}
 			break_thread_value = diff;
 			pthread_mutex_unlock(&break_thread_id_lock);
 		}
@@ -849,14 +948,31 @@ void *timerthread(void *param)
 			stat->values[stat->cycles & par->bufmsk] = diff;
 
 		/* Update the histogram */
-		if (histogram) {
+		if (loghist)
+			loghist_add(stat->loghist, diff);
+		else if (histogram) {
 			if (diff >= histogram)
 				stat->hist_overflow++;
 			else
 				stat->hist_array[diff]++;
 		}
 
+		if (stat->ring.buf) {
+			unsigned long head = stat->ring.head;
+
+			if (head - __atomic_load_n(&stat->ring.tail, __ATOMIC_ACQUIRE)
+			    < SAMPLE_RING_SIZE) {
+				stat->ring.buf[head & SAMPLE_RING_MASK] =
+					diff > INT32_MAX ? INT32_MAX : (int32_t) diff;
+				__atomic_store_n(&stat->ring.head, head + 1,
+						 __ATOMIC_RELEASE);
+			} else
+				__atomic_fetch_add(&stat->ring.drops, 1,
+						   __ATOMIC_RELAXED);
+		}
+
 		stat->cycles++;
+		stat_publish(stat);
 
 		next.tv_sec += interval.tv_sec;
 		next.tv_nsec += interval.tv_nsec;
@@ -913,6 +1029,8 @@ static void display_help(int error)
 	       "cyclictest <options>\n\n"
 	       "-a [NUM] --affinity        run thread #N on processor #N, if possible\n"
 	       "                           with NUM pin all threads to the processor NUM\n"
+	       "-A       --attribute       record irq/softirq/sched/timer events and explain\n"
+	       "                           the break latency (used with -b)\n"
 	       "-b USEC  --breaktrace=USEC send break trace command when latency > USEC\n"
 	       "-B       --preemptirqs     both preempt and irqsoff tracing (used with -b)\n"
 	       "-c CLOCK --clock=CLOCK     select clock\n"
@@ -929,9 +1047,12 @@ static void display_help(int error)
                "                           (with same priority about many threads)\n"
 	       "                           US is the max time to be be tracked in microseconds\n"
 	       "-H       --histofall=US    same as -h except with an additional summary column\n"
+	       "-F FILE  --samplefile=FILE stream every sample in binary form to FILE\n"
 	       "-i INTV  --interval=INTV   base interval of thread in us default=1000\n"
 	       "-I       --irqsoff         Irqsoff tracing (used with -b)\n"
 	       "-l LOOPS --loops=LOOPS     number of loops: default=0(endless)\n"
+	       "-L       --loghist         log-linear histogram with ~3%% resolution and no\n"
+	       "                           overflow, implies -h (US is then ignored)\n"
 	       "-m       --mlockall        lock current and future memory allocations\n"
 	       "-M       --refresh_on_max  delay updating the screen until a new max latency is hit\n" 
 	       "-n       --nanosleep       use clock_nanosleep\n"
@@ -943,6 +1064,7 @@ static void display_help(int error)
 	       "-q       --quiet           print only a summary on exit\n"
 	       "-Q       --priospread       spread priority levels starting at specified value\n"
 	       "-r       --relative        use relative timer instead of absolute\n"
+	       "-R MS    --refresh=MS      statistics display update interval in ms, default=10\n"
 	       "-s       --system          use sys_nanosleep and sys_setitimer\n"
 	       "-t       --threads         one thread per available processor\n"
 	       "-t [NUM] --threads=NUM     number of threads:\n"
@@ -1047,6 +1169,7 @@ static void process_options (int argc, char *argv[])
 		/** Options for getopt */
 		static struct option long_options[] = {
 			{"affinity", optional_argument, NULL, 'a'},
+			{"attribute", no_argument, NULL, 'A'},
 			{"breaktrace", required_argument, NULL, 'b'},
 			{"preemptirqs", no_argument, NULL, 'B'},
 			{"clock", required_argument, NULL, 'c'},
@@ -1057,8 +1180,10 @@ static void process_options (int argc, char *argv[])
 			{"histogram", required_argument, NULL, 'h'},
 			{"histofall", required_argument, NULL, 'H'},
 			{"interval", required_argument, NULL, 'i'},
+			{"samplefile", required_argument, NULL, 'F'},
 			{"irqsoff", no_argument, NULL, 'I'},
 			{"loops", required_argument, NULL, 'l'},
+			{"loghist", no_argument, NULL, 'L'},
 			{"mlockall", no_argument, NULL, 'm' },
 			{"refresh_on_max", no_argument, NULL, 'M' },
 			{"nanosleep", no_argument, NULL, 'n'},
@@ -1069,6 +1194,7 @@ static void process_options (int argc, char *argv[])
 			{"preemptoff", no_argument, NULL, 'P'},
 			{"quiet", no_argument, NULL, 'q'},
 			{"relative", no_argument, NULL, 'r'},
+			{"refresh", required_argument, NULL, 'R'},
 			{"system", no_argument, NULL, 's'},
 			{"threads", optional_argument, NULL, 't'},
 			{"unbuffered", no_argument, NULL, 'u'},
@@ -1085,7 +1211,7 @@ static void process_options (int argc, char *argv[])
 			{"priospread", no_argument, NULL, 'Q'},
 			{NULL, 0, NULL, 0}
 		};
-		int c = getopt_long(argc, argv, "a::b:Bc:Cd:Efh:H:i:Il:MnNo:O:p:PmqQrsSt::uUvD:wWT:y:e:",
+		int c = getopt_long(argc, argv, "a::Ab:Bc:Cd:EfF:h:H:i:Il:LMnNo:O:p:PmqQrR:sSt::uUvD:wWT:y:e:",
 				    long_options, &option_index);
 		if (c == -1)
 			break;
@@ -1104,6 +1230,7 @@ static void process_options (int argc, char *argv[])
 				setaffinity = AFFINITY_USEALL;
 			}
 			break;
+		case 'A': attribution = 1; break;
 		case 'b': tracelimit = atoi(optarg); break;
 		case 'B': tracetype = PREEMPTIRQSOFF; break;
 		case 'c': clocksel = atoi(optarg); break;
@@ -1111,6 +1238,7 @@ static void process_options (int argc, char *argv[])
 		case 'd': distance = atoi(optarg); break;
 		case 'E': enable_events = 1; break;
 		case 'f': tracetype = FUNCTION; ftrace = 1; break;
+		case 'F': samplefile = optarg; break;
 		case 'H': histofall = 1; /* fall through */
 		case 'h': histogram = atoi(optarg); break;
 		case 'i': interval = atoi(optarg); break;
@@ -1124,6 +1252,7 @@ static void process_options (int argc, char *argv[])
 			}
 			break;
 		case 'l': max_cycles = atoi(optarg); break;
+		case 'L': loghist = 1; break;
 		case 'n': use_nanosleep = MODE_CLOCK_NANOSLEEP; break;
 		case 'N': use_nsecs = 1; break;
 		case 'o': oscope_reduction = atoi(optarg); break;
@@ -1145,6 +1274,7 @@ static void process_options (int argc, char *argv[])
 		case 'q': quiet = 1; break;
 		case 'Q': priospread = 1; break;
 		case 'r': timermode = TIMER_RELTIME; break;
+		case 'R': refresh = atoi(optarg); break;
 		case 's': use_system = MODE_SYS_OFFSET; break;
 		case 't':
 			if (smp) {
@@ -1227,9 +1357,22 @@ static void process_options (int argc, char *argv[])
 	if (clocksel < 0 || clocksel > ARRAY_SIZE(clocksources))
 		error = 1;
 
+	if (attribution && !tracelimit) {
+		warn("-A only meaningful with -b\n");
+		error = 1;
+	}
+
+	if (attribution && clocksources[clocksel] != CLOCK_MONOTONIC) {
+		warn("-A needs CLOCK_MONOTONIC\n");
+		error = 1;
+	}
+
 	if (oscope_reduction < 1)
 		error = 1;
 
+	if (refresh < 1)
+		error = 1;
+
 	if (oscope_reduction > 1 && !verbose) {
 		warn("-o option only meaningful, if verbose\n");
 		error = 1;
@@ -1241,7 +1384,11 @@ static void process_options (int argc, char *argv[])
 	if (histogram > HIST_MAX)
 		histogram = HIST_MAX;
 
-	if (histogram && distance != -1)
+	/* the log histogram replaces the linear one, nothing to allocate */
+	if (loghist)
+		histogram = 0;
+
+	if ((histogram || loghist) && distance != -1)
 		warn("distance is ignored and set to 0, if histogram enabled\n");
 	if (distance == -1)
 		distance = DEFAULT_DISTANCE;
@@ -1339,15 +1486,62 @@ static void print_tids(struct thread_param *par[], int nthreads)
 	printf("\n");
 }
 
-static void print_hist(struct thread_param *par[], int nthreads)
+/*
+ * Dump the non empty buckets of the log-linear histograms, labelled with
+ * the smallest latency they hold, followed by per thread percentiles.
+ */
+static void print_loghist(struct thread_param *par[], int nthreads,
+			  unsigned long long int *log_entries)
 {
+	static const double pcts[] = { 50.0, 90.0, 99.0, 99.9, 99.99, 99.999 };
+	struct loghist *all;
 	int i, j;
-	unsigned long long int log_entries[nthreads+1];
-	unsigned long maxmax, alloverflows;
 
-	bzero(log_entries, sizeof(log_entries));
+	all = calloc(1, sizeof(*all));
+	if (!all)
+		fatal("failed to allocate summary histogram\n");
+	for (j = 0; j < nthreads; j++)
+		loghist_merge(all, par[j]->stats->loghist);
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		if (!all->count[i])
+			continue;
+
+		printf("%06llu ", (unsigned long long) loghist_lower(i));
+
+		for (j = 0; j < nthreads; j++) {
+			unsigned long long curr = par[j]->stats->loghist->count[i];
+			printf("%06llu", curr);
+			if (j < nthreads - 1)
+				printf("\t");
+			log_entries[j] += curr;
+		}
+		if (histofall && nthreads > 1) {
+			printf("\t%06llu", all->count[i]);
+			log_entries[nthreads] += all->count[i];
+		}
+		printf("\n");
+	}
+
+	for (i = 0; i < ARRAY_SIZE(pcts); i++) {
+		printf("# P%g Latencies:", pcts[i]);
+		for (j = 0; j < nthreads; j++)
+			printf(" %05llu", (unsigned long long)
+			       loghist_percentile(par[j]->stats->loghist, pcts[i]));
+		if (histofall && nthreads > 1)
+			printf(" %05llu", (unsigned long long)
+			       loghist_percentile(all, pcts[i]));
+		printf("\n");
+	}
+	free(all);
+}
+
+/* Dump one line per microsecond (nanosecond) up to the histogram limit */
+static void print_linhist(struct thread_param *par[], int nthreads,
+			  unsigned long long int *log_entries)
+{
+	int i, j;
 
-	printf("# Histogram\n");
 	for (i = 0; i < histogram; i++) {
 		unsigned long long int allthreads = 0;
 
@@ -1367,6 +1561,21 @@ static void print_hist(struct thread_param *par[], int nthreads)
 		}
 		printf("\n");
 	}
+}
+
+static void print_hist(struct thread_param *par[], int nthreads)
+{
+	int j;
+	unsigned long long int log_entries[nthreads+1];
+	unsigned long maxmax, alloverflows;
+
+	bzero(log_entries, sizeof(log_entries));
+
+	printf("# Histogram\n");
+	if (loghist)
+		print_loghist(par, nthreads, log_entries);
+	else
+		print_linhist(par, nthreads, log_entries);
 	printf("# Total:");
 	for (j = 0; j < nthreads; j++)
 		printf(" %09llu", log_entries[j]);
@@ -1406,6 +1615,9 @@ static void print_hist(struct thread_param *par[], int nthreads)
 static void print_stat(struct thread_param *par, int index, int verbose)
 {
 	struct thread_stat *stat = par->stats;
+	struct stat_snapshot snap;
+
+	stat_snapshot(stat, &snap);
 
 	if (!verbose) {
 		if (quiet != 1) {
@@ -1417,12 +1629,12 @@ static void print_stat(struct thread_param *par, int index, int verbose)
                                 fmt = "T:%2d (%5d) P:%2d I:%ld C:%7lu "
 					"Min:%7ld Act:%5ld Avg:%5ld Max:%8ld\n";
                         printf(fmt, index, stat->tid, par->prio, 
-                               par->interval, stat->cycles, stat->min, stat->act,
-			       stat->cycles ?
-			       (long)(stat->avg/stat->cycles) : 0, stat->max);
+                               par->interval, snap.cycles, snap.min, snap.act,
+			       snap.cycles ?
+			       (long)(snap.avg/snap.cycles) : 0, snap.max);
 		}
 	} else {
-		while (stat->cycles != stat->cyclesread) {
+		while (snap.cycles != stat->cyclesread) {
 			long diff = stat->values
 			    [stat->cyclesread & par->bufmsk];
 
@@ -1441,6 +1653,136 @@ static void print_stat(struct thread_param *par, int index, int verbose)
 	}
 }
 
+/*
+ * Binary sample stream (-F): a file header followed by chunks, each a
+ * chunk header plus count raw int32_t latencies of one thread in the
+ * unit of the run (us, or ns with -N).  Samples of a thread are in
+ * order; seq is the index of the first sample of the chunk within the
+ * stream of that thread and drops the number of samples lost so far
+ * because the writer could not keep up.
+ */
+#define SAMPLE_MAGIC	"CYCSMPL1"
+
+struct sample_file_header {
+	char magic[8];
+	uint32_t nthreads;
+	uint32_t unit_ns;
+	uint32_t interval;
+	uint32_t distance;
+};
+
+struct sample_chunk_header {
+	uint32_t thread;
+	uint32_t count;
+	uint64_t seq;
+	uint64_t drops;
+};
+
+static int sample_fd = -1;
+static int sample_writer_stop;
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len) {
+		ssize_t ret = write(fd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int sample_write_chunk(int thread, struct sample_ring *ring,
+			      unsigned long from, unsigned long count)
+{
+	struct sample_chunk_header ch;
+
+	ch.thread = thread;
+	ch.count = count;
+	ch.seq = from;
+	ch.drops = __atomic_load_n(&ring->drops, __ATOMIC_RELAXED);
+	if (write_all(sample_fd, &ch, sizeof(ch)))
+		return -1;
+	return write_all(sample_fd, &ring->buf[from & SAMPLE_RING_MASK],
+			 count * sizeof(int32_t));
+}
+
+/* Move everything the measuring threads produced so far to the file */
+static void sample_drain(struct thread_stat **statistics, int nthreads)
+{
+	int i;
+
+	for (i = 0; i < nthreads && sample_fd >= 0; i++) {
+		struct sample_ring *ring = &statistics[i]->ring;
+		unsigned long head, tail, count;
+
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		tail = ring->tail;
+		while (tail != head) {
+			/* do not run over the end of the ring */
+			count = SAMPLE_RING_SIZE - (tail & SAMPLE_RING_MASK);
+			if (count > head - tail)
+				count = head - tail;
+			if (sample_write_chunk(i, ring, tail, count)) {
+				warn("sample stream write failed: %s\n",
+				     strerror(errno));
+				close(sample_fd);
+				sample_fd = -1;
+				break;
+			}
+			tail += count;
+			__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+/*
+ * Sample writer thread, runs SCHED_OTHER so the file I/O never competes
+ * with the measuring threads.
+ */
+static void *samplewriter(void *param)
+{
+	struct thread_stat **statistics = param;
+	struct sched_param schedp;
+
+	memset(&schedp, 0, sizeof(schedp));
+	sched_setscheduler(0, SCHED_OTHER, &schedp);
+
+	while (!__atomic_load_n(&sample_writer_stop, __ATOMIC_ACQUIRE)) {
+		sample_drain(statistics, num_threads);
+		usleep(10000);
+	}
+	/* the measuring threads are gone, pick up the rest */
+	sample_drain(statistics, num_threads);
+	return NULL;
+}
+
+static void open_samplefile(void)
+{
+	struct sample_file_header hdr;
+
+	sample_fd = open(samplefile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (sample_fd < 0)
+		fatal("could not open sample file %s: %s\n", samplefile,
+		      strerror(errno));
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SAMPLE_MAGIC, sizeof(hdr.magic));
+	hdr.nthreads = num_threads;
+	hdr.unit_ns = use_nsecs ? 1 : 1000;
+	hdr.interval = interval;
+	hdr.distance = (histogram || loghist) ? 0 : distance;
+	if (write_all(sample_fd, &hdr, sizeof(hdr)))
+		fatal("could not write sample file %s: %s\n", samplefile,
+		      strerror(errno));
+}
+
 int main(int argc, char **argv)
 {
 	sigset_t sigset;
@@ -1451,6 +1793,8 @@ int main(int argc, char **argv)
 	int max_cpus = sysconf(_SC_NPROCESSORS_CONF);
 	int i, ret = -1;
 	int status;
+	pthread_t writer;
+	int writer_started = 0;
 
 	process_options(argc, argv);
 
@@ -1480,6 +1824,9 @@ int main(int argc, char **argv)
 	if (check_timer())
 		warn("High resolution timers not available\n");
 
+	if (attribution && latattr_setup(max_cpus))
+		fatal("could not set up latency attribution, see above\n");
+
 	mode = use_nanosleep + use_system;
 
 	sigemptyset(&sigset);
@@ -1496,6 +1843,9 @@ int main(int argc, char **argv)
 	if (!statistics)
 		goto outpar;
 
+	if (samplefile)
+		open_samplefile();
+
 	for (i = 0; i < num_threads; i++) {
 		pthread_attr_t attr;
 		int node;
@@ -1555,6 +1905,25 @@ int main(int argc, char **argv)
 			memset(stat->hist_array, 0, bufsize);
 		}
 
+		if (loghist) {
+			stat->loghist = threadalloc(sizeof(struct loghist), node);
+			if (stat->loghist == NULL)
+				fatal("failed to allocate log histogram on node %d\n",
+				      node);
+			memset(stat->loghist, 0, sizeof(struct loghist));
+		}
+
+		/* prefault the ring, the measuring thread must not page fault */
+		if (samplefile) {
+			stat->ring.buf = mmap(NULL, SAMPLE_RING_SIZE * sizeof(int32_t),
+					      PROT_READ | PROT_WRITE,
+					      MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+					      -1, 0);
+			if (stat->ring.buf == MAP_FAILED)
+				fatal("failed to map sample ring for thread %d: %s\n",
+				      i, strerror(errno));
+		}
+
 		if (verbose) {
 			int bufsize = VALBUF_SIZE * sizeof(long);
 			stat->values = threadalloc(bufsize, node);
@@ -1578,7 +1947,7 @@ int main(int argc, char **argv)
 		par->timermode = timermode;
 		par->signal = signum;
 		par->interval = interval;
-		if (!histogram) /* same interval on CPUs */
+		if (!histogram && !loghist) /* same interval on CPUs */
 			interval += distance;
 		if (verbose)
 			printf("Thread %d Interval: %d\n", i, interval);
@@ -1593,6 +1962,7 @@ int main(int argc, char **argv)
 		stat->min = 1000000;
 		stat->max = 0;
 		stat->avg = 0.0;
+		stat->snap.min = stat->min;
 		stat->threadstarted = 1;
 		status = pthread_create(&stat->thread, &attr, timerthread, par);
 		if (status)
@@ -1600,6 +1970,14 @@ int main(int argc, char **argv)
 
 	}
 
+	if (samplefile) {
+		status = pthread_create(&writer, NULL, samplewriter, statistics);
+		if (status)
+			fatal("failed to create sample writer thread: %s\n",
+			      strerror(status));
+		writer_started = 1;
+	}
+
 	while (!shutdown) {
 		char lavg[256];
 		int fd, len, allstopped = 0;
@@ -1627,13 +2005,15 @@ int main(int argc, char **argv)
 		}
 
 		for (i = 0; i < num_threads; i++) {
+			struct stat_snapshot snap;
 
 			print_stat(parameters[i], i, verbose);
-			if(max_cycles && statistics[i]->cycles >= max_cycles)
+			stat_snapshot(statistics[i], &snap);
+			if(max_cycles && snap.cycles >= max_cycles)
 				allstopped++;
 		}
 
-		usleep(10000);
+		usleep(refresh * 1000);
 		if (shutdown || allstopped)
 			break;
 		if (!verbose && !quiet)
@@ -1659,17 +2039,40 @@ int main(int argc, char **argv)
 			pthread_kill(statistics[i]->thread, SIGTERM);
 		if (statistics[i]->threadstarted) {
 			pthread_join(statistics[i]->thread, NULL);
-			if (quiet && !histogram)
+			if (quiet && !histogram && !loghist)
 				print_stat(parameters[i], i, 0);
 		}
 		if (statistics[i]->values)
 			threadfree(statistics[i]->values, VALBUF_SIZE*sizeof(long), parameters[i]->node);
 	}
 
-	if (histogram) {
+	if (writer_started) {
+		__atomic_store_n(&sample_writer_stop, 1, __ATOMIC_RELEASE);
+		pthread_join(writer, NULL);
+	}
+	if (samplefile) {
+		printf("# Sample stream drops:");
+		for (i = 0; i < num_threads; i++) {
+			if (!statistics[i])
+				continue;
+			printf(" %05lu", statistics[i]->ring.drops);
+			if (statistics[i]->ring.buf)
+				munmap(statistics[i]->ring.buf,
+				       SAMPLE_RING_SIZE * sizeof(int32_t));
+		}
+		printf("\n");
+		if (sample_fd >= 0)
+			close(sample_fd);
+	}
+
+	if (histogram || loghist) {
 		print_hist(parameters, num_threads);
-		for (i = 0; i < num_threads; i++)
-			threadfree(statistics[i]->hist_array, histogram*sizeof(long), parameters[i]->node);
+		for (i = 0; i < num_threads; i++) {
+			if (statistics[i]->loghist)
+				threadfree(statistics[i]->loghist, sizeof(struct loghist), parameters[i]->node);
+			if (statistics[i]->hist_array)
+				threadfree(statistics[i]->hist_array, histogram*sizeof(long), parameters[i]->node);
+		}
 	}
 
 	if (tracelimit) {
@@ -1677,6 +2080,10 @@ int main(int argc, char **argv)
 		if (break_thread_id) {
 			printf("# Break thread: %d\n", break_thread_id);
 			printf("# Break value: %llu\n", (unsigned long long)break_thread_value);
+			if (attribution && break_cpu >= 0)
+				latattr_report(break_cpu, break_thread_id,
+					       break_expected_ns, break_actual_ns,
+					       break_interval_ns, use_nsecs);
 		}
 	}
 	
@@ -1698,6 +2105,9 @@ int main(int argc, char **argv)
 	if (tracelimit)
 		tracing(0);
 
+	if (attribution)
+		latattr_cleanup();
+
 
 	/* close any tracer file descriptors */
 	if (trace_fd >= 0)
@@ -0,0 +1,559 @@
+/*
+ * Latency root cause attribution for cyclictest
+ *
+ * Every CPU gets one perf ring buffer, mapped read only and written
+ * backwards, i.e. in overwrite mode: the kernel always keeps the most
+ * recent events and nobody has to read them while the test runs.  All
+ * tracepoint events of a CPU are redirected into that ring.  When the
+ * break trace limit is hit the rings are paused, and the events that
+ * preceded the late wakeup are decoded, dumped and used to split the
+ * latency into timer, hardirq, softirq, preemption and other time.
+ *
+ * Timestamps are taken from CLOCK_MONOTONIC, so they can be compared
+ * with the expected and actual wakeup times cyclictest measured.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "rt-utils.h"
+#include "error.h"
+#include "latattr.h"
+
+/* data pages per CPU ring, must be power of 2 ! */
+#define LATATTR_PAGES	256
+
+#define TP_FIELDS	4
+#define COMM_LEN	16
+
+enum {
+	EV_IRQ_ENTRY,
+	EV_IRQ_EXIT,
+	EV_SOFTIRQ_ENTRY,
+	EV_SOFTIRQ_EXIT,
+	EV_SWITCH,
+	EV_WAKEUP,
+	EV_TIMER_ENTRY,
+	EV_TIMER_EXIT,
+	EV_MAX,
+};
+
+struct tp_field {
+	int offset;
+	int size;
+};
+
+static struct tracepoint {
+	const char *event;
+	const char *fields[TP_FIELDS];
+	int id;
+	struct tp_field f[TP_FIELDS];
+} tracepoints[EV_MAX] = {
+	[EV_IRQ_ENTRY]		= { "irq/irq_handler_entry", { "irq" } },
+	[EV_IRQ_EXIT]		= { "irq/irq_handler_exit", { "irq" } },
+	[EV_SOFTIRQ_ENTRY]	= { "irq/softirq_entry", { "vec" } },
+	[EV_SOFTIRQ_EXIT]	= { "irq/softirq_exit", { "vec" } },
+	[EV_SWITCH]		= { "sched/sched_switch",
+				    { "prev_comm", "prev_pid",
+				      "next_comm", "next_pid" } },
+	[EV_WAKEUP]		= { "sched/sched_wakeup", { "comm", "pid" } },
+	[EV_TIMER_ENTRY]	= { "timer/hrtimer_expire_entry", { "function" } },
+	[EV_TIMER_EXIT]		= { "timer/hrtimer_expire_exit", { "hrtimer" } },
+};
+
+/* one decoded event */
+struct attr_event {
+	int64_t time;
+	int cpu;
+	int type;
+	long a;
+	long b;
+	char comm1[COMM_LEN];
+	char comm2[COMM_LEN];
+};
+
+struct cpu_ring {
+	int *fds;
+	int nfds;
+	void *base;
+};
+
+static struct cpu_ring *rings;
+static int nr_rings;
+static size_t page_size;
+
+static const char *tracefs_prefix(void)
+{
+	char *prefix = get_debugfileprefix();
+
+	if (prefix[0] != '\0')
+		return prefix;
+	return "/sys/kernel/tracing/";
+}
+
+/*
+ * Read the id and the offsets of the fields we need from
+ * events/<system>/<event>/format
+ */
+static int tp_parse(struct tracepoint *tp)
+{
+	char path[MAX_PATH], line[256];
+	FILE *fp;
+	int i;
+
+	snprintf(path, sizeof(path), "%sevents/%s/format",
+		 tracefs_prefix(), tp->event);
+	if ((fp = fopen(path, "r")) == NULL)
+		return -1;
+
+	tp->id = -1;
+	for (i = 0; i < TP_FIELDS; i++)
+		tp->f[i].size = 0;
+
+	while (fgets(line, sizeof(line), fp)) {
+		char *field, *name, *end;
+
+		if (sscanf(line, "ID: %d", &tp->id) == 1)
+			continue;
+		if ((field = strstr(line, "field:")) == NULL)
+			continue;
+		if ((end = strchr(field, ';')) == NULL)
+			continue;
+		*end = '\0';
+		/* the name is the last word, minus any array suffix */
+		if ((name = strrchr(field, ' ')) == NULL)
+			continue;
+		name++;
+		if ((field = strchr(name, '[')) != NULL)
+			*field = '\0';
+
+		for (i = 0; i < TP_FIELDS && tp->fields[i]; i++) {
+			if (strcmp(tp->fields[i], name))
+				continue;
+			sscanf(end + 1, " offset:%d; size:%d;",
+			       &tp->f[i].offset, &tp->f[i].size);
+		}
+	}
+	fclose(fp);
+
+	for (i = 0; i < TP_FIELDS && tp->fields[i]; i++)
+		if (!tp->f[i].size)
+			return -1;
+	return tp->id < 0 ? -1 : 0;
+}
+
+static long tp_value(const char *raw, int rawsize, struct tp_field *f)
+{
+	if (f->offset + f->size > rawsize)
+		return 0;
+	switch (f->size) {
+	case 1: return *(int8_t *)(raw + f->offset);
+	case 2: return *(int16_t *)(raw + f->offset);
+	case 4: return *(int32_t *)(raw + f->offset);
+	case 8: return *(int64_t *)(raw + f->offset);
+	}
+	return 0;
+}
+
+static void tp_comm(char *dst, const char *raw, int rawsize, struct tp_field *f)
+{
+	int len = f->size < COMM_LEN ? f->size : COMM_LEN;
+
+	memset(dst, 0, COMM_LEN);
+	if (f->offset + len <= rawsize)
+		memcpy(dst, raw + f->offset, len);
+	dst[COMM_LEN - 1] = '\0';
+}
+
+static int perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu,
+			   int group_fd, unsigned long flags)
+{
+	return syscall(__NR_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+/*
+ * Open all tracepoints on all CPUs.  Tracepoints the kernel does not
+ * have are skipped, failing to set up a ring at all is an error.
+ */
+int latattr_setup(int max_cpus)
+{
+	struct perf_event_attr attr;
+	int cpu, ev;
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+	for (ev = 0; ev < EV_MAX; ev++) {
+		if (tp_parse(&tracepoints[ev])) {
+			warn("tracepoint %s not available\n",
+			     tracepoints[ev].event);
+			tracepoints[ev].id = -1;
+		}
+	}
+
+	rings = calloc(max_cpus, sizeof(struct cpu_ring));
+	if (!rings)
+		fatal("failed to allocate attribution rings\n");
+	nr_rings = max_cpus;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_TRACEPOINT;
+	attr.size = sizeof(attr);
+	attr.sample_period = 1;
+	attr.sample_type = PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_RAW;
+	attr.use_clockid = 1;
+	attr.clockid = CLOCK_MONOTONIC;
+	attr.write_backward = 1;
+
+	for (cpu = 0; cpu < max_cpus; cpu++) {
+		struct cpu_ring *ring = &rings[cpu];
+
+		ring->fds = calloc(EV_MAX, sizeof(int));
+		if (!ring->fds)
+			fatal("failed to allocate attribution fds\n");
+
+		for (ev = 0; ev < EV_MAX; ev++) {
+			int fd;
+
+			if (tracepoints[ev].id < 0)
+				continue;
+			attr.config = tracepoints[ev].id;
+			fd = perf_event_open(&attr, -1, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+			if (fd < 0) {
+				/* offline CPUs simply stay without a ring */
+				if (errno == ENODEV)
+					break;
+				err_msg_n(errno, "perf_event_open %s on CPU %d",
+					  tracepoints[ev].event, cpu);
+				return -1;
+			}
+			if (!ring->nfds) {
+				ring->base = mmap(NULL, (LATATTR_PAGES + 1) * page_size,
+						  PROT_READ, MAP_SHARED, fd, 0);
+				if (ring->base == MAP_FAILED) {
+					err_msg_n(errno, "mmap of perf ring for CPU %d", cpu);
+					close(fd);
+					ring->base = NULL;
+					return -1;
+				}
+			} else if (ioctl(fd, PERF_EVENT_IOC_SET_OUTPUT, ring->fds[0])) {
+				err_msg_n(errno, "redirecting %s on CPU %d",
+					  tracepoints[ev].event, cpu);
+				close(fd);
+				return -1;
+			}
+			ring->fds[ring->nfds++] = fd;
+		}
+	}
+	return 0;
+}
+
+/* Stop recording, called by the measuring thread that hit the limit */
+void latattr_freeze(void)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < nr_rings; cpu++)
+		if (rings[cpu].nfds)
+			ioctl(rings[cpu].fds[0], PERF_EVENT_IOC_PAUSE_OUTPUT, 1);
+}
+
+static void ring_copy(const char *data, size_t mask, uint64_t off,
+		      void *dst, size_t len)
+{
+	char *d = dst;
+
+	while (len--)
+		*d++ = data[off++ & mask];
+}
+
+static void decode_sample(int cpu, const char *rec, size_t len,
+			  struct attr_event *e)
+{
+	const char *raw, *end = rec + len;
+	uint32_t rawsize;
+	struct tracepoint *tp;
+	int type;
+
+	/* header, pid, tid, time, raw size, raw data */
+	e->type = -1;
+	if (len < sizeof(struct perf_event_header) + 8 + 8 + 4)
+		return;
+	rec += sizeof(struct perf_event_header) + 8;
+	memcpy(&e->time, rec, 8);
+	rec += 8;
+	memcpy(&rawsize, rec, 4);
+	raw = rec + 4;
+	if (rawsize < 2 || raw + rawsize > end)
+		rawsize = 0;
+	if (!rawsize)
+		return;
+
+	for (type = 0; type < EV_MAX; type++)
+		if (tracepoints[type].id == *(uint16_t *)raw)
+			break;
+	if (type == EV_MAX)
+		return;
+
+	tp = &tracepoints[type];
+	e->type = type;
+	e->cpu = cpu;
+	switch (type) {
+	case EV_SWITCH:
+		tp_comm(e->comm1, raw, rawsize, &tp->f[0]);
+		e->a = tp_value(raw, rawsize, &tp->f[1]);
+		tp_comm(e->comm2, raw, rawsize, &tp->f[2]);
+		e->b = tp_value(raw, rawsize, &tp->f[3]);
+		break;
+	case EV_WAKEUP:
+		tp_comm(e->comm1, raw, rawsize, &tp->f[0]);
+		e->a = tp_value(raw, rawsize, &tp->f[1]);
+		break;
+	default:
+		e->a = tp_value(raw, rawsize, &tp->f[0]);
+		break;
+	}
+}
+
+/*
+ * Walk a backward written ring from the newest record towards the
+ * oldest one, until the buffer is exhausted or we hit unwritten space.
+ */
+static int read_ring(int cpu, struct attr_event **events, int *nevents,
+		     int *size)
+{
+	struct cpu_ring *ring = &rings[cpu];
+	struct perf_event_mmap_page *pc = ring->base;
+	size_t data_size = LATATTR_PAGES * page_size;
+	size_t mask = data_size - 1;
+	const char *data = (char *)ring->base + page_size;
+	uint64_t head, off;
+	static char rec[65536];
+
+	head = __atomic_load_n(&pc->data_head, __ATOMIC_ACQUIRE);
+	for (off = head; off - head + sizeof(struct perf_event_header) <= data_size; ) {
+		struct perf_event_header hdr;
+
+		ring_copy(data, mask, off, &hdr, sizeof(hdr));
+		if (hdr.size == 0 || off - head + hdr.size > data_size)
+			break;
+		if (hdr.type == PERF_RECORD_SAMPLE) {
+			if (*nevents == *size) {
+				*size = *size ? *size * 2 : 4096;
+				*events = realloc(*events, *size * sizeof(**events));
+				if (!*events)
+					return -1;
+			}
+			ring_copy(data, mask, off, rec, hdr.size);
+			decode_sample(cpu, rec, hdr.size, &(*events)[*nevents]);
+			if ((*events)[*nevents].type >= 0)
+				(*nevents)++;
+		}
+		off += hdr.size;
+	}
+	return 0;
+}
+
+static int cmp_event(const void *p1, const void *p2)
+{
+	const struct attr_event *e1 = p1, *e2 = p2;
+
+	if (e1->time < e2->time)
+		return -1;
+	return e1->time > e2->time;
+}
+
+static void print_event(struct attr_event *e, int64_t expected_ns)
+{
+	printf("# %+12.3f CPU%-3d %-22s", (e->time - expected_ns) / 1000.0,
+	       e->cpu, strchr(tracepoints[e->type].event, '/') + 1);
+	switch (e->type) {
+	case EV_IRQ_ENTRY:
+	case EV_IRQ_EXIT:
+		printf(" irq=%ld", e->a);
+		break;
+	case EV_SOFTIRQ_ENTRY:
+	case EV_SOFTIRQ_EXIT:
+		printf(" vec=%ld", e->a);
+		break;
+	case EV_SWITCH:
+		printf(" %s:%ld ==> %s:%ld", e->comm1, e->a, e->comm2, e->b);
+		break;
+	case EV_WAKEUP:
+		printf(" %s:%ld", e->comm1, e->a);
+		break;
+	case EV_TIMER_ENTRY:
+		printf(" function=%p", (void *)e->a);
+		break;
+	}
+	printf("\n");
+}
+
+/* where the time between expected and actual wakeup went */
+enum { CAUSE_TIMER, CAUSE_HARDIRQ, CAUSE_SOFTIRQ, CAUSE_PREEMPT,
+       CAUSE_OTHER, CAUSE_MAX };
+
+static const char *cause_names[CAUSE_MAX] = {
+	"timer", "hardirq", "softirq", "preemption", "other",
+};
+
+static int64_t overlap(int64_t from, int64_t to, int64_t start, int64_t end)
+{
+	if (from < start)
+		from = start;
+	if (to > end)
+		to = end;
+	return to > from ? to - from : 0;
+}
+
+/*
+ * Task context time before the wakeup is timer slack, between wakeup
+ * and the switch to the thread it is preemption, anything after that
+ * the thread's own way back to user space.
+ */
+static void charge_phases(int64_t *causes, int64_t from, int64_t to,
+			  int64_t t_wake, int64_t t_switch)
+{
+	causes[CAUSE_TIMER] += overlap(from, to, INT64_MIN, t_wake);
+	causes[CAUSE_PREEMPT] += overlap(from, to, t_wake, t_switch);
+	causes[CAUSE_OTHER] += overlap(from, to, t_switch, INT64_MAX);
+}
+
+void latattr_report(int cpu, pid_t tid, int64_t expected_ns,
+		    int64_t actual_ns, int64_t lookback_ns, int use_nsecs)
+{
+	struct attr_event *events = NULL;
+	int nevents = 0, size = 0;
+	int64_t t_sleep, t_wake, t_switch, t, last;
+	int64_t causes[CAUSE_MAX];
+	int hard = 0, soft = 0;
+	const char *preemptor = NULL;
+	long preemptor_pid = 0;
+	int i, c;
+
+	for (c = 0; c < nr_rings; c++)
+		if (rings[c].nfds && read_ring(c, &events, &nevents, &size))
+			fatal("failed to allocate attribution events\n");
+	qsort(events, nevents, sizeof(*events), cmp_event);
+
+	/* the thread went to sleep, was woken and got the CPU back */
+	t_sleep = expected_ns - lookback_ns;
+	t_wake = t_switch = -1;
+	for (i = 0; i < nevents; i++) {
+		struct attr_event *e = &events[i];
+
+		if (e->time > actual_ns)
+			break;
+		if (e->type == EV_SWITCH && e->a == tid && e->time < expected_ns)
+			t_sleep = e->time;
+	}
+	for (i = 0; i < nevents && t_wake < 0; i++)
+		if (events[i].type == EV_WAKEUP && events[i].a == tid &&
+		    events[i].time >= t_sleep && events[i].time <= actual_ns)
+			t_wake = events[i].time;
+	/* no wakeup event, use the first hrtimer expiry after the deadline */
+	for (i = 0; i < nevents && t_wake < 0; i++)
+		if (events[i].type == EV_TIMER_ENTRY && events[i].cpu == cpu &&
+		    events[i].time >= expected_ns && events[i].time <= actual_ns)
+			t_wake = events[i].time;
+	if (t_wake < expected_ns)
+		t_wake = expected_ns;
+	for (i = 0; i < nevents && t_switch < 0; i++) {
+		struct attr_event *e = &events[i];
+
+		if (e->type == EV_SWITCH && e->cpu == cpu && e->b == tid &&
+		    e->time >= t_wake && e->time <= actual_ns) {
+			t_switch = e->time;
+			preemptor = e->comm1;
+			preemptor_pid = e->a;
+		}
+	}
+	if (t_switch < 0)
+		t_switch = t_wake;
+
+	printf("# Latency attribution: thread %d on CPU %d, %.3f us late\n",
+	       tid, cpu, (actual_ns - expected_ns) / 1000.0);
+	printf("# Events (us relative to the expected wakeup):\n");
+	for (i = 0; i < nevents; i++) {
+		struct attr_event *e = &events[i];
+
+		if (e->time < expected_ns - lookback_ns || e->time > actual_ns)
+			continue;
+		if (e->cpu == cpu || (e->type == EV_WAKEUP && e->a == tid))
+			print_event(e, expected_ns);
+	}
+
+	/*
+	 * Sweep the events of the CPU in time order and charge every
+	 * stretch of [expected, actual] to irq context if we were in one,
+	 * else to the phase of the wakeup it belongs to.
+	 */
+	memset(causes, 0, sizeof(causes));
+	last = expected_ns;
+	for (i = 0; i <= nevents; i++) {
+		struct attr_event *e = i < nevents ? &events[i] : NULL;
+
+		if (e && e->cpu != cpu)
+			continue;
+		t = e ? e->time : actual_ns;
+		if (t > actual_ns)
+			t = actual_ns;
+		if (t > last) {
+			if (hard)
+				causes[CAUSE_HARDIRQ] += t - last;
+			else if (soft)
+				causes[CAUSE_SOFTIRQ] += t - last;
+			else
+				charge_phases(causes, last, t, t_wake, t_switch);
+			last = t;
+		}
+		if (!e)
+			break;
+		switch (e->type) {
+		case EV_IRQ_ENTRY:	hard++; break;
+		case EV_IRQ_EXIT:	if (hard) hard--; break;
+		case EV_SOFTIRQ_ENTRY:	soft++; break;
+		case EV_SOFTIRQ_EXIT:	if (soft) soft--; break;
+		}
+	}
+
+	printf("# Breakdown:");
+	for (c = 0; c < CAUSE_MAX; c++) {
+		if (use_nsecs)
+			printf(" %s %lld ns", cause_names[c], (long long)causes[c]);
+		else
+			printf(" %s %lld us", cause_names[c],
+			       (long long)(causes[c] / 1000));
+		if (c < CAUSE_MAX - 1)
+			printf(",");
+	}
+	printf("\n");
+	if (preemptor && causes[CAUSE_PREEMPT])
+		printf("# Preempted by: %s:%ld\n", preemptor, preemptor_pid);
+
+	free(events);
+}
+
+void latattr_cleanup(void)
+{
+	int cpu, i;
+
+	for (cpu = 0; cpu < nr_rings; cpu++) {
+		struct cpu_ring *ring = &rings[cpu];
+
+		if (ring->base)
+			munmap(ring->base, (LATATTR_PAGES + 1) * page_size);
+		for (i = 0; i < ring->nfds; i++)
+			close(ring->fds[i]);
+		free(ring->fds);
+	}
+	free(rings);
+	rings = NULL;
+	nr_rings = 0;
+}
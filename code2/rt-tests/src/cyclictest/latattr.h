@@ -0,0 +1,21 @@
+/*
+ * Latency root cause attribution for cyclictest.
+ *
+ * Keeps an in-memory, per CPU, overwriting ring of the most recent
+ * irq, softirq, scheduler and hrtimer tracepoint events (via
+ * perf_event_open), so that the events leading up to a latency spike
+ * can be dumped and classified once the break trace limit is hit.
+ */
+#ifndef _LATATTR_H
+#define _LATATTR_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+int latattr_setup(int max_cpus);
+void latattr_freeze(void);
+void latattr_report(int cpu, pid_t tid, int64_t expected_ns,
+		    int64_t actual_ns, int64_t lookback_ns, int use_nsecs);
+void latattr_cleanup(void);
+
+#endif	/* _LATATTR_H */
@@ -19,6 +19,21 @@
 
 static int numa = 0;
 
+/*
+ * Per thread data is handed out on its own cache lines, so that the
+ * measuring threads never share a line with someone else's data.
+ */
+#define RT_ALLOC_ALIGN	64
+
+static inline void *rt_aligned_alloc(size_t size)
+{
+	void *ptr;
+
+	if (posix_memalign(&ptr, RT_ALLOC_ALIGN, size))
+		return NULL;
+	return ptr;
+}
+
 #ifdef NUMA
 #include <numa.h>
 
@@ -30,7 +45,7 @@ static void *
 threadalloc(size_t size, int node)
 {
 	if (node == -1)
-		return malloc(size);
+		return rt_aligned_alloc(size);
 	return numa_alloc_onnode(size, node);
 }
 
@@ -114,7 +129,7 @@ static void *rt_numa_numa_alloc_onnode(size_t size, int node, int cpu)
 
 #else
 
-static inline void *threadalloc(size_t size, int n) { return malloc(size); }
+static inline void *threadalloc(size_t size, int n) { return rt_aligned_alloc(size); }
 static inline void threadfree(void *ptr, size_t s, int n) { free(ptr); }
 static inline void rt_numa_set_numa_run_on_node(int n, int c) { }
 static inline void numa_on_and_available() { };
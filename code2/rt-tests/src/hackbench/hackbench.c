@@ -2,6 +2,11 @@
  * This is the latest version of hackbench.c, that tests scheduler and
  * unix-socket (or pipe) performance.
  *
+ * Besides sockets and pipes, messages can be passed through vmsplice()d
+ * pipes, io_uring batched writes/reads, or shared memory rings woken up
+ * through eventfd/epoll (or busy polled), and every Nth message can carry
+ * a timestamp to get the send to receive latency distribution.
+ *
  * Usage: hackbench [-pipe] <num groups> [process|thread] [loops]
  *
  * Build it with:
@@ -29,6 +34,17 @@
 #include <signal.h>
 #include <setjmp.h>
 #include <sched.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+
+#include "rt-utils.h"
+#include "rt-hist.h"
 
 static unsigned int datasize = 100;
 static unsigned int loops = 100;
@@ -44,20 +60,84 @@ static unsigned int fifo = 0;
 
 static unsigned int process_mode = PROCESS_MODE;
 
-static int use_pipes = 0;
+/*
+ * How messages travel from a sender to a receiver.  The fd based
+ * transports copy through the kernel, all senders of a group sharing
+ * each receiver's fd.  eventfd and ring give every sender/receiver pair
+ * a shared memory single producer/single consumer ring instead; the
+ * receiver sleeps in epoll_wait() on its eventfd while all of its rings
+ * are empty (eventfd), or busy polls them with sched_yield() (ring).
+ */
+enum {
+	T_SOCKET,
+	T_PIPE,
+	T_EVENTFD,
+	T_RING,
+	T_VMSPLICE,
+	T_URING,
+};
+
+static const char *transport_names[] = {
+	[T_SOCKET]	= "socket",
+	[T_PIPE]	= "pipe",
+	[T_EVENTFD]	= "eventfd",
+	[T_RING]	= "ring",
+	[T_VMSPLICE]	= "vmsplice",
+	[T_URING]	= "io_uring",
+};
+
+static int transport = T_SOCKET;
+
+/* stamp every sample_every'th message of a sender, 0: no sampling */
+static unsigned int sample_every = 0;
+static int json = 0;
+
+/* one histogram per receiver, shared with forked children */
+static struct loghist *lat_hists;
+
+#define CACHELINE_SIZE	64
+#define RING_SLOTS	64	/* power of two */
+#define RECV_BATCH	16	/* messages per io_uring read */
+
+struct msg_ring {
+	unsigned long head __attribute__((aligned(CACHELINE_SIZE)));
+	unsigned long tail __attribute__((aligned(CACHELINE_SIZE)));
+	/* RING_SLOTS messages of datasize bytes follow */
+};
+
+/* The rings of one receiver, one per sender of the group */
+struct ring_set {
+	int sleeping __attribute__((aligned(CACHELINE_SIZE)));
+	int efd;
+	unsigned int nr;
+	/* nr rings of ring_stride bytes follow */
+};
+
+static size_t ring_stride;
+/* every ring set made, for unmapping after the run */
+static struct ring_set **ring_sets;
+static unsigned int nr_ring_sets;
+
+/* A sender -> receiver connection */
+struct link {
+	int fds[2];
+	struct ring_set *rings;
+};
 
 struct sender_context {
 	unsigned int num_fds;
+	unsigned int id;	/* ring to use in each receiver's set */
 	int ready_out;
 	int wakefd;
-	int out_fds[0];
+	struct link out[0];
 };
 
 struct receiver_context {
 	unsigned int num_packets;
-	int in_fds[2];
+	struct link in;
 	int ready_out;
 	int wakefd;
+	struct loghist *hist;
 };
 
 
@@ -92,13 +172,15 @@ static void print_usage_exit()
 {
 	printf("Usage: hackbench [-p|--pipe] [-s|--datasize <bytes>] [-l|--loops <num loops>]\n"
 	       "\t\t [-g|--groups <num groups] [-f|--fds <num fds>]\n"
+	       "\t\t [-x|--transport socket|pipe|eventfd|ring|vmsplice|io_uring]\n"
+	       "\t\t [-L|--latency <sample every N>] [-j|--json]\n"
 	       "\t\t [-T|--threads] [-P|--process] [--help]\n");
 	exit(1);
 }
 
 static void fdpair(int fds[2])
 {
-	if (use_pipes) {
+	if (transport == T_PIPE || transport == T_VMSPLICE) {
 		if (pipe(fds) == 0)
 			return;
 	} else {
@@ -129,60 +211,523 @@ static void reset_worker_signals(void)
 	signal(SIGINT, SIG_DFL);
 }
 
+static struct ring_set *ring_set_alloc(unsigned int nr)
+{
+	size_t len = sizeof(struct ring_set) + nr * ring_stride;
+	struct ring_set *set;
+
+	set = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (set == MAP_FAILED)
+		return NULL;
+	set->nr = nr;
+	set->efd = -1;
+	if (transport == T_EVENTFD) {
+		set->efd = eventfd(0, 0);
+		if (set->efd < 0) {
+			munmap(set, len);
+			return NULL;
+		}
+	}
+	return set;
+}
+
+static void ring_set_free(struct ring_set *set)
+{
+	if (set->efd >= 0)
+		close(set->efd);
+	munmap(set, sizeof(struct ring_set) + set->nr * ring_stride);
+}
+
+static inline struct msg_ring *set_ring(struct ring_set *set, unsigned int n)
+{
+	return (struct msg_ring *)((char *)(set + 1) + n * ring_stride);
+}
+
+static inline char *ring_slot(struct msg_ring *ring, unsigned long n)
+{
+	return (char *)(ring + 1) + (n & (RING_SLOTS - 1)) * datasize;
+}
+
+static inline int ring_empty(struct msg_ring *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail;
+}
+
+/* Senders yield while the ring is full, receivers never block them */
+static void ring_send(struct ring_set *set, unsigned int id, const char *data)
+{
+	struct msg_ring *ring = set_ring(set, id);
+	unsigned long head = ring->head;
+
+	while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= RING_SLOTS)
+		sched_yield();
+	memcpy(ring_slot(ring, head), data, datasize);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	if (transport != T_EVENTFD)
+		return;
+	/* pairs with the fence in ring_recv(), one of us sees the other */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&set->sleeping, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(&set->sleeping, 0, __ATOMIC_ACQ_REL))
+		if (eventfd_write(set->efd, 1) < 0)
+			barf("SENDER: eventfd_write");
+}
+
+/* Take the next message from any of the rings, round robin */
+static void ring_recv(struct ring_set *set, unsigned int *next, int epfd,
+		      char *data)
+{
+	struct epoll_event ev;
+	struct msg_ring *ring;
+	unsigned int i, n;
+	eventfd_t val;
+
+	for (;;) {
+		for (i = 0; i < set->nr; i++) {
+			n = (*next + i) % set->nr;
+			ring = set_ring(set, n);
+			if (ring_empty(ring))
+				continue;
+			memcpy(data, ring_slot(ring, ring->tail), datasize);
+			__atomic_store_n(&ring->tail, ring->tail + 1,
+					 __ATOMIC_RELEASE);
+			*next = n + 1;
+			return;
+		}
+
+		if (transport != T_EVENTFD) {
+			sched_yield();
+			continue;
+		}
+		__atomic_store_n(&set->sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		for (i = 0; i < set->nr; i++)
+			if (!ring_empty(set_ring(set, i)))
+				break;
+		if (i < set->nr) {
+			__atomic_store_n(&set->sleeping, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (epoll_wait(epfd, &ev, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			barf("SERVER: epoll_wait");
+		}
+		if (eventfd_read(set->efd, &val) < 0)
+			barf("SERVER: eventfd_read");
+	}
+}
+
+/*
+ * Minimal io_uring plumbing on top of the raw system calls, one ring per
+ * worker: queue up to 'entries' requests, submit them with a single
+ * io_uring_enter() and wait for all of their completions.
+ */
+struct uring {
+	int fd;
+	char *sq, *cq;		/* the rings, one mapping if cq == sq */
+	size_t sq_len, cq_len, sqes_len;
+	unsigned int entries;
+	unsigned int *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned int queued;
+};
+
+/* Unmap and close whatever uring_setup got as far as */
+static void uring_teardown(struct uring *r)
+{
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_len);
+	if (r->cq && r->cq != r->sq)
+		munmap(r->cq, r->cq_len);
+	if (r->sq)
+		munmap(r->sq, r->sq_len);
+	if (r->fd >= 0)
+		close(r->fd);
+	r->sqes = NULL;
+	r->sq = r->cq = NULL;
+	r->fd = -1;
+}
+
+static int uring_setup(struct uring *r, unsigned int entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+	void *sqes;
+
+	memset(&p, 0, sizeof(p));
+	r->sq = r->cq = NULL;
+	r->sqes = NULL;
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		return -1;
+
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->sq_len = r->cq_len = (r->sq_len > r->cq_len ?
+					 r->sq_len : r->cq_len);
+
+	sq = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto fail;
+	r->sq = r->cq = cq = sq;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED) {
+			r->cq = NULL;
+			goto fail;
+		}
+		r->cq = cq;
+	}
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		goto fail;
+	r->sqes = sqes;
+
+	r->entries = p.sq_entries;
+	r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	r->queued = 0;
+	return 0;
+fail:
+	uring_teardown(r);
+	return -1;
+}
+
+static void uring_queue(struct uring *r, int op, int fd, void *buf,
+			unsigned int len, unsigned long long user_data)
+{
+	unsigned int tail = *r->sq_tail + r->queued;
+	unsigned int idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->off = -1ULL;	/* current position, streams have no offset */
+	sqe->user_data = user_data;
+	r->sq_array[idx] = idx;
+	r->queued++;
+}
+
+/* Submit everything queued, wait for it and hand back each result */
+static void uring_submit_wait(struct uring *r,
+			      void (*complete)(void *arg, unsigned long long user_data, int res),
+			      void *arg)
+{
+	unsigned int n = r->queued, head;
+
+	__atomic_store_n(r->sq_tail, *r->sq_tail + n, __ATOMIC_RELEASE);
+	r->queued = 0;
+	while (syscall(__NR_io_uring_enter, r->fd, n, n,
+		       IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+		if (errno != EINTR)
+			barf("io_uring_enter");
+
+	head = *r->cq_head;
+	while (n) {
+		if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			if (syscall(__NR_io_uring_enter, r->fd, 0, 1,
+				    IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+			    errno != EINTR)
+				barf("io_uring_enter");
+			continue;
+		}
+		struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+
+		complete(arg, cqe->user_data, cqe->res);
+		head++;
+		n--;
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static int uring_supported(void)
+{
+	struct io_uring_params p;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	fd = syscall(__NR_io_uring_setup, 1, &p);
+	if (fd < 0)
+		return 0;
+	close(fd);
+	return 1;
+}
+
+/* Write the whole buffer, starting at offset done */
+static void write_all(int fd, const char *data, unsigned int done)
+{
+	int ret;
+
+	while (done < datasize) {
+		ret = write(fd, data + done, datasize - done);
+		if (ret < 0)
+			barf("SENDER: write");
+		done += ret;
+	}
+}
+
+struct send_batch {
+	struct sender_context *ctx;
+	char *bufs;
+};
+
+static void send_complete(void *arg, unsigned long long j, int res)
+{
+	struct send_batch *b = arg;
+
+	if (res < 0) {
+		errno = -res;
+		barf("SENDER: io_uring write");
+	}
+	if (res < datasize)
+		write_all(b->ctx->out[j].fds[1], b->bufs + j * datasize, res);
+}
+
+/*
+ * Give each spliced message a slot that does not straddle a page, so it
+ * goes into the pipe as one buffer, all or nothing, like a small write().
+ */
+static inline size_t vmsplice_offset(size_t n)
+{
+	size_t page = getpagesize(), per_page = page / datasize;
+
+	if (!per_page)
+		return n * datasize;
+	return n / per_page * page + n % per_page * datasize;
+}
+
+/* Stamp the message if it is one of the sampled ones */
+static inline void stamp(char *data, unsigned long seq)
+{
+	uint64_t now = 0;
+
+	if (!sample_every)
+		return;
+	if (seq % sample_every == 0)
+		now = rt_gettime_ns();
+	memcpy(data, &now, sizeof(now));
+}
+
+static inline void account(struct receiver_context *ctx, const char *data)
+{
+	uint64_t then;
+
+	if (!sample_every)
+		return;
+	memcpy(&then, data, sizeof(then));
+	if (then)
+		loghist_add(ctx->hist, rt_gettime_ns() - then);
+}
+
 /* Sender sprays loops messages down each file descriptor */
 static void *sender(struct sender_context *ctx)
 {
-	char data[datasize];
-	unsigned int i, j;
+	char *data = malloc(datasize);
+	unsigned int i, j, nslots = 0;
+	unsigned long seq = 0;
+	struct send_batch batch = { .ctx = ctx };
+	struct uring ur;
+	char *vbuf = NULL;
+	size_t len;
 
 	reset_worker_signals();
+	if (!data)
+		barf("SENDER: malloc");
+	memset(data, '-', datasize);
+
+	if (transport == T_URING) {
+		if (uring_setup(&ur, ctx->num_fds) < 0)
+			barf("SENDER: io_uring_setup");
+		batch.bufs = malloc(ctx->num_fds * datasize);
+		if (!batch.bufs)
+			barf("SENDER: malloc");
+		for (j = 0; j < ctx->num_fds; j++)
+			memcpy(batch.bufs + j * datasize, data, datasize);
+	} else if (transport == T_VMSPLICE) {
+		/*
+		 * The pipe keeps referencing spliced pages until they are
+		 * read, so rotate over twice as many slots per pipe as the
+		 * pipe can hold buffers before a slot gets rewritten.
+		 */
+		int sz = fcntl(ctx->out[0].fds[1], F_GETPIPE_SZ);
+
+		if (sz < 0)
+			barf("SENDER: F_GETPIPE_SZ");
+		nslots = 2 * (sz / getpagesize());
+		len = vmsplice_offset((size_t)ctx->num_fds * nslots) + datasize;
+		if (posix_memalign((void **)&vbuf, getpagesize(), len))
+			barf("SENDER: posix_memalign");
+		memset(vbuf, '-', len);
+	}
+
 	ready(ctx->ready_out, ctx->wakefd);
-	memset(&data, '-', datasize);
 
 	/* Now pump to every receiver. */
 	for (i = 0; i < loops; i++) {
 		for (j = 0; j < ctx->num_fds; j++) {
-			int ret, done = 0;
-
-again:
-			ret = write(ctx->out_fds[j], data + done, sizeof(data)-done);
-			if (ret < 0)
-				barf("SENDER: write");
-			done += ret;
-			if (done < sizeof(data))
-				goto again;
+			struct iovec iov;
+			int ret;
+
+			switch (transport) {
+			case T_URING:
+				stamp(batch.bufs + j * datasize, seq++);
+				uring_queue(&ur, IORING_OP_WRITE,
+					    ctx->out[j].fds[1],
+					    batch.bufs + j * datasize, datasize, j);
+				break;
+			case T_EVENTFD:
+			case T_RING:
+				stamp(data, seq++);
+				ring_send(ctx->out[j].rings, ctx->id, data);
+				break;
+			case T_VMSPLICE:
+				iov.iov_base = vbuf +
+					vmsplice_offset((size_t)j * nslots + i % nslots);
+				iov.iov_len = datasize;
+				stamp(iov.iov_base, seq++);
+				while (iov.iov_len) {
+					ret = vmsplice(ctx->out[j].fds[1], &iov, 1, 0);
+					if (ret < 0)
+						barf("SENDER: vmsplice");
+					iov.iov_base = (char *)iov.iov_base + ret;
+					iov.iov_len -= ret;
+				}
+				break;
+			default:
+				stamp(data, seq++);
+				write_all(ctx->out[j].fds[1], data, 0);
+			}
 		}
+		/* one system call for the whole round */
+		if (transport == T_URING)
+			uring_submit_wait(&ur, send_complete, &batch);
 	}
 
+	if (transport == T_URING)
+		uring_teardown(&ur);
+	free(batch.bufs);
+	free(vbuf);
+	free(data);
 	return NULL;
 }
 
+struct recv_batch {
+	int res;
+};
+
+static void recv_complete(void *arg, unsigned long long user_data, int res)
+{
+	((struct recv_batch *)arg)->res = res;
+}
+
+/* Receive up to RECV_BATCH messages per read, splitting them up here */
+static void uring_receiver(struct receiver_context *ctx)
+{
+	size_t left = (size_t)ctx->num_packets * datasize;
+	size_t len = (size_t)RECV_BATCH * datasize;
+	size_t want, pos, have = 0;
+	char *buf = malloc(len);
+	struct recv_batch res;
+	struct uring ur;
+
+	if (!buf)
+		barf("SERVER: malloc");
+	if (uring_setup(&ur, 1) < 0)
+		barf("SERVER: io_uring_setup");
+
+	while (left) {
+		want = len - have;
+		if (want > left)
+			want = left;
+		uring_queue(&ur, IORING_OP_READ, ctx->in.fds[0], buf + have, want, 0);
+		uring_submit_wait(&ur, recv_complete, &res);
+		if (res.res < 0) {
+			errno = -res.res;
+			barf("SERVER: io_uring read");
+		}
+		if (res.res == 0)
+			barf("SERVER: unexpected EOF");
+		have += res.res;
+		left -= res.res;
+
+		/* Account for the complete messages, keep the partial one */
+		for (pos = 0; have - pos >= datasize; pos += datasize)
+			account(ctx, buf + pos);
+		if (pos < have)
+			memmove(buf, buf + pos, have - pos);
+		have -= pos;
+	}
+	uring_teardown(&ur);
+	free(buf);
+}
 
 /* One receiver per fd */
 static void *receiver(struct receiver_context* ctx)
 {
-	unsigned int i;
+	unsigned int i, next = 0;
+	int epfd = -1;
 
 	reset_worker_signals();
-	if (process_mode == PROCESS_MODE)
-		close(ctx->in_fds[1]);
+	if (process_mode == PROCESS_MODE && !ctx->in.rings)
+		close(ctx->in.fds[1]);
+
+	if (transport == T_EVENTFD) {
+		struct epoll_event ev = { .events = EPOLLIN };
+
+		epfd = epoll_create1(0);
+		if (epfd < 0 ||
+		    epoll_ctl(epfd, EPOLL_CTL_ADD, ctx->in.rings->efd, &ev) < 0)
+			barf("SERVER: epoll");
+	}
 
 	/* Wait for start... */
 	ready(ctx->ready_out, ctx->wakefd);
 
+	if (transport == T_URING) {
+		uring_receiver(ctx);
+		goto out;
+	}
+
 	/* Receive them all */
 	for (i = 0; i < ctx->num_packets; i++) {
 		char data[datasize];
 		int ret, done = 0;
 
+		if (ctx->in.rings) {
+			ring_recv(ctx->in.rings, &next, epfd, data);
+			account(ctx, data);
+			continue;
+		}
 again:
-		ret = read(ctx->in_fds[0], data + done, datasize - done);
+		ret = read(ctx->in.fds[0], data + done, datasize - done);
 		if (ret < 0)
 			barf("SERVER: read");
 		done += ret;
 		if (done < datasize)
 			goto again;
+		account(ctx, data);
 	}
+out:
+	if (epfd >= 0)
+		close(epfd);
 	if (ctx) {
 		free(ctx);
 	}
@@ -288,8 +833,8 @@ static unsigned int group(childinfo_t *child,
 			  int wakefd)
 {
 	unsigned int i;
-	struct sender_context* snd_ctx = malloc (sizeof(struct sender_context)
-			+num_fds*sizeof(int));
+	size_t snd_size = sizeof(struct sender_context) + num_fds*sizeof(struct link);
+	struct sender_context* snd_ctx = malloc (snd_size);
 
 	if (!snd_ctx) {
 		sneeze("malloc() [sender ctx]");
@@ -298,7 +843,7 @@ static unsigned int group(childinfo_t *child,
 
 
 	for (i = 0; i < num_fds; i++) {
-		int fds[2];
+		struct link link = { .fds = { -1, -1 } };
 		struct receiver_context* ctx = malloc (sizeof(*ctx));
 
 		if (!ctx) {
@@ -307,31 +852,52 @@ static unsigned int group(childinfo_t *child,
 		}
 
 
-		/* Create the pipe between client and server */
-		fdpair(fds);
+		/* Create the pipe (or rings) between client and server */
+		if (transport == T_EVENTFD || transport == T_RING) {
+			link.rings = ring_set_alloc(num_fds);
+			if (!link.rings) {
+				sneeze("ring_set_alloc()");
+				return (i > 0 ? i-1 : 0);
+			}
+			ring_sets[nr_ring_sets++] = link.rings;
+		} else {
+			fdpair(link.fds);
+		}
 
 		ctx->num_packets = num_fds*loops;
-		ctx->in_fds[0] = fds[0];
-		ctx->in_fds[1] = fds[1];
+		ctx->in = link;
 		ctx->ready_out = ready_out;
 		ctx->wakefd = wakefd;
+		ctx->hist = lat_hists ? &lat_hists[tab_offset / 2 + i] : NULL;
 
 		child[tab_offset+i] = create_worker(ctx, (void *)(void *)receiver);
 		if( child[tab_offset+i].error < 0 ) {
 			return (i > 0 ? i-1 : 0);
 		}
-		snd_ctx->out_fds[i] = fds[1];
-		if (process_mode == PROCESS_MODE)
-			close(fds[0]);
+		snd_ctx->out[i] = link;
+		if (process_mode == PROCESS_MODE && !link.rings)
+			close(link.fds[0]);
 	}
 
 	/* Now we have all the fds, fork the senders */
+	snd_ctx->ready_out = ready_out;
+	snd_ctx->wakefd = wakefd;
+	snd_ctx->num_fds = num_fds;
 	for (i = 0; i < num_fds; i++) {
-		snd_ctx->ready_out = ready_out;
-		snd_ctx->wakefd = wakefd;
-		snd_ctx->num_fds = num_fds;
+		struct sender_context *ctx = snd_ctx;
+
+		/* ring senders need to know which ring is theirs */
+		if (snd_ctx->out[0].rings) {
+			ctx = malloc(snd_size);
+			if (!ctx) {
+				sneeze("malloc() [sender ctx]");
+				return (num_fds+i)-1;
+			}
+			memcpy(ctx, snd_ctx, snd_size);
+			ctx->id = i;
+		}
 
-		child[tab_offset+num_fds+i] = create_worker(snd_ctx, (void *)(void *)sender);
+		child[tab_offset+num_fds+i] = create_worker(ctx, (void *)(void *)sender);
 		if( child[tab_offset+num_fds+i].error < 0 ) {
 			return (num_fds+i)-1;
 		}
@@ -340,7 +906,8 @@ static unsigned int group(childinfo_t *child,
 	/* Close the fds we have left */
 	if (process_mode == PROCESS_MODE)
 		for (i = 0; i < num_fds; i++)
-			close(snd_ctx->out_fds[i]);
+			if (!snd_ctx->out[i].rings)
+				close(snd_ctx->out[i].fds[1]);
 
 	/* Return number of children to reap */
 	return num_fds * 2;
@@ -362,18 +929,21 @@ static void process_options (int argc, char *argv[])
 			{"threads",   no_argument,	 NULL, 'T'},
 			{"processes", no_argument,	 NULL, 'P'},
 			{"fifo",      no_argument,       NULL, 'F'},
+			{"transport", required_argument, NULL, 'x'},
+			{"latency",   required_argument, NULL, 'L'},
+			{"json",      no_argument,       NULL, 'j'},
 			{"help",      no_argument,	 NULL, 'h'},
 			{NULL, 0, NULL, 0}
 		};
 
-		int c = getopt_long(argc, argv, "ps:l:g:f:TPFh",
+		int c = getopt_long(argc, argv, "ps:l:g:f:TPFx:L:jh",
 				    longopts, &optind);
 		if (c == -1) {
 			break;
 		}
 		switch (c) {
 		case 'p':
-			use_pipes = 1;
+			transport = T_PIPE;
 			break;
 
 		case 's':
@@ -415,6 +985,31 @@ static void process_options (int argc, char *argv[])
 			fifo = 1;
 			break;
 
+		case 'x': {
+			int t;
+
+			for (t = 0; t <= T_URING; t++)
+				if (!strcmp(optarg, transport_names[t]))
+					break;
+			if (t > T_URING) {
+				fprintf(stderr, "%s: unknown transport %s\n", argv[0], optarg);
+				error = 1;
+			} else
+				transport = t;
+			break;
+		}
+
+		case 'L':
+			if (!(argv[optind] && (sample_every = atoi(optarg)) > 0)) {
+				fprintf(stderr, "%s: --latency|-L requires an integer > 0\n", argv[0]);
+				error = 1;
+			}
+			break;
+
+		case 'j':
+			json = 1;
+			break;
+
 		case 'h':
 			print_usage_exit();
 
@@ -423,6 +1018,30 @@ static void process_options (int argc, char *argv[])
 		}
 	}
 
+	if (sample_every && datasize < sizeof(uint64_t)) {
+		fprintf(stderr, "%s: --latency|-L needs a datasize of at least %zu bytes\n",
+			argv[0], sizeof(uint64_t));
+		error = 1;
+	}
+
+	/*
+	 * Senders share each receiver's fd, messages only stay in one
+	 * piece (and stamps where the receiver expects them) as long as
+	 * they are written atomically.
+	 */
+	if (sample_every && datasize > PIPE_BUF &&
+	    transport != T_EVENTFD && transport != T_RING) {
+		fprintf(stderr, "%s: --latency|-L over the %s transport needs a datasize of at most %d bytes\n",
+			argv[0], transport_names[transport], PIPE_BUF);
+		error = 1;
+	}
+
+	if (transport == T_URING && !error && !uring_supported()) {
+		fprintf(stderr, "%s: io_uring is not available (error: %s)\n",
+			argv[0], strerror(errno));
+		error = 1;
+	}
+
 	if( error ) {
 		exit(1);
 	}
@@ -436,6 +1055,69 @@ void sigcatcher(int sig) {
 	longjmp(jmpbuf, 1);
 }
 
+static void print_results(struct timeval *diff)
+{
+	static const double pcts[] = { 50.0, 90.0, 99.0, 99.9, 99.99 };
+	static const char *names[] = { "p50", "p90", "p99", "p99.9", "p99.99" };
+	double secs = diff->tv_sec + diff->tv_usec / 1e6;
+	unsigned long long msgs = (unsigned long long)num_groups * num_fds * num_fds * loops;
+	unsigned long long samples = 0, min = 0, max = 0;
+	struct loghist *all = NULL;
+	int i;
+
+	if (lat_hists) {
+		all = calloc(1, sizeof(*all));
+		if (!all)
+			barf("main:malloc()");
+		for (i = 0; i < num_groups * num_fds; i++)
+			loghist_merge(all, &lat_hists[i]);
+		samples = loghist_total(all);
+		for (i = 0; i < HIST_BUCKETS && !all->count[i]; i++)
+			;
+		min = i < HIST_BUCKETS ? loghist_lower(i) : 0;
+		for (i = HIST_BUCKETS - 1; i >= 0 && !all->count[i]; i--)
+			;
+		max = i >= 0 ? loghist_upper(i) : 0;
+	}
+
+	if (secs <= 0)
+		secs = 1e-6;
+
+	if (!json) {
+		printf("Time: %lu.%03lu\n", diff->tv_sec, diff->tv_usec/1000);
+		printf("Throughput: %.0f msgs/s, %.1f MB/s\n", msgs / secs,
+		       msgs * datasize / secs / (1024 * 1024));
+		if (all) {
+			printf("Latency (ns): Samples %llu, Min %llu", samples, min);
+			for (i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++)
+				printf(", P%s %llu", names[i] + 1,
+				       (unsigned long long)loghist_percentile(all, pcts[i]));
+			printf(", Max %llu\n", max);
+		}
+		free(all);
+		return;
+	}
+
+	printf("{\"mode\": \"%s\", \"transport\": \"%s\", \"groups\": %u, "
+	       "\"fds\": %u, \"tasks\": %u, \"loops\": %u, \"datasize\": %u, ",
+	       process_mode == THREAD_MODE ? "threaded" : "process",
+	       transport_names[transport], num_groups, num_fds,
+	       num_groups * num_fds * 2, loops, datasize);
+	printf("\"time_s\": %.6f, \"messages\": %llu, \"msgs_per_sec\": %.0f, "
+	       "\"mb_per_sec\": %.3f", secs, msgs, msgs / secs,
+	       msgs * datasize / secs / (1024 * 1024));
+	if (all) {
+		printf(", \"latency_ns\": {\"sample_every\": %u, \"samples\": %llu, "
+		       "\"min\": %llu", sample_every, samples, min);
+		for (i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++)
+			printf(", \"%s\": %llu", names[i],
+			       (unsigned long long)loghist_percentile(all, pcts[i]));
+		printf(", \"max\": %llu}", max);
+	}
+	printf("}\n");
+	free(all);
+}
+
 int main(int argc, char *argv[])
 {
 	unsigned int i;
@@ -446,16 +1128,34 @@ int main(int argc, char *argv[])
 
 	process_options (argc, argv);
 
-	printf("Running in %s mode with %d groups using %d file descriptors each (== %d tasks)\n",
-	       (process_mode == THREAD_MODE ? "threaded" : "process"),
-	       num_groups, 2*num_fds, num_groups*(num_fds*2));
-	printf("Each sender will pass %d messages of %d bytes\n", loops, datasize);
+	if (!json) {
+		printf("Running in %s mode with %d groups using %d file descriptors each (== %d tasks)\n",
+		       (process_mode == THREAD_MODE ? "threaded" : "process"),
+		       num_groups, 2*num_fds, num_groups*(num_fds*2));
+		printf("Each sender will pass %d messages of %d bytes\n", loops, datasize);
+		if (transport != T_SOCKET)
+			printf("Using the %s transport\n", transport_names[transport]);
+	}
 	fflush(NULL);
 
 	child_tab = calloc(num_fds * 2 * num_groups, sizeof(childinfo_t));
 	if (!child_tab)
 		barf("main:malloc()");
 
+	ring_stride = (sizeof(struct msg_ring) + RING_SLOTS * datasize +
+		       CACHELINE_SIZE - 1) & ~(CACHELINE_SIZE - 1);
+	ring_sets = calloc(num_fds * num_groups, sizeof(*ring_sets));
+	if (!ring_sets)
+		barf("main:malloc()");
+
+	if (sample_every) {
+		/* shared, so that forked receivers report back into it */
+		lat_hists = mmap(NULL, num_groups * num_fds * sizeof(struct loghist),
+				 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (lat_hists == MAP_FAILED)
+			barf("main:mmap()");
+	}
+
 	fdpair(readyfds);
 	fdpair(wakefds);
 
@@ -510,7 +1210,10 @@ int main(int argc, char *argv[])
 
 	/* Print time... */
 	timersub(&stop, &start, &diff);
-	printf("Time: %lu.%03lu\n", diff.tv_sec, diff.tv_usec/1000);
+	print_results(&diff);
+	for (i = 0; i < nr_ring_sets; i++)
+		ring_set_free(ring_sets[i]);
+	free(ring_sets);
 	free(child_tab);
 	exit(0);
 }
@@ -0,0 +1,746 @@
+/*
+ * hwlat.c
+ *
+ * Hardware/firmware latency detector that runs entirely in user space,
+ * for kernels that ship neither debugfs nor the hwlat_detector module.
+ *
+ * One thread per CPU, pinned, spins for 'width' out of every 'window'
+ * reading the TSC (or CLOCK_MONOTONIC_RAW) back to back.  Any gap in
+ * the readings, either between the two reads of a pair (inner) or
+ * between two pairs (outer), is time the CPU spent elsewhere: an SMI, a
+ * firmware stall or, since we cannot disable interrupts from here, an
+ * interrupt or preemption.  Run it on isolated CPUs (isolcpus=, nohz_full=,
+ * irqaffinity=) to keep the latter out of the picture; windows in which
+ * the thread got preempted are counted separately, and on x86 the SMI
+ * count MSR is read when /dev/cpu/N/msr is available.
+ *
+ * The options and the summary follow hwlatdetect(8).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+#include "rt-utils.h"
+#include "rt-hist.h"
+#include "error.h"
+
+#define CACHELINE_SIZE		64
+#define MSR_SMI_COUNT		0x34
+#define HIST_FLOOR_NS		1000	/* gaps below this are not recorded */
+#define ISOLATED_CPUS		"/sys/devices/system/cpu/isolated"
+
+#define DEFAULT_DURATION	120		/* s */
+#define DEFAULT_THRESHOLD	10		/* us */
+#define DEFAULT_WINDOW		1000000		/* us */
+#define DEFAULT_WIDTH		500000		/* us */
+
+struct hwsample {
+	struct timespec ts;
+	uint64_t inner_ns;
+	uint64_t outer_ns;
+	int cpu;
+};
+
+/* one per detector thread, only touched by it until it is joined */
+struct detector {
+	int cpu;
+	uint64_t width_us;
+	uint64_t window_us;
+	pthread_t thread;
+	int failed;
+
+	unsigned long windows;
+	unsigned long exceeding;	/* windows with a gap above threshold */
+	unsigned long preempted;	/* ... of which we were preempted in */
+	unsigned long gaps;		/* gaps above threshold */
+	uint64_t max_ns;
+	long long smi_start;
+	long long smi_end;
+
+	struct hwsample *samples;
+	int nr_samples;
+	int size;
+
+	struct loghist hist;
+} __attribute__((aligned(CACHELINE_SIZE)));
+
+/* per CPU width/window override */
+struct duty {
+	int cpu;
+	uint64_t width_us;
+	uint64_t window_us;
+};
+
+static int debugging;
+static int quiet;
+static int histogram;
+static int priority;
+static int duration = DEFAULT_DURATION;
+static uint64_t threshold = DEFAULT_THRESHOLD;
+static uint64_t window = DEFAULT_WINDOW;
+static uint64_t width = DEFAULT_WIDTH;
+static char *reportfile;
+static char *cpulist;
+static struct duty *duties;
+static int nr_duties;
+static int use_tsc = -1;
+static double tsc_per_ns = 1.0;
+static volatile int stopping;
+
+#define debug(fmt, args...) \
+	do { if (debugging) printf(fmt, ## args); } while (0)
+#define report(fmt, args...) \
+	do { if (!quiet) printf(fmt, ## args); } while (0)
+
+static inline uint64_t read_clock(void)
+{
+	struct timespec ts;
+
+#ifdef HAVE_TSC
+	if (use_tsc)
+		return __rdtsc();
+#endif
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t) ts.tv_sec * NSEC_PER_SEC_ULL + ts.tv_nsec;
+}
+
+static inline uint64_t ticks_to_ns(uint64_t ticks)
+{
+	return use_tsc ? (uint64_t) (ticks / tsc_per_ns) : ticks;
+}
+
+static inline uint64_t ns_to_ticks(uint64_t ns)
+{
+	return use_tsc ? (uint64_t) (ns * tsc_per_ns) : ns;
+}
+
+/* the TSC is only good for this if it ticks at a constant rate, always */
+static int tsc_invariant(void)
+{
+#ifdef HAVE_TSC
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+		return !!(edx & (1 << 8));
+#endif
+	return 0;
+}
+
+static void calibrate_tsc(void)
+{
+	struct timespec delay = { 0, 100000000 };
+	struct timespec r0, r1;
+	uint64_t t0, t1, ns;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &r0);
+	t0 = read_clock();
+	nanosleep(&delay, NULL);
+	clock_gettime(CLOCK_MONOTONIC_RAW, &r1);
+	t1 = read_clock();
+
+	ns = (r1.tv_sec - r0.tv_sec) * NSEC_PER_SEC_ULL + r1.tv_nsec - r0.tv_nsec;
+	tsc_per_ns = (double) (t1 - t0) / ns;
+	debug("TSC runs at %.3f MHz\n", tsc_per_ns * 1000);
+}
+
+/* SMI count MSR, needs the msr module and root; -1 if unavailable */
+static long long read_smi_count(int cpu)
+{
+#ifdef HAVE_TSC
+	char path[MAX_PATH];
+	uint64_t val;
+	int fd, ret;
+
+	snprintf(path, sizeof(path), "/dev/cpu/%d/msr", cpu);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	ret = pread(fd, &val, sizeof(val), MSR_SMI_COUNT);
+	close(fd);
+	if (ret == sizeof(val))
+		return val & 0xffffffff;
+#endif
+	return -1;
+}
+
+static void add_sample(struct detector *d, uint64_t inner_ns, uint64_t outer_ns)
+{
+	struct hwsample *s;
+
+	if (d->nr_samples == d->size) {
+		d->size = d->size ? d->size * 2 : 64;
+		s = realloc(d->samples, d->size * sizeof(*s));
+		if (!s) {
+			/* keep counting, just stop recording */
+			d->size = d->nr_samples;
+			return;
+		}
+		d->samples = s;
+	}
+	s = &d->samples[d->nr_samples++];
+	clock_gettime(CLOCK_REALTIME, &s->ts);
+	s->inner_ns = inner_ns;
+	s->outer_ns = outer_ns;
+	s->cpu = d->cpu;
+}
+
+static long involuntary_switches(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_THREAD, &ru))
+		return 0;
+	return ru.ru_nivcsw;
+}
+
+static void *detector_thread(void *arg)
+{
+	struct detector *d = arg;
+	uint64_t width_ticks = ns_to_ticks(d->width_us * 1000);
+	uint64_t thresh_ticks = ns_to_ticks(threshold * 1000);
+	uint64_t floor_ticks = ns_to_ticks(HIST_FLOOR_NS);
+	struct timespec next;
+
+	if (set_cpu_affinity(d->cpu) || set_fifo_priority(priority)) {
+		d->failed = 1;
+		return NULL;
+	}
+	d->smi_start = read_smi_count(d->cpu);
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (!stopping) {
+		uint64_t start, last, t1, t2, inner, outer;
+		uint64_t max_inner = 0, max_outer = 0;
+		long nivcsw = involuntary_switches();
+
+		start = last = read_clock();
+		do {
+			t1 = read_clock();
+			t2 = read_clock();
+			inner = t2 - t1;
+			outer = t1 - last;
+			last = t2;
+
+			/* rare, so the bookkeeping stays out of the way */
+			if (inner > floor_ticks || outer > floor_ticks) {
+				if (inner > max_inner)
+					max_inner = inner;
+				if (outer > max_outer)
+					max_outer = outer;
+				if (inner > floor_ticks)
+					loghist_add(&d->hist, ticks_to_ns(inner));
+				if (outer > floor_ticks)
+					loghist_add(&d->hist, ticks_to_ns(outer));
+				d->gaps += (inner > thresh_ticks) + (outer > thresh_ticks);
+			}
+		} while (t2 - start < width_ticks && !stopping);
+
+		d->windows++;
+		if (max_inner > thresh_ticks || max_outer > thresh_ticks) {
+			d->exceeding++;
+			if (involuntary_switches() != nivcsw)
+				d->preempted++;
+			add_sample(d, ticks_to_ns(max_inner), ticks_to_ns(max_outer));
+		}
+		if (ticks_to_ns(max_inner) > d->max_ns)
+			d->max_ns = ticks_to_ns(max_inner);
+		if (ticks_to_ns(max_outer) > d->max_ns)
+			d->max_ns = ticks_to_ns(max_outer);
+
+		/* the non-sampling part of the window */
+		next.tv_sec += d->window_us / 1000000;
+		next.tv_nsec += (d->window_us % 1000000) * 1000;
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000;
+		}
+		while (!stopping &&
+		       clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+			;
+	}
+
+	d->smi_end = read_smi_count(d->cpu);
+	return NULL;
+}
+
+/* "<n>{s,m,h,d,w}" -> seconds, like hwlatdetect */
+static int parse_seconds(const char *str)
+{
+	char *end;
+	long val = strtol(str, &end, 10);
+
+	if (end == str || val < 0)
+		return -1;
+	switch (*end) {
+	case '\0':
+	case 's':
+		break;
+	case 'm':
+		val *= 60;
+		break;
+	case 'h':
+		val *= 3600;
+		break;
+	case 'd':
+		val *= 86400;
+		break;
+	case 'w':
+		val *= 86400 * 7;
+		break;
+	default:
+		return -1;
+	}
+	if (*end && end[1])
+		return -1;
+	return val;
+}
+
+/* "<n>{us,ms,s}" -> microseconds, like hwlatdetect */
+static long long parse_usecs(const char *str)
+{
+	char *end;
+	long long val = strtoll(str, &end, 10);
+
+	if (end == str || val < 0)
+		return -1;
+	if (!*end || !strcmp(end, "us"))
+		return val;
+	if (!strcmp(end, "ms"))
+		return val * 1000;
+	if (!strcmp(end, "s"))
+		return val * 1000000;
+	return -1;
+}
+
+/* "CPU:WIDTH/WINDOW", e.g. "3:100ms/1s" */
+static int parse_duty(char *str)
+{
+	struct duty *d;
+	char *colon = strchr(str, ':');
+	char *slash = colon ? strchr(colon, '/') : NULL;
+	long long w, win;
+
+	if (!colon || !slash)
+		return -1;
+	*slash = '\0';
+	w = parse_usecs(colon + 1);
+	win = parse_usecs(slash + 1);
+	*slash = '/';
+	if (w <= 0 || win < w)
+		return -1;
+
+	d = realloc(duties, (nr_duties + 1) * sizeof(*d));
+	if (!d)
+		fatal("error allocating duty cycles\n");
+	duties = d;
+	d = &duties[nr_duties++];
+	d->cpu = atoi(str);
+	d->width_us = w;
+	d->window_us = win;
+	return 0;
+}
+
+static void display_help(void)
+{
+	printf("hwlat V %1.2f\n", VERSION_STRING);
+	puts("Usage: hwlat <options>");
+	puts("Function: detect hardware/firmware latencies (SMIs) from user space");
+	puts(
+	"Options:\n"
+	"-c CPUS  --cpus=CPUS        CPUs to run detectors on (e.g. 2-5,8), default\n"
+	"                            are the isolated CPUs, or all if none are\n"
+	"-C NAME  --clock=NAME       tsc or raw (CLOCK_MONOTONIC_RAW), default is\n"
+	"                            tsc when it is invariant\n"
+	"-d TIME  --duration=TIME    test duration <n>{s,m,h,d,w}, default=120s\n"
+	"-H       --histogram        print a histogram of the gaps per CPU\n"
+	"-p PRIO  --priority=PRIO    run the detectors SCHED_FIFO at PRIO\n"
+	"-q       --quiet            turn off all screen output\n"
+	"-r PATH  --report=PATH      write the samples to PATH\n"
+	"-t USEC  --threshold=USEC   gaps above USEC are latencies, default=10\n"
+	"-u DUTY  --duty=CPU:WIDTH/WINDOW\n"
+	"                            width and window for one CPU, repeatable\n"
+	"-w TIME  --window=TIME      sample window <n>{us,ms,s}, default=1s\n"
+	"-W TIME  --width=TIME       spinning time per window, default=500ms\n"
+	"         --debug            turn on debugging prints\n"
+	"         --cleanup          accepted for hwlatdetect compatibility");
+	exit(1);
+}
+
+enum {
+	OPT_DEBUG = 256,
+	OPT_CLEANUP,
+};
+
+static void process_options(int argc, char *argv[])
+{
+	int error = 0;
+	long long val;
+
+	for (;;) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{"cpus", required_argument, NULL, 'c'},
+			{"clock", required_argument, NULL, 'C'},
+			{"duration", required_argument, NULL, 'd'},
+			{"histogram", no_argument, NULL, 'H'},
+			{"priority", required_argument, NULL, 'p'},
+			{"quiet", no_argument, NULL, 'q'},
+			{"report", required_argument, NULL, 'r'},
+			{"threshold", required_argument, NULL, 't'},
+			{"duty", required_argument, NULL, 'u'},
+			{"window", required_argument, NULL, 'w'},
+			{"width", required_argument, NULL, 'W'},
+			{"debug", no_argument, NULL, OPT_DEBUG},
+			{"cleanup", no_argument, NULL, OPT_CLEANUP},
+			{"help", no_argument, NULL, 'h'},
+			{NULL, 0, NULL, 0}
+		};
+		int c = getopt_long(argc, argv, "c:C:d:Hp:qr:t:u:w:W:h",
+				    long_options, &option_index);
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'c': cpulist = optarg; break;
+		case 'C':
+			if (!strcmp(optarg, "tsc"))
+				use_tsc = 1;
+			else if (!strcmp(optarg, "raw"))
+				use_tsc = 0;
+			else
+				error = 1;
+			break;
+		case 'd':
+			duration = parse_seconds(optarg);
+			if (duration <= 0)
+				error = 1;
+			break;
+		case 'H': histogram = 1; break;
+		case 'p': priority = atoi(optarg); break;
+		case 'q': quiet = 1; debugging = 0; break;
+		case 'r': reportfile = optarg; break;
+		case 't':
+			val = parse_usecs(optarg);
+			if (val <= 0)
+				error = 1;
+			threshold = val;
+			break;
+		case 'u':
+			if (parse_duty(optarg))
+				error = 1;
+			break;
+		case 'w':
+			val = parse_usecs(optarg);
+			if (val <= 0)
+				error = 1;
+			window = val;
+			if (window < width) {
+				debug("shrinking width to %llu for new window of %llu\n",
+				      (unsigned long long) window / 2,
+				      (unsigned long long) window);
+				width = window / 2;
+			}
+			break;
+		case 'W':
+			val = parse_usecs(optarg);
+			if (val <= 0)
+				error = 1;
+			width = val;
+			if (width > window) {
+				debug("widening window to %llu for new width of %llu\n",
+				      (unsigned long long) width * 2,
+				      (unsigned long long) width);
+				window = width * 2;
+			}
+			break;
+		case OPT_DEBUG: debugging = 1; quiet = 0; break;
+		case OPT_CLEANUP: break;
+		case 'h':
+		case '?':
+		default:
+			error = 1;
+			break;
+		}
+	}
+
+	if (priority < 0 || priority > 99)
+		error = 1;
+#ifndef HAVE_TSC
+	if (use_tsc == 1) {
+		warn("no TSC on this architecture\n");
+		error = 1;
+	}
+#endif
+	if (error)
+		display_help();
+}
+
+/* the CPUs to run on: -c, else the isolated ones, else all we may use */
+static int get_cpus(int **cpus)
+{
+	char buf[4096];
+	cpu_set_t mask;
+	int fd, n, i;
+
+	if (cpulist)
+		return parse_cpu_list(cpulist, cpus);
+
+	fd = open(ISOLATED_CPUS, O_RDONLY);
+	if (fd >= 0) {
+		n = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (n > 0) {
+			buf[n] = '\0';
+			buf[strcspn(buf, "\n")] = '\0';
+			n = parse_cpu_list(buf, cpus);
+			if (n > 0) {
+				debug("using the isolated CPUs %s\n", buf);
+				return n;
+			}
+		}
+	}
+
+	if (sched_getaffinity(0, sizeof(mask), &mask))
+		return -1;
+	*cpus = calloc(CPU_COUNT(&mask), sizeof(int));
+	if (!*cpus)
+		return -1;
+	for (i = 0, n = 0; i < CPU_SETSIZE; i++)
+		if (CPU_ISSET(i, &mask))
+			(*cpus)[n++] = i;
+	return n;
+}
+
+static int cmp_sample(const void *a, const void *b)
+{
+	const struct hwsample *x = a, *y = b;
+
+	if (x->ts.tv_sec != y->ts.tv_sec)
+		return x->ts.tv_sec < y->ts.tv_sec ? -1 : 1;
+	if (x->ts.tv_nsec != y->ts.tv_nsec)
+		return x->ts.tv_nsec < y->ts.tv_nsec ? -1 : 1;
+	return 0;
+}
+
+/* timestamp, inner and outer gap in us like the kernel module, plus the CPU */
+static void print_samples(FILE *f, struct hwsample *s, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		fprintf(f, "%010lu.%010lu\t%llu\t%llu\t%d\n",
+			(unsigned long) s[i].ts.tv_sec,
+			(unsigned long) s[i].ts.tv_nsec,
+			(unsigned long long) (s[i].inner_ns / 1000),
+			(unsigned long long) (s[i].outer_ns / 1000),
+			s[i].cpu);
+}
+
+static void print_cpus(struct detector *det, int n)
+{
+	int i;
+
+	report("\nPer CPU results:\n");
+	for (i = 0; i < n; i++) {
+		struct detector *d = &det[i];
+		char smis[32] = "n/a";
+
+		if (d->smi_start >= 0 && d->smi_end >= 0)
+			snprintf(smis, sizeof(smis), "%lld", d->smi_end - d->smi_start);
+		report("CPU %3d: width %lluus window %lluus, windows %lu, "
+		       "exceeding %lu (preempted %lu), gaps %lu, max %lluus, SMIs %s\n",
+		       d->cpu, (unsigned long long) d->width_us,
+		       (unsigned long long) d->window_us, d->windows,
+		       d->exceeding, d->preempted, d->gaps,
+		       (unsigned long long) (d->max_ns / 1000), smis);
+	}
+}
+
+/* one row per nonempty bucket, one column per CPU, like cyclictest -h */
+static void print_histogram(struct detector *det, int n)
+{
+	int b, i;
+
+	printf("# Gap histogram, gaps of at least %dns, bucket lower bound in ns\n",
+	       HIST_FLOOR_NS);
+	printf("# bucket");
+	for (i = 0; i < n; i++)
+		printf("  CPU%-5d", det[i].cpu);
+	printf("\n");
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		int used = 0;
+
+		for (i = 0; i < n; i++)
+			used |= det[i].hist.count[b] != 0;
+		if (!used)
+			continue;
+		printf("%8llu", (unsigned long long) loghist_lower(b));
+		for (i = 0; i < n; i++)
+			printf(" %9llu", det[i].hist.count[b]);
+		printf("\n");
+	}
+}
+
+static void sighand(int sig)
+{
+	stopping = 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct detector *det;
+	struct hwsample *all;
+	unsigned long exceeding = 0;
+	uint64_t max_ns = 0;
+	int *cpus, ncpus, i, j, nr = 0;
+	struct timespec end, now;
+
+	process_options(argc, argv);
+
+	ncpus = get_cpus(&cpus);
+	if (ncpus <= 0)
+		fatal("invalid cpu list\n");
+	/* CPUs only named in --duty get a detector too */
+	for (i = 0; i < nr_duties; i++) {
+		for (j = 0; j < ncpus && cpus[j] != duties[i].cpu; j++)
+			;
+		if (j == ncpus) {
+			cpus = realloc(cpus, (ncpus + 1) * sizeof(int));
+			if (!cpus)
+				fatal("error allocating cpu list\n");
+			cpus[ncpus++] = duties[i].cpu;
+		}
+	}
+
+	if (use_tsc < 0)
+		use_tsc = tsc_invariant();
+	else if (use_tsc && !tsc_invariant())
+		warn("TSC is not invariant, gaps may be misreported\n");
+	if (use_tsc)
+		calibrate_tsc();
+
+	det = aligned_alloc(CACHELINE_SIZE, ncpus * sizeof(*det));
+	if (!det)
+		fatal("error allocating detectors\n");
+	memset(det, 0, ncpus * sizeof(*det));
+	for (i = 0; i < ncpus; i++) {
+		det[i].cpu = cpus[i];
+		det[i].width_us = width;
+		det[i].window_us = window;
+		for (j = 0; j < nr_duties; j++)
+			if (duties[j].cpu == cpus[i]) {
+				det[i].width_us = duties[j].width_us;
+				det[i].window_us = duties[j].window_us;
+			}
+	}
+
+	if (mlockall(MCL_CURRENT|MCL_FUTURE) == -1)
+		debug("mlockall failed: %s\n", strerror(errno));
+
+	signal(SIGINT, sighand);
+	signal(SIGTERM, sighand);
+
+	report("hwlatdetect:  test duration %d seconds\n", duration);
+	report("   parameters:\n");
+	report("        Latency threshold: %lluus\n", (unsigned long long) threshold);
+	report("        Sample window:     %lluus\n", (unsigned long long) window);
+	report("        Sample width:      %lluus\n", (unsigned long long) width);
+	report("     Non-sampling period:  %lluus\n", (unsigned long long) (window - width));
+	report("        Output File:       %s\n", reportfile ? reportfile : "None");
+	report("        Clock:             %s\n", use_tsc ? "tsc" : "CLOCK_MONOTONIC_RAW");
+	report("        CPUs:              %d\n", ncpus);
+	report("\nStarting test\n");
+	fflush(stdout);
+
+	for (i = 0; i < ncpus; i++)
+		if (pthread_create(&det[i].thread, NULL, detector_thread, &det[i]))
+			fatal("failed to create detector thread for CPU %d\n", cpus[i]);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec += duration;
+	do {
+		struct timespec delay = { 0, 100000000 };
+
+		nanosleep(&delay, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (!stopping && (now.tv_sec < end.tv_sec ||
+		 (now.tv_sec == end.tv_sec && now.tv_nsec < end.tv_nsec)));
+	stopping = 1;
+
+	for (i = 0; i < ncpus; i++) {
+		pthread_join(det[i].thread, NULL);
+		if (det[i].failed)
+			warn("detector on CPU %d failed to start\n", det[i].cpu);
+		exceeding += det[i].exceeding;
+		nr += det[i].nr_samples;
+		if (det[i].max_ns > max_ns)
+			max_ns = det[i].max_ns;
+	}
+
+	all = malloc((nr ? nr : 1) * sizeof(*all));
+	if (!all)
+		fatal("error allocating samples\n");
+	for (i = 0, nr = 0; i < ncpus; i++) {
+		memcpy(all + nr, det[i].samples, det[i].nr_samples * sizeof(*all));
+		nr += det[i].nr_samples;
+	}
+	qsort(all, nr, sizeof(*all), cmp_sample);
+
+	report("test finished\n");
+	report("Max Latency: %lluus\n", (unsigned long long) (max_ns / 1000));
+	report("Samples recorded: %d\n", nr);
+	report("Samples exceeding threshold: %lu\n", exceeding);
+
+	if (reportfile) {
+		FILE *f = fopen(reportfile, "w");
+
+		if (!f)
+			fatal("cannot open %s: %s\n", reportfile, strerror(errno));
+		print_samples(f, all, nr);
+		fclose(f);
+		report("sample data (%d samples) written to %s\n", nr, reportfile);
+	} else if (!quiet)
+		print_samples(stdout, all, nr);
+
+	if (!quiet) {
+		print_cpus(det, ncpus);
+		if (histogram)
+			print_histogram(det, ncpus);
+	}
+
+	for (i = 0; i < ncpus; i++)
+		free(det[i].samples);
+	free(det);
+	free(all);
+	free(cpus);
+	free(duties);
+
+	/* like hwlatdetect, but without wrapping around to "success" */
+	return exceeding > 255 ? 255 : exceeding;
+}
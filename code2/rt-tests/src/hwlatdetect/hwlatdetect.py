@@ -462,7 +462,16 @@ if __name__ == '__main__':
         quiet = True
         debugging = False
 
-    detect = Detector()
+    try:
+        detect = Detector()
+    except RuntimeError, e:
+        # no module (or debugfs): fall back to the userspace detector,
+        # which takes the same options
+        debug("%s, trying the userspace detector" % e)
+        try:
+            os.execvp("hwlat", ["hwlat"] + sys.argv[1:])
+        except OSError:
+            raise e
 
     if o.cleanup:
         debug("forcing cleanup of debugfs and hardware latency module")
@@ -0,0 +1,47 @@
+#ifndef __RT_HIST_H
+#define __RT_HIST_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Log-linear (HDR style) latency histogram.
+ *
+ * Values below HIST_SUB are counted exactly, one bucket per unit.  Above
+ * that every power of two is split into HIST_HALF linear sub-buckets, so
+ * the bucket width never exceeds 2/HIST_SUB of the value it holds (about
+ * 3% with HIST_SUB_BITS == 6).  The whole 64 bit range fits in
+ * HIST_BUCKETS counters, so there is no overflow bucket, and histograms
+ * of different threads can be merged by adding them element by element.
+ */
+#define HIST_SUB_BITS	6
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_HALF	(HIST_SUB >> 1)
+#define HIST_BUCKETS	((66 - HIST_SUB_BITS) * HIST_HALF)
+
+struct loghist {
+	unsigned long long count[HIST_BUCKETS];
+};
+
+static inline int loghist_index(uint64_t v)
+{
+	int e;
+
+	if (v < HIST_SUB)
+		return v;
+	e = (63 - __builtin_clzll(v)) - (HIST_SUB_BITS - 1);
+	return e * HIST_HALF + (int)(v >> e);
+}
+
+static inline void loghist_add(struct loghist *h, uint64_t v)
+{
+	h->count[loghist_index(v)]++;
+}
+
+uint64_t loghist_lower(int idx);
+uint64_t loghist_upper(int idx);
+void loghist_merge(struct loghist *dst, const struct loghist *src);
+unsigned long long loghist_total(const struct loghist *h);
+uint64_t loghist_percentile(const struct loghist *h, double pct);
+
+#endif	/* __RT_HIST_H */
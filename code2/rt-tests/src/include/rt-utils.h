@@ -5,6 +5,11 @@
 #define STR(x) _STR(x)
 #define MAX_PATH 256
 
+#include <stdint.h>
+#include <time.h>
+
+#define NSEC_PER_SEC_ULL 1000000000ULL
+
 int check_privs(void);
 char *get_debugfileprefix(void);
 int mount_debugfs(char *);
@@ -17,4 +22,18 @@ int event_disable(char *event);
 int event_enable_all(void);
 int event_disable_all(void);
 
+int set_cpu_affinity(int cpu);
+int set_fifo_priority(int prio);
+int cpu_to_node(int cpu);
+int parse_cpu_list(const char *str, int **cpus);
+
+/* CLOCK_MONOTONIC in nanoseconds, cheap enough for the hot path */
+static inline uint64_t rt_gettime_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * NSEC_PER_SEC_ULL + ts.tv_nsec;
+}
+
 #endif	/* __RT_UTILS.H */
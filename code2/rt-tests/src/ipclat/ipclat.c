@@ -0,0 +1,997 @@
+/*
+ * ipclat.c
+ *
+ * One ping-pong latency engine for all the interprocess communication
+ * primitives that pmqtest, ptsematest, svsematest and sigwaittest each
+ * measure on their own: pairs of threads, the sender stamps the current
+ * CLOCK_MONOTONIC time and signals, the receiver takes the difference
+ * when it wakes up, waits for the interval and signals back.
+ *
+ * Transports are plugged in through struct ipc_ops, see the transports
+ * table below.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <mqueue.h>
+#include <semaphore.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ipc.h>
+#include <sys/sem.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+#include "rt-utils.h"
+#include "rt-hist.h"
+#include "error.h"
+
+#define gettid() syscall(__NR_gettid)
+
+#define USEC_PER_SEC		1000000
+#define MQ_NAME			"/ipclat%d.%d"
+#define MATRIX_LOOPS		10000
+#define CACHELINE_SIZE		64
+
+/* the two directions of a channel */
+#define DIR_TEST		0	/* sender -> receiver, measured */
+#define DIR_SYNC		1	/* receiver -> sender */
+
+union semun {
+	int val;
+	struct semid_ds *buf;
+	unsigned short *array;
+};
+
+/* one direction of a channel, only the member of the transport is used */
+struct ipc_dir {
+	mqd_t mq;
+	sem_t sem;
+	int fd[2];
+	unsigned int word __attribute__((aligned(CACHELINE_SIZE)));
+	unsigned int seen;
+};
+
+struct ipc_chan {
+	int num;
+	int semid;
+	struct ipc_dir dir[2];
+	uint64_t stamp __attribute__((aligned(CACHELINE_SIZE)));
+};
+
+struct ipc_ops {
+	const char *name;
+	const char *desc;
+	int (*supported)(void);
+	int (*setup)(struct ipc_chan *ch);
+	int (*signal)(struct ipc_chan *ch, int dir);
+	int (*wait)(struct ipc_chan *ch, int dir);
+	void (*cleanup)(struct ipc_chan *ch);
+	int busywait;	/* waiter never gives up its CPU */
+};
+
+static int volatile stopping;
+
+/* POSIX message queues */
+
+static int mq_setup(struct ipc_chan *ch)
+{
+	struct mq_attr mqstat;
+	char name[32];
+	int d;
+
+	memset(&mqstat, 0, sizeof(mqstat));
+	mqstat.mq_maxmsg = 1;
+	mqstat.mq_msgsize = 8;
+	for (d = 0; d < 2; d++) {
+		sprintf(name, MQ_NAME, ch->num, d);
+		mq_unlink(name);
+		ch->dir[d].mq = mq_open(name, O_CREAT|O_RDWR, 0600, &mqstat);
+		if (ch->dir[d].mq == (mqd_t) -1)
+			return -1;
+	}
+	return 0;
+}
+
+static int mq_signal(struct ipc_chan *ch, int dir)
+{
+	struct timespec ts;
+
+	/* never block, a full queue means the peer is already woken */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	if (mq_timedsend(ch->dir[dir].mq, "ping", 4, 1, &ts) && errno != ETIMEDOUT)
+		return -1;
+	return 0;
+}
+
+static int mq_wait(struct ipc_chan *ch, int dir)
+{
+	char buf[8];
+
+	return mq_receive(ch->dir[dir].mq, buf, sizeof(buf), NULL) < 0 ? -1 : 0;
+}
+
+static void mq_cleanup(struct ipc_chan *ch)
+{
+	char name[32];
+	int d;
+
+	for (d = 0; d < 2; d++) {
+		mq_close(ch->dir[d].mq);
+		sprintf(name, MQ_NAME, ch->num, d);
+		mq_unlink(name);
+	}
+}
+
+/* POSIX semaphores */
+
+static int possem_setup(struct ipc_chan *ch)
+{
+	if (sem_init(&ch->dir[DIR_TEST].sem, 0, 0))
+		return -1;
+	return sem_init(&ch->dir[DIR_SYNC].sem, 0, 0);
+}
+
+static int possem_signal(struct ipc_chan *ch, int dir)
+{
+	return sem_post(&ch->dir[dir].sem);
+}
+
+static int possem_wait(struct ipc_chan *ch, int dir)
+{
+	return sem_wait(&ch->dir[dir].sem);
+}
+
+static void possem_cleanup(struct ipc_chan *ch)
+{
+	sem_destroy(&ch->dir[DIR_TEST].sem);
+	sem_destroy(&ch->dir[DIR_SYNC].sem);
+}
+
+/* SysV semaphores, one set with one semaphore per direction */
+
+static int sysvsem_setup(struct ipc_chan *ch)
+{
+	union semun arg;
+
+	ch->semid = semget(IPC_PRIVATE, 2, IPC_CREAT | 0600);
+	if (ch->semid < 0)
+		return -1;
+	arg.val = 0;
+	if (semctl(ch->semid, DIR_TEST, SETVAL, arg) ||
+	    semctl(ch->semid, DIR_SYNC, SETVAL, arg))
+		return -1;
+	return 0;
+}
+
+static int sysvsem_signal(struct ipc_chan *ch, int dir)
+{
+	struct sembuf op = { .sem_num = dir, .sem_op = 1, .sem_flg = 0 };
+
+	return semop(ch->semid, &op, 1);
+}
+
+static int sysvsem_wait(struct ipc_chan *ch, int dir)
+{
+	struct sembuf op = { .sem_num = dir, .sem_op = -1, .sem_flg = 0 };
+
+	return semop(ch->semid, &op, 1);
+}
+
+static void sysvsem_cleanup(struct ipc_chan *ch)
+{
+	semctl(ch->semid, 0, IPC_RMID);
+}
+
+/* raw futex on a flag word */
+
+static int futex_setup(struct ipc_chan *ch)
+{
+	ch->dir[DIR_TEST].word = ch->dir[DIR_SYNC].word = 0;
+	return 0;
+}
+
+static int futex_signal(struct ipc_chan *ch, int dir)
+{
+	unsigned int *word = &ch->dir[dir].word;
+
+	__atomic_store_n(word, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	return 0;
+}
+
+static int futex_wait(struct ipc_chan *ch, int dir)
+{
+	unsigned int *word = &ch->dir[dir].word;
+
+	while (!__atomic_exchange_n(word, 0, __ATOMIC_ACQUIRE)) {
+		if (stopping)
+			return -1;
+		syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+	}
+	return 0;
+}
+
+/* eventfd, one counter per direction */
+
+static int eventfd_setup(struct ipc_chan *ch)
+{
+	ch->dir[DIR_TEST].fd[0] = eventfd(0, 0);
+	ch->dir[DIR_SYNC].fd[0] = eventfd(0, 0);
+	return ch->dir[DIR_TEST].fd[0] < 0 || ch->dir[DIR_SYNC].fd[0] < 0 ? -1 : 0;
+}
+
+static int eventfd_signal(struct ipc_chan *ch, int dir)
+{
+	uint64_t val = 1;
+
+	return write(ch->dir[dir].fd[0], &val, sizeof(val)) == sizeof(val) ? 0 : -1;
+}
+
+static int eventfd_wait(struct ipc_chan *ch, int dir)
+{
+	uint64_t val;
+
+	return read(ch->dir[dir].fd[0], &val, sizeof(val)) == sizeof(val) ? 0 : -1;
+}
+
+static void eventfd_cleanup(struct ipc_chan *ch)
+{
+	close(ch->dir[DIR_TEST].fd[0]);
+	close(ch->dir[DIR_SYNC].fd[0]);
+}
+
+/*
+ * pipes and UNIX stream sockets share signal/wait: one byte goes
+ * from fd[1] to fd[0]
+ */
+
+static int pipe_setup(struct ipc_chan *ch)
+{
+	if (pipe(ch->dir[DIR_TEST].fd))
+		return -1;
+	return pipe(ch->dir[DIR_SYNC].fd);
+}
+
+static int unix_setup(struct ipc_chan *ch)
+{
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, ch->dir[DIR_TEST].fd))
+		return -1;
+	return socketpair(AF_UNIX, SOCK_STREAM, 0, ch->dir[DIR_SYNC].fd);
+}
+
+static int fd_signal(struct ipc_chan *ch, int dir)
+{
+	char c = 0;
+
+	return write(ch->dir[dir].fd[1], &c, 1) == 1 ? 0 : -1;
+}
+
+static int fd_wait(struct ipc_chan *ch, int dir)
+{
+	char c;
+
+	return read(ch->dir[dir].fd[0], &c, 1) == 1 ? 0 : -1;
+}
+
+static void fd_cleanup(struct ipc_chan *ch)
+{
+	int d;
+
+	for (d = 0; d < 2; d++) {
+		close(ch->dir[d].fd[0]);
+		close(ch->dir[d].fd[1]);
+	}
+}
+
+/*
+ * shared memory spinning: the sender bumps a sequence count on its own
+ * cache line, the receiver busy waits for it to change
+ */
+
+static int spin_signal(struct ipc_chan *ch, int dir)
+{
+	__atomic_fetch_add(&ch->dir[dir].word, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static int spin_wait(struct ipc_chan *ch, int dir)
+{
+	struct ipc_dir *d = &ch->dir[dir];
+
+	while (__atomic_load_n(&d->word, __ATOMIC_ACQUIRE) == d->seen) {
+		if (stopping)
+			return -1;
+		cpu_relax();
+	}
+	d->seen++;
+	return 0;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Same as spin, but the waiting CPU parks in the light C0.1/C0.2 state
+ * with UMONITOR/UMWAIT until the line is written, if the CPU has WAITPKG
+ */
+static int umwait_supported(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return !!(ecx & (1 << 5));
+}
+
+__attribute__((target("waitpkg")))
+static int umwait_wait(struct ipc_chan *ch, int dir)
+{
+	struct ipc_dir *d = &ch->dir[dir];
+
+	while (__atomic_load_n(&d->word, __ATOMIC_ACQUIRE) == d->seen) {
+		if (stopping)
+			return -1;
+		__builtin_ia32_umonitor(&d->word);
+		if (__atomic_load_n(&d->word, __ATOMIC_ACQUIRE) != d->seen)
+			break;
+		/* C0.2, wake up at the latest after ~100k TSC cycles */
+		__builtin_ia32_umwait(0, __builtin_ia32_rdtsc() + 100000);
+	}
+	d->seen++;
+	return 0;
+}
+#else
+static int umwait_supported(void) { return 0; }
+#define umwait_wait spin_wait
+#endif
+
+static int spin_setup(struct ipc_chan *ch)
+{
+	ch->dir[DIR_TEST].word = ch->dir[DIR_TEST].seen = 0;
+	ch->dir[DIR_SYNC].word = ch->dir[DIR_SYNC].seen = 0;
+	return 0;
+}
+
+static void nop_cleanup(struct ipc_chan *ch)
+{
+}
+
+static struct ipc_ops transports[] = {
+	{ "mq", "POSIX message queue", NULL,
+	  mq_setup, mq_signal, mq_wait, mq_cleanup },
+	{ "possem", "POSIX semaphore", NULL,
+	  possem_setup, possem_signal, possem_wait, possem_cleanup },
+	{ "sysvsem", "SysV semaphore", NULL,
+	  sysvsem_setup, sysvsem_signal, sysvsem_wait, sysvsem_cleanup },
+	{ "futex", "raw futex", NULL,
+	  futex_setup, futex_signal, futex_wait, nop_cleanup },
+	{ "eventfd", "eventfd", NULL,
+	  eventfd_setup, eventfd_signal, eventfd_wait, eventfd_cleanup },
+	{ "pipe", "pipe", NULL,
+	  pipe_setup, fd_signal, fd_wait, fd_cleanup },
+	{ "unix", "UNIX stream socket", NULL,
+	  unix_setup, fd_signal, fd_wait, fd_cleanup },
+	{ "spin", "shared memory busy wait", NULL,
+	  spin_setup, spin_signal, spin_wait, nop_cleanup, 1 },
+	{ "umwait", "shared memory UMONITOR/UMWAIT", umwait_supported,
+	  spin_setup, spin_signal, umwait_wait, nop_cleanup, 1 },
+	{ NULL },
+};
+
+struct params {
+	int num;
+	int cpu;
+	int priority;
+	int sender;
+	int max_cycles;
+	int tracelimit;
+	int tid;
+	int stopped;
+	int samples;
+	struct timespec delay;
+	uint64_t mindiff, maxdiff, curdiff;
+	double sumdiff;
+	struct loghist *hist;
+	struct ipc_ops *ops;
+	struct ipc_chan *chan;
+	pthread_t threadid;
+	char error[MAX_PATH * 2];
+};
+
+static void tracing_off(struct params *par)
+{
+	char path[MAX_PATH];
+	int fd;
+
+	snprintf(path, sizeof(path), "%stracing_on", get_debugfileprefix());
+	if ((fd = open(path, O_WRONLY)) >= 0) {
+		write(fd, "0", 1);
+		close(fd);
+	} else
+		snprintf(par->error, sizeof(par->error),
+			 "Could not access %s\n", path);
+}
+
+static void *ipcthread(void *param)
+{
+	struct params *par = param;
+	struct ipc_chan *ch = par->chan;
+	struct ipc_ops *ops = par->ops;
+
+	set_fifo_priority(par->priority);
+	set_cpu_affinity(par->cpu);
+	par->tid = gettid();
+
+	while (!stopping) {
+		if (par->sender) {
+			/* Start of latency measurement ... */
+			__atomic_store_n(&ch->stamp, rt_gettime_ns(), __ATOMIC_RELEASE);
+			if (ops->signal(ch, DIR_TEST)) {
+				snprintf(par->error, sizeof(par->error),
+					 "could not signal: %s\n", strerror(errno));
+				stopping = 1;
+				break;
+			}
+			par->samples++;
+			if (par->max_cycles && par->samples >= par->max_cycles)
+				break;
+			/* wait until the receiver is ready */
+			if (ops->wait(ch, DIR_SYNC))
+				break;
+		} else {
+			uint64_t diff;
+
+			/* a wakeup after stopping is stop_pair() kicking us */
+			if (ops->wait(ch, DIR_TEST) || stopping)
+				break;
+			/* ... end of latency measurement */
+			diff = rt_gettime_ns() - __atomic_load_n(&ch->stamp, __ATOMIC_ACQUIRE);
+
+			if (diff < par->mindiff)
+				par->mindiff = diff;
+			if (diff > par->maxdiff)
+				par->maxdiff = diff;
+			par->curdiff = diff;
+			par->sumdiff += (double) diff;
+			loghist_add(par->hist, diff);
+			par->samples++;
+
+			if (par->tracelimit && diff > par->tracelimit * 1000ULL) {
+				tracing_off(par);
+				stopping = 1;
+				break;
+			}
+			if (par->max_cycles && par->samples >= par->max_cycles)
+				break;
+
+			clock_nanosleep(CLOCK_MONOTONIC, 0, &par->delay, NULL);
+
+			/* tell the sender that we are ready for the next one */
+			if (ops->signal(ch, DIR_SYNC)) {
+				snprintf(par->error, sizeof(par->error),
+					 "could not signal: %s\n", strerror(errno));
+				stopping = 1;
+				break;
+			}
+		}
+	}
+	par->stopped = 1;
+	return NULL;
+}
+
+static void display_help(void)
+{
+	struct ipc_ops *ops;
+
+	printf("ipclat V %1.2f\n", VERSION_STRING);
+	puts("Usage: ipclat <options>");
+	puts("Function: measure interprocess communication latency in ns");
+	puts(
+	"Options:\n"
+	"-a [NUM] --affinity        run thread #N on processor #N, if possible\n"
+	"                           with NUM pin all threads to the processor NUM\n"
+	"-b USEC  --breaktrace=USEC send break trace command when latency > USEC\n"
+	"-d DIST  --distance=DIST   distance of thread intervals in us default=500\n"
+	"-i INTV  --interval=INTV   base interval of thread in us default=1000\n"
+	"-l LOOPS --loops=LOOPS     number of loops: default=0(endless)\n"
+	"-M CPUS  --matrix=CPUS     measure every sender/receiver CPU pair of the\n"
+	"                           list CPUS (e.g. 0-3,8) and print P50 and P99\n"
+	"                           matrices, loops default to " STR(MATRIX_LOOPS) "\n"
+	"-p PRIO  --prio=PRIO       priority\n"
+	"-q       --quiet           print only a summary on exit\n"
+	"-S       --smp             SMP testing: options -a -t and same priority\n"
+	"                           of all threads\n"
+	"-t       --threads         one thread pair per available processor\n"
+	"-t [NUM] --threads=NUM     number of thread pairs:\n"
+	"                           without NUM, threads = max_cpus\n"
+	"                           without -t default = 1\n"
+	"-x NAME  --transport=NAME  IPC primitive to measure, default=futex:");
+	for (ops = transports; ops->name; ops++)
+		printf("                           %-8s %s\n", ops->name, ops->desc);
+	exit(1);
+}
+
+enum {
+	AFFINITY_UNSPECIFIED,
+	AFFINITY_SPECIFIED,
+	AFFINITY_USEALL
+};
+
+static int setaffinity = AFFINITY_UNSPECIFIED;
+static int affinity;
+static int tracelimit;
+static int priority;
+static int num_threads = 1;
+static int max_cycles;
+static int interval = 1000;
+static int distance = 500;
+static int smp;
+static int sameprio;
+static int quiet;
+static char *matrix;
+static struct ipc_ops *ops = &transports[3];	/* futex */
+static int *busy_cpus;	/* busywait: receiver 2i and sender 2i+1 of pair i */
+
+static void process_options(int argc, char *argv[])
+{
+	int error = 0;
+	int max_cpus = sysconf(_SC_NPROCESSORS_CONF);
+
+	for (;;) {
+		int option_index = 0;
+		/** Options for getopt */
+		static struct option long_options[] = {
+			{"affinity", optional_argument, NULL, 'a'},
+			{"breaktrace", required_argument, NULL, 'b'},
+			{"distance", required_argument, NULL, 'd'},
+			{"interval", required_argument, NULL, 'i'},
+			{"loops", required_argument, NULL, 'l'},
+			{"matrix", required_argument, NULL, 'M'},
+			{"priority", required_argument, NULL, 'p'},
+			{"quiet", no_argument, NULL, 'q'},
+			{"smp", no_argument, NULL, 'S'},
+			{"threads", optional_argument, NULL, 't'},
+			{"transport", required_argument, NULL, 'x'},
+			{"help", no_argument, NULL, '?'},
+			{NULL, 0, NULL, 0}
+		};
+		int c = getopt_long(argc, argv, "a::b:d:i:l:M:p:qSt::x:",
+				    long_options, &option_index);
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'a':
+			if (smp) {
+				warn("-a ignored due to --smp\n");
+				break;
+			}
+			if (optarg != NULL) {
+				affinity = atoi(optarg);
+				setaffinity = AFFINITY_SPECIFIED;
+			} else if (optind<argc && atoi(argv[optind])) {
+				affinity = atoi(argv[optind]);
+				setaffinity = AFFINITY_SPECIFIED;
+			} else {
+				setaffinity = AFFINITY_USEALL;
+			}
+			break;
+		case 'b': tracelimit = atoi(optarg); break;
+		case 'd': distance = atoi(optarg); break;
+		case 'i': interval = atoi(optarg); break;
+		case 'l': max_cycles = atoi(optarg); break;
+		case 'M': matrix = optarg; break;
+		case 'p': priority = atoi(optarg); break;
+		case 'q': quiet = 1; break;
+		case 'S':
+			smp = 1;
+			num_threads = max_cpus;
+			setaffinity = AFFINITY_USEALL;
+			break;
+		case 't':
+			if (smp) {
+				warn("-t ignored due to --smp\n");
+				break;
+			}
+			if (optarg != NULL)
+				num_threads = atoi(optarg);
+			else if (optind<argc && atoi(argv[optind]))
+				num_threads = atoi(argv[optind]);
+			else
+				num_threads = max_cpus;
+			break;
+		case 'x':
+			for (ops = transports; ops->name; ops++)
+				if (!strcmp(ops->name, optarg))
+					break;
+			if (!ops->name) {
+				fprintf(stderr, "ERROR: unknown transport %s\n", optarg);
+				error = 1;
+			}
+			break;
+		case '?': error = 1; break;
+		}
+	}
+
+	if (setaffinity == AFFINITY_SPECIFIED) {
+		if (affinity < 0)
+			error = 1;
+		if (affinity >= max_cpus) {
+			fprintf(stderr, "ERROR: CPU #%d not found, only %d CPUs available\n",
+			    affinity, max_cpus);
+			error = 1;
+		}
+	}
+
+	if (num_threads < 1 || num_threads > 255)
+		error = 1;
+
+	if (priority < 0 || priority > 99)
+		error = 1;
+
+	if (interval < 0 || distance < 0)
+		error = 1;
+
+	if (priority && smp)
+		sameprio = 1;
+
+	if (matrix && !max_cycles)
+		max_cycles = MATRIX_LOOPS;
+
+	if (error)
+		display_help();
+
+	if (ops->supported && !ops->supported())
+		fatal("transport %s is not supported on this machine\n", ops->name);
+
+	/*
+	 * A busy waiting thread at RT priority never lets another on its
+	 * CPU run, so every receiver and every sender gets a CPU of its
+	 * own, from those we may run on: two per pair.
+	 */
+	if (ops->busywait) {
+		cpu_set_t mask;
+		int cpu, n = 0;
+
+		if (sched_getaffinity(0, sizeof(mask), &mask))
+			fatal("sched_getaffinity: %s\n", strerror(errno));
+		if (smp)
+			num_threads = CPU_COUNT(&mask) / 2;
+		if (setaffinity == AFFINITY_SPECIFIED && num_threads > 1)
+			fatal("-a %d would put every %s pair on one CPU\n",
+			      affinity, ops->name);
+		if (num_threads < 1 || 2 * num_threads > CPU_COUNT(&mask))
+			fatal("transport %s needs two CPUs per thread pair, "
+			      "%d CPUs for %d pairs\n", ops->name,
+			      CPU_COUNT(&mask), num_threads);
+		busy_cpus = calloc(2 * num_threads, sizeof(int));
+		if (!busy_cpus)
+			fatal("error allocating cpu list\n");
+		for (cpu = 0; cpu < CPU_SETSIZE && n < 2 * num_threads; cpu++)
+			if (CPU_ISSET(cpu, &mask))
+				busy_cpus[n++] = cpu;
+		/* -a N: the receiver on N, the sender on the next CPU */
+		if (setaffinity == AFFINITY_SPECIFIED) {
+			busy_cpus[0] = affinity;
+			for (cpu = 1; cpu < CPU_SETSIZE; cpu++)
+				if (CPU_ISSET((affinity + cpu) % CPU_SETSIZE, &mask))
+					break;
+			busy_cpus[1] = (affinity + cpu) % CPU_SETSIZE;
+		}
+	}
+}
+
+static void sighand(int sig)
+{
+	stopping = 1;
+}
+
+/* set up one sender/receiver pair on channel ch, not yet started */
+static void init_pair(struct params *receiver, struct params *sender,
+		      struct ipc_chan *ch, int num, int rcpu, int scpu,
+		      int prio, int intv)
+{
+	memset(ch, 0, sizeof(*ch));
+	ch->num = num;
+	if (ops->setup(ch))
+		fatal("could not set up %s channel %d: %s\n", ops->name, num,
+		      strerror(errno));
+
+	memset(receiver, 0, sizeof(*receiver));
+	receiver->num = num;
+	receiver->cpu = rcpu;
+	receiver->priority = prio;
+	receiver->tracelimit = tracelimit;
+	receiver->max_cycles = max_cycles;
+	receiver->mindiff = UINT64_MAX;
+	receiver->delay.tv_sec = intv / USEC_PER_SEC;
+	receiver->delay.tv_nsec = (intv % USEC_PER_SEC) * 1000;
+	receiver->ops = ops;
+	receiver->chan = ch;
+	receiver->hist = calloc(1, sizeof(struct loghist));
+	if (!receiver->hist)
+		fatal("error allocating histogram\n");
+
+	memcpy(sender, receiver, sizeof(*sender));
+	sender->cpu = scpu;
+	sender->sender = 1;
+	sender->hist = NULL;
+}
+
+static void start_pair(struct params *receiver, struct params *sender)
+{
+	if (pthread_create(&receiver->threadid, NULL, ipcthread, receiver) ||
+	    pthread_create(&sender->threadid, NULL, ipcthread, sender))
+		fatal("could not create thread pair %d\n", receiver->num);
+}
+
+/*
+ * Wake anybody still waiting on the channel and collect the threads.
+ * Spinning and futex waiters see stopping by themselves.
+ */
+static void stop_pair(struct params *receiver, struct params *sender)
+{
+	struct timespec delay = { 0, 1000000 };
+	int tries;
+
+	for (tries = 0; tries < 1000; tries++) {
+		if (receiver->stopped && sender->stopped)
+			break;
+		if (!receiver->stopped)
+			ops->signal(receiver->chan, DIR_TEST);
+		if (!sender->stopped)
+			ops->signal(sender->chan, DIR_SYNC);
+		nanosleep(&delay, NULL);
+	}
+	pthread_join(receiver->threadid, NULL);
+	pthread_join(sender->threadid, NULL);
+	ops->cleanup(receiver->chan);
+}
+
+static void print_summary(struct params *receiver, int n)
+{
+	int i;
+
+	printf("# transport %s (%s), latencies in ns\n", ops->name, ops->desc);
+	for (i = 0; i < n; i++) {
+		struct loghist *h = receiver[i].hist;
+
+		printf("#%d -> #%d, Samples %d, Min %llu, Avg %llu, P50 %llu, "
+		       "P90 %llu, P99 %llu, P99.9 %llu, P99.99 %llu, Max %llu\n",
+		       i*2+1, i*2, receiver[i].samples,
+		       (unsigned long long) (receiver[i].samples ? receiver[i].mindiff : 0),
+		       (unsigned long long) (receiver[i].samples ?
+			receiver[i].sumdiff / receiver[i].samples + 0.5 : 0),
+		       (unsigned long long) loghist_percentile(h, 50.0),
+		       (unsigned long long) loghist_percentile(h, 90.0),
+		       (unsigned long long) loghist_percentile(h, 99.0),
+		       (unsigned long long) loghist_percentile(h, 99.9),
+		       (unsigned long long) loghist_percentile(h, 99.99),
+		       (unsigned long long) receiver[i].maxdiff);
+	}
+}
+
+/*
+ * Placement matrix: one pair at a time, sender on the row CPU, receiver
+ * on the column CPU, so the pairs do not disturb each other.
+ */
+static int run_matrix(void)
+{
+	static const double pcts[] = { 50.0, 99.0 };
+	struct params receiver, sender;
+	struct ipc_chan *ch;
+	uint64_t *result[2];
+	int *cpus, ncpus, s, r, p;
+
+	ncpus = parse_cpu_list(matrix, &cpus);
+	if (ncpus <= 0)
+		fatal("invalid cpu list %s\n", matrix);
+
+	ch = aligned_alloc(CACHELINE_SIZE, sizeof(*ch));
+	result[0] = calloc(ncpus * ncpus, sizeof(uint64_t));
+	result[1] = calloc(ncpus * ncpus, sizeof(uint64_t));
+	if (!ch || !result[0] || !result[1])
+		fatal("error allocating matrix\n");
+
+	for (s = 0; s < ncpus && !stopping; s++) {
+		for (r = 0; r < ncpus && !stopping; r++) {
+			/* busy waiting on the sender's CPU would livelock */
+			if (ops->busywait && cpus[s] == cpus[r])
+				continue;
+			init_pair(&receiver, &sender, ch, 0, cpus[r], cpus[s],
+				  priority, interval);
+			start_pair(&receiver, &sender);
+			while (!(receiver.stopped && sender.stopped) && !stopping)
+				usleep(10000);
+			stop_pair(&receiver, &sender);
+			for (p = 0; p < 2; p++)
+				result[p][s * ncpus + r] =
+					loghist_percentile(receiver.hist, pcts[p]);
+			free(receiver.hist);
+			if (!quiet)
+				fprintf(stderr, "CPU%d -> CPU%d done\r", cpus[s], cpus[r]);
+		}
+	}
+	if (!quiet)
+		fprintf(stderr, "\n");
+
+	for (p = 0; p < 2; p++) {
+		printf("# %s P%g latency in ns, sender (rows) -> receiver (columns)\n",
+		       ops->name, pcts[p]);
+		printf("%-14s", "");
+		for (r = 0; r < ncpus; r++) {
+			char label[16];
+
+			snprintf(label, sizeof(label), "CPU%d/node%d",
+				 cpus[r], cpu_to_node(cpus[r]));
+			printf(" %11s", label);
+		}
+		printf("\n");
+		for (s = 0; s < ncpus; s++) {
+			printf("CPU%-3d node%-3d", cpus[s], cpu_to_node(cpus[s]));
+			for (r = 0; r < ncpus; r++) {
+				if (ops->busywait && cpus[s] == cpus[r])
+					printf(" %11s", "-");
+				else
+					printf(" %11llu",
+					       (unsigned long long) result[p][s * ncpus + r]);
+			}
+			printf("\n");
+		}
+	}
+
+	free(result[0]);
+	free(result[1]);
+	free(ch);
+	free(cpus);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+	int max_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	struct params *receiver = NULL;
+	struct params *sender = NULL;
+	struct ipc_chan *chans = NULL;
+	struct timespec maindelay;
+	int first = 1;
+	int errorlines = 0;
+
+	process_options(argc, argv);
+
+	if (check_privs())
+		return 1;
+
+	if (mlockall(MCL_CURRENT|MCL_FUTURE) == -1) {
+		perror("mlockall");
+		return 1;
+	}
+
+	signal(SIGINT, sighand);
+	signal(SIGTERM, sighand);
+
+	if (matrix)
+		return run_matrix();
+
+	receiver = calloc(num_threads, sizeof(struct params));
+	sender = calloc(num_threads, sizeof(struct params));
+	chans = aligned_alloc(CACHELINE_SIZE, num_threads * sizeof(struct ipc_chan));
+	if (receiver == NULL || sender == NULL || chans == NULL)
+		fatal("error allocating thread parameters\n");
+
+	for (i = 0; i < num_threads; i++) {
+		int cpu = -1, scpu;
+
+		switch (setaffinity) {
+		case AFFINITY_UNSPECIFIED: cpu = -1; break;
+		case AFFINITY_SPECIFIED: cpu = affinity; break;
+		case AFFINITY_USEALL: cpu = i % max_cpus; break;
+		}
+		scpu = cpu;
+		if (cpu >= 0 && ops->busywait) {
+			cpu = busy_cpus[2 * i];
+			scpu = busy_cpus[2 * i + 1];
+		}
+		init_pair(&receiver[i], &sender[i], &chans[i], i, cpu, scpu,
+			  priority, interval);
+		start_pair(&receiver[i], &sender[i]);
+		if (priority > 1 && !sameprio)
+			priority--;
+		interval += distance;
+	}
+
+	maindelay.tv_sec = 0;
+	maindelay.tv_nsec = 50000000; /* 50 ms */
+
+	while (!stopping) {
+		int allstopped = 1;
+
+		for (i = 0; i < num_threads; i++)
+			if (!receiver[i].stopped || !sender[i].stopped)
+				allstopped = 0;
+
+		if (!quiet) {
+			if (!first)
+				printf("\033[%dA", num_threads*2 + errorlines);
+			first = 0;
+
+			for (i = 0; i < num_threads; i++)
+				printf("#%1d: ID%d, P%d, CPU%d, I%ld; #%1d: ID%d, P%d, CPU%d, Cycles %d   \n",
+				       i*2, receiver[i].tid, receiver[i].priority, receiver[i].cpu,
+				       receiver[i].delay.tv_nsec / 1000,
+				       i*2+1, sender[i].tid, sender[i].priority, sender[i].cpu,
+				       sender[i].samples);
+			for (i = 0; i < num_threads; i++) {
+				printf("#%d -> #%d, Min %6llu, Cur %6llu, Avg %6llu, Max %6llu\n",
+				       i*2+1, i*2,
+				       (unsigned long long) (receiver[i].samples ? receiver[i].mindiff : 0),
+				       (unsigned long long) receiver[i].curdiff,
+				       (unsigned long long) (receiver[i].samples ?
+					receiver[i].sumdiff / receiver[i].samples + 0.5 : 0),
+				       (unsigned long long) receiver[i].maxdiff);
+				if (receiver[i].error[0] != '\0') {
+					printf("%s", receiver[i].error);
+					errorlines++;
+					receiver[i].error[0] = '\0';
+				}
+				if (sender[i].error[0] != '\0') {
+					printf("%s", sender[i].error);
+					errorlines++;
+					sender[i].error[0] = '\0';
+				}
+			}
+			fflush(NULL);
+		}
+		if (allstopped)
+			break;
+		nanosleep(&maindelay, NULL);
+	}
+
+	stopping = 1;
+	for (i = 0; i < num_threads; i++)
+		stop_pair(&receiver[i], &sender[i]);
+
+	print_summary(receiver, num_threads);
+
+	for (i = 0; i < num_threads; i++)
+		free(receiver[i].hist);
+	free(chans);
+	free(receiver);
+	free(sender);
+	free(busy_cpus);
+	return 0;
+}
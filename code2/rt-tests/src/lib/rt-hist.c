@@ -0,0 +1,67 @@
+/*
+ * Log-linear latency histogram helpers, see rt-hist.h
+ */
+#include "rt-hist.h"
+
+/* smallest value counted in bucket idx */
+uint64_t loghist_lower(int idx)
+{
+	int e;
+
+	if (idx < HIST_SUB)
+		return idx;
+	e = idx / HIST_HALF - 1;
+	return (uint64_t)(idx - e * HIST_HALF) << e;
+}
+
+/* largest value counted in bucket idx */
+uint64_t loghist_upper(int idx)
+{
+	int e;
+
+	if (idx < HIST_SUB)
+		return idx;
+	e = idx / HIST_HALF - 1;
+	return ((uint64_t)(idx - e * HIST_HALF + 1) << e) - 1;
+}
+
+void loghist_merge(struct loghist *dst, const struct loghist *src)
+{
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->count[i] += src->count[i];
+}
+
+unsigned long long loghist_total(const struct loghist *h)
+{
+	unsigned long long total = 0;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		total += h->count[i];
+	return total;
+}
+
+/*
+ * Return the upper bound of the bucket holding the pct'th percentile,
+ * i.e. a value that at least pct percent of the samples did not exceed.
+ */
+uint64_t loghist_percentile(const struct loghist *h, double pct)
+{
+	unsigned long long total = loghist_total(h);
+	unsigned long long want, seen = 0;
+	int i;
+
+	if (!total)
+		return 0;
+	want = (unsigned long long)(total * pct / 100.0 + 0.5);
+	if (want < 1)
+		want = 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->count[i];
+		if (seen >= want)
+			return loghist_upper(i);
+	}
+	return loghist_upper(HIST_BUCKETS - 1);
+}
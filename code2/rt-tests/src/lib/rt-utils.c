@@ -16,6 +16,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <dirent.h>
 #include "rt-utils.h"
 #include "error.h"
 
@@ -273,3 +274,105 @@ int check_privs(void)
 	return sched_setscheduler(0, policy, &old_param);
 }
 
+
+/*
+ * pin the calling thread to cpu, -1 leaves the affinity alone
+ */
+int set_cpu_affinity(int cpu)
+{
+	cpu_set_t mask;
+
+	if (cpu < 0)
+		return 0;
+	CPU_ZERO(&mask);
+	CPU_SET(cpu, &mask);
+	if (sched_setaffinity(0, sizeof(mask), &mask) == -1) {
+		warn("Could not set CPU affinity to CPU #%d\n", cpu);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * make the calling thread SCHED_FIFO with prio, 0 leaves it SCHED_OTHER
+ */
+int set_fifo_priority(int prio)
+{
+	struct sched_param schedp;
+
+	if (prio <= 0)
+		return 0;
+	memset(&schedp, 0, sizeof(schedp));
+	schedp.sched_priority = prio;
+	if (sched_setscheduler(0, SCHED_FIFO, &schedp)) {
+		warn("Could not set priority to %d\n", prio);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * NUMA node of a CPU from sysfs, 0 if the kernel does not tell
+ */
+int cpu_to_node(int cpu)
+{
+	char path[MAX_PATH];
+	struct dirent *de;
+	DIR *dir;
+	int node = 0;
+
+	sprintf(path, "/sys/devices/system/cpu/cpu%d", cpu);
+	if ((dir = opendir(path)) == NULL)
+		return 0;
+	while ((de = readdir(dir)) != NULL)
+		if (sscanf(de->d_name, "node%d", &node) == 1)
+			break;
+	closedir(dir);
+	return node;
+}
+
+/*
+ * parse a cpu list like "0-3,8,10-11" into a newly allocated array,
+ * returns the number of cpus or -1 on a malformed list
+ */
+int parse_cpu_list(const char *str, int **cpus)
+{
+	int n = 0, size = 0;
+	const char *p = str;
+
+	*cpus = NULL;
+	while (*p) {
+		char *end;
+		long first, last, cpu;
+
+		first = strtol(p, &end, 10);
+		if (end == p || first < 0)
+			goto bad;
+		last = first;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p || last < first)
+				goto bad;
+		}
+		for (cpu = first; cpu <= last; cpu++) {
+			if (n == size) {
+				size = size ? size * 2 : 16;
+				*cpus = realloc(*cpus, size * sizeof(int));
+				if (!*cpus)
+					fatal("error allocating cpu list\n");
+			}
+			(*cpus)[n++] = cpu;
+		}
+		if (*end == ',')
+			end++;
+		else if (*end != '\0')
+			goto bad;
+		p = end;
+	}
+	return n;
+bad:
+	free(*cpus);
+	*cpus = NULL;
+	return -1;
+}
@@ -53,7 +53,13 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
+#include <stdint.h>
 #include <termios.h>
+#include <time.h>
+#include <linux/futex.h>
+
+#include "rt-hist.h"
 
 /* conversions */
 #define USEC_PER_SEC 	1000000
@@ -128,6 +134,16 @@ int uniprocessor = 0;
 /* lock all memory */
 int lockall = 0;
 
+/* kind of lock the inversion groups fight over */
+enum mutex_kind {
+	MUTEX_PI,		/* pthread mutex, PTHREAD_PRIO_INHERIT */
+	MUTEX_ROBUST,		/* robust pthread mutex, PTHREAD_PRIO_INHERIT */
+	MUTEX_PROTECT,		/* pthread mutex, PTHREAD_PRIO_PROTECT */
+	MUTEX_FUTEX,		/* bare FUTEX_LOCK_PI/FUTEX_UNLOCK_PI */
+};
+const char *mutex_names[] = { "pi", "robust", "protect", "futex" };
+int mutex_kind = MUTEX_PI;
+
 /* command line options */
 struct option options[] = {
 	{"duration", required_argument, NULL, 't'},
@@ -141,6 +157,7 @@ struct option options[] = {
 	{"debug", no_argument, NULL, 'd'},
 	{"version", no_argument, NULL, 'V'},
 	{"mlockall", no_argument, NULL, 'm'},
+	{"mutex", required_argument, NULL, 'x'},
 	{"help", no_argument, NULL, 'h'},
 	{NULL, 0, NULL, 0},
 };
@@ -185,6 +202,9 @@ struct group_parameters {
 	/* group mutex */
 	pthread_mutex_t mutex;
 
+	/* lock word used instead of mutex with --mutex=futex */
+	uint32_t futex;
+
 	/* state barriers */
 	pthread_barrier_t start_barrier;
 	pthread_barrier_t locked_barrier;
@@ -205,6 +225,11 @@ struct group_parameters {
 	/* total watchdog hits */
 	int watchdog_hits;
 
+	/* time (ns) the high priority thread spent blocked on the mutex */
+	struct loghist *block_hist;
+	uint64_t block_min;
+	uint64_t block_max;
+
 } *groups;
 
 /* number of consecutive watchdog hits before quitting */
@@ -235,9 +260,12 @@ int create_group(struct group_parameters *group);
 unsigned long total_inversions(void);
 void banner(void);
 void summary(void);
+void block_summary(void);
 void wait_for_termination(void);
 int barrier_init(pthread_barrier_t * b, const pthread_barrierattr_t * attr,
 		 unsigned count, const char *name);
+int group_lock(struct group_parameters *p);
+int group_unlock(struct group_parameters *p);
 
 int main(int argc, char **argv)
 {
@@ -614,6 +642,71 @@ int verify_cpu(int cpu)
 	return FAILURE;
 }
 
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * PI futex, as described in futex(2): the lock word holds the owner's
+ * tid, an uncontended lock or unlock is a single compare and swap, and
+ * the kernel takes over (and boosts the owner) once there are waiters.
+ */
+static __thread pid_t self_tid;
+
+static int futex_lock_pi(uint32_t *uaddr)
+{
+	uint32_t unowned = 0;
+
+	if (self_tid == 0)
+		self_tid = syscall(SYS_gettid);
+	if (__atomic_compare_exchange_n(uaddr, &unowned, self_tid, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return 0;
+	while (syscall(SYS_futex, uaddr, FUTEX_LOCK_PI_PRIVATE, 0, NULL,
+		       NULL, 0) == -1)
+		if (errno != EINTR)
+			return errno;
+	return 0;
+}
+
+static int futex_unlock_pi(uint32_t *uaddr)
+{
+	uint32_t owner = self_tid;
+
+	if (__atomic_compare_exchange_n(uaddr, &owner, 0, 0,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		return 0;
+	if (syscall(SYS_futex, uaddr, FUTEX_UNLOCK_PI_PRIVATE, 0, NULL,
+		    NULL, 0) == -1)
+		return errno;
+	return 0;
+}
+
+int group_lock(struct group_parameters *p)
+{
+	int status;
+
+	if (mutex_kind == MUTEX_FUTEX)
+		return futex_lock_pi(&p->futex);
+
+	status = pthread_mutex_lock(&p->mutex);
+	/* the previous owner died holding it; take it over */
+	if (status == EOWNERDEAD)
+		status = pthread_mutex_consistent(&p->mutex);
+	return status;
+}
+
+int group_unlock(struct group_parameters *p)
+{
+	if (mutex_kind == MUTEX_FUTEX)
+		return futex_unlock_pi(&p->futex);
+	return pthread_mutex_unlock(&p->mutex);
+}
+
 void *low_priority(void *arg)
 {
 	int status;
@@ -692,7 +785,13 @@ void *low_priority(void *arg)
 		}
 
 		debug("low_priority[%d]: claiming mutex\n", p->id);
-		pthread_mutex_lock(&p->mutex);
+		status = group_lock(p);
+		if (status) {
+			error("low_priority[%d]: locking mutex: %s\n",
+			      p->id, strerror(status));
+			set_shutdown_flag();
+			return NULL;
+		}
 		debug("low_priority[%d]: mutex locked\n", p->id);
 
 		debug("low_priority[%d]: entering locked wait\n", p->id);
@@ -715,7 +814,7 @@ void *low_priority(void *arg)
 
 		/* release the mutex */
 		debug("low_priority[%d]: unlocking mutex\n", p->id);
-		pthread_mutex_unlock(&p->mutex);
+		group_unlock(p);
 
 		/* finish state */
 		debug("low_priority[%d]: entering finish wait\n", p->id);
@@ -850,6 +949,7 @@ void *high_priority(void *arg)
 	int status;
 	int unbounded;
 	unsigned long count = 0;
+	uint64_t t0, blocked;
 	struct group_parameters *p = (struct group_parameters *)arg;
 	pthread_barrier_t *loop_barr = &p->loop_barr;
 	pthread_mutex_t *loop_mtx = &p->loop_mtx;
@@ -922,11 +1022,24 @@ void *high_priority(void *arg)
 			return NULL;
 		}
 		debug("high_priority[%d]: locking mutex\n", p->id);
-		pthread_mutex_lock(&p->mutex);
+		t0 = now_ns();
+		status = group_lock(p);
+		blocked = now_ns() - t0;
+		if (status) {
+			error("high_priority[%d]: locking mutex: %s\n",
+			      p->id, strerror(status));
+			set_shutdown_flag();
+			return NULL;
+		}
 		debug("high_priority[%d]: got mutex\n", p->id);
+		loghist_add(p->block_hist, blocked);
+		if (blocked < p->block_min)
+			p->block_min = blocked;
+		if (blocked > p->block_max)
+			p->block_max = blocked;
 
 		debug("high_priority[%d]: unlocking mutex\n", p->id);
-		pthread_mutex_unlock(&p->mutex);
+		group_unlock(p);
 		debug("high_priority[%d]: entering finish state\n", p->id);
 
 		status = pthread_barrier_wait(&p->finish_barrier);
@@ -1011,6 +1124,7 @@ void usage(void)
 	printf
 	    ("\t--uniprocessor\t- force all threads to run on one processor\n");
 	printf("\t--mlockall\t- lock current and future memory\n");
+	printf("\t--mutex=<type>\t- group lock: pi, robust, protect or futex [pi]\n");
 	printf("\t--debug\t\t- turn on debug prints\n");
 	printf("\t--version\t- print version number on output\n");
 	printf("\t--help\t\t- print this message\n");
@@ -1088,13 +1202,33 @@ int initialize_group(struct group_parameters *group)
 		return FAILURE;
 	}
 
-	/* set priority inheritance attribute for mutex */
+	/* set priority inheritance (or ceiling) attribute for mutex */
 	status = pthread_mutexattr_setprotocol(&mutex_attr,
+					       mutex_kind == MUTEX_PROTECT ?
+					       PTHREAD_PRIO_PROTECT :
 					       PTHREAD_PRIO_INHERIT);
 	if (status) {
 		error("setting mutex attribute policy: %s\n", strerror(status));
 		return FAILURE;
 	}
+	if (mutex_kind == MUTEX_PROTECT) {
+		status = pthread_mutexattr_setprioceiling(&mutex_attr,
+							  HIGH_PRIO());
+		if (status) {
+			error("setting mutex priority ceiling: %s\n",
+			      strerror(status));
+			return FAILURE;
+		}
+	}
+	if (mutex_kind == MUTEX_ROBUST) {
+		status = pthread_mutexattr_setrobust(&mutex_attr,
+						     PTHREAD_MUTEX_ROBUST);
+		if (status) {
+			error("setting mutex robustness: %s\n",
+			      strerror(status));
+			return FAILURE;
+		}
+	}
 	/* initialize the group mutex */
 	status = pthread_mutex_init(&group->mutex, &mutex_attr);
 	if (status) {
@@ -1102,6 +1236,16 @@ int initialize_group(struct group_parameters *group)
 		return FAILURE;
 	}
 
+	group->futex = 0;
+
+	group->block_hist = calloc(1, sizeof(struct loghist));
+	if (group->block_hist == NULL) {
+		error("allocating block time histogram\n");
+		return FAILURE;
+	}
+	group->block_min = UINT64_MAX;
+	group->block_max = 0;
+
 	/* initialize the group barriers */
 	if (barrier_init(&group->start_barrier, NULL, NUM_TEST_THREADS,
 			 "start_barrier"))
@@ -1243,6 +1387,18 @@ void process_command_line(int argc, char **argv)
 		case 'm':
 			lockall = 1;
 			break;
+		case 'x':
+			for (mutex_kind = 0; mutex_kind <= MUTEX_FUTEX;
+			     mutex_kind++)
+				if (strcmp(optarg, mutex_names[mutex_kind]) == 0)
+					break;
+			if (mutex_kind > MUTEX_FUTEX) {
+				fprintf(stderr, "unknown mutex type %s\n",
+					optarg);
+				usage();
+				exit(1);
+			}
+			break;
 		}
 	}
 }
@@ -1275,6 +1431,7 @@ void banner(void)
 		printf("Number of inversions per group: %d\n", inversions);
 	printf("Test threads using scheduler policy: %s\n",
 	       policy == SCHED_FIFO ? "SCHED_FIFO" : "SCHED_RR");
+	printf("Group mutex type: %s\n", mutex_names[mutex_kind]);
 	printf("    Admin thread priority:  %d\n", MAIN_PRIO());
 	printf("%d groups of 3 threads will be created\n", ngroups);
 	printf("    High thread priority:   %d\n", HIGH_PRIO());
@@ -1290,6 +1447,64 @@ void summary(void)
 	printf("Total inversion performed: %lu\n", total_inversions());
 	printf("Test Duration: %d days, %d hours, %d minutes, %d seconds\n",
 	       t->tm_yday, t->tm_hour, t->tm_min, t->tm_sec);
+	block_summary();
+}
+
+/* percentile of a block time histogram, clamped to the observed maximum */
+static double block_pct(const struct loghist *h, double pct, uint64_t max)
+{
+	uint64_t v = loghist_percentile(h, pct);
+
+	return (v > max ? max : v) / 1000.0;
+}
+
+static void print_block_times(const char *name, const struct loghist *h,
+			      uint64_t min, uint64_t max)
+{
+	unsigned long long n = loghist_total(h);
+
+	if (n == 0) {
+		printf("%6s %10llu\n", name, n);
+		return;
+	}
+	printf("%6s %10llu %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f\n",
+	       name, n, min / 1000.0, block_pct(h, 50.0, max),
+	       block_pct(h, 90.0, max), block_pct(h, 99.0, max),
+	       block_pct(h, 99.9, max), max / 1000.0);
+}
+
+/* per group and overall time the high priority threads spent blocked */
+void block_summary(void)
+{
+	struct loghist *all;
+	uint64_t min = UINT64_MAX, max = 0;
+	char name[16];
+	int i;
+
+	all = calloc(1, sizeof(*all));
+	if (all == NULL)
+		return;
+
+	printf("Mutex block time (%s, usec):\n", mutex_names[mutex_kind]);
+	printf("%6s %10s %9s %9s %9s %9s %9s %9s\n", "Group", "Acquired",
+	       "Min", "P50", "P90", "P99", "P99.9", "Max");
+	for (i = 0; i < ngroups; i++) {
+		struct group_parameters *g = &groups[i];
+
+		if (g->block_hist == NULL)
+			continue;
+		sprintf(name, "%d", g->id);
+		print_block_times(name, g->block_hist, g->block_min,
+				  g->block_max);
+		loghist_merge(all, g->block_hist);
+		if (g->block_min < min)
+			min = g->block_min;
+		if (g->block_max > max)
+			max = g->block_max;
+	}
+	if (ngroups > 1)
+		print_block_times("All", all, min, max);
+	free(all);
 }
 
 int
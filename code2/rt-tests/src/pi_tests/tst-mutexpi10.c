@@ -49,6 +49,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <time.h>
 
 /* test timeout */
 #define TIMEOUT 2
@@ -109,6 +110,10 @@ volatile int low_unlocked = 0;
 
 cpu_set_t cpu_mask;
 
+/* time (ns) the high priority thread spent blocked on the mutex */
+long long block_min = -1, block_max = 0, block_total = 0;
+int block_count = 0;
+
 struct thread_parameters
 {
   pthread_t tid;
@@ -337,6 +342,10 @@ MAIN (int argc, char **argv)
       return FAILURE;
     }
   info ("main: all threads terminated!\n");
+  if (block_count)
+    printf ("main: mutex block time (usec): min %.2f avg %.2f max %.2f\n",
+	    block_min / 1000.0, block_total / 1000.0 / block_count,
+	    block_max / 1000.0);
   if (deadlocked)
     {
       info ("main: test failed\n");
@@ -596,6 +605,8 @@ void *
 high_priority (void *arg)
 {
   int status;
+  struct timespec t0, t1;
+  long long blocked;
   struct thread_parameters *p = (struct thread_parameters *) arg;
 
   report_threadinfo ("high_priority");
@@ -630,8 +641,18 @@ high_priority (void *arg)
 	  return NULL;
 	}
       info ("high_priority: locking mutex\n");
+      clock_gettime (CLOCK_MONOTONIC, &t0);
       pthread_mutex_lock (&mutex);
+      clock_gettime (CLOCK_MONOTONIC, &t1);
       info ("high_priority: got mutex\n");
+      blocked = (t1.tv_sec - t0.tv_sec) * 1000000000LL
+	+ (t1.tv_nsec - t0.tv_nsec);
+      if (block_min < 0 || blocked < block_min)
+	block_min = blocked;
+      if (blocked > block_max)
+	block_max = blocked;
+      block_total += blocked;
+      block_count++;
       high_has_run = 1;
       info ("high_priority: unlocking mutex\n");
       pthread_mutex_unlock (&mutex);
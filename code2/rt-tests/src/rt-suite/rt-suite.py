@@ -0,0 +1,560 @@
+#!/usr/bin/python
+
+# rt-suite: run rt-tests scenarios in parallel and compare two runs
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License Version 2
+# as published by the Free Software Foundation.
+#
+# A scenario file is an ini file, one section per scenario:
+#
+#   [cyclictest-hackbench]
+#   test     = cyclictest
+#   args     = -m -p 95 -t 2 -i 200 -l 100000
+#   cpus     = 2-3
+#   load     = hackbench -g 4 -l 1000000
+#   loadcpus = 0-1
+#   repeat   = 6
+#   duration = 60
+#
+# "rt-suite run" executes the scenarios, scenarios with disjoint CPU sets
+# side by side, parses the output of each tool into one schema and writes
+# all runs to a JSON file; "rt-suite compare" diffs two such files.
+
+from __future__ import print_function
+
+import sys
+import os
+import re
+import json
+import math
+import time
+import shlex
+import signal
+import socket
+import threading
+import subprocess
+
+try:
+    from ConfigParser import RawConfigParser
+except ImportError:
+    from configparser import RawConfigParser
+
+version = "0.1"
+debugging = False
+quiet = False
+SCHEMA = 1
+
+def debug(str):
+    if debugging: print(str)
+
+def info(str):
+    if not quiet: print(str)
+
+def cpu_list(str):
+    "parse a cpu list like 0-3,8 into a set, None means all cpus"
+    if not str:
+        return None
+    cpus = set()
+    for part in str.split(','):
+        if '-' in part:
+            first, last = part.split('-')
+            cpus.update(range(int(first), int(last) + 1))
+        else:
+            cpus.add(int(part))
+    return cpus
+
+#
+# Output parsers, one per tool.  Each returns a dict with "threads" (a
+# list of per thread min/avg/max and whatever else the tool reports),
+# optionally "hist" (the merged latency histogram as [lower, count]
+# pairs) and "unit", and possibly tool specific metrics.
+#
+
+def parse_cyclictest(out):
+    res = { "unit": "us", "threads": [] }
+    stats = {}
+    rows = []
+    nthreads = None
+    for l in out.splitlines():
+        m = re.match(r'T:\s*(\d+) \(\s*\d+\) P:\s*\d+ I:\s*\d+ C:\s*(\d+) '
+                     r'Min:\s*(\d+) Act:\s*\d+ Avg:\s*(\d+) Max:\s*(\d+)', l)
+        if m:
+            t = int(m.group(1))
+            stats[t] = { "cycles": int(m.group(2)), "min": int(m.group(3)),
+                         "avg": int(m.group(4)), "max": int(m.group(5)) }
+            continue
+        m = re.match(r'# (Min|Avg|Max) Latencies:((?: \d+)+)', l)
+        if m:
+            vals = [int(v) for v in m.group(2).split()]
+            if m.group(1) == "Min":
+                nthreads = len(vals)
+            for t, v in enumerate(vals[:nthreads]):
+                stats.setdefault(t, {})[m.group(1).lower()] = v
+            continue
+        m = re.match(r'# P([\d.]+) Latencies:((?: \d+)+)', l)
+        if m:
+            for t, v in enumerate(m.group(2).split()):
+                stats.setdefault(t, {})["p" + m.group(1)] = int(v)
+            continue
+        if re.match(r'\d+ \d+', l):
+            rows.append([int(v) for v in l.split()])
+    if re.search(r' (-N|--nsecs)( |$)', out.split("\n", 1)[0]):
+        res["unit"] = "ns"
+    res["threads"] = [stats[t] for t in sorted(stats)]
+    if rows:
+        # leave out the --histofall column, if any
+        n = nthreads or len(rows[0]) - 1
+        res["hist"] = [[r[0], sum(r[1:1 + n])] for r in rows]
+    return res
+
+def parse_pingpong(out):
+    "ptsematest, svsematest, sigwaittest, pmqtest and ipclat"
+    res = { "unit": "us", "threads": [] }
+    pairs = {}
+    for l in out.splitlines():
+        m = re.match(r'#(\d+) -> #(\d+), (.*)', l)
+        if not m:
+            continue
+        stat = {}
+        for k, v in re.findall(r'([A-Za-z][\w.]*) +(\d+)', m.group(3)):
+            stat[k.lower()] = int(v)
+        # the tools keep reprinting the same lines, the last ones count
+        pairs[(int(m.group(1)), int(m.group(2)))] = stat
+    if "latencies in ns" in out:
+        res["unit"] = "ns"
+    res["threads"] = [pairs[p] for p in sorted(pairs)]
+    return res
+
+def parse_hackbench(out):
+    res = { "threads": [] }
+    for l in out.splitlines():
+        if l.startswith('{'):
+            try:
+                j = json.loads(l)
+            except ValueError:
+                continue
+            res["time_s"] = j["time_s"]
+            res["msgs_per_sec"] = j["msgs_per_sec"]
+            if "latency_ns" in j:
+                res["unit"] = "ns"
+                res["threads"] = [j["latency_ns"]]
+        m = re.match(r'Time: ([\d.]+)', l)
+        if m:
+            res["time_s"] = float(m.group(1))
+        m = re.match(r'Throughput: (\d+) msgs/s', l)
+        if m:
+            res["msgs_per_sec"] = int(m.group(1))
+    return res
+
+def parse_hwlat(out):
+    res = { "unit": "us", "threads": [] }
+    for l in out.splitlines():
+        m = re.match(r'Max Latency: (\d+)us', l)
+        if m:
+            res["threads"] = [{ "max": int(m.group(1)) }]
+        m = re.match(r'Samples exceeding threshold: (\d+)', l)
+        if m:
+            res["exceeding"] = int(m.group(1))
+        m = re.match(r'CPU\s+(\d+): .*exceeding (\d+) .* max (\d+)us', l)
+        if m:
+            res.setdefault("cpus", []).append({ "cpu": int(m.group(1)),
+                                                "exceeding": int(m.group(2)),
+                                                "max": int(m.group(3)) })
+    return res
+
+def parse_pi_stress(out):
+    res = { "threads": [] }
+    m = re.search(r'Total inversion performed: (\d+)', out)
+    if m:
+        res["inversions"] = int(m.group(1))
+    return res
+
+def parse_generic(out):
+    return { "threads": [] }
+
+parsers = {
+    "cyclictest"    : parse_cyclictest,
+    "signaltest"    : parse_cyclictest,
+    "ptsematest"    : parse_pingpong,
+    "svsematest"    : parse_pingpong,
+    "sigwaittest"   : parse_pingpong,
+    "pmqtest"       : parse_pingpong,
+    "ipclat"        : parse_pingpong,
+    "hackbench"     : parse_hackbench,
+    "hwlat"         : parse_hwlat,
+    "hwlatdetect"   : parse_hwlat,
+    "pi_stress"     : parse_pi_stress,
+}
+
+# options the parsers rely on, added when the scenario does not give them
+required_args = {
+    "cyclictest"    : [("-q", "--quiet"), ("-L", "--loghist")],
+    "signaltest"    : [("-q", "--quiet")],
+    "ipclat"        : [("-q", "--quiet")],
+    "hackbench"     : [("-j", "--json")],
+}
+
+def hist_quantile(hist, pct):
+    "lower end of the bucket holding the pct'th percentile"
+    total = sum(c for b, c in hist)
+    if not total:
+        return None
+    want = max(1, int(total * pct / 100.0 + 0.5))
+    seen = 0
+    for b, c in hist:
+        seen += c
+        if seen >= want:
+            return b
+    return hist[-1][0]
+
+def summarize(res):
+    "the per tool results folded into the common metrics"
+    s = {}
+    threads = res.get("threads", [])
+    for k, f in (("min", min), ("max", max)):
+        vals = [t[k] for t in threads if k in t]
+        if vals:
+            s[k] = f(vals)
+    vals = [t["avg"] for t in threads if "avg" in t]
+    if vals:
+        s["avg"] = float(sum(vals)) / len(vals)
+    if res.get("hist"):
+        for p in (50, 99, 99.9, 99.99):
+            s["p%g" % p] = hist_quantile(res["hist"], p)
+    else:
+        for p in ("p50", "p99", "p99.9", "p99.99"):
+            vals = [t[p] for t in threads if p in t]
+            if vals:
+                s[p] = max(vals)
+    for k in ("time_s", "msgs_per_sec", "exceeding", "inversions"):
+        if k in res:
+            s[k] = res[k]
+    return s
+
+class Scenario(object):
+    def __init__(self, name, opts, bindir):
+        self.name = name
+        self.test = opts["test"]
+        self.args = shlex.split(opts.get("args", ""))
+        self.cpus = opts.get("cpus", "")
+        self.load = opts.get("load", "")
+        self.loadcpus = opts.get("loadcpus", "")
+        self.repeat = int(opts.get("repeat", "1"))
+        self.duration = int(opts.get("duration", "0"))
+        self.bindir = bindir
+        for short, long in required_args.get(self.test, []):
+            if short not in self.args and long not in self.args:
+                self.args.append(short)
+
+    def cpuset(self):
+        cpus = cpu_list(self.cpus)
+        load = cpu_list(self.loadcpus) if self.load else set()
+        if cpus is None or load is None:
+            return None
+        return cpus | load
+
+    def command(self, prog, args, cpus):
+        path = os.path.join(self.bindir, prog)
+        cmd = [path if os.path.exists(path) else prog] + args
+        if cpus:
+            cmd = ["taskset", "-c", cpus] + cmd
+        return cmd
+
+    def run_once(self, n):
+        load = None
+        if self.load:
+            l = shlex.split(self.load)
+            lcmd = self.command(l[0], l[1:], self.loadcpus)
+            debug("%s: load %s" % (self.name, " ".join(lcmd)))
+            load = subprocess.Popen(lcmd, stdout=open(os.devnull, "w"),
+                                    stderr=subprocess.STDOUT,
+                                    preexec_fn=os.setsid)
+        cmd = self.command(self.test, self.args, self.cpus)
+        debug("%s: run %d: %s" % (self.name, n, " ".join(cmd)))
+        start = time.time()
+        p = subprocess.Popen(cmd, stdout=subprocess.PIPE,
+                             stderr=subprocess.STDOUT,
+                             universal_newlines=True)
+        timer = None
+        if self.duration:
+            # the tools print their statistics when interrupted
+            timer = threading.Timer(self.duration, p.send_signal, [signal.SIGINT])
+            timer.start()
+        out = p.communicate()[0]
+        if timer:
+            timer.cancel()
+        end = time.time()
+        if load:
+            try:
+                os.killpg(load.pid, signal.SIGTERM)
+            except OSError:
+                pass
+            load.wait()
+        # the histogram can be long, keep the parsed form only
+        res = parsers.get(self.test, parse_generic)("%s\n%s" % (" ".join(cmd), out))
+        res.update({
+            "scenario"  : self.name,
+            "test"      : self.test,
+            "command"   : cmd,
+            "load"      : self.load,
+            "run"       : n,
+            "status"    : p.returncode,
+            "elapsed_s" : round(end - start, 3),
+        })
+        res["summary"] = summarize(res)
+        if p.returncode and p.returncode != -signal.SIGINT and self.test != "hwlat":
+            res["tail"] = out.splitlines()[-10:]
+        return res
+
+def read_scenarios(path, bindir, only):
+    cfg = RawConfigParser()
+    if not cfg.read(path):
+        raise RuntimeError("cannot read scenario file %s" % path)
+    scenarios = []
+    for name in cfg.sections():
+        if only and name not in only:
+            continue
+        opts = dict(cfg.items(name))
+        if "test" not in opts:
+            raise RuntimeError("scenario %s: no test given" % name)
+        scenarios.append(Scenario(name, opts, bindir))
+    return scenarios
+
+def run_all(scenarios, jobs):
+    """
+    Run every repetition of every scenario, up to jobs at a time; a run
+    only starts next to others whose CPU sets it does not overlap, a
+    scenario without a CPU set runs alone.
+    """
+    pending = [(s, n) for s in scenarios for n in range(s.repeat)]
+    running = []
+    results = []
+    lock = threading.Condition()
+
+    def worker(s, n):
+        try:
+            r = s.run_once(n)
+        except OSError as e:
+            r = { "scenario": s.name, "test": s.test, "run": n,
+                  "status": -1, "error": str(e), "threads": [], "summary": {} }
+        with lock:
+            info("%-24s run %d: status %d %s" % (s.name, n, r["status"],
+                 " ".join("%s=%s" % kv for kv in sorted(r["summary"].items()))))
+            results.append(r)
+            running.remove((s, n))
+            lock.notify()
+
+    def fits(s):
+        if len(running) >= jobs:
+            return False
+        mine = s.cpuset()
+        for o, m in running:
+            theirs = o.cpuset()
+            if mine is None or theirs is None or mine & theirs:
+                return False
+        return True
+
+    with lock:
+        while pending or running:
+            for item in pending:
+                if fits(item[0]):
+                    pending.remove(item)
+                    running.append(item)
+                    threading.Thread(target=worker, args=item).start()
+                    break
+            else:
+                lock.wait()
+    return sorted(results, key=lambda r: (r["scenario"], r["run"]))
+
+#
+# Statistics for the comparison, normal approximations only, so that
+# nothing beyond the standard library is needed.
+#
+
+def norm_sf(z):
+    "P(Z > z)"
+    return 0.5 * math.erfc(z / math.sqrt(2))
+
+def two_proportions(k1, n1, k2, n2):
+    "two sided p value of k1/n1 and k2/n2 being the same proportion"
+    if not n1 or not n2:
+        return None
+    p = float(k1 + k2) / (n1 + n2)
+    se = math.sqrt(p * (1 - p) * (1.0 / n1 + 1.0 / n2))
+    if se == 0:
+        return 1.0
+    z = (float(k2) / n2 - float(k1) / n1) / se
+    return 2 * norm_sf(abs(z))
+
+def mann_whitney(a, b):
+    "two sided p value of a and b coming from the same distribution"
+    if len(a) < 2 or len(b) < 2:
+        return None
+    both = sorted([(v, 0) for v in a] + [(v, 1) for v in b])
+    ranks = [0.0] * len(both)
+    i = 0
+    while i < len(both):
+        j = i
+        while j + 1 < len(both) and both[j + 1][0] == both[i][0]:
+            j += 1
+        for k in range(i, j + 1):
+            ranks[k] = (i + j) / 2.0 + 1
+        i = j + 1
+    r1 = sum(r for r, (v, g) in zip(ranks, both) if g == 0)
+    n1, n2 = len(a), len(b)
+    u = r1 - n1 * (n1 + 1) / 2.0
+    mu = n1 * n2 / 2.0
+    sigma = math.sqrt(n1 * n2 * (n1 + n2 + 1) / 12.0)
+    if sigma == 0:
+        return 1.0
+    return 2 * norm_sf(abs(u - mu) / sigma)
+
+def mann_whitney_min_p(n1, n2):
+    """smallest two sided p value the U test can give for n1 and n2 runs:
+    the exact probability of the two samples not overlapping at all"""
+    ways = 1
+    for k in range(1, n1 + 1):
+        ways = ways * (n2 + k) // k
+    return min(1.0, 2.0 / ways)
+
+def merge_hists(runs):
+    hist = {}
+    for r in runs:
+        for b, c in r.get("hist", []):
+            hist[b] = hist.get(b, 0) + c
+    return sorted(hist.items())
+
+# metrics where larger is better, everything else is a latency or a time
+higher_is_better = ("msgs_per_sec", "inversions")
+
+def compare(base, new, alpha, threshold):
+    "print one line per scenario and metric, return the number of regressions"
+    regressions = 0
+    bruns = {}
+    nruns = {}
+    for r in base["runs"]:
+        bruns.setdefault(r["scenario"], []).append(r)
+    for r in new["runs"]:
+        nruns.setdefault(r["scenario"], []).append(r)
+
+    underpowered = []
+    print("%-24s %-8s %12s %12s %8s %10s  %s" %
+          ("scenario", "metric", "base", "new", "change", "p", "verdict"))
+    for name in sorted(set(bruns) | set(nruns)):
+        if name not in bruns or name not in nruns:
+            print("%-24s only in %s" % (name, "base" if name in bruns else "new"))
+            continue
+        b, n = bruns[name], nruns[name]
+        bh, nh = merge_hists(b), merge_hists(n)
+        metrics = sorted(set(k for r in b + n for k in r["summary"]))
+        for m in metrics:
+            bv = [r["summary"][m] for r in b if r["summary"].get(m) is not None]
+            nv = [r["summary"][m] for r in n if r["summary"].get(m) is not None]
+            if not bv or not nv:
+                continue
+            if m.startswith("p") and m[1:2].isdigit() and bh and nh:
+                # tails: how often does new exceed the base quantile
+                bq = hist_quantile(bh, float(m[1:]))
+                nq = hist_quantile(nh, float(m[1:]))
+                n1 = sum(c for v, c in bh)
+                n2 = sum(c for v, c in nh)
+                k1 = sum(c for v, c in bh if v > bq)
+                k2 = sum(c for v, c in nh if v > bq)
+                p = two_proportions(k1, n1, k2, n2)
+                bval, nval = bq, nq
+                worse = float(k2) / n2 > float(k1) / n1
+            else:
+                p = mann_whitney(bv, nv)
+                if p is not None and mann_whitney_min_p(len(bv), len(nv)) >= alpha:
+                    # too few runs for any difference to be significant
+                    p = None
+                    if name not in underpowered:
+                        underpowered.append(name)
+                bval = float(sum(bv)) / len(bv)
+                nval = float(sum(nv)) / len(nv)
+                worse = (nval < bval) if m in higher_is_better else (nval > bval)
+            change = (nval - bval) * 100.0 / bval if bval else 0.0
+            verdict = ""
+            if p is not None and p < alpha and abs(change) >= threshold:
+                verdict = "REGRESSION" if worse else "improvement"
+            elif p is None and abs(change) >= threshold:
+                verdict = "(worse)" if worse else "(better)"
+            if verdict == "REGRESSION":
+                regressions += 1
+            print("%-24s %-8s %12.6g %12.6g %+7.1f%% %10s  %s" %
+                  (name, m, bval, nval, change,
+                   "n/a" if p is None else "%.3g" % p, verdict))
+        bs = [r["status"] for r in b]
+        ns = [r["status"] for r in n]
+        if bs != ns:
+            print("%-24s status   %12s %12s" % (name, bs, ns))
+    if underpowered:
+        repeat = 2
+        while mann_whitney_min_p(repeat, repeat) >= alpha:
+            repeat += 1
+        print("%s: too few runs to test at alpha=%g, need repeat >= %d" %
+              (", ".join(underpowered), alpha, repeat), file=sys.stderr)
+    return regressions
+
+def usage():
+    print("""usage: rt-suite run [options] <scenario file> [scenario ...]
+       rt-suite compare [options] <base.json> <new.json>
+
+run options:
+  --output=PATH     write the results to PATH (default: results-<host>-<time>.json)
+  --jobs=N          run up to N scenarios at once (default: 1)
+  --bindir=DIR      where to find the tests (default: next to rt-suite, then PATH)
+
+compare options:
+  --alpha=P         significance level (default: 0.01)
+  --threshold=PCT   ignore changes smaller than PCT percent (default: 5)
+
+common options:
+  --debug           turn on debugging prints
+  --quiet           turn off progress output""")
+    sys.exit(2)
+
+if __name__ == '__main__':
+    from optparse import OptionParser
+
+    parser = OptionParser(add_help_option=False)
+    parser.add_option("--output", default=None, type="string", dest="output")
+    parser.add_option("--jobs", default=1, type="int", dest="jobs")
+    parser.add_option("--bindir", default=None, type="string", dest="bindir")
+    parser.add_option("--alpha", default=0.01, type="float", dest="alpha")
+    parser.add_option("--threshold", default=5.0, type="float", dest="threshold")
+    parser.add_option("--debug", action="store_true", default=False, dest="debug")
+    parser.add_option("--quiet", action="store_true", default=False, dest="quiet")
+    parser.add_option("-h", "--help", action="store_true", default=False, dest="help")
+
+    (o, a) = parser.parse_args()
+    debugging = o.debug
+    quiet = o.quiet and not o.debug
+    if o.help or len(a) < 2:
+        usage()
+
+    if a[0] == "run":
+        bindir = o.bindir or os.path.dirname(os.path.abspath(sys.argv[0]))
+        scenarios = read_scenarios(a[1], bindir, a[2:])
+        started = time.strftime("%Y-%m-%dT%H:%M:%S")
+        runs = run_all(scenarios, max(1, o.jobs))
+        output = o.output or "results-%s-%s.json" % (socket.gethostname(),
+                                                      time.strftime("%Y%m%d-%H%M%S"))
+        f = open(output, "w")
+        json.dump({ "schema": SCHEMA, "version": version,
+                    "host": socket.gethostname(), "kernel": os.uname()[2],
+                    "started": started, "scenario_file": a[1],
+                    "runs": runs }, f, indent=1, sort_keys=True)
+        f.close()
+        info("results of %d runs written to %s" % (len(runs), output))
+        sys.exit(1 if [r for r in runs if r["status"] not in (0, -signal.SIGINT)
+                       and r["test"] != "hwlat"] else 0)
+    elif a[0] == "compare" and len(a) == 3:
+        base = json.load(open(a[1]))
+        new = json.load(open(a[2]))
+        info("base: %s %s %s" % (base["host"], base["kernel"], base["started"]))
+        info("new:  %s %s %s" % (new["host"], new["kernel"], new["started"]))
+        sys.exit(1 if compare(base, new, o.alpha, o.threshold) else 0)
+    else:
+        usage()
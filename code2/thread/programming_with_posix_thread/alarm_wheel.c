@@ -0,0 +1,126 @@
+/*
+ * alarm_wheel.c
+ *
+ * The alarm_cond.c program, with the sorted alarm list replaced
+ * by a timing wheel (timer_wheel.c). Entering an alarm no longer
+ * walks the list to find its place, and the alarm thread no
+ * longer requeues the alarm it was waiting for when an earlier
+ * one arrives: adding an earlier alarm simply re-arms the
+ * wheel's timerfd, and the alarm thread, which sleeps in poll()
+ * on that descriptor, wakes up for it.
+ *
+ * The wheel ticks every 10 milliseconds, so "0 message" fires at
+ * once and alarms are not rounded to whole seconds of time().
+ */
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include "errors.h"
+#include "timer_wheel.h"
+
+#define TICK_NS         10000000        /* 10 ms */
+#define TICKS_PER_SEC   (1000000000 / TICK_NS)
+
+/*
+ * The alarm carries its timer, so adding one allocates nothing
+ * beyond the alarm itself.
+ */
+typedef struct alarm_tag {
+    wheel_timer_t       timer;
+    int                 seconds;
+    char                message[64];
+} alarm_t;
+
+pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
+timer_wheel_t alarm_wheel;
+
+/*
+ * Called by timer_wheel_run, with alarm_mutex locked.
+ */
+void alarm_expired (wheel_timer_t *timer, void *arg)
+{
+    alarm_t *alarm = (alarm_t*)arg;
+
+    printf ("(%d) %s\n", alarm->seconds, alarm->message);
+    free (alarm);
+}
+
+/*
+ * The alarm thread's start routine.
+ */
+void *alarm_thread (void *arg)
+{
+    struct pollfd pfd;
+    int status;
+
+    /*
+     * Loop forever, processing alarms. The alarm thread will be
+     * disintegrated when the process exits. The mutex is held
+     * only while running the wheel, not while waiting: an alarm
+     * entered meanwhile re-arms the timerfd we are polling.
+     */
+    pfd.fd = timer_wheel_fd (&alarm_wheel);
+    pfd.events = POLLIN;
+    while (1) {
+        if (poll (&pfd, 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            errno_abort ("Poll timerfd");
+        }
+        status = pthread_mutex_lock (&alarm_mutex);
+        if (status != 0)
+            err_abort (status, "Lock mutex");
+        timer_wheel_run (&alarm_wheel);
+        status = pthread_mutex_unlock (&alarm_mutex);
+        if (status != 0)
+            err_abort (status, "Unlock mutex");
+    }
+}
+
+int main (int argc, char *argv[])
+{
+    int status;
+    char line[128];
+    alarm_t *alarm;
+    pthread_t thread;
+
+    status = timer_wheel_init (&alarm_wheel, TICK_NS);
+    if (status != 0)
+        err_abort (status, "Init timer wheel");
+    status = pthread_create (
+        &thread, NULL, alarm_thread, NULL);
+    if (status != 0)
+        err_abort (status, "Create alarm thread");
+    while (1) {
+        printf ("Alarm> ");
+        if (fgets (line, sizeof (line), stdin) == NULL) exit (0);
+        if (strlen (line) <= 1) continue;
+        alarm = (alarm_t*)malloc (sizeof (alarm_t));
+        if (alarm == NULL)
+            errno_abort ("Allocate alarm");
+
+        /*
+         * Parse input line into seconds (%d) and a message
+         * (%63[^\n]), consisting of up to 63 characters
+         * separated from the seconds by whitespace.
+         */
+        if (sscanf (line, "%d %63[^\n]",
+            &alarm->seconds, alarm->message) < 2
+            || alarm->seconds < 0) {
+            fprintf (stderr, "Bad command\n");
+            free (alarm);
+        } else {
+            timer_wheel_timer_init (&alarm->timer, alarm_expired, alarm);
+            status = pthread_mutex_lock (&alarm_mutex);
+            if (status != 0)
+                err_abort (status, "Lock mutex");
+            status = timer_wheel_add (&alarm_wheel, &alarm->timer,
+                (unsigned long)alarm->seconds * TICKS_PER_SEC);
+            if (status != 0)
+                err_abort (status, "Add alarm");
+            status = pthread_mutex_unlock (&alarm_mutex);
+            if (status != 0)
+                err_abort (status, "Unlock mutex");
+        }
+    }
+}
@@ -0,0 +1,197 @@
+/*
+ * barrier_bench.c
+ *
+ * Measure barrier latency: threads, pinned one per processor in
+ * order (as barrier_tree.c assumes), go through a barrier again
+ * and again with no work in between, and the time per phase is
+ * reported for barrier.c, pthread_barrier_t and the tree barrier
+ * of barrier_tree.c, over a range of thread counts.
+ *
+ * Before timing, each barrier is checked: every thread bumps a
+ * counter before each wait and, after it, must find that all the
+ * threads have bumped it for that phase.
+ *
+ * Usage: barrier_bench [phases [max_threads]]
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "barrier.h"
+#include "barrier_tree.h"
+#include "errors.h"
+
+#define BARRIERS        3
+#define MAX_THREADS     256
+#define CHECK_PHASES    1000
+
+const char *barrier_names[BARRIERS] = {"barrier.c", "pthread", "tree"};
+
+barrier_t bench_barrier;
+pthread_barrier_t bench_pbarrier;
+tbarrier_t bench_tbarrier;
+
+int which;                              /* barrier being measured */
+int threads;
+long phases;
+int checking;
+long arrived;                           /* for the check */
+long failures;
+int cpus;
+
+typedef struct thread_tag {
+    pthread_t   thread_id;
+    int         id;
+} thread_t;
+
+thread_t thread[MAX_THREADS];
+
+static void bench_wait (int id)
+{
+    int status;
+
+    switch (which) {
+    case 0:
+        status = barrier_wait (&bench_barrier);
+        if (status > 0)
+            err_abort (status, "Wait on barrier");
+        break;
+    case 1:
+        status = pthread_barrier_wait (&bench_pbarrier);
+        if (status != 0 && status != PTHREAD_BARRIER_SERIAL_THREAD)
+            err_abort (status, "Wait on pthread barrier");
+        break;
+    case 2:
+        status = tbarrier_wait (&bench_tbarrier, id);
+        if (status > 0)
+            err_abort (status, "Wait on tree barrier");
+        break;
+    }
+}
+
+/*
+ * Start routine for threads.
+ */
+void *thread_routine (void *arg)
+{
+    thread_t *self = (thread_t*)arg;
+    cpu_set_t set;
+    long phase, count, bad = 0;
+
+    CPU_ZERO (&set);
+    CPU_SET (self->id % cpus, &set);
+    pthread_setaffinity_np (pthread_self (), sizeof (set), &set);
+    for (phase = 0; phase < phases; phase++) {
+        if (checking)
+            __atomic_fetch_add (&arrived, 1, __ATOMIC_RELAXED);
+        bench_wait (self->id);
+        if (checking) {
+            count = __atomic_load_n (&arrived, __ATOMIC_RELAXED);
+            if (count < (phase + 1) * threads)
+                bad++;
+            /*
+             * And nobody may start bumping for the next phase
+             * until everybody has looked.
+             */
+            bench_wait (self->id);
+        }
+    }
+    if (bad > 0)
+        __atomic_fetch_add (&failures, bad, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/*
+ * Run threads through phases of one barrier; returns the
+ * nanoseconds per phase.
+ */
+static double bench_run (int barrier, int n, long count, int check)
+{
+    struct timespec start, end;
+    int i, status;
+
+    which = barrier;
+    threads = n;
+    phases = count;
+    checking = check;
+    arrived = 0;
+    switch (which) {
+    case 0:
+        status = barrier_init (&bench_barrier, n);
+        break;
+    case 1:
+        status = pthread_barrier_init (&bench_pbarrier, NULL, n);
+        break;
+    default:
+        status = tbarrier_init (&bench_tbarrier, n);
+        break;
+    }
+    if (status != 0)
+        err_abort (status, "Init barrier");
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    for (i = 0; i < n; i++) {
+        thread[i].id = i;
+        status = pthread_create (&thread[i].thread_id,
+            NULL, thread_routine, (void*)&thread[i]);
+        if (status != 0)
+            err_abort (status, "Create thread");
+    }
+    for (i = 0; i < n; i++) {
+        status = pthread_join (thread[i].thread_id, NULL);
+        if (status != 0)
+            err_abort (status, "Join thread");
+    }
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    switch (which) {
+    case 0:
+        barrier_destroy (&bench_barrier);
+        break;
+    case 1:
+        pthread_barrier_destroy (&bench_pbarrier);
+        break;
+    default:
+        tbarrier_destroy (&bench_tbarrier);
+        break;
+    }
+    return ((end.tv_sec - start.tv_sec) * 1e9
+        + (end.tv_nsec - start.tv_nsec)) / count;
+}
+
+int main (int argc, char *argv[])
+{
+    long count = 20000;
+    int max_threads, n, b;
+
+    cpus = sysconf (_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        cpus = 1;
+    max_threads = 2 * cpus < 8 ? 8 : 2 * cpus;
+    if (argc > 1)
+        count = atol (argv[1]);
+    if (argc > 2)
+        max_threads = atoi (argv[2]);
+    if (count < 1 || max_threads < 1 || max_threads > MAX_THREADS) {
+        fprintf (stderr, "Usage: %s [phases [max_threads]]\n", argv[0]);
+        return 1;
+    }
+
+    printf ("ns per phase, %ld phases, %d processors\n", count, cpus);
+    printf ("threads");
+    for (b = 0; b < BARRIERS; b++)
+        printf (" %10s", barrier_names[b]);
+    printf ("\n");
+    for (n = 1; n <= max_threads; n = n < cpus && 2 * n > cpus ? cpus : 2 * n) {
+        printf ("%7d", n);
+        for (b = 0; b < BARRIERS; b++) {
+            bench_run (b, n, CHECK_PHASES, 1);
+            printf (" %10.0f", bench_run (b, n, count, 0));
+        }
+        printf ("\n");
+        fflush (stdout);
+    }
+    if (failures > 0) {
+        fprintf (stderr, "%ld threads left a barrier early\n", failures);
+        return 1;
+    }
+    return 0;
+}
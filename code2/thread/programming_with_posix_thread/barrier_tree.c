@@ -0,0 +1,271 @@
+/*
+ * barrier_tree.c
+ *
+ * This file implements the combining tree barrier of
+ * barrier_tree.h.
+ *
+ * Each node counts down from its fan-in. The arrival that takes
+ * a node to 0 resets it for the next phase and moves on to the
+ * parent; everyone else waits for the sense flag to flip. The
+ * reset can't race with the next phase: nobody gets out of this
+ * one until the root is complete, and the chain of decrements
+ * that led there orders every reset before the flip.
+ *
+ * A waiter reads the sense flag before it counts itself in, so
+ * it knows which value to wait for; the phase can't end before
+ * it has arrived.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "errors.h"
+#include "barrier_tree.h"
+
+#define TBARRIER_SPIN   4000            /* polls of sense before sleeping */
+#define MAX_CPUS        1024
+
+#if defined (__i386__) || defined (__x86_64__)
+# define cpu_relax()    __asm__ __volatile__ ("pause")
+#else
+# define cpu_relax()    do { } while (0)
+#endif
+
+/*
+ * Fill in the NUMA node of each processor from sysfs, where
+ * /sys/devices/system/node/nodeN/cpulist reads like "0-7,16-23".
+ * Without NUMA information, every processor is on node 0.
+ */
+static void numa_nodes (int *node_of, int cpus)
+{
+    char path[64], list[256], *p;
+    FILE *file;
+    int node, first, last, cpu;
+
+    for (cpu = 0; cpu < cpus; cpu++)
+        node_of[cpu] = 0;
+    for (node = 0; node < MAX_CPUS; node++) {
+        snprintf (path, sizeof (path),
+            "/sys/devices/system/node/node%d/cpulist", node);
+        file = fopen (path, "r");
+        if (file == NULL)
+            break;
+        if (fgets (list, sizeof (list), file) != NULL) {
+            p = list;
+            while (sscanf (p, "%d", &first) == 1) {
+                last = first;
+                while (*p >= '0' && *p <= '9')
+                    p++;
+                if (*p == '-') {
+                    p++;
+                    sscanf (p, "%d", &last);
+                    while (*p >= '0' && *p <= '9')
+                        p++;
+                }
+                for (cpu = first; cpu <= last && cpu < cpus; cpu++)
+                    node_of[cpu] = node;
+                if (*p != ',')
+                    break;
+                p++;
+            }
+        }
+        fclose (file);
+    }
+}
+
+/*
+ * Build the tree bottom up. A level groups up to TBARRIER_FANIN
+ * neighbours of the level below, never across NUMA nodes until
+ * each node is down to a single subtree.
+ */
+static int tbarrier_build (tbarrier_t *tb, int count)
+{
+    int *units, *numa, *new_units, *new_numa, *node_of;
+    int cpus, n, m, i, j, k, used = 0, level = 0, distinct, status = 0;
+    tbarrier_node_t *node;
+
+    cpus = sysconf (_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        cpus = 1;
+    if (cpus > MAX_CPUS)
+        cpus = MAX_CPUS;
+    units = (int*)malloc (4 * count * sizeof (int));
+    node_of = (int*)malloc (cpus * sizeof (int));
+    if (units == NULL || node_of == NULL) {
+        free (units);
+        free (node_of);
+        return ENOMEM;
+    }
+    numa = units + count;
+    new_units = numa + count;
+    new_numa = new_units + count;
+    numa_nodes (node_of, cpus);
+
+    /*
+     * The leaves: thread ids, ordered by node (a stable
+     * selection, so ids stay in order within a node).
+     */
+    n = 0;
+    for (k = 0; n < count; k++)
+        for (i = 0; i < count; i++)
+            if (node_of[i % cpus] == k) {
+                units[n] = i;
+                numa[n++] = k;
+            }
+
+    do {
+        /*
+         * One subtree left per NUMA node: from here on, combine
+         * across nodes.
+         */
+        distinct = 1;
+        for (i = 1; i < n; i++)
+            if (numa[i] == numa[i - 1])
+                distinct = 0;
+        if (distinct)
+            for (i = 0; i < n; i++)
+                numa[i] = 0;
+
+        m = 0;
+        for (i = 0; i < n; i = j) {
+            for (j = i; j < n && j - i < TBARRIER_FANIN
+                    && numa[j] == numa[i]; j++)
+                ;
+            if (level > 0 && j - i == 1) {
+                /*
+                 * Nothing to combine it with yet: carry it up
+                 * rather than giving it a parent of its own.
+                 * Every node above the leaves then joins two or
+                 * more, so there are fewer than 2 * count nodes.
+                 */
+                new_units[m] = units[i];
+                new_numa[m++] = numa[i];
+                continue;
+            }
+            if (used >= 2 * count + 2) {
+                status = EINVAL;        /* can't happen */
+                goto out;
+            }
+            node = &tb->nodes[used];
+            node->count = node->fanin = j - i;
+            node->parent = NULL;
+            for (k = i; k < j; k++)
+                if (level == 0)
+                    tb->leaf[units[k]] = node;
+                else
+                    tb->nodes[units[k]].parent = node;
+            new_units[m] = used++;
+            new_numa[m++] = numa[i];
+        }
+        for (i = 0; i < m; i++) {
+            units[i] = new_units[i];
+            numa[i] = new_numa[i];
+        }
+        n = m;
+        level++;
+    } while (n > 1);
+out:
+    free (units);
+    free (node_of);
+    return status;
+}
+
+/*
+ * Initialize a tree barrier for count threads.
+ */
+int tbarrier_init (tbarrier_t *tb, int count)
+{
+    int status;
+
+    if (count <= 0)
+        return EINVAL;
+    tb->sense = 0;
+    tb->sleepers = 0;
+    tb->threshold = count;
+    tb->spin = count <= sysconf (_SC_NPROCESSORS_ONLN) ? TBARRIER_SPIN : 0;
+    status = posix_memalign ((void **)&tb->nodes, 64,
+        (2 * count + 2) * sizeof (tbarrier_node_t));
+    if (status != 0)
+        return status;
+    tb->leaf = (tbarrier_node_t**)malloc (count * sizeof (tbarrier_node_t*));
+    if (tb->leaf == NULL) {
+        free (tb->nodes);
+        return ENOMEM;
+    }
+    status = tbarrier_build (tb, count);
+    if (status != 0) {
+        free (tb->leaf);
+        free (tb->nodes);
+        return status;
+    }
+    tb->valid = TBARRIER_VALID;
+    return 0;
+}
+
+/*
+ * Destroy a tree barrier when done using it.
+ */
+int tbarrier_destroy (tbarrier_t *tb)
+{
+    if (tb->valid != TBARRIER_VALID)
+        return EINVAL;
+
+    /*
+     * Check whether any threads are known to be waiting; report
+     * "BUSY" if so.
+     */
+    if (tb->leaf[0]->count != tb->leaf[0]->fanin
+            || __atomic_load_n (&tb->sleepers, __ATOMIC_SEQ_CST) > 0)
+        return EBUSY;
+    tb->valid = 0;
+    free (tb->leaf);
+    free (tb->nodes);
+    return 0;
+}
+
+/*
+ * Wait for all members of a barrier to reach the barrier. Like
+ * barrier_wait, the thread that completes the barrier returns
+ * -1, so it can run some serial code before the next phase;
+ * the others return 0.
+ */
+int tbarrier_wait (tbarrier_t *tb, int id)
+{
+    tbarrier_node_t *node;
+    int sense, spin;
+
+    if (tb->valid != TBARRIER_VALID || id < 0 || id >= tb->threshold)
+        return EINVAL;
+    sense = __atomic_load_n (&tb->sense, __ATOMIC_ACQUIRE);
+    node = tb->leaf[id];
+    while (__atomic_sub_fetch (&node->count, 1, __ATOMIC_ACQ_REL) == 0) {
+        __atomic_store_n (&node->count, node->fanin, __ATOMIC_RELAXED);
+        node = node->parent;
+        if (node == NULL) {
+            /*
+             * Last one in: release everybody.
+             */
+            __atomic_store_n (&tb->sense, !sense, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n (&tb->sleepers, __ATOMIC_SEQ_CST) > 0)
+                syscall (SYS_futex, &tb->sense, FUTEX_WAKE_PRIVATE,
+                    INT_MAX, NULL, NULL, 0);
+            return -1;
+        }
+    }
+
+    for (spin = 0; spin < tb->spin; spin++) {
+        if (__atomic_load_n (&tb->sense, __ATOMIC_ACQUIRE) != sense)
+            return 0;
+        cpu_relax ();
+    }
+    __atomic_fetch_add (&tb->sleepers, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n (&tb->sense, __ATOMIC_ACQUIRE) == sense)
+        syscall (SYS_futex, &tb->sense, FUTEX_WAIT_PRIVATE, sense,
+            NULL, NULL, 0);
+    __atomic_fetch_sub (&tb->sleepers, 1, __ATOMIC_RELEASE);
+    return 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * barrier_tree.h
+ *
+ * This header file describes a "combining tree" barrier, for
+ * fork-join code that goes through a barrier thousands of times
+ * a second.
+ *
+ * barrier.c makes every thread lock one mutex on the way in and
+ * wait on one condition variable, so every phase ends in a storm
+ * of futex wakeups and mutex handoffs. Here arriving threads
+ * count down in small tree nodes, each on its own cache line,
+ * and only the last arrival at a node carries on up to its
+ * parent. The thread that completes the root flips a "sense"
+ * flag, and everybody who is waiting sees it change. Waiters spin
+ * on the flag for a while before sleeping on it with a futex. They
+ * don't spin when there are more threads than processors, since
+ * the thread they wait for may need their processor.
+ *
+ * The tree is built NUMA-aware. Thread id i is taken to run on
+ * the i-th online processor (modulo their number), which is how
+ * fork-join code usually pins its workers. The leaves and lower
+ * levels only combine threads of the same NUMA node, so just one
+ * arrival per node crosses to another node's memory.
+ *
+ * Each thread must pass its own id, 0 to count - 1, and keep it
+ * for the life of the barrier.
+ */
+#include <pthread.h>
+
+#define TBARRIER_FANIN  4               /* children per tree node */
+
+/*
+ * A tree node: arrivals still expected in this phase.
+ */
+typedef struct tbarrier_node_tag {
+    int                         count;
+    int                         fanin;
+    struct tbarrier_node_tag    *parent;        /* NULL for the root */
+} __attribute__ ((aligned (64))) tbarrier_node_t;
+
+/*
+ * Structure describing a tree barrier.
+ */
+typedef struct tbarrier_tag {
+    int                 sense __attribute__ ((aligned (64)));
+                                        /* futex: flips at each phase */
+    int                 sleepers;       /* threads in futex wait */
+    tbarrier_node_t     *nodes;
+    tbarrier_node_t     **leaf;         /* by thread id */
+    int                 threshold;      /* number of threads required */
+    int                 spin;           /* polls of sense before sleeping */
+    int                 valid;          /* set when valid */
+} tbarrier_t;
+
+#define TBARRIER_VALID  0xdbcaff
+
+/*
+ * Define tree barrier functions
+ */
+extern int tbarrier_init (tbarrier_t *barrier, int count);
+extern int tbarrier_destroy (tbarrier_t *barrier);
+extern int tbarrier_wait (tbarrier_t *barrier, int id);
@@ -0,0 +1,1133 @@
+/*
+ * crew_grep.c
+ *
+ * The work crew of crew.c grown into a parallel recursive grep:
+ *
+ *      crew_grep [-j crew] [-l] [-n] [-u] string path...
+ *      crew_grep [-j crew] [-l] [-n] [-u] -e string [-e string]... path...
+ *
+ * prints each line of the files under the paths that contains
+ * any of the strings, as "path:line" ("path:number:line" with
+ * -n), or just the names of the files with -l. The crew has one
+ * thread per processor unless -j says otherwise.
+ *
+ * crew.c puts every file and directory on one list behind one
+ * mutex, finds each name's type with lstat, and reads files a line
+ * at a time with stdio. That's fine for a demonstration, but on a
+ * fast disk with millions of files the crew spends its time
+ * fighting over the mutex. Here:
+ *
+ *  - Each worker has a deque of its own. It adds what it finds
+ *    to the back and takes its next item from the back, so it
+ *    works depth first through its own subtree. An idle worker
+ *    steals half of somebody else's deque from the front, where
+ *    the oldest (and so biggest) subtrees are.
+ *  - Directories are read with getdents64, which gives each
+ *    name's type without a stat, and entries are opened with
+ *    openat relative to their directory, so the kernel doesn't
+ *    walk the whole path every time.
+ *  - Files are read a megabyte at a time, and the search runs over
+ *    the whole block rather than line by line; only a hit is
+ *    widened to its line. The search checks 16 positions at a time
+ *    for the first and last byte of the string (SSE2), and only
+ *    compares the rest where both match.
+ *  - Output comes out in the order a single thread would have
+ *    produced it (directories in the order getdents64 returns
+ *    them, like grep -r) unless -u is given. Each file's output
+ *    is saved in a tree that mirrors the directories, and whoever
+ *    finishes the item the output cursor is waiting for moves the
+ *    cursor on, printing as far as it can.
+ *
+ * Symbolic links are skipped in directories, as in crew.c, but a
+ * path on the command line may be one.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+#include "errors.h"
+
+#define BLOCK_SIZE      (1024 * 1024)   /* File read size */
+#define DIRENT_SIZE     (64 * 1024)     /* getdents64 buffer size */
+#define STEAL_MAX       64              /* Most items taken in a steal */
+#define BATCH_SIZE      64              /* Entries queued at a time */
+#define LINE_MAX_SIZE   (64 * BLOCK_SIZE) /* Longest line searched */
+
+/*
+ * The entries getdents64 returns.
+ */
+typedef struct linux_dirent64 {
+    uint64_t            d_ino;
+    int64_t             d_off;
+    unsigned short      d_reclen;
+    unsigned char       d_type;
+    char                d_name[1];
+} dirent64_t;
+
+/*
+ * An open directory, shared by the work items for its entries so
+ * they can be opened relative to it; it's closed when the last of
+ * them is done.
+ */
+typedef struct dir_tag {
+    int                 fd;             /* Open directory */
+    long                refs;           /* Items (and lister) using it */
+} dir_t;
+
+/*
+ * Output in order: a node for every file and directory. A file's
+ * node holds its output until the cursor gets to it; a directory's
+ * holds its entries' nodes, in directory order.
+ */
+typedef struct result_tag {
+    struct result_tag   *parent;
+    struct result_tag   **child;        /* Entries, for a directory */
+    int                 children;
+    int                 next_child;     /* Next entry to print */
+    char                *text;          /* Output, for a file */
+    size_t              length;
+    int                 done;           /* Searched or listed */
+} result_t;
+
+/*
+ * Queued items of work for the crew. crew_start queues one for
+ * each path, and workers queue one for each entry of a directory.
+ */
+typedef struct work_tag {
+    dir_t               *dir;           /* Directory path is in, or NULL */
+    result_t            *result;        /* Where output goes, if ordered */
+    int                 type;           /* DT_DIR, DT_REG or DT_UNKNOWN */
+    int                 name;           /* Offset of name in path */
+    char                path[1];        /* Directory or file */
+} work_t, *work_p;
+
+/*
+ * One of these is initialized for each worker thread in the
+ * crew. It contains the "identity" of each worker, its deque and
+ * its buffers.
+ */
+typedef struct worker_tag {
+    int                 index;          /* Thread's index */
+    pthread_t           thread;         /* Thread for worker */
+    struct crew_tag     *crew;          /* Pointer to crew */
+    pthread_mutex_t     mutex;          /* Protects deque */
+    work_p              *deque;         /* Circular, size a power of 2 */
+    long                size;
+    long                head, tail;     /* Steal at head, own at tail */
+    unsigned int        seed;           /* For picking victims */
+    char                *buffer;        /* File blocks */
+    size_t              buffer_size;
+    char                *out;           /* Output for current file */
+    size_t              out_length, out_size;
+    char                *dirents;       /* getdents64 buffer */
+} __attribute__ ((aligned (64))) worker_t, *worker_p;
+
+/*
+ * The external "handle" for a work crew. Contains the
+ * crew synchronization state and the search.
+ */
+typedef struct crew_tag {
+    int                 crew_size;      /* Size of array */
+    worker_t            *crew;          /* Crew members */
+    long                queued;         /* Items in deques */
+    long                pending;        /* Items not yet done */
+    long                idle;           /* Workers waiting for work */
+    int                 started;        /* Set by crew_start */
+    pthread_mutex_t     mutex;          /* Mutex for crew data */
+    pthread_cond_t      done;           /* Wait for crew done */
+    pthread_cond_t      go;             /* Wait for work */
+    int                 open_dirs;      /* Directories held open */
+    int                 max_dirs;       /* Most held open */
+    char                **strings;      /* Search strings */
+    size_t              *lengths;
+    size_t              max_length;     /* Longest string */
+    int                 string_count;
+    int                 ordered;        /* Print in traversal order */
+    int                 files_only;     /* -l */
+    int                 line_numbers;   /* -n */
+    pthread_mutex_t     out_mutex;      /* Serializes output */
+    result_t            *cursor;        /* Next result to print */
+    int                 matched;        /* Something matched */
+    int                 errors;         /* Something couldn't be read */
+} crew_t, *crew_p;
+
+/*
+ * Find string in buffer, or return NULL.
+ */
+static const char *string_search (
+    const char *buffer, size_t length, const char *string, size_t size)
+{
+    const char *p, *end;
+
+    if (size == 0)
+        return buffer;
+    if (length < size)
+        return NULL;
+    if (size == 1)
+        return memchr (buffer, string[0], length);
+    end = buffer + length - size;       /* Last possible start */
+#ifdef __SSE2__
+    {
+        __m128i first = _mm_set1_epi8 (string[0]);
+        __m128i last = _mm_set1_epi8 (string[size - 1]);
+        __m128i head, tail;
+        unsigned int mask;
+
+        /*
+         * Check 16 starting positions at once for the first and
+         * last byte.
+         */
+        for (p = buffer; p + 16 <= end + 1; p += 16) {
+            head = _mm_loadu_si128 ((const __m128i*)p);
+            tail = _mm_loadu_si128 ((const __m128i*)(p + size - 1));
+            mask = _mm_movemask_epi8 (_mm_and_si128 (
+                _mm_cmpeq_epi8 (head, first), _mm_cmpeq_epi8 (tail, last)));
+            while (mask != 0) {
+                int bit = __builtin_ctz (mask);
+
+                if (memcmp (p + bit + 1, string + 1, size - 2) == 0)
+                    return p + bit;
+                mask &= mask - 1;
+            }
+        }
+    }
+#else
+    p = buffer;
+#endif
+    for (; p <= end; p++) {
+        p = memchr (p, string[0], end - p + 1);
+        if (p == NULL)
+            return NULL;
+        if (p[size - 1] == string[size - 1]
+                && memcmp (p + 1, string + 1, size - 2) == 0)
+            return p;
+    }
+    return NULL;
+}
+
+/*
+ * Add to the output of the current file.
+ */
+static void out_append (worker_p mine, const char *text, size_t length)
+{
+    if (mine->out_length + length > mine->out_size) {
+        while (mine->out_length + length > mine->out_size)
+            mine->out_size *= 2;
+        mine->out = (char*)realloc (mine->out, mine->out_size);
+        if (mine->out == NULL)
+            errno_abort ("Allocating output");
+    }
+    memcpy (mine->out + mine->out_length, text, length);
+    mine->out_length += length;
+}
+
+/*
+ * Print, in order, every result from the cursor on that is done.
+ * Called with out_mutex locked. A node is freed once it, and (for
+ * a directory) all its entries, have been printed.
+ */
+static void output_advance (crew_p crew)
+{
+    result_t *result, *parent;
+
+    while ((result = crew->cursor) != NULL && result->done) {
+        if (result->text != NULL) {
+            fwrite (result->text, 1, result->length, stdout);
+            free (result->text);
+            result->text = NULL;
+        }
+        if (result->next_child < result->children) {
+            crew->cursor = result->child[result->next_child++];
+            continue;
+        }
+        while (1) {
+            parent = result->parent;
+            free (result->child);
+            free (result);
+            if (parent == NULL) {
+                crew->cursor = NULL;
+                break;
+            }
+            if (parent->next_child < parent->children) {
+                crew->cursor = parent->child[parent->next_child++];
+                break;
+            }
+            result = parent;
+        }
+    }
+}
+
+/*
+ * A work item is done: hand over the output of a file, or let
+ * the cursor into a directory's entries.
+ */
+static void output_done (worker_p mine, work_p work)
+{
+    crew_p crew = mine->crew;
+    result_t *result = work->result;
+    int status;
+
+    if (!crew->ordered) {
+        if (mine->out_length > 0) {
+            flockfile (stdout);
+            fwrite (mine->out, 1, mine->out_length, stdout);
+            funlockfile (stdout);
+        }
+        mine->out_length = 0;
+        return;
+    }
+    if (mine->out_length > 0) {
+        result->text = (char*)malloc (mine->out_length);
+        if (result->text == NULL)
+            errno_abort ("Allocating output");
+        memcpy (result->text, mine->out, mine->out_length);
+        result->length = mine->out_length;
+        mine->out_length = 0;
+    }
+    status = pthread_mutex_lock (&crew->out_mutex);
+    if (status != 0)
+        err_abort (status, "Lock output mutex");
+    result->done = 1;
+    output_advance (crew);
+    status = pthread_mutex_unlock (&crew->out_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock output mutex");
+}
+
+/*
+ * Queue items on a worker's own deque, and wake idle workers.
+ */
+static void crew_push (worker_p mine, work_p *work, int count)
+{
+    crew_p crew = mine->crew;
+    long i;
+    int status;
+
+    if (count == 0)
+        return;
+    status = pthread_mutex_lock (&mine->mutex);
+    if (status != 0)
+        err_abort (status, "Lock deque");
+    if (mine->tail - mine->head + count > mine->size) {
+        work_p *deque;
+        long size = mine->size;
+
+        while (mine->tail - mine->head + count > size)
+            size *= 2;
+        deque = (work_p*)malloc (size * sizeof (work_p));
+        if (deque == NULL)
+            errno_abort ("Allocating deque");
+        for (i = mine->head; i < mine->tail; i++)
+            deque[i & (size - 1)] = mine->deque[i & (mine->size - 1)];
+        free (mine->deque);
+        mine->deque = deque;
+        mine->size = size;
+    }
+    for (i = 0; i < count; i++)
+        mine->deque[(mine->tail + i) & (mine->size - 1)] = work[i];
+    __atomic_store_n (&mine->tail, mine->tail + count, __ATOMIC_RELAXED);
+    status = pthread_mutex_unlock (&mine->mutex);
+    if (status != 0)
+        err_abort (status, "Unlock deque");
+
+    /*
+     * Count them queued before looking for idle workers, while an
+     * idle worker counts itself idle before looking at queued;
+     * one of us sees the other.
+     */
+    __atomic_add_fetch (&crew->queued, count, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&crew->idle, __ATOMIC_SEQ_CST) > 0) {
+        status = pthread_mutex_lock (&crew->mutex);
+        if (status != 0)
+            err_abort (status, "Lock crew mutex");
+        if (count > 1)
+            status = pthread_cond_broadcast (&crew->go);
+        else
+            status = pthread_cond_signal (&crew->go);
+        if (status != 0)
+            err_abort (status, "Signal go");
+        status = pthread_mutex_unlock (&crew->mutex);
+        if (status != 0)
+            err_abort (status, "Unlock crew mutex");
+    }
+}
+
+/*
+ * Take the newest item from a worker's own deque.
+ */
+static work_p crew_pop (worker_p mine)
+{
+    work_p work = NULL;
+    int status;
+
+    if (__atomic_load_n (&mine->tail, __ATOMIC_RELAXED)
+            == __atomic_load_n (&mine->head, __ATOMIC_RELAXED))
+        return NULL;
+    status = pthread_mutex_lock (&mine->mutex);
+    if (status != 0)
+        err_abort (status, "Lock deque");
+    if (mine->tail > mine->head) {
+        __atomic_store_n (&mine->tail, mine->tail - 1, __ATOMIC_RELAXED);
+        work = mine->deque[mine->tail & (mine->size - 1)];
+    }
+    status = pthread_mutex_unlock (&mine->mutex);
+    if (status != 0)
+        err_abort (status, "Unlock deque");
+    return work;
+}
+
+/*
+ * Take the oldest half of another worker's deque. Returns one of
+ * them to work on, and queues the rest on our own.
+ */
+static work_p crew_steal (worker_p mine)
+{
+    crew_p crew = mine->crew;
+    work_p loot[STEAL_MAX];
+    worker_p victim;
+    long count, i;
+    int start, n, status;
+
+    start = rand_r (&mine->seed) % crew->crew_size;
+    for (n = 0; n < crew->crew_size; n++) {
+        victim = &crew->crew[(start + n) % crew->crew_size];
+        if (victim == mine
+                || __atomic_load_n (&victim->tail, __ATOMIC_RELAXED)
+                    == __atomic_load_n (&victim->head, __ATOMIC_RELAXED))
+            continue;
+        status = pthread_mutex_lock (&victim->mutex);
+        if (status != 0)
+            err_abort (status, "Lock deque");
+        count = (victim->tail - victim->head + 1) / 2;
+        if (count > STEAL_MAX)
+            count = STEAL_MAX;
+        for (i = 0; i < count; i++)
+            loot[i] = victim->deque[(victim->head + i) & (victim->size - 1)];
+        __atomic_store_n (&victim->head, victim->head + count,
+            __ATOMIC_RELAXED);
+        status = pthread_mutex_unlock (&victim->mutex);
+        if (status != 0)
+            err_abort (status, "Unlock deque");
+        if (count == 0)
+            continue;
+
+        /*
+         * They're still counted as queued; crew_push would count
+         * them again.
+         */
+        if (count > 1) {
+            status = pthread_mutex_lock (&mine->mutex);
+            if (status != 0)
+                err_abort (status, "Lock deque");
+            if (mine->tail - mine->head + count - 1 > mine->size) {
+                status = pthread_mutex_unlock (&mine->mutex);
+                if (status != 0)
+                    err_abort (status, "Unlock deque");
+                __atomic_sub_fetch (&crew->queued, count - 1,
+                    __ATOMIC_SEQ_CST);
+                crew_push (mine, loot + 1, count - 1);
+            } else {
+                for (i = 1; i < count; i++)
+                    mine->deque[(mine->tail + i - 1) & (mine->size - 1)]
+                        = loot[i];
+                __atomic_store_n (&mine->tail, mine->tail + count - 1,
+                    __ATOMIC_RELAXED);
+                status = pthread_mutex_unlock (&mine->mutex);
+                if (status != 0)
+                    err_abort (status, "Unlock deque");
+            }
+        }
+        return loot[0];
+    }
+    return NULL;
+}
+
+/*
+ * Get the next work item, waiting if there is none. Returns NULL
+ * once the crew is done.
+ */
+static work_p crew_get (worker_p mine)
+{
+    crew_p crew = mine->crew;
+    work_p work;
+    int status;
+
+    while (1) {
+        work = crew_pop (mine);
+        if (work == NULL)
+            work = crew_steal (mine);
+        if (work != NULL) {
+            __atomic_sub_fetch (&crew->queued, 1, __ATOMIC_SEQ_CST);
+            return work;
+        }
+        if (__atomic_load_n (&crew->pending, __ATOMIC_SEQ_CST) == 0)
+            return NULL;
+
+        /*
+         * Some items may be on their way from one deque to
+         * another; if any are queued, just look again.
+         */
+        status = pthread_mutex_lock (&crew->mutex);
+        if (status != 0)
+            err_abort (status, "Lock crew mutex");
+        __atomic_add_fetch (&crew->idle, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n (&crew->queued, __ATOMIC_SEQ_CST) == 0
+                && __atomic_load_n (&crew->pending, __ATOMIC_SEQ_CST) != 0) {
+            DPRINTF (("Crew %d idle\n", mine->index));
+            status = pthread_cond_wait (&crew->go, &crew->mutex);
+            if (status != 0)
+                err_abort (status, "Wait for work");
+        }
+        __atomic_sub_fetch (&crew->idle, 1, __ATOMIC_SEQ_CST);
+        status = pthread_mutex_unlock (&crew->mutex);
+        if (status != 0)
+            err_abort (status, "Unlock crew mutex");
+    }
+}
+
+/*
+ * Drop a work item's reference to its directory.
+ */
+static void dir_release (crew_p crew, dir_t *dir)
+{
+    if (dir == NULL
+            || __atomic_sub_fetch (&dir->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    close (dir->fd);
+    __atomic_sub_fetch (&crew->open_dirs, 1, __ATOMIC_RELAXED);
+    free (dir);
+}
+
+/*
+ * Open a work item's path, relative to its directory if that's
+ * still open.
+ */
+static int work_open (work_p work, int flags)
+{
+    flags |= O_RDONLY | O_NOCTTY | O_CLOEXEC;
+    if (work->dir != NULL)
+        return openat (work->dir->fd, work->path + work->name, flags);
+    return open (work->path, flags);
+}
+
+/*
+ * Search the lines of the first length bytes of buffer (which end
+ * with a newline, except at the end of the file). Returns 1 when
+ * the rest of the file needn't be searched.
+ */
+static int search_block (
+    worker_p mine, work_p work, const char *buffer, size_t length,
+    long *line, int binary)
+{
+    crew_p crew = mine->crew;
+    const char *next[crew->string_count];
+    const char *pos = buffer, *end = buffer + length, *best;
+    const char *start, *stop, *counted = buffer;
+    char number[32];
+    int i;
+
+    for (i = 0; i < crew->string_count; i++)
+        next[i] = string_search (
+            buffer, length, crew->strings[i], crew->lengths[i]);
+    while (1) {
+        best = NULL;
+        for (i = 0; i < crew->string_count; i++)
+            if (next[i] != NULL && (best == NULL || next[i] < best))
+                best = next[i];
+        if (best == NULL)
+            break;
+        __atomic_store_n (&crew->matched, 1, __ATOMIC_RELAXED);
+
+        if (crew->files_only || binary) {
+            if (crew->files_only) {
+                out_append (mine, work->path, strlen (work->path));
+                out_append (mine, "\n", 1);
+            } else {
+                out_append (mine, "Binary file ", 12);
+                out_append (mine, work->path, strlen (work->path));
+                out_append (mine, " matches\n", 9);
+            }
+            return 1;
+        }
+        start = memrchr (pos, '\n', best - pos);
+        start = (start == NULL ? pos : start + 1);
+        stop = memchr (best, '\n', end - best);
+        if (stop == NULL)
+            stop = end;
+        out_append (mine, work->path, strlen (work->path));
+        out_append (mine, ":", 1);
+        if (crew->line_numbers) {
+            while ((counted = memchr (counted, '\n', start - counted)) != NULL
+                    && counted < start) {
+                (*line)++;
+                counted++;
+            }
+            counted = start;
+            out_append (mine, number,
+                snprintf (number, sizeof (number), "%ld:", *line));
+        }
+        out_append (mine, start, stop - start);
+        out_append (mine, "\n", 1);
+        if (stop >= end - 1)
+            break;
+        pos = stop + 1;
+        for (i = 0; i < crew->string_count; i++)
+            if (next[i] != NULL && next[i] < pos)
+                next[i] = string_search (
+                    pos, end - pos, crew->strings[i], crew->lengths[i]);
+    }
+    if (crew->line_numbers)
+        while ((counted = memchr (counted, '\n', end - counted)) != NULL) {
+            (*line)++;
+            counted++;
+        }
+    return 0;
+}
+
+/*
+ * Search a file, a block at a time. A line that runs past the end
+ * of a block is carried over to the next one. Lines don't matter
+ * when only the first hit is wanted (-l, or a binary file), so then
+ * a block without a newline is searched whole, and only enough of
+ * its end is carried to catch a string across the break; otherwise
+ * a line longer than LINE_MAX_SIZE gives up on the file.
+ */
+static void search_file (worker_p mine, work_p work)
+{
+    crew_p crew = mine->crew;
+    size_t carry = 0, end, limit;
+    ssize_t bytes;
+    long line = 1;
+    const char *last;
+    int fd, binary = -1;
+
+    fd = work_open (work, 0);
+    if (fd < 0) {
+        fprintf (stderr, "Unable to open %s: %d (%s)\n",
+            work->path, errno, strerror (errno));
+        __atomic_store_n (&crew->errors, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    while (1) {
+        bytes = read (fd, mine->buffer + carry, mine->buffer_size - carry);
+        if (bytes < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf (stderr, "Unable to read %s: %d (%s)\n",
+                work->path, errno, strerror (errno));
+            __atomic_store_n (&crew->errors, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        end = carry + bytes;
+        if (end == 0)
+            break;
+        if (binary < 0)
+            binary = memchr (mine->buffer, '\0', end) != NULL;
+        if (bytes == 0)
+            limit = end;                /* Last line has no newline */
+        else {
+            last = memrchr (mine->buffer, '\n', end);
+            if (last == NULL && end == mine->buffer_size
+                    && (binary || crew->files_only)) {
+                if (search_block (mine, work, mine->buffer, end, &line, 1))
+                    break;
+                carry = crew->max_length - 1;
+                memmove (mine->buffer, mine->buffer + end - carry, carry);
+                continue;
+            }
+            if (last == NULL) {
+                /*
+                 * One line fills the buffer; make room for more.
+                 */
+                if (end == mine->buffer_size) {
+                    if (mine->buffer_size >= LINE_MAX_SIZE) {
+                        fprintf (stderr, "%s: line longer than %d bytes\n",
+                            work->path, LINE_MAX_SIZE);
+                        __atomic_store_n (&crew->errors, 1, __ATOMIC_RELAXED);
+                        break;
+                    }
+                    mine->buffer_size *= 2;
+                    mine->buffer = (char*)realloc (
+                        mine->buffer, mine->buffer_size);
+                    if (mine->buffer == NULL)
+                        errno_abort ("Allocating buffer");
+                }
+                carry = end;
+                continue;
+            }
+            limit = last - mine->buffer + 1;
+        }
+        if (search_block (mine, work, mine->buffer, limit, &line, binary))
+            break;
+        carry = end - limit;
+        memmove (mine->buffer, mine->buffer + limit, carry);
+        if (bytes == 0)
+            break;
+    }
+    close (fd);
+}
+
+/*
+ * Make a work item for an entry of a directory.
+ */
+static work_p work_new (
+    work_p parent, dir_t *dir, const char *name, int type)
+{
+    size_t length = strlen (parent->path), name_length = strlen (name);
+    work_p work;
+
+    work = (work_p)malloc (sizeof (work_t) + length + name_length + 1);
+    if (work == NULL)
+        errno_abort ("Unable to allocate work");
+    memcpy (work->path, parent->path, length);
+    if (length > 0 && parent->path[length - 1] != '/')
+        work->path[length++] = '/';
+    memcpy (work->path + length, name, name_length + 1);
+    work->name = length;
+    work->type = type;
+    work->dir = dir;
+    if (dir != NULL)
+        __atomic_add_fetch (&dir->refs, 1, __ATOMIC_RELAXED);
+    work->result = NULL;
+    return work;
+}
+
+/*
+ * Queue work items for the entries of a directory, a batch at a
+ * time so the rest of the crew can start on them early. The
+ * directory stays open for them, unless too many already are.
+ */
+static void list_dir (worker_p mine, work_p work)
+{
+    crew_p crew = mine->crew;
+    work_p batch[BATCH_SIZE];
+    result_t *result = work->result, *entry_result;
+    dir_t *dir = NULL;
+    dirent64_t *entry;
+    long bytes, offset;
+    int fd, type, count = 0, size = 0;
+
+    fd = work_open (work, O_DIRECTORY);
+    if (fd < 0) {
+        fprintf (stderr, "Unable to open directory %s: %d (%s)\n",
+            work->path, errno, strerror (errno));
+        __atomic_store_n (&crew->errors, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (__atomic_add_fetch (&crew->open_dirs, 1, __ATOMIC_RELAXED)
+            <= crew->max_dirs) {
+        dir = (dir_t*)malloc (sizeof (dir_t));
+        if (dir == NULL)
+            errno_abort ("Allocating directory");
+        dir->fd = fd;
+        dir->refs = 1;
+    } else
+        __atomic_sub_fetch (&crew->open_dirs, 1, __ATOMIC_RELAXED);
+
+    while (1) {
+        bytes = syscall (SYS_getdents64, fd, mine->dirents, DIRENT_SIZE);
+        if (bytes < 0) {
+            fprintf (stderr, "Unable to read directory %s: %d (%s)\n",
+                work->path, errno, strerror (errno));
+            __atomic_store_n (&crew->errors, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        if (bytes == 0)
+            break;                      /* End of directory */
+        for (offset = 0; offset < bytes; offset += entry->d_reclen) {
+            entry = (dirent64_t*)(mine->dirents + offset);
+            type = entry->d_type;
+            if (type != DT_DIR && type != DT_REG && type != DT_UNKNOWN)
+                continue;               /* Links, devices... */
+
+            /*
+             * Ignore "." and ".." entries.
+             */
+            if (entry->d_name[0] == '.' && (entry->d_name[1] == '\0'
+                    || (entry->d_name[1] == '.' && entry->d_name[2] == '\0')))
+                continue;
+            batch[count] = work_new (work, dir, entry->d_name, type);
+            if (crew->ordered) {
+                entry_result = (result_t*)calloc (1, sizeof (result_t));
+                if (entry_result == NULL)
+                    errno_abort ("Allocating result");
+                entry_result->parent = result;
+                if (result->children == size) {
+                    size = size == 0 ? 16 : 2 * size;
+                    result->child = (result_t**)realloc (
+                        result->child, size * sizeof (result_t*));
+                    if (result->child == NULL)
+                        errno_abort ("Allocating results");
+                }
+                result->child[result->children++] = entry_result;
+                batch[count]->result = entry_result;
+            }
+            if (++count == BATCH_SIZE) {
+                __atomic_add_fetch (&crew->pending, count, __ATOMIC_SEQ_CST);
+                crew_push (mine, batch, count);
+                count = 0;
+            }
+        }
+    }
+    __atomic_add_fetch (&crew->pending, count, __ATOMIC_SEQ_CST);
+    crew_push (mine, batch, count);
+    if (dir != NULL)
+        dir_release (crew, dir);
+    else
+        close (fd);
+}
+
+/*
+ * The thread start routine for crew threads. Waits until "go"
+ * command, processes work items until the crew is done.
+ */
+void *worker_routine (void *arg)
+{
+    worker_p mine = (worker_t*)arg;
+    crew_p crew = mine->crew;
+    work_p work;
+    struct stat filestat;
+    int status;
+
+    status = pthread_mutex_lock (&crew->mutex);
+    if (status != 0)
+        err_abort (status, "Lock crew mutex");
+
+    /*
+     * There won't be any work when the crew is created, so wait
+     * until crew_start has queued some.
+     */
+    while (!crew->started) {
+        status = pthread_cond_wait (&crew->go, &crew->mutex);
+        if (status != 0)
+            err_abort (status, "Wait for go");
+    }
+
+    status = pthread_mutex_unlock (&crew->mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+
+    DPRINTF (("Crew %d starting\n", mine->index));
+
+    while ((work = crew_get (mine)) != NULL) {
+        if (work->type == DT_UNKNOWN) {
+            /*
+             * The file system didn't say what this is.
+             */
+            if ((work->dir != NULL
+                    ? fstatat (work->dir->fd, work->path + work->name,
+                        &filestat, AT_SYMLINK_NOFOLLOW)
+                    : lstat (work->path, &filestat)) != 0) {
+                fprintf (stderr, "Unable to stat %s: %d (%s)\n",
+                    work->path, errno, strerror (errno));
+                __atomic_store_n (&crew->errors, 1, __ATOMIC_RELAXED);
+            } else if (S_ISDIR (filestat.st_mode))
+                work->type = DT_DIR;
+            else if (S_ISREG (filestat.st_mode))
+                work->type = DT_REG;
+        }
+        if (work->type == DT_DIR)
+            list_dir (mine, work);
+        else if (work->type == DT_REG)
+            search_file (mine, work);
+        output_done (mine, work);
+        dir_release (crew, work->dir);
+        free (work);
+
+        /*
+         * Decrement count of outstanding work items, and wake
+         * waiters if the crew is now idle. The entries of a
+         * directory were counted before it was, so the count
+         * won't go to 0 until we're really done.
+         */
+        if (__atomic_sub_fetch (&crew->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+            DPRINTF (("Crew thread %d done\n", mine->index));
+            status = pthread_mutex_lock (&crew->mutex);
+            if (status != 0)
+                err_abort (status, "Lock crew mutex");
+            status = pthread_cond_broadcast (&crew->go);
+            if (status != 0)
+                err_abort (status, "Wake workers");
+            status = pthread_cond_broadcast (&crew->done);
+            if (status != 0)
+                err_abort (status, "Wake waiters");
+            status = pthread_mutex_unlock (&crew->mutex);
+            if (status != 0)
+                err_abort (status, "Unlock mutex");
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Create a work crew.
+ */
+int crew_create (crew_t *crew, int crew_size)
+{
+    struct rlimit limit;
+    worker_p worker;
+    int crew_index;
+    int status;
+
+    if (crew_size <= 0)
+        return EINVAL;
+
+    status = posix_memalign ((void**)&crew->crew, 64,
+        crew_size * sizeof (worker_t));
+    if (status != 0)
+        return status;
+    memset (crew->crew, 0, crew_size * sizeof (worker_t));
+    crew->crew_size = crew_size;
+    crew->queued = crew->pending = crew->idle = 0;
+    crew->started = 0;
+    crew->cursor = NULL;
+    crew->matched = crew->errors = 0;
+
+    /*
+     * Directories are held open while their entries are waiting,
+     * so use as many descriptors as we may, and keep half of them
+     * for files and for later directories.
+     */
+    crew->open_dirs = 0;
+    crew->max_dirs = 64;
+    if (getrlimit (RLIMIT_NOFILE, &limit) == 0) {
+        if (limit.rlim_cur < limit.rlim_max) {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit (RLIMIT_NOFILE, &limit);
+            getrlimit (RLIMIT_NOFILE, &limit);
+        }
+        if (limit.rlim_cur != RLIM_INFINITY
+                && limit.rlim_cur / 2 < 1024 * 1024)
+            crew->max_dirs = limit.rlim_cur / 2;
+        else
+            crew->max_dirs = 1024 * 1024;
+    }
+
+    /*
+     * Initialize synchronization objects
+     */
+    status = pthread_mutex_init (&crew->mutex, NULL);
+    if (status != 0)
+        return status;
+    status = pthread_cond_init (&crew->done, NULL);
+    if (status != 0)
+        return status;
+    status = pthread_cond_init (&crew->go, NULL);
+    if (status != 0)
+        return status;
+    status = pthread_mutex_init (&crew->out_mutex, NULL);
+    if (status != 0)
+        return status;
+
+    /*
+     * Create the worker threads.
+     */
+    for (crew_index = 0; crew_index < crew_size; crew_index++) {
+        worker = &crew->crew[crew_index];
+        worker->index = crew_index;
+        worker->crew = crew;
+        worker->seed = crew_index + 1;
+        worker->size = 1024;
+        worker->deque = (work_p*)malloc (worker->size * sizeof (work_p));
+        worker->buffer_size = BLOCK_SIZE;
+        worker->buffer = (char*)malloc (worker->buffer_size);
+        worker->out_size = 4096;
+        worker->out = (char*)malloc (worker->out_size);
+        worker->dirents = (char*)malloc (DIRENT_SIZE);
+        if (worker->deque == NULL || worker->buffer == NULL
+                || worker->out == NULL || worker->dirents == NULL)
+            errno_abort ("Allocating worker");
+        status = pthread_mutex_init (&worker->mutex, NULL);
+        if (status != 0)
+            err_abort (status, "Init deque mutex");
+        status = pthread_create (&worker->thread,
+            NULL, worker_routine, (void*)worker);
+        if (status != 0)
+            err_abort (status, "Create worker");
+    }
+    return 0;
+}
+
+/*
+ * Search the paths with a work crew previously created using
+ * crew_create, and wait for it to finish. The workers quit when
+ * they run out of work, so a crew searches only once.
+ */
+int crew_start (
+    crew_p crew,
+    char **paths,
+    int path_count)
+{
+    work_p request[path_count];
+    result_t *root = NULL;
+    struct stat filestat;
+    int count = 0, i, status;
+
+    if (crew->started)
+        return EBUSY;
+    if (crew->ordered) {
+        root = (result_t*)calloc (1, sizeof (result_t));
+        if (root == NULL)
+            return ENOMEM;
+        root->child = (result_t**)calloc (path_count + 1, sizeof (result_t*));
+        if (root->child == NULL)
+            return ENOMEM;
+        root->done = 1;
+    }
+    for (i = 0; i < path_count; i++) {
+        /*
+         * Follow a link named on the command line.
+         */
+        if (stat (paths[i], &filestat) != 0) {
+            fprintf (stderr, "Unable to stat %s: %d (%s)\n",
+                paths[i], errno, strerror (errno));
+            crew->errors = 1;
+            continue;
+        }
+        if (!S_ISDIR (filestat.st_mode) && !S_ISREG (filestat.st_mode))
+            continue;
+        DPRINTF (("Requesting %s\n", paths[i]));
+        request[count] = (work_p)malloc (sizeof (work_t) + strlen (paths[i]));
+        if (request[count] == NULL)
+            errno_abort ("Unable to allocate request");
+        strcpy (request[count]->path, paths[i]);
+        request[count]->name = 0;
+        request[count]->dir = NULL;
+        request[count]->type = S_ISDIR (filestat.st_mode) ? DT_DIR : DT_REG;
+        request[count]->result = NULL;
+        if (root != NULL) {
+            request[count]->result = (result_t*)calloc (1, sizeof (result_t));
+            if (request[count]->result == NULL)
+                errno_abort ("Allocating result");
+            request[count]->result->parent = root;
+            root->child[root->children++] = request[count]->result;
+        }
+        count++;
+    }
+    crew->cursor = root;
+    crew->pending = count;
+    crew_push (&crew->crew[0], request, count);
+
+    status = pthread_mutex_lock (&crew->mutex);
+    if (status != 0)
+        return status;
+    crew->started = 1;
+    status = pthread_cond_broadcast (&crew->go);
+    if (status != 0)
+        err_abort (status, "Start crew");
+    while (__atomic_load_n (&crew->pending, __ATOMIC_SEQ_CST) > 0) {
+        status = pthread_cond_wait (&crew->done, &crew->mutex);
+        if (status != 0)
+            err_abort (status, "waiting for crew to finish");
+    }
+    status = pthread_mutex_unlock (&crew->mutex);
+    if (status != 0)
+        err_abort (status, "Unlock crew mutex");
+
+    /*
+     * The workers are on their way out, but may still look at
+     * the crew.
+     */
+    for (i = 0; i < crew->crew_size; i++) {
+        status = pthread_join (crew->crew[i].thread, NULL);
+        if (status != 0)
+            err_abort (status, "Join worker");
+    }
+
+    /*
+     * Print what's left, in case there was nothing to search.
+     */
+    if (root != NULL) {
+        status = pthread_mutex_lock (&crew->out_mutex);
+        if (status != 0)
+            err_abort (status, "Lock output mutex");
+        output_advance (crew);
+        status = pthread_mutex_unlock (&crew->out_mutex);
+        if (status != 0)
+            err_abort (status, "Unlock output mutex");
+    }
+    return 0;
+}
+
+/*
+ * The main program to "drive" the crew... Exits like grep: 0 if
+ * anything matched, 1 if nothing did, 2 on errors.
+ */
+int main (int argc, char *argv[])
+{
+    crew_t my_crew;
+    int crew_size, option, i, status;
+
+    crew_size = sysconf (_SC_NPROCESSORS_ONLN);
+    if (crew_size < 1)
+        crew_size = 1;
+    my_crew.strings = (char**)malloc (argc * sizeof (char*));
+    my_crew.lengths = (size_t*)malloc (argc * sizeof (size_t));
+    if (my_crew.strings == NULL || my_crew.lengths == NULL)
+        errno_abort ("Allocating strings");
+    my_crew.string_count = 0;
+    my_crew.max_length = 1;
+    my_crew.ordered = 1;
+    my_crew.files_only = 0;
+    my_crew.line_numbers = 0;
+    while ((option = getopt (argc, argv, "e:j:lnu")) != -1) {
+        switch (option) {
+        case 'e':
+            my_crew.strings[my_crew.string_count++] = optarg;
+            break;
+        case 'j':
+            crew_size = atoi (optarg);
+            break;
+        case 'l':
+            my_crew.files_only = 1;
+            break;
+        case 'n':
+            my_crew.line_numbers = 1;
+            break;
+        case 'u':
+            my_crew.ordered = 0;
+            break;
+        default:
+            crew_size = 0;
+            break;
+        }
+    }
+    if (my_crew.string_count == 0 && optind < argc)
+        my_crew.strings[my_crew.string_count++] = argv[optind++];
+    if (crew_size <= 0 || my_crew.string_count == 0 || optind >= argc) {
+        fprintf (stderr,
+            "Usage: %s [-j crew] [-l] [-n] [-u] string path...\n"
+            "       %s [-j crew] [-l] [-n] [-u] -e string [-e string]..."
+            " path...\n", argv[0], argv[0]);
+        return 2;
+    }
+    for (i = 0; i < my_crew.string_count; i++) {
+        if (strchr (my_crew.strings[i], '\n') != NULL) {
+            fprintf (stderr, "Search strings can't hold a newline\n");
+            return 2;
+        }
+        my_crew.lengths[i] = strlen (my_crew.strings[i]);
+        if (my_crew.lengths[i] > my_crew.max_length)
+            my_crew.max_length = my_crew.lengths[i];
+    }
+
+    status = crew_create (&my_crew, crew_size);
+    if (status != 0)
+        err_abort (status, "Create crew");
+
+    status = crew_start (&my_crew, argv + optind, argc - optind);
+    if (status != 0)
+        err_abort (status, "Start crew");
+
+    if (my_crew.errors)
+        return 2;
+    return my_crew.matched ? 0 : 1;
+}
@@ -0,0 +1,164 @@
+/*
+ * epoch.c
+ *
+ * This file implements the epoch scheme of epoch.h.
+ *
+ * A reader reads the epoch, counts itself in that parity's half
+ * of its slot and only then loads the shared pointer. A writer
+ * publishes the new pointer before epoch_synchronize bumps the
+ * epoch and sums the old half. With sequentially consistent
+ * atomics on both sides, a reader the sum misses is one that
+ * counted itself after the bump, and so loads the new pointer.
+ *
+ * One bump is not enough on its own: a reader may read the epoch
+ * just before a bump, count itself in the old half after the sum
+ * found it empty, and hold the pointer of that day into the next
+ * grace period, which waits on the other half. Waiting out both
+ * halves, one after each of two bumps, covers it.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include "errors.h"
+#include "epoch.h"
+
+#define SYNC_SPIN       100             /* polls before a writer yields */
+
+/*
+ * Slots are handed out to threads round robin, on their first
+ * read lock.
+ */
+static int next_slot = 0;
+static __thread int my_slot = -1;
+
+static epoch_slot_t *epoch_slot (epoch_t *ep)
+{
+    if (my_slot < 0)
+        my_slot = __atomic_fetch_add (&next_slot, 1, __ATOMIC_RELAXED)
+            % EPOCH_SLOTS;
+    return &ep->slot[my_slot];
+}
+
+static long epoch_readers (epoch_t *ep, int idx)
+{
+    long readers = 0;
+    int i;
+
+    for (i = 0; i < EPOCH_SLOTS; i++)
+        readers += __atomic_load_n (
+            &ep->slot[i].readers[idx], __ATOMIC_SEQ_CST);
+    return readers;
+}
+
+/*
+ * Start a new epoch, and wait for the readers of the old one.
+ */
+static void epoch_flip (epoch_t *ep)
+{
+    unsigned long old;
+    int spin;
+
+    old = __atomic_fetch_add (&ep->epoch, 1, __ATOMIC_SEQ_CST);
+    for (spin = 0; epoch_readers (ep, old & 1) > 0; spin++)
+        if (spin >= SYNC_SPIN)
+            sched_yield ();
+}
+
+/*
+ * Initialize an epoch domain
+ */
+int epoch_init (epoch_t *ep)
+{
+    int i, status;
+
+    for (i = 0; i < EPOCH_SLOTS; i++)
+        ep->slot[i].readers[0] = ep->slot[i].readers[1] = 0;
+    ep->epoch = 0;
+    status = pthread_mutex_init (&ep->write_mutex, NULL);
+    if (status != 0)
+        return status;
+    status = pthread_mutex_init (&ep->sync_mutex, NULL);
+    if (status != 0) {
+        pthread_mutex_destroy (&ep->write_mutex);
+        return status;
+    }
+    ep->valid = EPOCH_VALID;
+    return 0;
+}
+
+/*
+ * Destroy an epoch domain
+ */
+int epoch_destroy (epoch_t *ep)
+{
+    int status, status1;
+
+    if (ep->valid != EPOCH_VALID)
+        return EINVAL;
+    if (epoch_readers (ep, 0) + epoch_readers (ep, 1) > 0)
+        return EBUSY;
+    ep->valid = 0;
+    status = pthread_mutex_destroy (&ep->write_mutex);
+    status1 = pthread_mutex_destroy (&ep->sync_mutex);
+    return (status != 0 ? status : status1);
+}
+
+/*
+ * Enter a read-side critical section. idx is for the matching
+ * epoch_readunlock.
+ */
+int epoch_readlock (epoch_t *ep, int *idx)
+{
+    if (ep->valid != EPOCH_VALID)
+        return EINVAL;
+    *idx = __atomic_load_n (&ep->epoch, __ATOMIC_SEQ_CST) & 1;
+    __atomic_fetch_add (&epoch_slot (ep)->readers[*idx], 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+/*
+ * Leave a read-side critical section.
+ */
+int epoch_readunlock (epoch_t *ep, int idx)
+{
+    if (ep->valid != EPOCH_VALID)
+        return EINVAL;
+    __atomic_fetch_sub (&epoch_slot (ep)->readers[idx], 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Exclude other writers while preparing and publishing a new
+ * copy. Readers are not affected.
+ */
+int epoch_writelock (epoch_t *ep)
+{
+    if (ep->valid != EPOCH_VALID)
+        return EINVAL;
+    return pthread_mutex_lock (&ep->write_mutex);
+}
+
+int epoch_writeunlock (epoch_t *ep)
+{
+    if (ep->valid != EPOCH_VALID)
+        return EINVAL;
+    return pthread_mutex_unlock (&ep->write_mutex);
+}
+
+/*
+ * Wait until every reader that was in a read-side critical
+ * section when this was called has left it. Must not be called
+ * from inside one.
+ */
+int epoch_synchronize (epoch_t *ep)
+{
+    int status;
+
+    if (ep->valid != EPOCH_VALID)
+        return EINVAL;
+    status = pthread_mutex_lock (&ep->sync_mutex);
+    if (status != 0)
+        return status;
+    epoch_flip (ep);
+    epoch_flip (ep);
+    return pthread_mutex_unlock (&ep->sync_mutex);
+}
@@ -0,0 +1,70 @@
+/*
+ * epoch.h
+ *
+ * This header file describes an "epoch" scheme in the style of
+ * read-copy-update (RCU): readers never wait and never make a
+ * writer wait for the data, only for the memory.
+ *
+ * Shared data is reached through a pointer. A reader brackets
+ * its use of the pointer with epoch_readlock/epoch_readunlock,
+ * which only count it in its thread's slot. A writer, holding
+ * epoch_writelock to exclude other writers, copies the data,
+ * changes the copy and publishes it by storing the pointer;
+ * readers that started earlier carry on with the old copy. Before
+ * freeing the old copy the writer calls epoch_synchronize, which
+ * returns once every reader that might still be using it has
+ * called epoch_readunlock:
+ *
+ *      epoch_readlock (&epoch, &idx);
+ *      p = __atomic_load_n (&shared, __ATOMIC_ACQUIRE);
+ *      ... read *p ...
+ *      epoch_readunlock (&epoch, idx);
+ *
+ *      epoch_writelock (&epoch);
+ *      new = copy of *shared, changed;
+ *      old = shared;
+ *      __atomic_store_n (&shared, new, __ATOMIC_RELEASE);
+ *      epoch_writeunlock (&epoch);
+ *      epoch_synchronize (&epoch);
+ *      free (old);
+ *
+ * Readers are counted in one of two halves per slot, by the
+ * parity of the epoch when they came in. epoch_synchronize
+ * starts a new epoch and waits for the old half to drain, twice,
+ * so that readers of both parities that were there when it was
+ * called have left.
+ */
+#include <pthread.h>
+
+#define EPOCH_SLOTS     64              /* reader slots, one cache line each */
+
+/*
+ * A reader slot: readers in it, by epoch parity.
+ */
+typedef struct epoch_slot_tag {
+    long                readers[2];
+} __attribute__ ((aligned (64))) epoch_slot_t;
+
+/*
+ * Structure describing an epoch domain.
+ */
+typedef struct epoch_tag {
+    epoch_slot_t        slot[EPOCH_SLOTS];
+    unsigned long       epoch __attribute__ ((aligned (64)));
+    pthread_mutex_t     write_mutex;    /* one writer at a time */
+    pthread_mutex_t     sync_mutex;     /* one grace period at a time */
+    int                 valid;          /* set when valid */
+} epoch_t;
+
+#define EPOCH_VALID     0xe90c4
+
+/*
+ * Define epoch functions
+ */
+extern int epoch_init (epoch_t *epoch);
+extern int epoch_destroy (epoch_t *epoch);
+extern int epoch_readlock (epoch_t *epoch, int *idx);
+extern int epoch_readunlock (epoch_t *epoch, int idx);
+extern int epoch_writelock (epoch_t *epoch);
+extern int epoch_writeunlock (epoch_t *epoch);
+extern int epoch_synchronize (epoch_t *epoch);
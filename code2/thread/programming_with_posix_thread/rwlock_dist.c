@@ -0,0 +1,204 @@
+/*
+ * rwlock_dist.c
+ *
+ * This file implements the distributed read-write lock of
+ * rwlock_dist.h.
+ *
+ * A reader adds itself to its thread's slot and then looks for a
+ * writer; a writer raises the writer flag and then waits for
+ * every slot to drain. Both use sequentially consistent atomics
+ * for the write and the read that follows it, so either the
+ * reader sees the writer (and backs out) or the writer sees the
+ * reader (and waits for it), never neither.
+ *
+ * Readers that back out sleep on the writer flag with a futex
+ * and are woken when it drops. A writer waits for the readers by
+ * spinning and yielding: read-side critical sections are meant
+ * to be short.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <limits.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "errors.h"
+#include "rwlock_dist.h"
+
+#define WRITER_SPIN     100             /* polls before a writer yields */
+
+/*
+ * Slots are handed out to threads round robin, on their first
+ * read lock, so up to DRWL_SLOTS threads never share one.
+ */
+static int next_slot = 0;
+static __thread int my_slot = -1;
+
+static drwl_slot_t *drwl_slot (drwlock_t *rwl)
+{
+    if (my_slot < 0)
+        my_slot = __atomic_fetch_add (&next_slot, 1, __ATOMIC_RELAXED)
+            % DRWL_SLOTS;
+    return &rwl->slot[my_slot];
+}
+
+static int drwl_readers (drwlock_t *rwl)
+{
+    int i, readers = 0;
+
+    for (i = 0; i < DRWL_SLOTS; i++)
+        readers += __atomic_load_n (&rwl->slot[i].readers, __ATOMIC_SEQ_CST);
+    return readers;
+}
+
+/*
+ * Initialize a distributed read-write lock
+ */
+int drwl_init (drwlock_t *rwl)
+{
+    int i, status;
+
+    for (i = 0; i < DRWL_SLOTS; i++)
+        rwl->slot[i].readers = 0;
+    rwl->writer = 0;
+    rwl->r_wait = 0;
+    status = pthread_mutex_init (&rwl->mutex, NULL);
+    if (status != 0)
+        return status;
+    rwl->valid = DRWLOCK_VALID;
+    return 0;
+}
+
+/*
+ * Destroy a distributed read-write lock
+ */
+int drwl_destroy (drwlock_t *rwl)
+{
+    if (rwl->valid != DRWLOCK_VALID)
+        return EINVAL;
+    if (rwl->writer || drwl_readers (rwl) > 0)
+        return EBUSY;
+    rwl->valid = 0;
+    return pthread_mutex_destroy (&rwl->mutex);
+}
+
+/*
+ * Lock a distributed read-write lock for read access.
+ */
+int drwl_readlock (drwlock_t *rwl)
+{
+    drwl_slot_t *slot;
+
+    if (rwl->valid != DRWLOCK_VALID)
+        return EINVAL;
+    slot = drwl_slot (rwl);
+    while (1) {
+        __atomic_fetch_add (&slot->readers, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n (&rwl->writer, __ATOMIC_SEQ_CST) == 0)
+            return 0;
+
+        /*
+         * A writer is in, or waiting for us: back out, and sleep
+         * until it is done.
+         */
+        __atomic_fetch_sub (&slot->readers, 1, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add (&rwl->r_wait, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n (&rwl->writer, __ATOMIC_SEQ_CST) != 0)
+            syscall (SYS_futex, &rwl->writer, FUTEX_WAIT_PRIVATE, 1,
+                NULL, NULL, 0);
+        __atomic_fetch_sub (&rwl->r_wait, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Attempt to lock a distributed read-write lock for read access
+ * (don't block if unavailable).
+ */
+int drwl_readtrylock (drwlock_t *rwl)
+{
+    drwl_slot_t *slot;
+
+    if (rwl->valid != DRWLOCK_VALID)
+        return EINVAL;
+    slot = drwl_slot (rwl);
+    __atomic_fetch_add (&slot->readers, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&rwl->writer, __ATOMIC_SEQ_CST) == 0)
+        return 0;
+    __atomic_fetch_sub (&slot->readers, 1, __ATOMIC_SEQ_CST);
+    return EBUSY;
+}
+
+/*
+ * Unlock a distributed read-write lock from read access.
+ */
+int drwl_readunlock (drwlock_t *rwl)
+{
+    if (rwl->valid != DRWLOCK_VALID)
+        return EINVAL;
+    __atomic_fetch_sub (&drwl_slot (rwl)->readers, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Let waiting readers in again.
+ */
+static void drwl_release (drwlock_t *rwl)
+{
+    __atomic_store_n (&rwl->writer, 0, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&rwl->r_wait, __ATOMIC_SEQ_CST) > 0)
+        syscall (SYS_futex, &rwl->writer, FUTEX_WAKE_PRIVATE, INT_MAX,
+            NULL, NULL, 0);
+}
+
+/*
+ * Lock a distributed read-write lock for write access.
+ */
+int drwl_writelock (drwlock_t *rwl)
+{
+    int spin, status;
+
+    if (rwl->valid != DRWLOCK_VALID)
+        return EINVAL;
+    status = pthread_mutex_lock (&rwl->mutex);
+    if (status != 0)
+        return status;
+    __atomic_store_n (&rwl->writer, 1, __ATOMIC_SEQ_CST);
+    for (spin = 0; drwl_readers (rwl) > 0; spin++)
+        if (spin >= WRITER_SPIN)
+            sched_yield ();
+    return 0;
+}
+
+/*
+ * Attempt to lock a distributed read-write lock for write
+ * access. Don't block if unavailable.
+ */
+int drwl_writetrylock (drwlock_t *rwl)
+{
+    int status;
+
+    if (rwl->valid != DRWLOCK_VALID)
+        return EINVAL;
+    status = pthread_mutex_trylock (&rwl->mutex);
+    if (status != 0)
+        return status;
+    __atomic_store_n (&rwl->writer, 1, __ATOMIC_SEQ_CST);
+    if (drwl_readers (rwl) > 0) {
+        drwl_release (rwl);
+        pthread_mutex_unlock (&rwl->mutex);
+        return EBUSY;
+    }
+    return 0;
+}
+
+/*
+ * Unlock a distributed read-write lock from write access.
+ */
+int drwl_writeunlock (drwlock_t *rwl)
+{
+    if (rwl->valid != DRWLOCK_VALID)
+        return EINVAL;
+    drwl_release (rwl);
+    return pthread_mutex_unlock (&rwl->mutex);
+}
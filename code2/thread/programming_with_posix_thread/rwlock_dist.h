@@ -0,0 +1,56 @@
+/*
+ * rwlock_dist.h
+ *
+ * This header file describes a "distributed" reader/writer lock,
+ * with the same interfaces as rwlock.h (drwl_ instead of rwl_).
+ *
+ * In rwlock.c every reader locks the one mutex and updates the
+ * one r_active counter, so readers on different processors keep
+ * stealing the same cache line from each other even though they
+ * never have to wait for each other. Here each thread counts
+ * itself in one of several reader slots, each on its own cache
+ * line, and a reader that finds no writer touches nothing else.
+ * A writer has to look at every slot, which is the price of
+ * cheap reads: use it for data that is read far more often than
+ * it is written.
+ *
+ * Writers are preferred: once a writer has announced itself,
+ * new readers wait for it, so a stream of readers cannot starve
+ * it.
+ */
+#include <pthread.h>
+
+#define DRWL_SLOTS      64              /* reader slots, one cache line each */
+
+/*
+ * A reader slot: how many readers counted themselves here.
+ */
+typedef struct drwl_slot_tag {
+    int                 readers;
+} __attribute__ ((aligned (64))) drwl_slot_t;
+
+/*
+ * Structure describing a distributed read-write lock.
+ */
+typedef struct drwlock_tag {
+    drwl_slot_t         slot[DRWL_SLOTS];
+    int                 writer __attribute__ ((aligned (64)));
+                                        /* futex: a writer has or wants it */
+    int                 r_wait;         /* readers waiting on writer */
+    pthread_mutex_t     mutex;          /* one writer at a time */
+    int                 valid;          /* set when valid */
+} drwlock_t;
+
+#define DRWLOCK_VALID   0xfacadd
+
+/*
+ * Define distributed read-write lock functions
+ */
+extern int drwl_init (drwlock_t *rwlock);
+extern int drwl_destroy (drwlock_t *rwlock);
+extern int drwl_readlock (drwlock_t *rwlock);
+extern int drwl_readtrylock (drwlock_t *rwlock);
+extern int drwl_readunlock (drwlock_t *rwlock);
+extern int drwl_writelock (drwlock_t *rwlock);
+extern int drwl_writetrylock (drwlock_t *rwlock);
+extern int drwl_writeunlock (drwlock_t *rwlock);
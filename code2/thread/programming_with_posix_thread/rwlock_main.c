@@ -4,11 +4,23 @@
  * Demonstrate use of read-write locks as implemented by
  * rwlock.c
  *
+ * With -b, instead compare it under contention with the other
+ * read-mostly schemes: pthread_rwlock_t, the distributed lock of
+ * rwlock_dist.c, the sequence lock of seqlock.c and the epochs
+ * of epoch.c. Every thread reads (checking it sees a consistent
+ * record) or, a given share of the time, updates one small
+ * shared record, for a sweep of thread counts and update shares.
+ *
  * Special notes: On a Solaris system, call thr_setconcurrency()
  * to allow interleaved thread execution, since threads are not
  * timesliced.
  */
+#include <sched.h>
+#include <time.h>
 #include "rwlock.h"
+#include "rwlock_dist.h"
+#include "seqlock.h"
+#include "epoch.h"
 #include "errors.h"
 
 #define THREADS         5
@@ -93,6 +105,247 @@ void *thread_routine (void *arg)
     return NULL;
 }
 
+/*
+ * The benchmark's shared record: a consistent copy has all four
+ * fields equal.
+ */
+typedef struct record_tag {
+    long        a, b, c, d;
+} record_t;
+
+#define LOCKS           5
+#define BENCH_THREADS   64
+
+const char *lock_names[LOCKS] = {
+    "rwlock.c", "pthread", "dist", "seqlock", "epoch"};
+
+rwlock_t bench_rwl = RWL_INITIALIZER;
+pthread_rwlock_t bench_prwl = PTHREAD_RWLOCK_INITIALIZER;
+drwlock_t bench_drwl;
+seqlock_t bench_seql = SEQL_INITIALIZER;
+epoch_t bench_epoch;
+record_t bench_record;                  /* all but epoch */
+record_t *bench_shared;                 /* epoch: the current copy */
+
+int bench_lock;                         /* which one is being measured */
+int bench_permille;                     /* updates per 1000 operations */
+volatile int bench_go, bench_stop;
+long bench_torn;                        /* inconsistent reads seen */
+
+typedef struct bench_thread_tag {
+    pthread_t   thread_id;
+    long        ops;
+} __attribute__ ((aligned (64))) bench_thread_t;
+
+bench_thread_t bench_threads[BENCH_THREADS];
+
+/*
+ * One read: copy the record under the lock being measured.
+ */
+static void bench_read (record_t *copy)
+{
+    record_t *p;
+    unsigned int seq;
+    int idx;
+
+    switch (bench_lock) {
+    case 0:
+        rwl_readlock (&bench_rwl);
+        *copy = bench_record;
+        rwl_readunlock (&bench_rwl);
+        break;
+    case 1:
+        pthread_rwlock_rdlock (&bench_prwl);
+        *copy = bench_record;
+        pthread_rwlock_unlock (&bench_prwl);
+        break;
+    case 2:
+        drwl_readlock (&bench_drwl);
+        *copy = bench_record;
+        drwl_readunlock (&bench_drwl);
+        break;
+    case 3:
+        do {
+            seq = seql_readbegin (&bench_seql);
+            copy->a = __atomic_load_n (&bench_record.a, __ATOMIC_RELAXED);
+            copy->b = __atomic_load_n (&bench_record.b, __ATOMIC_RELAXED);
+            copy->c = __atomic_load_n (&bench_record.c, __ATOMIC_RELAXED);
+            copy->d = __atomic_load_n (&bench_record.d, __ATOMIC_RELAXED);
+        } while (seql_readretry (&bench_seql, seq));
+        break;
+    case 4:
+        epoch_readlock (&bench_epoch, &idx);
+        p = __atomic_load_n (&bench_shared, __ATOMIC_ACQUIRE);
+        *copy = *p;
+        epoch_readunlock (&bench_epoch, idx);
+        break;
+    }
+}
+
+/*
+ * One update: bump every field of the record.
+ */
+static void bench_write (void)
+{
+    record_t *old, *new;
+    long value;
+
+    switch (bench_lock) {
+    case 0:
+        rwl_writelock (&bench_rwl);
+        value = bench_record.a + 1;
+        bench_record.a = bench_record.b = bench_record.c
+            = bench_record.d = value;
+        rwl_writeunlock (&bench_rwl);
+        break;
+    case 1:
+        pthread_rwlock_wrlock (&bench_prwl);
+        value = bench_record.a + 1;
+        bench_record.a = bench_record.b = bench_record.c
+            = bench_record.d = value;
+        pthread_rwlock_unlock (&bench_prwl);
+        break;
+    case 2:
+        drwl_writelock (&bench_drwl);
+        value = bench_record.a + 1;
+        bench_record.a = bench_record.b = bench_record.c
+            = bench_record.d = value;
+        drwl_writeunlock (&bench_drwl);
+        break;
+    case 3:
+        seql_writelock (&bench_seql);
+        value = bench_record.a + 1;
+        __atomic_store_n (&bench_record.a, value, __ATOMIC_RELAXED);
+        __atomic_store_n (&bench_record.b, value, __ATOMIC_RELAXED);
+        __atomic_store_n (&bench_record.c, value, __ATOMIC_RELAXED);
+        __atomic_store_n (&bench_record.d, value, __ATOMIC_RELAXED);
+        seql_writeunlock (&bench_seql);
+        break;
+    case 4:
+        new = (record_t*)malloc (sizeof (record_t));
+        if (new == NULL)
+            errno_abort ("Allocate record");
+        epoch_writelock (&bench_epoch);
+        old = bench_shared;
+        value = old->a + 1;
+        new->a = new->b = new->c = new->d = value;
+        __atomic_store_n (&bench_shared, new, __ATOMIC_RELEASE);
+        epoch_writeunlock (&bench_epoch);
+        epoch_synchronize (&bench_epoch);
+        free (old);
+        break;
+    }
+}
+
+/*
+ * Benchmark thread start routine: read or update until told to
+ * stop.
+ */
+void *bench_routine (void *arg)
+{
+    bench_thread_t *self = (bench_thread_t*)arg;
+    unsigned int seed = (unsigned int)(self - bench_threads) + 1;
+    record_t copy = {0, 0, 0, 0};
+    long ops = 0, torn = 0;
+
+    while (!bench_go)
+        sched_yield ();
+    while (!bench_stop) {
+        if (rand_r (&seed) % 1000 < bench_permille)
+            bench_write ();
+        else {
+            bench_read (&copy);
+            if (copy.a != copy.b || copy.a != copy.c || copy.a != copy.d)
+                torn++;
+        }
+        ops++;
+    }
+    self->ops = ops;
+    __atomic_fetch_add (&bench_torn, torn, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/*
+ * Run threads on one lock for ms milliseconds; returns millions
+ * of operations per second.
+ */
+static double bench_run (int lock, int threads, int permille, int ms)
+{
+    struct timespec start, end, pause;
+    double secs;
+    long ops = 0;
+    int count, status;
+
+    bench_lock = lock;
+    bench_permille = permille;
+    bench_go = bench_stop = 0;
+    for (count = 0; count < threads; count++) {
+        status = pthread_create (&bench_threads[count].thread_id,
+            NULL, bench_routine, (void*)&bench_threads[count]);
+        if (status != 0)
+            err_abort (status, "Create thread");
+    }
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    bench_go = 1;
+    pause.tv_sec = ms / 1000;
+    pause.tv_nsec = (ms % 1000) * 1000000;
+    nanosleep (&pause, NULL);
+    bench_stop = 1;
+    for (count = 0; count < threads; count++) {
+        status = pthread_join (bench_threads[count].thread_id, NULL);
+        if (status != 0)
+            err_abort (status, "Join thread");
+        ops += bench_threads[count].ops;
+    }
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return ops / secs / 1e6;
+}
+
+/*
+ * Sweep thread counts (1, 2, 4, ... up to twice the processors)
+ * and update shares, printing a table of Mops/s per lock.
+ */
+int bench_main (int ms)
+{
+    static const int permilles[] = {0, 1, 10, 100, 500};
+    int cpus, threads, p, lock, status;
+
+    cpus = sysconf (_SC_NPROCESSORS_ONLN);
+    if (cpus < 2)
+        cpus = 2;
+    status = drwl_init (&bench_drwl);
+    if (status != 0)
+        err_abort (status, "Init distributed rw lock");
+    status = epoch_init (&bench_epoch);
+    if (status != 0)
+        err_abort (status, "Init epoch");
+    bench_shared = (record_t*)calloc (1, sizeof (record_t));
+    if (bench_shared == NULL)
+        errno_abort ("Allocate record");
+
+    printf ("Mops/s, %d ms per run\n", ms);
+    printf ("threads updates");
+    for (lock = 0; lock < LOCKS; lock++)
+        printf (" %9s", lock_names[lock]);
+    printf ("\n");
+    for (threads = 1; threads <= 2 * cpus && threads <= BENCH_THREADS;
+            threads *= 2)
+        for (p = 0; p < sizeof (permilles) / sizeof (permilles[0]); p++) {
+            printf ("%7d %6.1f%%", threads, permilles[p] / 10.0);
+            for (lock = 0; lock < LOCKS; lock++)
+                printf (" %9.2f",
+                    bench_run (lock, threads, permilles[p], ms));
+            printf ("\n");
+            fflush (stdout);
+        }
+    if (bench_torn > 0) {
+        fprintf (stderr, "%ld inconsistent reads\n", bench_torn);
+        return 1;
+    }
+    return 0;
+}
+
 int main (int argc, char *argv[])
 {
     int count;
@@ -102,6 +355,9 @@ int main (int argc, char *argv[])
     int thread_updates = 0;
     int data_updates = 0;
 
+    if (argc > 1 && strcmp (argv[1], "-b") == 0)
+        return bench_main (argc > 2 ? atoi (argv[2]) : 100);
+
 #ifdef sun
     /*
      * On Solaris 2.5, threads are not timesliced. To ensure
@@ -0,0 +1,94 @@
+/*
+ * seqlock.c
+ *
+ * This file implements the sequence lock of seqlock.h.
+ *
+ * The fences matter more than the code: a writer's increment to
+ * odd must be visible before any of its data stores, and its
+ * data stores before the increment back to even; a reader's data
+ * loads must come after its first look at the sequence number
+ * and before its second.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include "errors.h"
+#include "seqlock.h"
+
+/*
+ * Initialize a sequence lock
+ */
+int seql_init (seqlock_t *sl)
+{
+    int status;
+
+    sl->seq = 0;
+    status = pthread_mutex_init (&sl->mutex, NULL);
+    if (status != 0)
+        return status;
+    sl->valid = SEQLOCK_VALID;
+    return 0;
+}
+
+/*
+ * Destroy a sequence lock
+ */
+int seql_destroy (seqlock_t *sl)
+{
+    if (sl->valid != SEQLOCK_VALID)
+        return EINVAL;
+    if (__atomic_load_n (&sl->seq, __ATOMIC_RELAXED) & 1)
+        return EBUSY;
+    sl->valid = 0;
+    return pthread_mutex_destroy (&sl->mutex);
+}
+
+/*
+ * Start a read: wait out a busy writer, and return the sequence
+ * number to hand to seql_readretry.
+ */
+unsigned int seql_readbegin (seqlock_t *sl)
+{
+    unsigned int seq;
+
+    while ((seq = __atomic_load_n (&sl->seq, __ATOMIC_ACQUIRE)) & 1)
+        sched_yield ();
+    return seq;
+}
+
+/*
+ * Finish a read: nonzero if a writer got in since
+ * seql_readbegin, and the data has to be read again.
+ */
+int seql_readretry (seqlock_t *sl, unsigned int seq)
+{
+    __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    return __atomic_load_n (&sl->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/*
+ * Lock a sequence lock for write access.
+ */
+int seql_writelock (seqlock_t *sl)
+{
+    int status;
+
+    if (sl->valid != SEQLOCK_VALID)
+        return EINVAL;
+    status = pthread_mutex_lock (&sl->mutex);
+    if (status != 0)
+        return status;
+    __atomic_store_n (&sl->seq, sl->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Unlock a sequence lock from write access.
+ */
+int seql_writeunlock (seqlock_t *sl)
+{
+    if (sl->valid != SEQLOCK_VALID)
+        return EINVAL;
+    __atomic_store_n (&sl->seq, sl->seq + 1, __ATOMIC_RELEASE);
+    return pthread_mutex_unlock (&sl->mutex);
+}
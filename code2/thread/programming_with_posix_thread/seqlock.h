@@ -0,0 +1,51 @@
+/*
+ * seqlock.h
+ *
+ * This header file describes a "sequence lock", for small data
+ * (a few words, no pointers to follow) that is read very often
+ * and written seldom.
+ *
+ * Readers take no lock at all and write nothing shared: they
+ * note the sequence number, copy the data, and check that the
+ * sequence number hasn't moved. If it has, a writer was busy and
+ * the copy may be torn, so they copy again:
+ *
+ *      do {
+ *          seq = seql_readbegin (&lock);
+ *          copy = data;
+ *      } while (seql_readretry (&lock, seq));
+ *
+ * Writers are serialized by a mutex and make the sequence number
+ * odd while they change the data. Since a reader may see the
+ * data half written, it must only copy it, never act on it
+ * (follow a pointer, index an array) before seql_readretry says
+ * the copy is good.
+ */
+#include <pthread.h>
+
+/*
+ * Structure describing a sequence lock.
+ */
+typedef struct seqlock_tag {
+    unsigned int        seq;            /* odd while a writer is busy */
+    pthread_mutex_t     mutex;          /* one writer at a time */
+    int                 valid;          /* set when valid */
+} seqlock_t;
+
+#define SEQLOCK_VALID   0x5e9106
+
+/*
+ * Support static initialization of sequence locks
+ */
+#define SEQL_INITIALIZER \
+    {0, PTHREAD_MUTEX_INITIALIZER, SEQLOCK_VALID}
+
+/*
+ * Define sequence lock functions
+ */
+extern int seql_init (seqlock_t *seqlock);
+extern int seql_destroy (seqlock_t *seqlock);
+extern unsigned int seql_readbegin (seqlock_t *seqlock);
+extern int seql_readretry (seqlock_t *seqlock, unsigned int seq);
+extern int seql_writelock (seqlock_t *seqlock);
+extern int seql_writeunlock (seqlock_t *seqlock);
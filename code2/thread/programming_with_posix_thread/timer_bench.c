@@ -0,0 +1,178 @@
+/*
+ * timer_bench.c
+ *
+ * Compare the timing wheel (timer_wheel.c) with the sorted alarm
+ * list of alarm_cond.c: add a number of timers due at random in
+ * the next minute, cancel every fourth one, then let time run on
+ * until all the rest have expired.
+ *
+ * The list inserts in O(n), so filling it is quadratic; it is
+ * measured with fewer timers (the second argument) and its time
+ * for the full count is projected from that.
+ *
+ * Both run on virtual time, ticks of a millisecond, so only the
+ * data structures are measured.
+ *
+ * Usage: timer_bench [timers [list_timers]]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "errors.h"
+#include "timer_wheel.h"
+
+#define SPAN            60000           /* ticks: a minute of ms */
+
+/*
+ * The list entry of alarm_cond.c, minus the message.
+ */
+typedef struct alarm_tag {
+    struct alarm_tag    *link;
+    unsigned long       time;
+} alarm_t;
+
+alarm_t *alarm_list = NULL;
+long fired = 0;
+
+static double now_secs (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * alarm_insert of alarm_cond.c: walk to the first later alarm.
+ */
+void alarm_insert (alarm_t *alarm)
+{
+    alarm_t **last, *next;
+
+    last = &alarm_list;
+    next = *last;
+    while (next != NULL && next->time < alarm->time) {
+        last = &next->link;
+        next = next->link;
+    }
+    alarm->link = next;
+    *last = alarm;
+}
+
+/*
+ * Cancelling from a singly linked list means finding it first.
+ */
+void alarm_cancel (alarm_t *alarm)
+{
+    alarm_t **last;
+
+    for (last = &alarm_list; *last != NULL; last = &(*last)->link)
+        if (*last == alarm) {
+            *last = alarm->link;
+            return;
+        }
+}
+
+void timer_fired (wheel_timer_t *timer, void *arg)
+{
+    fired++;
+}
+
+int main (int argc, char *argv[])
+{
+    timer_wheel_t wheel;
+    wheel_timer_t *timers;
+    alarm_t *alarms, *alarm;
+    unsigned long *due, tick;
+    long n = 1000000, m = 20000, i, cancelled;
+    double t0, t_add, t_cancel, t_expire;
+    double l_add, l_cancel, l_expire;
+    unsigned int seed = 1;
+    int status;
+
+    if (argc > 1)
+        n = atol (argv[1]);
+    if (argc > 2)
+        m = atol (argv[2]);
+    if (n < 1 || m < 1) {
+        fprintf (stderr, "Usage: %s [timers [list_timers]]\n", argv[0]);
+        return 1;
+    }
+    if (m > n)
+        m = n;
+    timers = (wheel_timer_t*)malloc (n * sizeof (wheel_timer_t));
+    alarms = (alarm_t*)malloc (m * sizeof (alarm_t));
+    due = (unsigned long*)malloc (n * sizeof (unsigned long));
+    if (timers == NULL || alarms == NULL || due == NULL)
+        errno_abort ("Allocate timers");
+    for (i = 0; i < n; i++)
+        due[i] = 1 + rand_r (&seed) % SPAN;
+
+    /*
+     * The wheel, with n timers.
+     */
+    status = timer_wheel_init (&wheel, 1000000);
+    if (status != 0)
+        err_abort (status, "Init timer wheel");
+    for (i = 0; i < n; i++)
+        timer_wheel_timer_init (&timers[i], timer_fired, NULL);
+    t0 = now_secs ();
+    for (i = 0; i < n; i++)
+        timer_wheel_add_at (&wheel, &timers[i], due[i]);
+    t_add = now_secs () - t0;
+    t0 = now_secs ();
+    cancelled = 0;
+    for (i = 0; i < n; i += 4)
+        cancelled += timer_wheel_cancel (&wheel, &timers[i]);
+    t_cancel = now_secs () - t0;
+    t0 = now_secs ();
+    for (tick = 0; tick <= SPAN; tick++)
+        timer_wheel_advance (&wheel, tick);
+    t_expire = now_secs () - t0;
+    if (fired != n - cancelled) {
+        fprintf (stderr, "Wheel ran %ld timers of %ld\n",
+            fired, n - cancelled);
+        return 1;
+    }
+    timer_wheel_destroy (&wheel);
+
+    /*
+     * The list, with m timers.
+     */
+    t0 = now_secs ();
+    for (i = 0; i < m; i++) {
+        alarms[i].time = due[i];
+        alarm_insert (&alarms[i]);
+    }
+    l_add = now_secs () - t0;
+    t0 = now_secs ();
+    for (i = 0; i < m; i += 4)
+        alarm_cancel (&alarms[i]);
+    l_cancel = now_secs () - t0;
+    t0 = now_secs ();
+    fired = 0;
+    for (tick = 0; tick <= SPAN; tick++)
+        while (alarm_list != NULL && alarm_list->time <= tick) {
+            alarm = alarm_list;
+            alarm_list = alarm->link;
+            fired++;
+        }
+    l_expire = now_secs () - t0;
+
+    printf ("wheel, %ld timers: add %.1f ns, cancel %.1f ns, "
+        "expire %.1f ns each; %.3f s in all\n", n,
+        t_add * 1e9 / n, t_cancel * 1e9 / ((n + 3) / 4),
+        t_expire * 1e9 / (n - cancelled), t_add + t_cancel + t_expire);
+    printf ("list, %ld timers: add %.1f ns, cancel %.1f ns, "
+        "expire %.1f ns each; %.3f s in all\n", m,
+        l_add * 1e9 / m, l_cancel * 1e9 / ((m + 3) / 4),
+        l_expire * 1e9 / fired, l_add + l_cancel + l_expire);
+    if (m < n)
+        printf ("list, %ld timers: about %.0f s to add and cancel "
+            "(quadratic)\n", n,
+            (l_add + l_cancel) * ((double)n / m) * ((double)n / m));
+    free (due);
+    free (alarms);
+    free (timers);
+    return 0;
+}
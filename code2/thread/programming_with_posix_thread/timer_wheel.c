@@ -0,0 +1,401 @@
+/*
+ * timer_wheel.c
+ *
+ * This file implements the hierarchical timing wheel described
+ * in timer_wheel.h (after Varghese and Lauck, and the classic
+ * Linux kernel timer wheel).
+ *
+ * A timer due in delta ticks goes in the lowest level whose
+ * span covers delta, in the slot for its expiry tick's digit at
+ * that level. The first level slot of the tick being processed
+ * holds exactly the timers due now. Each time the first level
+ * index wraps to 0 the next slot up is emptied and its timers
+ * re-added, which puts each of them one level lower (and, one
+ * level at a time, finally in the first level).
+ *
+ * timer_wheel_advance() walks the ticks one by one, but a tick
+ * with nothing due costs only a bitmap test. Timers that were
+ * due before the tick being processed (added late, or from a
+ * callback) run on the next tick.
+ */
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "errors.h"
+#include "timer_wheel.h"
+
+#define L0_MASK         (TIMER_WHEEL_L0_SIZE - 1)
+#define LN_MASK         (TIMER_WHEEL_LN_SIZE - 1)
+#define LEVEL_SHIFT(n)  (TIMER_WHEEL_L0_BITS + ((n) - 1) * TIMER_WHEEL_LN_BITS)
+#define MAX_DELTA       ((1UL << LEVEL_SHIFT (TIMER_WHEEL_LEVELS)) - 1)
+#define NOT_ARMED       ULONG_MAX
+
+#define MAP_SET(map, i)   ((map)[(i) / 64] |= 1UL << ((i) % 64))
+#define MAP_CLEAR(map, i) ((map)[(i) / 64] &= ~(1UL << ((i) % 64)))
+#define MAP_TEST(map, i)  ((map)[(i) / 64] & (1UL << ((i) % 64)))
+
+static void list_init (wheel_timer_t *head)
+{
+    head->next = head->prev = head;
+}
+
+static void list_append (wheel_timer_t *head, wheel_timer_t *timer)
+{
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void list_unlink (wheel_timer_t *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+}
+
+/*
+ * Move the whole of a slot list onto an empty local head, so the
+ * slot can take new timers while the old ones are worked on.
+ */
+static void list_move (wheel_timer_t *from, wheel_timer_t *to)
+{
+    if (from->next == from) {
+        list_init (to);
+        return;
+    }
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    list_init (from);
+}
+
+/*
+ * Put a timer in its slot, relative to wheel->base.
+ */
+static void wheel_insert (timer_wheel_t *wheel, wheel_timer_t *timer)
+{
+    unsigned long expires = timer->expires;
+    unsigned long delta = expires - wheel->base;
+    int level, idx;
+
+    if ((long)delta < 0) {
+        /*
+         * Already due: the next tick to be processed.
+         */
+        idx = wheel->base & L0_MASK;
+        list_append (&wheel->l0[idx], timer);
+        MAP_SET (wheel->l0_map, idx);
+        return;
+    }
+    if (delta < TIMER_WHEEL_L0_SIZE) {
+        idx = expires & L0_MASK;
+        list_append (&wheel->l0[idx], timer);
+        MAP_SET (wheel->l0_map, idx);
+        return;
+    }
+    if (delta > MAX_DELTA) {
+        /*
+         * Further than the wheel reaches: park it in the top
+         * level, it will be looked at again when that slot is
+         * cascaded.
+         */
+        expires = wheel->base + MAX_DELTA;
+        delta = MAX_DELTA;
+    }
+    for (level = 1; level < TIMER_WHEEL_LEVELS; level++)
+        if (delta < 1UL << LEVEL_SHIFT (level + 1))
+            break;
+    idx = (expires >> LEVEL_SHIFT (level)) & LN_MASK;
+    list_append (&wheel->ln[level - 1][idx], timer);
+    wheel->ln_map[level - 1] |= 1UL << idx;
+}
+
+/*
+ * Empty one slot of an upper level back into the wheel. Returns
+ * the slot index, so the caller knows whether the level has come
+ * round and the next one up is due as well.
+ */
+static int wheel_cascade (timer_wheel_t *wheel, int level)
+{
+    wheel_timer_t list, *timer;
+    int idx;
+
+    idx = (wheel->base >> LEVEL_SHIFT (level)) & LN_MASK;
+    if (wheel->ln_map[level - 1] & (1UL << idx)) {
+        wheel->ln_map[level - 1] &= ~(1UL << idx);
+        list_move (&wheel->ln[level - 1][idx], &list);
+        while (list.next != &list) {
+            timer = list.next;
+            list_unlink (timer);
+            wheel_insert (wheel, timer);
+        }
+    }
+    return idx;
+}
+
+/*
+ * The tick the wheel next has to look at: the earliest timer in
+ * the first level, or the earliest cascade of a non-empty slot
+ * above, whichever comes first. NOT_ARMED if there are no timers.
+ */
+static unsigned long wheel_next (timer_wheel_t *wheel)
+{
+    unsigned long next = NOT_ARMED, when, top;
+    int off, idx, level, shift;
+
+    if (wheel->count == 0)
+        return NOT_ARMED;
+    for (off = 0; off < TIMER_WHEEL_L0_SIZE; off++) {
+        idx = (wheel->base + off) & L0_MASK;
+        if (!MAP_TEST (wheel->l0_map, idx))
+            continue;
+        if (wheel->l0[idx].next == &wheel->l0[idx]) {
+            MAP_CLEAR (wheel->l0_map, idx);     /* emptied by cancels */
+            continue;
+        }
+        next = wheel->base + off;
+        break;
+    }
+    for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        if (wheel->ln_map[level - 1] == 0)
+            continue;
+        shift = LEVEL_SHIFT (level);
+        top = wheel->base >> shift;
+        for (off = 1; off <= TIMER_WHEEL_LN_SIZE; off++) {
+            idx = (top + off) & LN_MASK;
+            if (!(wheel->ln_map[level - 1] & (1UL << idx)))
+                continue;
+            if (wheel->ln[level - 1][idx].next
+                    == &wheel->ln[level - 1][idx]) {
+                wheel->ln_map[level - 1] &= ~(1UL << idx);
+                continue;
+            }
+            when = (top + off) << shift;
+            if (next == NOT_ARMED || (long)(when - next) < 0)
+                next = when;
+            break;
+        }
+    }
+    return next;
+}
+
+/*
+ * Set the timerfd for a tick, or disarm it.
+ */
+static void wheel_arm (timer_wheel_t *wheel, unsigned long tick)
+{
+    struct itimerspec its;
+    unsigned long long ns;
+
+    if (tick == wheel->armed)
+        return;
+    memset (&its, 0, sizeof (its));
+    if (tick != NOT_ARMED) {
+        ns = (unsigned long long)wheel->start.tv_nsec
+            + (unsigned long long)tick * wheel->tick_ns;
+        its.it_value.tv_sec = wheel->start.tv_sec + ns / 1000000000;
+        its.it_value.tv_nsec = ns % 1000000000;
+        if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+            its.it_value.tv_nsec = 1;   /* zero would disarm */
+    }
+    if (timerfd_settime (wheel->fd, TFD_TIMER_ABSTIME, &its, NULL) == 0)
+        wheel->armed = tick;
+}
+
+/*
+ * Initialize a timing wheel with ticks of tick_ns nanoseconds,
+ * starting at tick 0 now.
+ */
+int timer_wheel_init (timer_wheel_t *wheel, long tick_ns)
+{
+    int i, level;
+
+    if (tick_ns <= 0)
+        return EINVAL;
+    for (i = 0; i < TIMER_WHEEL_L0_SIZE; i++)
+        list_init (&wheel->l0[i]);
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++)
+        for (i = 0; i < TIMER_WHEEL_LN_SIZE; i++)
+            list_init (&wheel->ln[level][i]);
+    memset (wheel->l0_map, 0, sizeof (wheel->l0_map));
+    memset (wheel->ln_map, 0, sizeof (wheel->ln_map));
+    wheel->base = 0;
+    wheel->count = 0;
+    wheel->armed = NOT_ARMED;
+    wheel->tick_ns = tick_ns;
+    clock_gettime (CLOCK_MONOTONIC, &wheel->start);
+    wheel->fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (wheel->fd < 0)
+        return errno;
+    wheel->valid = TIMER_WHEEL_VALID;
+    return 0;
+}
+
+/*
+ * Destroy a timing wheel. Pending timers are simply forgotten
+ * (they belong to the caller).
+ */
+int timer_wheel_destroy (timer_wheel_t *wheel)
+{
+    if (wheel->valid != TIMER_WHEEL_VALID)
+        return EINVAL;
+    wheel->valid = 0;
+    if (close (wheel->fd) != 0)
+        return errno;
+    return 0;
+}
+
+/*
+ * Prepare a timer for use.
+ */
+void timer_wheel_timer_init (
+    wheel_timer_t *timer, wheel_callback_t callback, void *arg)
+{
+    timer->next = timer->prev = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->arg = arg;
+}
+
+/*
+ * The current tick by the clock.
+ */
+unsigned long timer_wheel_now (timer_wheel_t *wheel)
+{
+    struct timespec now;
+    long long ns;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    ns = (long long)(now.tv_sec - wheel->start.tv_sec) * 1000000000
+        + (now.tv_nsec - wheel->start.tv_nsec);
+    return ns / wheel->tick_ns;
+}
+
+/*
+ * Schedule a timer to run at tick expires. A timer that is
+ * already pending is moved.
+ */
+int timer_wheel_add_at (
+    timer_wheel_t *wheel, wheel_timer_t *timer, unsigned long expires)
+{
+    if (wheel->valid != TIMER_WHEEL_VALID)
+        return EINVAL;
+    if (timer->next != NULL)
+        list_unlink (timer);
+    else
+        wheel->count++;
+    timer->expires = expires;
+    wheel_insert (wheel, timer);
+
+    /*
+     * Only earlier than what the timerfd is set for needs a
+     * system call; anything else is found when it goes off.
+     */
+    if (wheel->armed == NOT_ARMED || (long)(expires - wheel->armed) < 0)
+        wheel_arm (wheel, (long)(expires - wheel->base) < 0
+            ? wheel->base : expires);
+    return 0;
+}
+
+/*
+ * Schedule a timer to run ticks from now.
+ */
+int timer_wheel_add (
+    timer_wheel_t *wheel, wheel_timer_t *timer, unsigned long ticks)
+{
+    return timer_wheel_add_at (wheel, timer, timer_wheel_now (wheel) + ticks);
+}
+
+/*
+ * Cancel a timer. Returns 1 if it was pending, 0 if it had
+ * already run (or was never added).
+ */
+int timer_wheel_cancel (timer_wheel_t *wheel, wheel_timer_t *timer)
+{
+    if (timer->next == NULL)
+        return 0;
+    list_unlink (timer);
+    wheel->count--;
+    return 1;
+}
+
+int timer_wheel_pending (wheel_timer_t *timer)
+{
+    return timer->next != NULL;
+}
+
+/*
+ * The descriptor to poll: it becomes readable when
+ * timer_wheel_run() has work to do.
+ */
+int timer_wheel_fd (timer_wheel_t *wheel)
+{
+    return wheel->fd;
+}
+
+/*
+ * Run every timer due up to and including tick now, in tick
+ * order. Returns the number of timers run. For callers that keep
+ * time themselves; timer_wheel_run() goes by the clock.
+ */
+int timer_wheel_advance (timer_wheel_t *wheel, unsigned long now)
+{
+    wheel_timer_t list, *timer;
+    int idx, level, fired = 0;
+
+    if (wheel->valid != TIMER_WHEEL_VALID)
+        return 0;
+    while ((long)(now - wheel->base) >= 0) {
+        if (wheel->count == 0) {
+            wheel->base = now + 1;
+            break;
+        }
+        idx = wheel->base & L0_MASK;
+        if (idx == 0)
+            for (level = 1; level < TIMER_WHEEL_LEVELS; level++)
+                if (wheel_cascade (wheel, level) != 0)
+                    break;
+
+        /*
+         * Move on before running anything, so a timer added by a
+         * callback for "now" goes in the next tick's slot, not
+         * back in this one.
+         */
+        wheel->base++;
+        if (!MAP_TEST (wheel->l0_map, idx))
+            continue;
+        MAP_CLEAR (wheel->l0_map, idx);
+        list_move (&wheel->l0[idx], &list);
+        while (list.next != &list) {
+            timer = list.next;
+            list_unlink (timer);
+            wheel->count--;
+            fired++;
+            timer->callback (timer, timer->arg);
+        }
+    }
+    return fired;
+}
+
+/*
+ * Run everything that is due by the clock, and set the timerfd
+ * for what comes next.
+ */
+int timer_wheel_run (timer_wheel_t *wheel)
+{
+    unsigned long long expirations;
+    int fired;
+
+    if (wheel->valid != TIMER_WHEEL_VALID)
+        return 0;
+    while (read (wheel->fd, &expirations, sizeof (expirations)) > 0)
+        ;
+    wheel->armed = NOT_ARMED;           /* it went off, or will be reset */
+    fired = timer_wheel_advance (wheel, timer_wheel_now (wheel));
+    wheel_arm (wheel, wheel_next (wheel));
+    return fired;
+}
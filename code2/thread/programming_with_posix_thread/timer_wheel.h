@@ -0,0 +1,88 @@
+/*
+ * timer_wheel.h
+ *
+ * This header file defines the interfaces for a hierarchical
+ * "timing wheel", a timer manager that stays fast with hundreds
+ * of thousands of pending timeouts.
+ *
+ * Time is counted in ticks of a length set when the wheel is
+ * initialized. The first level of the wheel has a slot for each
+ * of the next 256 ticks; each of the four levels above it has
+ * 64 slots, each slot covering a whole turn of the level below.
+ * Adding or cancelling a timer is a few pointer operations in
+ * one slot, whatever the number of timers. As time advances,
+ * every timer in the current first level slot expires at once,
+ * and when the first level comes round, the next slot of the
+ * level above is cascaded down into it.
+ *
+ * The wheel keeps a timerfd armed for its next expiry, so an
+ * event loop can simply poll timer_wheel_fd() along with its
+ * other descriptors and call timer_wheel_run() when it becomes
+ * readable.
+ *
+ * A wheel is not locked: callers that share one between threads
+ * must serialize calls themselves. Callbacks are run by
+ * timer_wheel_run (or timer_wheel_advance) and may add or
+ * cancel any timer, including their own.
+ */
+#include <time.h>
+
+#define TIMER_WHEEL_L0_BITS     8
+#define TIMER_WHEEL_LN_BITS     6
+#define TIMER_WHEEL_LEVELS      5       /* 8 + 4 * 6 = 32 bits of ticks */
+#define TIMER_WHEEL_L0_SIZE     (1 << TIMER_WHEEL_L0_BITS)
+#define TIMER_WHEEL_LN_SIZE     (1 << TIMER_WHEEL_LN_BITS)
+
+struct wheel_timer_tag;
+typedef void (*wheel_callback_t)(struct wheel_timer_tag *timer, void *arg);
+
+/*
+ * A timer. The caller owns the storage (embed it in whatever
+ * the timer is for), so the wheel never allocates.
+ */
+typedef struct wheel_timer_tag {
+    struct wheel_timer_tag      *next, *prev;   /* slot list, NULL if idle */
+    unsigned long               expires;        /* tick */
+    wheel_callback_t            callback;
+    void                        *arg;
+} wheel_timer_t;
+
+/*
+ * Structure describing a timing wheel. Each slot is the head of
+ * a circular list; the bitmaps say which slots may hold timers.
+ */
+typedef struct timer_wheel_tag {
+    wheel_timer_t       l0[TIMER_WHEEL_L0_SIZE];
+    wheel_timer_t       ln[TIMER_WHEEL_LEVELS - 1][TIMER_WHEEL_LN_SIZE];
+    unsigned long       l0_map[TIMER_WHEEL_L0_SIZE / 64];
+    unsigned long       ln_map[TIMER_WHEEL_LEVELS - 1];
+    unsigned long       base;           /* next tick to process */
+    unsigned long       count;          /* pending timers */
+    unsigned long       armed;          /* tick the timerfd is set for */
+    long                tick_ns;        /* length of a tick */
+    struct timespec     start;          /* tick 0, CLOCK_MONOTONIC */
+    int                 fd;             /* timerfd */
+    int                 valid;          /* set when valid */
+} timer_wheel_t;
+
+#define TIMER_WHEEL_VALID       0x7173e1
+
+/*
+ * Define timing wheel functions
+ */
+extern int timer_wheel_init (timer_wheel_t *wheel, long tick_ns);
+extern int timer_wheel_destroy (timer_wheel_t *wheel);
+extern void timer_wheel_timer_init (
+    wheel_timer_t       *timer,
+    wheel_callback_t    callback,
+    void                *arg);
+extern unsigned long timer_wheel_now (timer_wheel_t *wheel);
+extern int timer_wheel_add (
+    timer_wheel_t *wheel, wheel_timer_t *timer, unsigned long ticks);
+extern int timer_wheel_add_at (
+    timer_wheel_t *wheel, wheel_timer_t *timer, unsigned long expires);
+extern int timer_wheel_cancel (timer_wheel_t *wheel, wheel_timer_t *timer);
+extern int timer_wheel_pending (wheel_timer_t *timer);
+extern int timer_wheel_fd (timer_wheel_t *wheel);
+extern int timer_wheel_run (timer_wheel_t *wheel);
+extern int timer_wheel_advance (timer_wheel_t *wheel, unsigned long now);
@@ -54,6 +54,12 @@ static void *workq_server (void *arg)
         clock_gettime (CLOCK_REALTIME, &timeout);
         timeout.tv_sec += 2;
 
+        /*
+         * Count ourselves idle while we wait, so that workq_add
+         * signals us rather than leaving the request for a
+         * server that times out.
+         */
+        wq->idle++;
         while (wq->first == NULL && !wq->quit) {
             /*
              * Server threads time out after spending 2 seconds
@@ -83,11 +89,13 @@ static void *workq_server (void *arg)
                 DPRINTF ((
                     "Worker wait failed, %d (%s)\n",
                     status, strerror (status)));
+                wq->idle--;
                 wq->counter--;
                 pthread_mutex_unlock (&wq->mutex);
                 return NULL;
             }
         }
+        wq->idle--;
         DPRINTF (("Work queue: %#lx, quit: %d\n", wq->first, wq->quit));
         we = wq->first;
 
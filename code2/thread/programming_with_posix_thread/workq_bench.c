@@ -0,0 +1,195 @@
+/*
+ * workq_bench.c
+ *
+ * Measure work queue throughput: several producer threads each
+ * queue a number of tiny requests, and the clock stops when
+ * workq_destroy has seen all of them processed.
+ *
+ * Since workq_destroy wakes every server, the throughput run
+ * would not notice a request that sits in the queue with all
+ * the servers asleep. So first, one request at a time is queued
+ * and waited for, with a pause in between to let the servers
+ * park; a request that isn't run within a second is an error.
+ *
+ * Built twice by the Makefile: workq_bench against the mutex
+ * and malloc work queue in workq.c, workq_lf_bench (compiled
+ * with -DWORKQ_LF) against the lock-free ring in workq_lf.c.
+ * With a batch size above 1, workq_lf_bench queues with
+ * workq_add_many.
+ *
+ * Usage: workq_bench [producers [servers [items [batch]]]]
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "errors.h"
+#ifdef WORKQ_LF
+# include "workq_lf.h"
+#else
+# include "workq.h"
+#endif
+
+#define MAX_BATCH       1024
+#define PINGS           2000            /* requests in the latency check */
+#define PING_PAUSE      200000          /* ns between them */
+#define PING_TIMEOUT    1.0             /* seconds */
+
+workq_t workq;
+long items = 1000000;                   /* per producer */
+int batch = 1;
+long done = 0;                          /* sum of processed requests */
+
+/*
+ * The engine: about as little work as a request can be.
+ */
+void engine_routine (void *arg)
+{
+    __atomic_fetch_add (&done, (long)arg, __ATOMIC_RELAXED);
+}
+
+static double elapsed (struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec)
+        + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Queue one request at a time and wait for it to be run.
+ * Returns the worst latency in seconds, or -1 if a request
+ * was never run.
+ */
+double latency_check (int servers)
+{
+    struct timespec start, pause = {0, PING_PAUSE};
+    double secs, worst = 0;
+    int count, status;
+
+    status = workq_init (&workq, servers, engine_routine);
+    if (status != 0)
+        err_abort (status, "Init work queue");
+    for (count = 0; count < PINGS; count++) {
+        nanosleep (&pause, NULL);
+        clock_gettime (CLOCK_MONOTONIC, &start);
+        status = workq_add (&workq, (void*)1);
+        if (status != 0)
+            err_abort (status, "Add to work queue");
+        while (__atomic_load_n (&done, __ATOMIC_RELAXED) == count) {
+            if (elapsed (&start) > PING_TIMEOUT) {
+                fprintf (stderr, "Request %d not run after %.0f s\n",
+                    count, PING_TIMEOUT);
+                return -1;
+            }
+            sched_yield ();
+        }
+        secs = elapsed (&start);
+        if (secs > worst)
+            worst = secs;
+    }
+    status = workq_destroy (&workq);
+    if (status != 0)
+        err_abort (status, "Destroy work queue");
+    done = 0;
+    return worst;
+}
+
+/*
+ * Thread start routine that issues work queue requests. Each
+ * request is just the number 1, so nothing is allocated for it.
+ */
+void *producer_routine (void *arg)
+{
+    void *data[MAX_BATCH];
+    long count;
+    int n, status;
+
+    for (n = 0; n < MAX_BATCH; n++)
+        data[n] = (void*)1;
+    for (count = 0; count < items; count += n) {
+        n = batch;
+        if (n > items - count)
+            n = items - count;
+#ifdef WORKQ_LF
+        if (n > 1) {
+            status = workq_add_many (&workq, data, n);
+            if (status != 0)
+                err_abort (status, "Add to work queue");
+            continue;
+        }
+#endif
+        n = 1;
+        status = workq_add (&workq, data[0]);
+        if (status != 0)
+            err_abort (status, "Add to work queue");
+    }
+    return NULL;
+}
+
+int main (int argc, char *argv[])
+{
+    pthread_t *threads;
+    struct timespec start, end;
+    int producers = 2, servers = 4;
+    double secs, worst;
+    int count, status;
+
+    if (argc > 1)
+        producers = atoi (argv[1]);
+    if (argc > 2)
+        servers = atoi (argv[2]);
+    if (argc > 3)
+        items = atol (argv[3]);
+    if (argc > 4)
+        batch = atoi (argv[4]);
+    if (producers < 1 || servers < 1 || items < 1
+            || batch < 1 || batch > MAX_BATCH) {
+        fprintf (stderr,
+            "Usage: %s [producers [servers [items [batch]]]]\n", argv[0]);
+        return 1;
+    }
+    threads = (pthread_t*)malloc (producers * sizeof (pthread_t));
+    if (threads == NULL)
+        errno_abort ("Allocate threads");
+
+    worst = latency_check (servers);
+    if (worst < 0)
+        return 1;
+    printf ("%d servers: %d single requests, worst latency %.0f us\n",
+        servers, PINGS, worst * 1e6);
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    status = workq_init (&workq, servers, engine_routine);
+    if (status != 0)
+        err_abort (status, "Init work queue");
+    for (count = 0; count < producers; count++) {
+        status = pthread_create (
+            &threads[count], NULL, producer_routine, NULL);
+        if (status != 0)
+            err_abort (status, "Create thread");
+    }
+    for (count = 0; count < producers; count++) {
+        status = pthread_join (threads[count], NULL);
+        if (status != 0)
+            err_abort (status, "Join thread");
+    }
+    status = workq_destroy (&workq);
+    if (status != 0)
+        err_abort (status, "Destroy work queue");
+    clock_gettime (CLOCK_MONOTONIC, &end);
+
+    secs = (end.tv_sec - start.tv_sec)
+        + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (done != items * producers) {
+        fprintf (stderr, "Lost requests: %ld of %ld processed\n",
+            done, items * producers);
+        return 1;
+    }
+    printf ("%d producers, %d servers, batch %d: %ld requests in %.3f s, "
+        "%.0f/s\n", producers, servers, batch, done, secs, done / secs);
+    free (threads);
+    return 0;
+}
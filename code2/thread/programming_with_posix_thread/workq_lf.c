@@ -0,0 +1,388 @@
+/*
+ * workq_lf.c
+ *
+ * This file implements the work queue interfaces of workq.h
+ * (plus workq_add_many) over a bounded lock-free ring, see
+ * workq_lf.h.
+ *
+ * The ring is the bounded MPMC queue of Dmitry Vyukov: cell i
+ * is free for the producer whose index is i when its seq is i,
+ * and ready for the consumer whose index is i when its seq is
+ * i + 1. Taking the cell is a compare-and-swap on the shared
+ * index; filling or emptying it is a store to the cell's seq,
+ * so a slow thread holds up only its own cell.
+ *
+ * Waking a parked server follows the usual futex pattern: the
+ * server reads work_seq, announces itself in sleepers, looks at
+ * the queue once more and only then waits for work_seq to move.
+ * A producer publishes its work and then looks at sleepers, with
+ * a full fence on each side between the write and the read, so
+ * one of them always sees the other.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "errors.h"
+#include "workq_lf.h"
+
+#define WORKQ_SPIN      200             /* polls before a server parks */
+
+#if defined (__i386__) || defined (__x86_64__)
+# define cpu_relax()    __asm__ __volatile__ ("pause")
+#else
+# define cpu_relax()    do { } while (0)
+#endif
+
+/*
+ * The work queue this thread serves, if it is a server.
+ */
+static __thread workq_t *server_of = NULL;
+
+static void futex_wait (int *addr, int val, const struct timespec *timeout)
+{
+    syscall (SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+static void futex_wake (int *addr, int count)
+{
+    syscall (SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/*
+ * Claim up to count free cells in a row and fill them. Returns
+ * how many were queued, 0 if the ring is full.
+ */
+static int workq_push (workq_t *wq, void **data, int count)
+{
+    workq_cell_t *cell;
+    unsigned long pos, seq = 0;
+    int n, i;
+
+    pos = __atomic_load_n (&wq->enqueue, __ATOMIC_RELAXED);
+    while (1) {
+        for (n = 0; n < count; n++) {
+            seq = __atomic_load_n (
+                &wq->ring[(pos + n) & wq->mask].seq, __ATOMIC_ACQUIRE);
+            if (seq != pos + n)
+                break;
+        }
+        if (n == 0) {
+            /*
+             * Behind pos by a lap: still full from the last one.
+             * Otherwise another producer got there first.
+             */
+            if ((long)(seq - pos) < 0)
+                return 0;
+            pos = __atomic_load_n (&wq->enqueue, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (__atomic_compare_exchange_n (&wq->enqueue, &pos, pos + n,
+                0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+    }
+    for (i = 0; i < n; i++) {
+        cell = &wq->ring[(pos + i) & wq->mask];
+        cell->data = data[i];
+        __atomic_store_n (&cell->seq, pos + i + 1, __ATOMIC_RELEASE);
+    }
+    return n;
+}
+
+/*
+ * Take the oldest request. Returns 0 if the queue is empty.
+ */
+static int workq_pop (workq_t *wq, void **data)
+{
+    workq_cell_t *cell;
+    unsigned long pos, seq;
+    long dif;
+
+    pos = __atomic_load_n (&wq->dequeue, __ATOMIC_RELAXED);
+    while (1) {
+        cell = &wq->ring[pos & wq->mask];
+        seq = __atomic_load_n (&cell->seq, __ATOMIC_ACQUIRE);
+        dif = (long)(seq - (pos + 1));
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n (&wq->dequeue, &pos, pos + 1,
+                    0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0)
+            return 0;
+        else
+            pos = __atomic_load_n (&wq->dequeue, __ATOMIC_RELAXED);
+    }
+    *data = cell->data;
+    __atomic_store_n (&cell->seq, pos + wq->mask + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*
+ * Is there a request at the head of the queue? Only a hint,
+ * without claiming it.
+ */
+static int workq_ready (workq_t *wq)
+{
+    unsigned long pos;
+
+    pos = __atomic_load_n (&wq->dequeue, __ATOMIC_RELAXED);
+    return __atomic_load_n (&wq->ring[pos & wq->mask].seq,
+        __ATOMIC_RELAXED) == pos + 1;
+}
+
+/*
+ * Run one request, and once the ring is down to half full let
+ * any producers blocked on it go. The check on waiters is not
+ * fenced: a producer that is missed wakes up by itself within
+ * a millisecond, and the common path stays free of barriers.
+ */
+static void workq_run (workq_t *wq, void *data)
+{
+    unsigned long used;
+
+    wq->engine (data);
+    if (__atomic_load_n (&wq->waiters, __ATOMIC_RELAXED) == 0)
+        return;
+    used = __atomic_load_n (&wq->enqueue, __ATOMIC_RELAXED)
+        - __atomic_load_n (&wq->dequeue, __ATOMIC_RELAXED);
+    if (used <= (wq->mask + 1) / 2
+            && __atomic_exchange_n (&wq->waiters, 0, __ATOMIC_ACQ_REL)) {
+        __atomic_fetch_add (&wq->space_seq, 1, __ATOMIC_RELEASE);
+        futex_wake (&wq->space_seq, INT_MAX);
+    }
+}
+
+/*
+ * A server is done sleeping, or done getting ready to: take it
+ * out of sleepers and let the next single request wake another.
+ * Every way out of sleepers goes through here. A producer that
+ * set waking for this server may have had its wakeup land here,
+ * and if the flag stayed up no later single request would wake
+ * anybody while the others slept on.
+ */
+static void workq_unpark (workq_t *wq)
+{
+    __atomic_fetch_sub (&wq->sleepers, 1, __ATOMIC_RELAXED);
+    __atomic_store_n (&wq->waking, 0, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Thread start routine to serve the work queue.
+ */
+static void *workq_server (void *arg)
+{
+    workq_t *wq = (workq_t *)arg;
+    void *data;
+    int spin, seq;
+
+    DPRINTF (("A worker is starting\n"));
+    server_of = wq;
+    while (1) {
+        if (workq_pop (wq, &data)) {
+            workq_run (wq, data);
+            continue;
+        }
+
+        /*
+         * Requests tend to come in bursts: poll a little before
+         * paying for a sleep and a wakeup.
+         */
+        __atomic_fetch_add (&wq->spinning, 1, __ATOMIC_RELAXED);
+        for (spin = 0; spin < WORKQ_SPIN; spin++) {
+            cpu_relax ();
+            if (workq_ready (wq))
+                break;
+        }
+        __atomic_fetch_sub (&wq->spinning, 1, __ATOMIC_RELAXED);
+        if (spin < WORKQ_SPIN)
+            continue;
+
+        seq = __atomic_load_n (&wq->work_seq, __ATOMIC_ACQUIRE);
+        __atomic_fetch_add (&wq->sleepers, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence (__ATOMIC_SEQ_CST);
+        if (workq_pop (wq, &data)) {
+            workq_unpark (wq);
+            workq_run (wq, data);
+            continue;
+        }
+
+        /*
+         * If there are no more work requests, and the servers
+         * have been asked to quit, then shut down.
+         */
+        if (__atomic_load_n (&wq->quit, __ATOMIC_SEQ_CST)) {
+            workq_unpark (wq);
+            break;
+        }
+        DPRINTF (("Worker waiting for work\n"));
+        futex_wait (&wq->work_seq, seq, NULL);
+
+        /*
+         * Awake again. waking is cleared before looking at the
+         * queue, so a producer that skipped its wakeup because
+         * of the flag has its request seen here.
+         */
+        workq_unpark (wq);
+        __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    }
+
+    DPRINTF (("Worker exiting\n"));
+    return NULL;
+}
+
+/*
+ * Wake up to count parked servers after queueing work.
+ *
+ * A single request doesn't wake anyone while a server is still
+ * polling (it will take the work, or see it when it looks again
+ * before parking), nor while an earlier wakeup hasn't been
+ * answered yet: otherwise a producer that outruns the servers
+ * makes a system call for every request.
+ */
+static void workq_wake (workq_t *wq, int count)
+{
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&wq->sleepers, __ATOMIC_RELAXED) == 0)
+        return;
+    if (count == 1
+            && (__atomic_load_n (&wq->spinning, __ATOMIC_RELAXED) > 0
+                || __atomic_exchange_n (&wq->waking, 1, __ATOMIC_ACQ_REL)))
+        return;
+    __atomic_fetch_add (&wq->work_seq, 1, __ATOMIC_RELEASE);
+    futex_wake (&wq->work_seq, count);
+}
+
+/*
+ * Wait a while for a full ring to drain.
+ */
+static void workq_wait_space (workq_t *wq)
+{
+    struct timespec timeout = {0, 1000000};
+    unsigned long pos, cell_seq;
+    int seq;
+
+    seq = __atomic_load_n (&wq->space_seq, __ATOMIC_ACQUIRE);
+    __atomic_store_n (&wq->waiters, 1, __ATOMIC_SEQ_CST);
+    pos = __atomic_load_n (&wq->enqueue, __ATOMIC_RELAXED);
+    cell_seq = __atomic_load_n (&wq->ring[pos & wq->mask].seq,
+        __ATOMIC_ACQUIRE);
+    if ((long)(cell_seq - pos) < 0)
+        futex_wait (&wq->space_seq, seq, &timeout);
+}
+
+/*
+ * Initialize a work queue, and start its servers.
+ */
+int workq_init (workq_t *wq, int threads, void (*engine)(void *arg))
+{
+    unsigned long i;
+    int count, status;
+
+    if (threads <= 0 || (WORKQ_SIZE & (WORKQ_SIZE - 1)) != 0)
+        return EINVAL;
+    wq->enqueue = wq->dequeue = 0;
+    wq->work_seq = wq->sleepers = wq->spinning = wq->waking = 0;
+    wq->space_seq = wq->waiters = 0;
+    wq->mask = WORKQ_SIZE - 1;
+    status = posix_memalign ((void **)&wq->ring, 64,
+        WORKQ_SIZE * sizeof (workq_cell_t));
+    if (status != 0)
+        return status;
+    for (i = 0; i < WORKQ_SIZE; i++) {
+        wq->ring[i].seq = i;
+        wq->ring[i].data = NULL;
+    }
+    wq->threads = (pthread_t *)malloc (threads * sizeof (pthread_t));
+    if (wq->threads == NULL) {
+        free (wq->ring);
+        return ENOMEM;
+    }
+    wq->quit = 0;                       /* not time to quit */
+    wq->parallelism = threads;
+    wq->engine = engine;
+    wq->valid = WORKQ_VALID;
+
+    for (count = 0; count < threads; count++) {
+        status = pthread_create (
+            &wq->threads[count], NULL, workq_server, (void*)wq);
+        if (status != 0) {
+            /*
+             * Run down the servers we did start.
+             */
+            wq->parallelism = count;
+            workq_destroy (wq);
+            return status;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Destroy a work queue, once every queued request has been
+ * processed.
+ */
+int workq_destroy (workq_t *wq)
+{
+    int count, status, status1 = 0;
+
+    if (wq->valid != WORKQ_VALID)
+        return EINVAL;
+    wq->valid = 0;                 /* prevent any other operations */
+
+    __atomic_store_n (&wq->quit, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add (&wq->work_seq, 1, __ATOMIC_SEQ_CST);
+    futex_wake (&wq->work_seq, INT_MAX);
+    for (count = 0; count < wq->parallelism; count++) {
+        status = pthread_join (wq->threads[count], NULL);
+        if (status != 0 && status1 == 0)
+            status1 = status;
+    }
+    free (wq->threads);
+    free (wq->ring);
+    return status1;
+}
+
+/*
+ * Add a batch of items to a work queue: one claim of the
+ * producer index and one wakeup for as many cells as are free
+ * in a row.
+ */
+int workq_add_many (workq_t *wq, void **data, int count)
+{
+    void *item;
+    int n;
+
+    if (wq->valid != WORKQ_VALID)
+        return EINVAL;
+    while (count > 0) {
+        n = workq_push (wq, data, count);
+        if (n > 0) {
+            workq_wake (wq, n);
+            data += n;
+            count -= n;
+        } else if (server_of == wq) {
+            /*
+             * An engine adding to its own full queue: waiting
+             * could leave every server waiting. Make room by
+             * doing the oldest request here.
+             */
+            if (workq_pop (wq, &item))
+                workq_run (wq, item);
+        } else
+            workq_wait_space (wq);
+    }
+    return 0;
+}
+
+/*
+ * Add an item to a work queue.
+ */
+int workq_add (workq_t *wq, void *element)
+{
+    return workq_add_many (wq, &element, 1);
+}
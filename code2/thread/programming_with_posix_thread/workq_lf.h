@@ -0,0 +1,77 @@
+/*
+ * workq_lf.h
+ *
+ * A drop-in replacement for the work queue manager in workq.h,
+ * for when items arrive by the million per second and the
+ * queue's mutex and the malloc of each request become the real
+ * work.
+ *
+ * Requests live in a fixed ring of cells, each carrying a
+ * sequence number that says whether it is free for the current
+ * lap of the producers or full for the current lap of the
+ * consumers. Producers and consumers each claim a cell with one
+ * compare-and-swap on their own index and never touch a lock
+ * or the allocator. When the ring is full, workq_add waits for
+ * space (or, if called from an engine, runs the request itself
+ * so the servers can't deadlock on their own queue).
+ *
+ * All server threads are started by workq_init. A server that
+ * finds the queue empty spins briefly and then parks on a futex;
+ * producers only make the wakeup system call when someone is
+ * actually parked.
+ *
+ * workq_destroy processes everything already queued before the
+ * servers exit, like workq.h.
+ */
+#include <pthread.h>
+
+#ifndef WORKQ_SIZE
+# define WORKQ_SIZE     65536           /* cells, a power of 2 */
+#endif
+
+/*
+ * One queue slot. seq == index: free for the producer on this
+ * lap; seq == index + 1: holds data for the consumer.
+ */
+typedef struct workq_cell_tag {
+    unsigned long               seq;
+    void                        *data;
+} workq_cell_t;
+
+/*
+ * Structure describing a work queue. The two indices and the
+ * futex words are on separate cache lines, since producers,
+ * consumers and sleepers each hammer their own.
+ */
+typedef struct workq_tag {
+    unsigned long       enqueue __attribute__ ((aligned (64)));
+    unsigned long       dequeue __attribute__ ((aligned (64)));
+    int                 work_seq __attribute__ ((aligned (64)));
+                                        /* futex: bumped when work is added */
+    int                 sleepers;       /* servers parked on work_seq */
+    int                 spinning;       /* servers polling before they park */
+    int                 waking;         /* a wakeup is on its way */
+    int                 space_seq __attribute__ ((aligned (64)));
+                                        /* futex: bumped when a full ring drains */
+    int                 waiters;        /* set by producers parked on space_seq */
+    workq_cell_t        *ring __attribute__ ((aligned (64)));
+    unsigned long       mask;
+    pthread_t           *threads;
+    int                 valid;          /* set when valid */
+    int                 quit;           /* set when workq should quit */
+    int                 parallelism;    /* number of threads */
+    void                (*engine)(void *arg);   /* user engine */
+} workq_t;
+
+#define WORKQ_VALID     0xdec1992
+
+/*
+ * Define work queue functions
+ */
+extern int workq_init (
+    workq_t     *wq,
+    int         threads,                /* server threads */
+    void        (*engine)(void *));     /* engine routine */
+extern int workq_destroy (workq_t *wq);
+extern int workq_add (workq_t *wq, void *data);
+extern int workq_add_many (workq_t *wq, void **data, int count);
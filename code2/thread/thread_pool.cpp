@@ -1,122 +1,433 @@
-#include <string>  
-#include <iostream>  
-
-using namespace std;  
-
-#include "thread_pool.h" 
-void CTask::SetData(void * data)  
-{  
-	m_ptrData = data;  
-}  
-
-vector<pthread_t> CThreadPool::m_vecBusyThread;  
-vector<pthread_t> CThreadPool::m_vecIdleThread;  
-pthread_mutex_t CThreadPool::m_pthreadMutex = PTHREAD_MUTEX_INITIALIZER;  
-pthread_cond_t CThreadPool::m_pthreadCond = PTHREAD_COND_INITIALIZER;  
-
-CThreadPool::CThreadPool(int threadNum)  
-{  
-	this->m_iThreadNum = threadNum;  
-	Create();  
-}  
-int CThreadPool::MoveToIdle(pthread_t tid)  
-{  
-	vector<pthread_t>::iterator busyIter = m_vecBusyThread.begin();  
-	while(busyIter != m_vecBusyThread.end())  
-	{  
-		if(tid == *busyIter)  
-		{  
-			break;  
-		}  
-		busyIter++;  
-	}  
-	m_vecBusyThread.erase(busyIter);  
-	m_vecIdleThread.push_back(tid);  
-	return 0;  
-}  
-
-int CThreadPool::MoveToBusy(pthread_t tid)  
-{  
-	vector<pthread_t>::iterator idleIter = m_vecIdleThread.begin();  
-	while(idleIter != m_vecIdleThread.end())  
-	{  
-		if(tid == *idleIter)  
-		{  
-			break;  
-		}  
-		idleIter++;  
-	}  
-	m_vecIdleThread.erase(idleIter);  
-	m_vecBusyThread.push_back(tid);  
-	return 0;  
-}  
-void* CThreadPool::ThreadFunc(void * threadData)  
-{  
-	pthread_t tid = pthread_self();  
-	while(1)  
-	{  
-		pthread_mutex_lock(&m_pthreadMutex);  
-		pthread_cond_wait(&m_pthreadCond,&m_pthreadMutex);  
-		cout << "tid:" << tid << " run" << endl;  
-		//get task  
-		vector<CTask*>* taskList = (vector<CTask*>*)threadData;  
-		vector<CTask*>::iterator iter = taskList->begin();  
-		while(iter != taskList->end())  
-		{  
-
-			MoveToBusy(tid);  
-			break;  
-		}  
-		CTask* task = *iter;  
-		taskList->erase(iter);  
-		pthread_mutex_unlock(&m_pthreadMutex);  
-		cout << "idel thread number:" << CThreadPool::m_vecIdleThread.size() << endl;  
-		cout << "busy thread number:" << CThreadPool::m_vecBusyThread.size() << endl;  
-		//cout << "task to be run:" << taskList->size() << endl;  
-		task->Run();  
-
-		//cout << "CThread::thread work" << endl;  
-		cout << "tid:" << tid << " idle" << endl;  
-
-	}  
-	return (void*)0;  
-}  
-
-int CThreadPool::AddTask(CTask *task)  
-{  
-	this->m_vecTaskList.push_back(task);  
-	pthread_cond_signal(&m_pthreadCond);  
-	return 0;  
-}  
-int CThreadPool::Create()  
-{  
-	for(int i = 0; i < m_iThreadNum;i++)  
-	{  
-		pthread_t tid = 0;  
-		pthread_create(&tid,NULL,ThreadFunc,&m_vecTaskList);  
-		m_vecIdleThread.push_back(tid);  
-	}  
-	return 0;  
-}  
-
-int CThreadPool::StopAll()  
-{  
-	vector<pthread_t>::iterator iter = m_vecIdleThread.begin();  
-	while(iter != m_vecIdleThread.end())  
-	{  
-		pthread_cancel(*iter);  
-		pthread_join(*iter,NULL);  
-		iter++;  
-	}  
-
-	iter = m_vecBusyThread.begin();  
-	while(iter != m_vecBusyThread.end())  
-	{  
-		pthread_cancel(*iter);  
-		pthread_join(*iter,NULL);  
-		iter++;  
-	}  
-
-	return 0;  
-}  
+#include <string>
+#include <iostream>
+#include <sched.h>
+#include <unistd.h>
 
+using namespace std;
+
+#include "thread_pool.h"
+
+#define DEQUE_SIZE   4096    //每个线程的队列长度，2的幂
+#define INJECT_SIZE  65536   //全局注入队列长度
+#define INJECT_BATCH 32      //从全局队列一次最多搬到自己队列的任务数
+#define SPIN_ROUNDS  64      //找不到任务时休眠前再试几轮
+
+void CTask::SetData(void * data)
+{
+	m_ptrData = data;
+}
+
+/*
+ * Chase-Lev work-stealing deque, fixed size.
+ * Only the owner pushes and pops at the bottom; any thread steals from the top.
+ */
+class CWorkStealingDeque
+{
+private:
+	atomic<long> m_iTop;
+	char m_pad[64 - sizeof(atomic<long>)];   //top和bottom不在同一cache line
+	atomic<long> m_iBottom;
+	atomic<CTask*> m_buf[DEQUE_SIZE];
+public:
+	CWorkStealingDeque() : m_iTop(0), m_iBottom(0)
+	{
+		for(int i = 0; i < DEQUE_SIZE; i++)
+		{
+			m_buf[i].store(NULL, memory_order_relaxed);
+		}
+	}
+	bool Push(CTask *task)
+	{
+		long b = m_iBottom.load(memory_order_relaxed);
+		long t = m_iTop.load(memory_order_acquire);
+		if(b - t >= DEQUE_SIZE)
+		{
+			return false;
+		}
+		m_buf[b & (DEQUE_SIZE - 1)].store(task, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+		m_iBottom.store(b + 1, memory_order_relaxed);
+		return true;
+	}
+	CTask* Pop()
+	{
+		long b = m_iBottom.load(memory_order_relaxed) - 1;
+		m_iBottom.store(b, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		long t = m_iTop.load(memory_order_relaxed);
+		if(t > b)
+		{
+			m_iBottom.store(b + 1, memory_order_relaxed);
+			return NULL;
+		}
+		CTask *task = m_buf[b & (DEQUE_SIZE - 1)].load(memory_order_relaxed);
+		if(t == b)
+		{
+			//last one, race the thieves for it
+			if(!m_iTop.compare_exchange_strong(t, t + 1,
+				memory_order_seq_cst, memory_order_relaxed))
+			{
+				task = NULL;
+			}
+			m_iBottom.store(b + 1, memory_order_relaxed);
+		}
+		return task;
+	}
+	CTask* Steal()
+	{
+		long t = m_iTop.load(memory_order_acquire);
+		atomic_thread_fence(memory_order_seq_cst);
+		long b = m_iBottom.load(memory_order_acquire);
+		if(t >= b)
+		{
+			return NULL;
+		}
+		CTask *task = m_buf[t & (DEQUE_SIZE - 1)].load(memory_order_relaxed);
+		if(!m_iTop.compare_exchange_strong(t, t + 1,
+			memory_order_seq_cst, memory_order_relaxed))
+		{
+			return NULL;
+		}
+		return task;
+	}
+	bool Empty()
+	{
+		return m_iBottom.load(memory_order_acquire) <=
+			m_iTop.load(memory_order_acquire);
+	}
+};
+
+struct CWorker
+{
+	CWorkStealingDeque deque;
+	CThreadPool *pool;
+	int id;
+	unsigned int seed;    //选偷谁用
+	pthread_t tid;
+};
+
+//当前线程所属的worker，不是池里的线程为NULL
+static __thread CWorker *t_pWorker = NULL;
+
+CThreadPool::CThreadPool(int threadNum)
+	: m_iInjectHead(0), m_iInjectCount(0), m_iSleeping(0), m_iPending(0),
+	m_bStop(false), m_bExit(false), m_bStopped(false)
+{
+	if(threadNum <= 0)
+	{
+		threadNum = sysconf(_SC_NPROCESSORS_ONLN);
+		if(threadNum <= 0)
+		{
+			threadNum = 1;
+		}
+	}
+	this->m_iThreadNum = threadNum;
+	m_vecInject.resize(INJECT_SIZE);
+	pthread_mutex_init(&m_injectMutex, NULL);
+	pthread_mutex_init(&m_pthreadMutex, NULL);
+	pthread_cond_init(&m_pthreadCond, NULL);
+	pthread_cond_init(&m_doneCond, NULL);
+	Create();
+}
+
+CThreadPool::~CThreadPool()
+{
+	StopAll();
+	pthread_cond_destroy(&m_doneCond);
+	pthread_cond_destroy(&m_pthreadCond);
+	pthread_mutex_destroy(&m_pthreadMutex);
+	pthread_mutex_destroy(&m_injectMutex);
+}
+
+int CThreadPool::Inject(CTask **tasks, int n)
+{
+	pthread_mutex_lock(&m_injectMutex);
+	size_t count = m_iInjectCount.load(memory_order_relaxed);
+	int i = 0;
+	for(; i < n && count < INJECT_SIZE; i++, count++)
+	{
+		m_vecInject[(m_iInjectHead + count) % INJECT_SIZE] = tasks[i];
+	}
+	m_iInjectCount.store(count, memory_order_relaxed);
+	pthread_mutex_unlock(&m_injectMutex);
+	return i;
+}
+
+void CThreadPool::WakeUp(int n)
+{
+	//pairs with the fence in ThreadFunc: either we see the sleeper or it sees the task
+	atomic_thread_fence(memory_order_seq_cst);
+	if(m_iSleeping.load(memory_order_relaxed) == 0)
+	{
+		return;
+	}
+	pthread_mutex_lock(&m_pthreadMutex);
+	if(n == 1)
+	{
+		pthread_cond_signal(&m_pthreadCond);
+	}
+	else
+	{
+		pthread_cond_broadcast(&m_pthreadCond);
+	}
+	pthread_mutex_unlock(&m_pthreadMutex);
+}
+
+void CThreadPool::Execute(CTask *task)
+{
+	bool autoDelete = task->m_bAutoDelete;
+	task->Run();
+	if(autoDelete)
+	{
+		delete task;
+	}
+	if(m_iPending.fetch_sub(1) == 1)
+	{
+		pthread_mutex_lock(&m_pthreadMutex);
+		pthread_cond_broadcast(&m_doneCond);
+		pthread_mutex_unlock(&m_pthreadMutex);
+	}
+}
+
+CTask* CThreadPool::FindTask(CWorker *self)
+{
+	CTask *task = self->deque.Pop();
+	if(task != NULL)
+	{
+		return task;
+	}
+
+	//global queue: take one, and a share of the rest into our own deque
+	if(m_iInjectCount.load(memory_order_relaxed) != 0)
+	{
+		pthread_mutex_lock(&m_injectMutex);
+		size_t count = m_iInjectCount.load(memory_order_relaxed);
+		if(count != 0)
+		{
+			task = m_vecInject[m_iInjectHead];
+			m_iInjectHead = (m_iInjectHead + 1) % INJECT_SIZE;
+			count--;
+			size_t share = count / m_iThreadNum;
+			if(share > INJECT_BATCH)
+			{
+				share = INJECT_BATCH;
+			}
+			for(size_t i = 0; i < share; i++)
+			{
+				self->deque.Push(m_vecInject[m_iInjectHead]);
+				m_iInjectHead = (m_iInjectHead + 1) % INJECT_SIZE;
+			}
+			m_iInjectCount.store(count - share, memory_order_relaxed);
+		}
+		pthread_mutex_unlock(&m_injectMutex);
+		if(task != NULL)
+		{
+			return task;
+		}
+	}
+
+	//steal, starting from a random victim
+	int n = m_iThreadNum;
+	int start = rand_r(&self->seed) % n;
+	for(int i = 0; i < n; i++)
+	{
+		CWorker *victim = m_vecWorkers[(start + i) % n];
+		if(victim == self)
+		{
+			continue;
+		}
+		task = victim->deque.Steal();
+		if(task != NULL)
+		{
+			return task;
+		}
+	}
+	return NULL;
+}
+
+bool CThreadPool::HasWork()
+{
+	if(m_iInjectCount.load(memory_order_relaxed) != 0)
+	{
+		return true;
+	}
+	for(int i = 0; i < m_iThreadNum; i++)
+	{
+		if(!m_vecWorkers[i]->deque.Empty())
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+void* CThreadPool::ThreadFunc(void * threadData)
+{
+	CWorker *self = (CWorker*)threadData;
+	CThreadPool *pool = self->pool;
+	t_pWorker = self;
+	while(1)
+	{
+		CTask *task = NULL;
+		for(int i = 0; i < SPIN_ROUNDS && task == NULL; i++)
+		{
+			task = pool->FindTask(self);
+			if(task == NULL && i > SPIN_ROUNDS / 2)
+			{
+				sched_yield();
+			}
+		}
+		if(task != NULL)
+		{
+			pool->Execute(task);
+			continue;
+		}
+
+		//nothing anywhere: announce we are going to sleep, then look once more
+		pthread_mutex_lock(&pool->m_pthreadMutex);
+		pool->m_iSleeping.fetch_add(1);
+		atomic_thread_fence(memory_order_seq_cst);
+		if(pool->m_bExit.load())
+		{
+			pool->m_iSleeping.fetch_sub(1);
+			pthread_mutex_unlock(&pool->m_pthreadMutex);
+			break;
+		}
+		if(!pool->HasWork())
+		{
+			pthread_cond_wait(&pool->m_pthreadCond, &pool->m_pthreadMutex);
+		}
+		pool->m_iSleeping.fetch_sub(1);
+		pthread_mutex_unlock(&pool->m_pthreadMutex);
+	}
+	t_pWorker = NULL;
+	return (void*)0;
+}
+
+bool CThreadPool::InPool()
+{
+	return t_pWorker != NULL && t_pWorker->pool == this;
+}
+
+bool CThreadPool::RunOne()
+{
+	CTask *task = NULL;
+	if(InPool())
+	{
+		task = FindTask(t_pWorker);
+	}
+	if(task == NULL)
+	{
+		sched_yield();
+		return false;
+	}
+	Execute(task);
+	return true;
+}
+
+int CThreadPool::AddTask(CTask *task)
+{
+	return AddTasks(&task, 1) == 1 ? 0 : -1;
+}
+
+int CThreadPool::AddTasks(CTask **tasks, int n)
+{
+	if(n <= 0)
+	{
+		return 0;
+	}
+	//count them before looking at m_bStop, so StopAll either waits for them or we see the stop
+	m_iPending.fetch_add(n);
+	CWorker *self = t_pWorker;
+	if(self != NULL && self->pool != this)
+	{
+		self = NULL;
+	}
+	if(self == NULL && m_bStop.load())
+	{
+		if(m_iPending.fetch_sub(n) == n)
+		{
+			pthread_mutex_lock(&m_pthreadMutex);
+			pthread_cond_broadcast(&m_doneCond);
+			pthread_mutex_unlock(&m_pthreadMutex);
+		}
+		return -1;
+	}
+
+	int i = 0;
+	if(self != NULL)
+	{
+		//from a task: onto our own deque, others will steal
+		while(i < n && self->deque.Push(tasks[i]))
+		{
+			i++;
+		}
+	}
+	if(i < n)
+	{
+		i += Inject(tasks + i, n - i);
+	}
+	if(i > 0)
+	{
+		WakeUp(i);
+	}
+	//queues full: run the rest here, which also slows the producer down
+	for(; i < n; i++)
+	{
+		Execute(tasks[i]);
+	}
+	return n;
+}
+
+int CThreadPool::Create()
+{
+	for(int i = 0; i < m_iThreadNum; i++)
+	{
+		CWorker *worker = new CWorker;
+		worker->pool = this;
+		worker->id = i;
+		worker->seed = i * 2654435761u + 1;
+		m_vecWorkers.push_back(worker);
+	}
+	//all deques exist before any thread looks for something to steal
+	for(int i = 0; i < m_iThreadNum; i++)
+	{
+		pthread_create(&m_vecWorkers[i]->tid, NULL, ThreadFunc, m_vecWorkers[i]);
+	}
+	return 0;
+}
+
+void CThreadPool::Wait()
+{
+	pthread_mutex_lock(&m_pthreadMutex);
+	while(m_iPending.load() != 0)
+	{
+		pthread_cond_wait(&m_doneCond, &m_pthreadMutex);
+	}
+	pthread_mutex_unlock(&m_pthreadMutex);
+}
+
+int CThreadPool::StopAll()
+{
+	if(m_bStopped)
+	{
+		return 0;
+	}
+	m_bStop.store(true);
+	Wait();
+
+	pthread_mutex_lock(&m_pthreadMutex);
+	m_bExit.store(true);
+	pthread_cond_broadcast(&m_pthreadCond);
+	pthread_mutex_unlock(&m_pthreadMutex);
+	vector<CWorker*>::iterator iter = m_vecWorkers.begin();
+	while(iter != m_vecWorkers.end())
+	{
+		pthread_join((*iter)->tid, NULL);
+		delete *iter;
+		iter++;
+	}
+	m_vecWorkers.clear();
+	m_bStopped = true;
+	return 0;
+}
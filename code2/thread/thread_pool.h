@@ -1,38 +1,126 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <pthread.h>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <string>
 #include <vector>
 
 class CTask
 {
 protected:
-	string m_strTaskName;  //任务的名称
+	std::string m_strTaskName;  //任务的名称
 	void* m_ptrData;       //要执行的任务的具体数据
+	bool m_bAutoDelete;    //执行完后由线程池delete（Submit创建的任务）
+	friend class CThreadPool;
 public:
-	CTask(){}
-	CTask(string taskName)
+	CTask() : m_ptrData(NULL), m_bAutoDelete(false) {}
+	CTask(std::string taskName)
 	{
 		this->m_strTaskName = taskName;
 		m_ptrData = NULL;
+		m_bAutoDelete = false;
 	}
+	virtual ~CTask() {}
 	virtual int Run()= 0;
 	void SetData(void* data);    //设置任务数据
 };
 
+//把任意可调用对象包装成任务，结果通过future取得
+template <typename R>
+class CFuncTask : public CTask
+{
+	std::packaged_task<R()> m_task;
+public:
+	template <typename F>
+	CFuncTask(F f) : m_task(f)
+	{
+		m_bAutoDelete = true;
+	}
+	std::future<R> GetFuture()
+	{
+		return m_task.get_future();
+	}
+	int Run()
+	{
+		m_task();    //异常也保存在future里
+		return 0;
+	}
+};
+
+struct CWorker;
+
+/*
+ * 工作窃取线程池：每个线程有自己的Chase-Lev双端队列，
+ * 线程内提交的任务压入自己队列的底部（LIFO，缓存热），
+ * 空闲线程从别的线程队列的顶部偷任务；
+ * 外部线程提交的任务进入有界的全局注入队列。
+ * 全局队列满时提交者自己执行该任务，以此反压。
+ */
 class CThreadPool
 {
 private:
-	vector<CTask*> m_vecTaskList;         //任务列表
-	int m_iThreadNum;                            //线程池中启动的线程数
-	static vector<pthread_t> m_vecIdleThread;   //当前空闲的线程集合
-	static vector<pthread_t> m_vecBusyThread;   //当前正在执行的线程集合
-	static pthread_mutex_t m_pthreadMutex;    //线程同步锁
-	static pthread_cond_t m_pthreadCond;    //线程同步的条件变量
+	std::vector<CWorker*> m_vecWorkers;   //所有工作线程
+	int m_iThreadNum;                     //线程池中启动的线程数
+	std::vector<CTask*> m_vecInject;      //全局注入队列（环形缓冲区）
+	size_t m_iInjectHead;
+	std::atomic<size_t> m_iInjectCount;
+	pthread_mutex_t m_injectMutex;        //保护全局注入队列
+	pthread_mutex_t m_pthreadMutex;       //线程休眠/唤醒用的锁
+	pthread_cond_t m_pthreadCond;         //有新任务
+	pthread_cond_t m_doneCond;            //所有任务都执行完了
+	std::atomic<int> m_iSleeping;         //正在休眠的线程数
+	std::atomic<long> m_iPending;         //已提交还没执行完的任务数
+	std::atomic<bool> m_bStop;            //不再接受外部提交
+	std::atomic<bool> m_bExit;            //工作线程退出
+	bool m_bStopped;
 protected:
 	static void* ThreadFunc(void * threadData); //新线程的线程函数
-	static int MoveToIdle(pthread_t tid);   //线程执行结束后，把自己放入到空闲线程中
-	static int MoveToBusy(pthread_t tid);   //移入到忙碌线程中去
+	CTask* FindTask(CWorker *self);       //自己的队列、全局队列、再去偷
+	bool HasWork();
+	void Execute(CTask *task);
+	int Inject(CTask **tasks, int n);     //返回放进全局队列的个数
+	void WakeUp(int n);
 	int Create();          //创建所有的线程
 public:
-	CThreadPool(int threadNum);
-	int AddTask(CTask *task);      //把任务添加到线程池中
-	int StopAll();
+	CThreadPool(int threadNum = 0);       //0：每个CPU一个线程
+	~CThreadPool();
+	int AddTask(CTask *task);      //把任务添加到线程池中，StopAll之后返回-1
+	int AddTasks(CTask **tasks, int n);   //批量添加，只加一次锁、唤醒一次
+	//提交可调用对象，返回future；StopAll之后future里是broken_promise
+	template <typename F>
+	auto Submit(F f) -> std::future<decltype(f())>
+	{
+		CFuncTask<decltype(f())> *task = new CFuncTask<decltype(f())>(f);
+		std::future<decltype(f())> result = task->GetFuture();
+		if (AddTask(task) != 0)
+		{
+			delete task;
+		}
+		return result;
+	}
+	bool InPool();         //当前线程是不是本线程池的工作线程
+	bool RunOne();         //在池里的线程上帮着执行一个任务，没有可做的就让出CPU并返回false
+	//等future时帮着跑别的任务；任务里等自己提交的子任务要用它，不能直接get()
+	//池外的线程偷不到任务，直接阻塞等
+	template <typename R>
+	R Get(std::future<R> &result)
+	{
+		if(!InPool())
+		{
+			return result.get();
+		}
+		while(result.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+		{
+			RunOne();
+		}
+		return result.get();
+	}
+	void Wait();           //等所有已提交的任务执行完（不能在任务里调用）
+	int StopAll();         //不再接受新任务，执行完已有任务后结束所有线程
+	int GetThreadNum() const { return m_iThreadNum; }
 };
 
+#endif
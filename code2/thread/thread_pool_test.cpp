@@ -1,36 +1,110 @@
-#include <string>  
-#include <iostream>  
-using namespace std;  
-#include "thread_pool.h"  
+#include <string>
+#include <iostream>
+using namespace std;
+#include "thread_pool.h"
 #include <unistd.h>
+#include <sys/time.h>
 
-class CWorkTask: public CTask  
-{  
-	public:  
-		CWorkTask()  
-		{}  
-		int Run()  
-		{  
-			cout << (char*)this->m_ptrData << endl;  
-			sleep(10);  
-			return 0;  
-		}  
-};  
-
-int main()  
-{  
-	CWorkTask taskObj;  
-	char szTmp[] = "this is the first thread running,haha success";  
-	taskObj.SetData((void*)szTmp);  
-	CThreadPool threadPool(10);  
-	sleep(1);
-	for(int i = 0;i < 11;i++)  
-	{  
-		threadPool.AddTask(&taskObj);  
-	}  
-	while(1)  
-	{  
-		sleep(120);  
-	}  
-	return 0;  
-}  
+class CWorkTask: public CTask
+{
+	public:
+		CWorkTask()
+		{}
+		int Run()
+		{
+			cout << (char*)this->m_ptrData << endl;
+			sleep(1);
+			return 0;
+		}
+};
+
+//细粒度任务：每个任务只加一次
+class CCountTask: public CTask
+{
+	public:
+		atomic<long> *m_pCount;
+		int Run()
+		{
+			m_pCount->fetch_add(1, memory_order_relaxed);
+			return 0;
+		}
+};
+
+static double Now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+//任务里再提交任务，走线程自己的队列，空闲线程去偷
+static long Fib(CThreadPool *pool, int n)
+{
+	if(n < 20)
+	{
+		return n < 2 ? n : Fib(pool, n - 1) + Fib(pool, n - 2);
+	}
+	future<long> left = pool->Submit([=]() { return Fib(pool, n - 1); });
+	long right = Fib(pool, n - 2);
+	//left可能还在自己的队列里没人偷，等的时候要帮着跑
+	return pool->Get(left) + right;
+}
+
+int main()
+{
+	CWorkTask taskObj;
+	char szTmp[] = "this is the first thread running,haha success";
+	taskObj.SetData((void*)szTmp);
+	CThreadPool threadPool(10);
+	for(int i = 0;i < 11;i++)
+	{
+		threadPool.AddTask(&taskObj);
+	}
+	threadPool.Wait();
+
+	//future
+	future<int> answer = threadPool.Submit([]() { return 6 * 7; });
+	cout << "answer: " << answer.get() << endl;
+	future<void> oops = threadPool.Submit([]() { throw runtime_error("task failed"); });
+	try
+	{
+		oops.get();
+	}
+	catch(const exception &e)
+	{
+		cout << "exception from task: " << e.what() << endl;
+	}
+	threadPool.StopAll();
+	if(threadPool.AddTask(&taskObj) != 0)
+	{
+		cout << "AddTask after StopAll refused" << endl;
+	}
+
+	//吞吐量：一百万个细粒度任务，批量提交
+	const int N = 1000000;
+	const int BATCH = 1024;
+	CThreadPool pool;
+	vector<CCountTask> tasks(N);
+	vector<CTask*> ptrs(N);
+	atomic<long> count(0);
+	for(int i = 0; i < N; i++)
+	{
+		tasks[i].m_pCount = &count;
+		ptrs[i] = &tasks[i];
+	}
+	double t0 = Now();
+	for(int i = 0; i < N; i += BATCH)
+	{
+		pool.AddTasks(&ptrs[i], BATCH < N - i ? BATCH : N - i);
+	}
+	pool.Wait();
+	double t1 = Now();
+	cout << pool.GetThreadNum() << " threads: " << count.load() << " tasks in "
+		<< (t1 - t0) << "s, " << (long)(N / (t1 - t0)) << " tasks/s" << endl;
+
+	t0 = Now();
+	long fib = Fib(&pool, 30);
+	t1 = Now();
+	cout << "fib(30) = " << fib << " nested, " << (t1 - t0) << "s" << endl;
+	return 0;
+}